@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+namespace jac::fs {
+
+// File with a write-back buffer. The flash under the FAT filesystem is written
+// in sectors, so many small writes cost a read-modify-write of the sector each.
+// The file collects the written data and passes it to the filesystem in blocks
+// of the buffer size aligned to the multiples of the buffer size in the file;
+// writes larger than the buffer bypass it. Choose the buffer size as a multiple
+// of the sector size.
+//
+// Reading flushes the buffer first. Writes to the filesystem and closing a
+// written file are reported via fs::fileChanged. The file is not thread-safe.
+// All methods throw std::runtime_error on failure.
+class BufferedFile {
+public:
+    // Open the file with given flags of open(2); bufferSize 0 disables
+    // the buffering
+    BufferedFile( const std::string& path, int flags, size_t bufferSize );
+    BufferedFile( const BufferedFile& ) = delete;
+    BufferedFile& operator=( const BufferedFile& ) = delete;
+
+    // Flush and close the file, errors are ignored
+    ~BufferedFile();
+
+    // Read up to size bytes to data, return the number of bytes read; 0 means
+    // the end of the file
+    size_t read( uint8_t* data, size_t size );
+    void write( const uint8_t* data, size_t size );
+    // Pass the buffered data to the filesystem
+    void flush();
+    void close();
+
+    bool isOpen() const { return _fd >= 0; }
+    size_t buffered() const { return _buffered; }
+
+private:
+    [[noreturn]] void _fail( const std::string& what );
+    void _requireOpen() const;
+    void _writeAll( const uint8_t* data, size_t size );
+
+    std::string _path;
+    int _fd;
+    bool _append;
+    std::unique_ptr< uint8_t[] > _buffer;
+    size_t _bufferSize;
+    size_t _buffered = 0;
+    off_t _position = 0; // Position of the start of the buffer in the file
+    bool _written = false;
+};
+
+} // namespace jac::fs
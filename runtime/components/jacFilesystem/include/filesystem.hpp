@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
 #include <stdexcept>
@@ -75,7 +76,7 @@ public:
         return ret;
     }
 
-    // It would be nice to have a version without copy - i.e., PathView
+    // See PathView::dirname for a version without copy
     Path dirname() const {
         if ( _path.empty() )
             return {};
@@ -123,6 +124,87 @@ private:
     std::vector< std::string > _path;
 };
 
+// Non-owning view of a path given as a string. Unlike Path, it does not split
+// the path upfront; the components are produced on demand, so no allocation
+// is needed.
+class PathView {
+public:
+    PathView() = default;
+    PathView( std::string_view path ): _path( path ) {}
+    PathView( const char* path ): _path( path ) {}
+    PathView( const std::string& path ): _path( path ) {}
+
+    bool absolute() const {
+        return !_path.empty() && _path.front() == '/';
+    }
+
+    bool empty() const {
+        return _path.empty();
+    }
+
+    std::string_view str() const {
+        return _path;
+    }
+
+    // Return the first component, i.e., "" for absolute paths
+    std::string_view front() const {
+        return _path.substr( 0, _path.find( '/' ) );
+    }
+
+    // Return the path without the last component; "" if there is a single
+    // component
+    PathView dirname() const {
+        size_t pos = _path.rfind( '/' );
+        if ( pos == std::string_view::npos )
+            return {};
+        return _path.substr( 0, pos );
+    }
+
+    std::string_view basename() const {
+        size_t pos = _path.rfind( '/' );
+        return pos == std::string_view::npos ? _path : _path.substr( pos + 1 );
+    }
+
+    // Invoke f with every component of the path
+    template < typename F >
+    void forEach( F f ) const {
+        size_t start = 0;
+        while ( true ) {
+            size_t end = _path.find( '/', start );
+            if ( end == std::string_view::npos ) {
+                f( _path.substr( start ) );
+                return;
+            }
+            f( _path.substr( start, end - start ) );
+            start = end + 1;
+        }
+    }
+
+private:
+    std::string_view _path;
+};
+
+// Append the components of path to an absolute normalized path out (an empty
+// string stands for the root) and keep it normalized, i.e., skip empty and
+// "." components and resolve ".." ones. Going above the root is invalid (as
+// in Path::weakNormalForm) and throws an exception. Only out might allocate,
+// so reusing it makes the operation allocation-free.
+inline void appendNormalized( std::string& out, PathView path ) {
+    path.forEach( [&]( std::string_view chunk ) {
+        if ( chunk.empty() || chunk == "." )
+            return;
+        if ( chunk == ".." ) {
+            if ( out.empty() )
+                throw std::runtime_error( "Invalid path" );
+            size_t pos = out.rfind( '/' );
+            out.resize( pos == std::string::npos ? 0 : pos );
+            return;
+        }
+        out.push_back( '/' );
+        out.append( chunk );
+    } );
+}
+
 enum class FileType { File, Directory };
 
 // Recursively walk given path and yield all directories and files.
@@ -161,4 +243,12 @@ std::string concatPath( std::string a, const std::string& b );
 std::string readFile( const std::string& path );
 bool fileExists( const std::string& path );
 
+// Writers of files report the written paths (as passed to open) via
+// fileChanged, so caches of file properties (e.g., storage::FileHashCache)
+// can drop them. There is a single listener; it has to be safe to call from
+// any task.
+using FileChangeListener = void (*)( const std::string& path );
+void setFileChangeListener( FileChangeListener listener );
+void fileChanged( const std::string& path );
+
 } // namespace jac::fs
\ No newline at end of file
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace jac::fs {
+
+// Suffix of gzip-compressed files. A module "/a.js" can be stored as
+// "/a.js.gz" instead.
+inline constexpr const char* GZIP_SUFFIX = ".gz";
+
+// Decompress a gzip file. The function first reads the size of the content
+// from the gzip trailer and obtains the output buffer by calling allocate with
+// the size, then it inflates the file straight into the buffer. The buffer
+// itself serves as the dictionary, so the scratch memory is bounded by the
+// decompressor state and a small input buffer regardless of the file size.
+//
+// Throws std::runtime_error if the file cannot be read or it is corrupted.
+void inflateGzipFile( const std::string& path,
+    const std::function< uint8_t*( size_t ) >& allocate );
+
+} // namespace jac::fs
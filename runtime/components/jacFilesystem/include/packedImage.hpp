@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+namespace jac::fs {
+
+// Read-only view of a packed image of files. The image is produced by
+// tools/transfer.py and it is meant to be memory-mapped from flash, so the file
+// content can be used without copying it into RAM.
+//
+// The image has the following layout (all integers are little endian u32):
+// - header: magic ("JIMG"), version, total image size, entry count
+// - entry table: path offset, path length, data offset, data length for each
+//   entry; the entries are sorted by path
+// - path and data blob; every path and every data is terminated by a NUL
+//   character (that is not included in the lengths)
+//
+// All offsets are relative to the start of the image. The module loader
+// compiles the entries in place, so tools/transfer.py stores them already
+// wrapped in the module function (see NodeModuleLoader).
+class PackedImage {
+public:
+    static inline constexpr uint32_t MAGIC = 0x474D494A; // "JIMG"
+    static inline constexpr uint32_t VERSION = 2;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t size;
+        uint32_t entryCount;
+    };
+
+    struct Entry {
+        uint32_t pathOffset;
+        uint32_t pathLength;
+        uint32_t dataOffset;
+        uint32_t dataLength;
+    };
+
+    PackedImage() = default;
+    // Build a view of the image. If the data do not represent a valid image,
+    // an exception is thrown
+    PackedImage( const void* data, size_t size );
+
+    // Given a path (e.g., /index.js), return the content of the file or
+    // nullopt if there is no such file in the image.
+    std::optional< std::string_view > find( std::string_view path ) const;
+
+    bool contains( const void* ptr ) const {
+        auto* p = static_cast< const uint8_t* >( ptr );
+        return p >= _data && p < _data + _size;
+    }
+
+    const uint8_t* data() const { return _data; }
+    size_t size() const { return _size; }
+    size_t entryCount() const;
+
+    // Check if there is a valid image header at given memory. Use this to
+    // determine if the image (e.g., a partition) contains any image at all.
+    static bool isImage( const void* data, size_t size );
+
+private:
+    const Entry& _entry( int idx ) const;
+    std::string_view _string( uint32_t offset, uint32_t length ) const;
+
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+};
+
+// Let Duktape use strings located in the image directly (via
+// DUK_USE_EXTERNAL_STRINGS) instead of copying them into the heap. Only a
+// single image can be used this way.
+void useAsExternalStrings( const PackedImage& image );
+
+} // namespace jac::fs
@@ -0,0 +1,132 @@
+#include <bufferedFile.hpp>
+#include <filesystem.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+jac::fs::BufferedFile::BufferedFile( const std::string& path, int flags, size_t bufferSize )
+    : _path( path ), _append( flags & O_APPEND ), _bufferSize( bufferSize )
+{
+    _fd = open( path.c_str(), flags, 0666 );
+    if ( _fd < 0 )
+        _fail( "Cannot open" );
+    if ( flags & O_TRUNC )
+        fileChanged( _path );
+    if ( _bufferSize > 0 )
+        _buffer.reset( new uint8_t[ _bufferSize ] );
+}
+
+jac::fs::BufferedFile::~BufferedFile() {
+    try {
+        close();
+    }
+    catch( const std::runtime_error& ) {}
+}
+
+size_t jac::fs::BufferedFile::read( uint8_t* data, size_t size ) {
+    _requireOpen();
+    flush();
+    size_t total = 0;
+    while ( total != size ) {
+        int bytesRead = ::read( _fd, data + total, size - total );
+        if ( bytesRead < 0 )
+            _fail( "Cannot read" );
+        if ( bytesRead == 0 )
+            break;
+        total += bytesRead;
+    }
+    _position += total;
+    return total;
+}
+
+void jac::fs::BufferedFile::write( const uint8_t* data, size_t size ) {
+    _requireOpen();
+    if ( _bufferSize == 0 ) {
+        _writeAll( data, size );
+        return;
+    }
+    // Appending writes continue at the end of the file wherever we read
+    if ( _append && _buffered == 0 ) {
+        _position = lseek( _fd, 0, SEEK_END );
+        if ( _position < 0 )
+            _fail( "Cannot seek" );
+    }
+    while ( size > 0 ) {
+        // Bytes up to the next block boundary
+        size_t room = _bufferSize - ( _position + _buffered ) % _bufferSize;
+        if ( _buffered == 0 && size >= room ) {
+            // Write whole blocks directly, the write ends on a boundary
+            size_t direct = room + ( size - room ) / _bufferSize * _bufferSize;
+            _writeAll( data, direct );
+            _position += direct;
+            data += direct;
+            size -= direct;
+            continue;
+        }
+        size_t chunk = std::min( room, size );
+        std::memcpy( _buffer.get() + _buffered, data, chunk );
+        _buffered += chunk;
+        data += chunk;
+        size -= chunk;
+        if ( chunk == room )
+            flush();
+    }
+}
+
+void jac::fs::BufferedFile::flush() {
+    if ( _buffered == 0 )
+        return;
+    _writeAll( _buffer.get(), _buffered );
+    _position += _buffered;
+    _buffered = 0;
+}
+
+void jac::fs::BufferedFile::close() {
+    if ( _fd < 0 )
+        return;
+    // Close the file even if the data cannot be written
+    try {
+        flush();
+    }
+    catch( const std::runtime_error& ) {
+        ::close( _fd );
+        _fd = -1;
+        throw;
+    }
+    // The filesystem updates the size and the time of the file on close
+    if ( _written )
+        fileChanged( _path );
+    if ( ::close( _fd ) < 0 ) {
+        _fd = -1;
+        _fail( "Cannot close" );
+    }
+    _fd = -1;
+}
+
+void jac::fs::BufferedFile::_fail( const std::string& what ) {
+    throw std::runtime_error( what + " " + _path + ": " + std::strerror( errno ) );
+}
+
+void jac::fs::BufferedFile::_requireOpen() const {
+    if ( _fd < 0 )
+        throw std::runtime_error( "File " + _path + " is closed" );
+}
+
+void jac::fs::BufferedFile::_writeAll( const uint8_t* data, size_t size ) {
+    while ( size > 0 ) {
+        int written = ::write( _fd, data, size );
+        if ( written < 0 ) {
+            // Drop the buffered data, so the error is not reported again
+            _buffered = 0;
+            _fail( "Cannot write" );
+        }
+        data += written;
+        size -= written;
+    }
+    _written = true;
+    fileChanged( _path );
+}
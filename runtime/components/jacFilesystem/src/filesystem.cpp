@@ -1,7 +1,14 @@
 #include <filesystem.hpp>
+#include <atomic>
 #include <cassert>
 #include <stdexcept>
 
+namespace {
+
+std::atomic< jac::fs::FileChangeListener > fileChangeListener{ nullptr };
+
+} // namespace
+
 bool jac::fs::ensurePath( const std::string& path ) {
     assert( path.length() > 0 );
     size_t pos = 1;
@@ -27,19 +34,37 @@ std::string jac::fs::readFile( const std::string& path ) {
     int fileFd = open( path.c_str(), O_RDONLY );
     if ( fileFd < 0 )
         throw std::runtime_error( "Cannot open " + path + ": " + std::strerror( errno ) );
-    int bytesRead;
-    std::string fContent;
-    do {
-        const int CHUNK_SIZE = 64;
-        char buffer[ CHUNK_SIZE ];
-        bytesRead = read( fileFd, buffer, CHUNK_SIZE );
+    // Allocate the whole file at once and read it directly into the string to
+    // avoid reallocations while reading
+    struct stat fileStat;
+    if ( fstat( fileFd, &fileStat ) < 0 ) {
+        close( fileFd );
+        throw std::runtime_error( "Cannot stat " + path + ": " + std::strerror( errno ) );
+    }
+    std::string fContent( fileStat.st_size, '\0' );
+    size_t totalRead = 0;
+    while ( true ) {
+        ssize_t bytesRead;
+        if ( totalRead < fContent.size() )
+            bytesRead = read( fileFd, fContent.data() + totalRead, fContent.size() - totalRead );
+        else {
+            // Probe for the end of the file with a small buffer, so reading
+            // the whole file does not reallocate the string
+            char probe[ 64 ];
+            bytesRead = read( fileFd, probe, sizeof( probe ) );
+            if ( bytesRead > 0 )
+                fContent.append( probe, bytesRead ); // The file has grown
+        }
         if ( bytesRead < 0 ) {
             close( fileFd );
             throw std::runtime_error( "Cannot read " + path + ": " + std::strerror( errno ) );
         }
-        std::copy_n( buffer, bytesRead, std::back_inserter( fContent ) );
-    } while ( bytesRead != 0 );
+        if ( bytesRead == 0 )
+            break;
+        totalRead += bytesRead;
+    }
     close( fileFd );
+    fContent.resize( totalRead );
     return fContent;
 }
 
@@ -48,4 +73,13 @@ bool jac::fs::fileExists( const std::string& path ) {
     bool exists = fileFd >= 0;
     close( fileFd );
     return exists;
-}
\ No newline at end of file
+}
+
+void jac::fs::setFileChangeListener( FileChangeListener listener ) {
+    fileChangeListener.store( listener );
+}
+
+void jac::fs::fileChanged( const std::string& path ) {
+    if ( auto listener = fileChangeListener.load() )
+        listener( path );
+}
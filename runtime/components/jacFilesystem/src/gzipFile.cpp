@@ -0,0 +1,164 @@
+#include <gzipFile.hpp>
+
+#include <esp32/rom/miniz.h>
+#include <esp_rom_crc.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const int INPUT_BUFFER_SIZE = 1024;
+const int TRAILER_SIZE = 8;
+
+// See RFC 1952
+enum GzipFlags: uint8_t {
+    FHCRC = 1 << 1,
+    FEXTRA = 1 << 2,
+    FNAME = 1 << 3,
+    FCOMMENT = 1 << 4
+};
+
+uint32_t readU32( const uint8_t* data ) {
+    return data[ 0 ] | data[ 1 ] << 8 | data[ 2 ] << 16 | uint32_t( data[ 3 ] ) << 24;
+}
+
+class FileReader {
+public:
+    FileReader( const std::string& path ): _path( path ) {
+        _fd = open( path.c_str(), O_RDONLY );
+        if ( _fd < 0 )
+            fail( "Cannot open" );
+    }
+
+    ~FileReader() {
+        close( _fd );
+    }
+
+    [[noreturn]] void fail( const std::string& what ) {
+        throw std::runtime_error( what + " " + _path + ": " + std::strerror( errno ) );
+    }
+
+    [[noreturn]] void corrupted( const std::string& what ) {
+        throw std::runtime_error( "Corrupted gzip file " + _path + ": " + what );
+    }
+
+    void readExactly( uint8_t* buffer, size_t size ) {
+        while ( size > 0 ) {
+            int bytesRead = read( _fd, buffer, size );
+            if ( bytesRead < 0 )
+                fail( "Cannot read" );
+            if ( bytesRead == 0 )
+                corrupted( "unexpected end of file" );
+            buffer += bytesRead;
+            size -= bytesRead;
+        }
+    }
+
+    uint8_t readByte() {
+        uint8_t byte;
+        readExactly( &byte, 1 );
+        return byte;
+    }
+
+    void skipString() {
+        while ( readByte() != 0 );
+    }
+
+    off_t seek( off_t offset, int whence ) {
+        off_t position = lseek( _fd, offset, whence );
+        if ( position < 0 )
+            fail( "Cannot seek" );
+        return position;
+    }
+
+    int fd() const { return _fd; }
+
+private:
+    std::string _path;
+    int _fd;
+};
+
+} // namespace
+
+void jac::fs::inflateGzipFile( const std::string& path,
+    const std::function< uint8_t*( size_t ) >& allocate )
+{
+    FileReader file( path );
+
+    uint8_t header[ 10 ];
+    file.readExactly( header, sizeof( header ) );
+    if ( header[ 0 ] != 0x1f || header[ 1 ] != 0x8b || header[ 2 ] != 8 )
+        file.corrupted( "not a deflate gzip stream" );
+    uint8_t flags = header[ 3 ];
+    if ( flags & FEXTRA ) {
+        uint8_t extraLength[ 2 ];
+        file.readExactly( extraLength, 2 );
+        file.seek( extraLength[ 0 ] | extraLength[ 1 ] << 8, SEEK_CUR );
+    }
+    if ( flags & FNAME )
+        file.skipString();
+    if ( flags & FCOMMENT )
+        file.skipString();
+    if ( flags & FHCRC )
+        file.seek( 2, SEEK_CUR );
+    off_t dataStart = file.seek( 0, SEEK_CUR );
+
+    uint8_t trailer[ TRAILER_SIZE ];
+    off_t dataEnd = file.seek( -TRAILER_SIZE, SEEK_END );
+    if ( dataEnd < dataStart )
+        file.corrupted( "missing trailer" );
+    file.readExactly( trailer, TRAILER_SIZE );
+    uint32_t expectedCrc = readU32( trailer );
+    size_t size = readU32( trailer + 4 );
+    file.seek( dataStart, SEEK_SET );
+
+    uint8_t emptyOutput;
+    uint8_t* out = allocate( size );
+    if ( !out )
+        out = &emptyOutput; // Allocators may return null for empty content
+    std::unique_ptr< tinfl_decompressor > decompressor( new tinfl_decompressor );
+    std::unique_ptr< uint8_t[] > input( new uint8_t[ INPUT_BUFFER_SIZE ] );
+    tinfl_init( decompressor.get() );
+
+    size_t remaining = dataEnd - dataStart;
+    size_t inputOffset = 0;
+    size_t inputAvailable = 0;
+    size_t outputPosition = 0;
+    while ( true ) {
+        if ( inputAvailable == 0 && remaining > 0 ) {
+            inputAvailable = std::min< size_t >( remaining, INPUT_BUFFER_SIZE );
+            file.readExactly( input.get(), inputAvailable );
+            remaining -= inputAvailable;
+            inputOffset = 0;
+        }
+        size_t inBytes = inputAvailable;
+        size_t outBytes = size - outputPosition;
+        mz_uint32 decompFlags = TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF;
+        if ( remaining > 0 )
+            decompFlags |= TINFL_FLAG_HAS_MORE_INPUT;
+        tinfl_status status = tinfl_decompress( decompressor.get(),
+            input.get() + inputOffset, &inBytes, out, out + outputPosition, &outBytes,
+            decompFlags );
+        inputOffset += inBytes;
+        inputAvailable -= inBytes;
+        outputPosition += outBytes;
+        if ( status == TINFL_STATUS_DONE )
+            break;
+        if ( status < 0 )
+            file.corrupted( "invalid deflate stream" );
+        if ( status == TINFL_STATUS_HAS_MORE_OUTPUT )
+            file.corrupted( "content is longer than declared" );
+        if ( status == TINFL_STATUS_NEEDS_MORE_INPUT && inputAvailable == 0 && remaining == 0 )
+            file.corrupted( "truncated deflate stream" );
+    }
+    if ( outputPosition != size )
+        file.corrupted( "content is shorter than declared" );
+    if ( esp_rom_crc32_le( 0, out, size ) != expectedCrc )
+        file.corrupted( "CRC mismatch" );
+}
@@ -0,0 +1,102 @@
+#include <packedImage.hpp>
+#include <stdexcept>
+#include <cstring>
+#include <utility>
+#include <initializer_list>
+
+namespace {
+
+// The region Duktape is allowed to reference strings from
+const uint8_t* externalBegin = nullptr;
+const uint8_t* externalEnd = nullptr;
+
+// Short strings are not worth it - external string still needs a heap header
+// and accessing flash is slower than accessing RAM
+const size_t EXTERNAL_STRING_MIN_LENGTH = 256;
+
+} // namespace
+
+jac::fs::PackedImage::PackedImage( const void* data, size_t size )
+    : _data( static_cast< const uint8_t* >( data ) ), _size( size )
+{
+    if ( !isImage( data, size ) )
+        throw std::runtime_error( "Invalid image header" );
+    auto* header = reinterpret_cast< const Header* >( _data );
+    _size = header->size;
+
+    // Compare counts rather than sizes, the table size might overflow size_t
+    if ( header->entryCount > ( _size - sizeof( Header ) ) / sizeof( Entry ) )
+        throw std::runtime_error( "Image entry table is truncated" );
+    size_t tableEnd = sizeof( Header ) + header->entryCount * sizeof( Entry );
+    for ( size_t i = 0; i != header->entryCount; i++ ) {
+        const Entry& e = _entry( i );
+        for ( auto [ offset, length ] : { std::pair{ e.pathOffset, e.pathLength },
+                                          std::pair{ e.dataOffset, e.dataLength } } )
+        {
+            // Note that the string has to be followed by NUL
+            if ( offset < tableEnd || offset >= _size || length >= _size - offset )
+                throw std::runtime_error( "Image entry is out of bounds" );
+            if ( _data[ offset + length ] != '\0' )
+                throw std::runtime_error( "Image entry is not terminated" );
+        }
+    }
+}
+
+bool jac::fs::PackedImage::isImage( const void* data, size_t size ) {
+    if ( size < sizeof( Header ) )
+        return false;
+    auto* header = static_cast< const Header* >( data );
+    return header->magic == MAGIC
+        && header->version == VERSION
+        && header->size >= sizeof( Header )
+        && header->size <= size;
+}
+
+size_t jac::fs::PackedImage::entryCount() const {
+    if ( !_data )
+        return 0;
+    return reinterpret_cast< const Header* >( _data )->entryCount;
+}
+
+const jac::fs::PackedImage::Entry& jac::fs::PackedImage::_entry( int idx ) const {
+    return reinterpret_cast< const Entry* >( _data + sizeof( Header ) )[ idx ];
+}
+
+std::string_view jac::fs::PackedImage::_string( uint32_t offset, uint32_t length ) const {
+    return { reinterpret_cast< const char* >( _data + offset ), length };
+}
+
+std::optional< std::string_view > jac::fs::PackedImage::find( std::string_view path ) const {
+    // Entries are sorted, so we can bisect
+    int low = 0;
+    int high = entryCount();
+    while ( low < high ) {
+        int mid = ( low + high ) / 2;
+        const Entry& e = _entry( mid );
+        int cmp = _string( e.pathOffset, e.pathLength ).compare( path );
+        if ( cmp == 0 )
+            return _string( e.dataOffset, e.dataLength );
+        if ( cmp < 0 )
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return std::nullopt;
+}
+
+void jac::fs::useAsExternalStrings( const PackedImage& image ) {
+    externalBegin = image.data();
+    externalEnd = image.data() + image.size();
+}
+
+// Called by Duktape for every interned string, see DUK_USE_EXTSTR_INTERN_CHECK
+// in duktape.yml. Duktape requires the external string to be NUL terminated,
+// which is guaranteed for image entries.
+const void* jac_extstr_intern_check( void* /* udata */, const void* ptr, size_t length ) {
+    auto* p = static_cast< const uint8_t* >( ptr );
+    if ( length < EXTERNAL_STRING_MIN_LENGTH || p < externalBegin || p + length >= externalEnd )
+        return nullptr;
+    if ( p[ length ] != '\0' )
+        return nullptr;
+    return ptr;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <duktape.h>
+#include <filesystem.hpp>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace jac::bytecode {
+
+// Header of a bytecode cache file. The dumped function immediately follows the
+// header. The cache is considered valid only if all the fields match the
+// current source and Duktape build (its version and configuration); Duktape
+// does not validate bytecode on load, so we have to be strict here.
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t dukVersion;
+    uint32_t dukConfig;
+    uint32_t sourceHash;
+    uint32_t sourceLength;
+    uint32_t bytecodeLength;
+};
+
+inline constexpr uint32_t CACHE_MAGIC = 0x3243424A; // "JBC2" in little endian
+
+// The dumped bytecode depends on the Duktape configuration, e.g., the low-memory
+// profile (JAC_LOW_MEMORY) or the ROM built-ins (JAC_ROM_BUILTINS), so the
+// cache of a differently configured build is rejected. The fingerprint is
+// computed from the configuration files by duktape_library (releng/Duktape.cmake).
+#ifndef JAC_DUKTAPE_CONFIG_HASH
+    #error "JAC_DUKTAPE_CONFIG_HASH is not defined, link against the duktape target"
+#endif
+inline constexpr uint32_t CACHE_CONFIG = JAC_DUKTAPE_CONFIG_HASH;
+
+// FNV-1a hash. We only need to detect source changes, so there is no need for
+// a cryptographic hash. The seed allows hashing a source in multiple parts.
+inline uint32_t sourceHash( std::string_view data, uint32_t seed = 2166136261u ) {
+    uint32_t hash = seed;
+    for ( char c : data ) {
+        hash ^= static_cast< uint8_t >( c );
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+inline bool _readExactly( int fd, void* buffer, size_t size ) {
+    auto* out = static_cast< uint8_t* >( buffer );
+    while ( size > 0 ) {
+        auto bytesRead = ::read( fd, out, size );
+        if ( bytesRead <= 0 )
+            return false;
+        out += bytesRead;
+        size -= bytesRead;
+    }
+    return true;
+}
+
+inline bool _writeExactly( int fd, const void* buffer, size_t size ) {
+    auto* in = static_cast< const uint8_t* >( buffer );
+    while ( size > 0 ) {
+        auto bytesWritten = ::write( fd, in, size );
+        if ( bytesWritten <= 0 )
+            return false;
+        in += bytesWritten;
+        size -= bytesWritten;
+    }
+    return true;
+}
+
+// Try to load a function from the cache file. On success, the function is
+// pushed to the stack and true is returned. Otherwise, the stack is left
+// untouched.
+inline bool loadCached( duk_context* ctx, const std::string& cachePath,
+    uint32_t hash, uint32_t sourceLength )
+{
+    int fd = ::open( cachePath.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+
+    CacheHeader header;
+    bool valid = _readExactly( fd, &header, sizeof( header ) )
+        && header.magic == CACHE_MAGIC
+        && header.dukVersion == DUK_VERSION
+        && header.dukConfig == CACHE_CONFIG
+        && header.sourceHash == hash
+        && header.sourceLength == sourceLength
+        && header.bytecodeLength > 0;
+    if ( !valid ) {
+        ::close( fd );
+        return false;
+    }
+
+    void* buffer = duk_push_fixed_buffer( ctx, header.bytecodeLength );
+    bool complete = _readExactly( fd, buffer, header.bytecodeLength );
+    // There should be nothing after the bytecode, otherwise the file is damaged
+    uint8_t dummy;
+    complete = complete && ::read( fd, &dummy, 1 ) == 0;
+    ::close( fd );
+    if ( !complete ) {
+        duk_pop( ctx );
+        return false;
+    }
+
+    duk_load_function( ctx );
+    return true;
+}
+
+// Dump the function on top of the stack into the cache file. The function is
+// left on the stack. Failing to write the cache is not an error - the function
+// is simply compiled again next time.
+inline void storeCache( duk_context* ctx, const std::string& cachePath,
+    uint32_t hash, uint32_t sourceLength )
+{
+    duk_dup( ctx, -1 );
+    duk_dump_function( ctx );
+    duk_size_t bytecodeLength;
+    void* bytecode = duk_get_buffer( ctx, -1, &bytecodeLength );
+
+    CacheHeader header;
+    header.magic = CACHE_MAGIC;
+    header.dukVersion = DUK_VERSION;
+    header.dukConfig = CACHE_CONFIG;
+    header.sourceHash = hash;
+    header.sourceLength = sourceLength;
+    header.bytecodeLength = bytecodeLength;
+
+    int fd = ::open( cachePath.c_str(), O_TRUNC | O_WRONLY | O_CREAT, 0666 );
+    if ( fd >= 0 ) {
+        bool written = _writeExactly( fd, &header, sizeof( header ) )
+            && _writeExactly( fd, bytecode, bytecodeLength );
+        ::close( fd );
+        // A partially written cache would be rejected on load anyway, but
+        // let's not waste flash with it.
+        if ( !written )
+            ::unlink( cachePath.c_str() );
+        fs::fileChanged( cachePath );
+    }
+    duk_pop( ctx ); // Pop the bytecode buffer
+}
+
+// Compile a function whose source is given as prefix + source + suffix (e.g.,
+// "function () {" + source + "}") and leave it on the stack. If cachePath is
+// not empty, the compiled function is loaded from or stored into the given
+// file, so the parser is skipped when the source did not change.
+inline void compileFunction( duk_context* ctx, std::string_view prefix,
+    std::string_view source, std::string_view suffix,
+    const std::string& filename, const std::string& cachePath )
+{
+    uint32_t hash = sourceHash( suffix, sourceHash( source, sourceHash( prefix ) ) );
+    uint32_t sourceLength = prefix.size() + source.size() + suffix.size();
+    if ( !cachePath.empty() && loadCached( ctx, cachePath, hash, sourceLength ) )
+        return;
+
+    duk_push_lstring( ctx, prefix.data(), prefix.size() );
+    duk_push_lstring( ctx, source.data(), source.size() );
+    duk_push_lstring( ctx, suffix.data(), suffix.size() );
+    duk_concat( ctx, 3 );
+    duk_push_string( ctx, filename.c_str() );
+    duk_compile( ctx, DUK_COMPILE_FUNCTION );
+
+    if ( !cachePath.empty() )
+        storeCache( ctx, cachePath, hash, sourceLength );
+}
+
+} // namespace jac::bytecode
@@ -1,8 +1,13 @@
 #pragma once
 
 #include <duktape.h>
+#include <iostream>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 using DukCFunction = duk_ret_t (*)( duk_context * );
 
@@ -112,3 +117,265 @@ inline void dukRaiseError( duk_context* ctx, const std::string& error ) {
     duk_error( ctx, DUK_ERR_TYPE_ERROR, error.c_str() );
     __builtin_unreachable(); // duk_error never returns
 }
+
+// Typed access to Duktape values used by the bindings below. Specialize the
+// template to support further types.
+template < typename T, typename = void >
+struct DukType;
+
+template <>
+struct DukType< bool > {
+    static bool require( duk_context* ctx, int offset ) { return duk_require_boolean( ctx, offset ); }
+    static void push( duk_context* ctx, bool value ) { duk_push_boolean( ctx, value ); }
+};
+
+template < typename T >
+struct DukType< T, std::enable_if_t< std::is_integral_v< T > && std::is_signed_v< T > > > {
+    static T require( duk_context* ctx, int offset ) { return duk_require_int( ctx, offset ); }
+    static void push( duk_context* ctx, T value ) { duk_push_int( ctx, value ); }
+};
+
+template < typename T >
+struct DukType< T, std::enable_if_t< std::is_integral_v< T > && std::is_unsigned_v< T >
+    && !std::is_same_v< T, bool > > >
+{
+    static T require( duk_context* ctx, int offset ) { return duk_require_uint( ctx, offset ); }
+    static void push( duk_context* ctx, T value ) { duk_push_uint( ctx, value ); }
+};
+
+template < typename T >
+struct DukType< T, std::enable_if_t< std::is_floating_point_v< T > > > {
+    static T require( duk_context* ctx, int offset ) { return duk_require_number( ctx, offset ); }
+    static void push( duk_context* ctx, T value ) { duk_push_number( ctx, value ); }
+};
+
+// The view points to the Duktape heap; it is valid while the value is on the
+// stack, i.e., during the call
+template <>
+struct DukType< std::string_view > {
+    static std::string_view require( duk_context* ctx, int offset ) {
+        duk_size_t length;
+        const char* s = duk_require_lstring( ctx, offset, &length );
+        return { s, length };
+    }
+    static void push( duk_context* ctx, std::string_view value ) {
+        duk_push_lstring( ctx, value.data(), value.size() );
+    }
+};
+
+template <>
+struct DukType< std::string > {
+    static std::string require( duk_context* ctx, int offset ) {
+        return std::string( DukType< std::string_view >::require( ctx, offset ) );
+    }
+    static void push( duk_context* ctx, const std::string& value ) {
+        duk_push_lstring( ctx, value.data(), value.size() );
+    }
+};
+
+// Argument that has to be callable, e.g., a callback. The value stays on the
+// stack at the offset for the duration of the call.
+struct DukCallable {
+    int offset;
+};
+
+template <>
+struct DukType< DukCallable > {
+    static DukCallable require( duk_context* ctx, int offset ) {
+        duk_require_callable( ctx, offset );
+        return { offset };
+    }
+};
+
+template < typename Function >
+struct DukFunctionTraits;
+
+template < typename R, typename... Args >
+struct DukFunctionTraits< R (*)( Args... ) > {
+    using Return = R;
+    using Arguments = std::tuple< std::decay_t< Args >... >;
+    static constexpr bool takesContext = false;
+};
+
+// Functions taking the context as the first parameter get the context of the
+// call
+template < typename R, typename... Args >
+struct DukFunctionTraits< R (*)( duk_context*, Args... ) > {
+    using Return = R;
+    using Arguments = std::tuple< std::decay_t< Args >... >;
+    static constexpr bool takesContext = true;
+};
+
+template < typename Class, typename R, typename... Args >
+struct DukFunctionTraits< R ( Class::* )( Args... ) > {
+    using Return = R;
+    using Arguments = std::tuple< std::decay_t< Args >... >;
+    static constexpr bool takesContext = false;
+};
+
+template < auto Function >
+inline constexpr int dukArgCount = std::tuple_size_v<
+    typename DukFunctionTraits< decltype( Function ) >::Arguments >;
+
+template < typename Return, typename Call >
+duk_ret_t dukCallAndReturn( duk_context* ctx, Call call ) {
+    if constexpr ( std::is_void_v< Return > ) {
+        call();
+        return 0;
+    }
+    else {
+        DukType< std::decay_t< Return > >::push( ctx, call() );
+        return 1;
+    }
+}
+
+template < auto Function, size_t... Indices >
+duk_ret_t dukInvokeNative( duk_context* ctx, std::index_sequence< Indices... > ) {
+    using Traits = DukFunctionTraits< decltype( Function ) >;
+    using Arguments = typename Traits::Arguments;
+    // Braced initialization evaluates the arguments in order
+    Arguments args{ DukType< std::tuple_element_t< Indices, Arguments > >::require( ctx, Indices )... };
+    return dukCallAndReturn< typename Traits::Return >( ctx, [&]() -> decltype( auto ) {
+        if constexpr ( Traits::takesContext )
+            return Function( ctx, std::get< Indices >( std::move( args ) )... );
+        else
+            return Function( std::get< Indices >( std::move( args ) )... );
+    } );
+}
+
+// Duktape/C function that calls the C++ function with arguments converted via
+// DukType and pushes the result, e.g., dukNative< &setDuty >. The number of
+// arguments is dukArgCount< Function >.
+template < auto Function >
+duk_ret_t dukNative( duk_context* ctx ) {
+    return dukInvokeNative< Function >( ctx,
+        std::make_index_sequence< dukArgCount< Function > >() );
+}
+
+// Entry of a function list (see duk_put_function_list) for dukNative
+template < auto Function >
+constexpr duk_function_list_entry dukEntry( const char* name ) {
+    return { name, dukNative< Function >, dukArgCount< Function > };
+}
+
+// Native objects
+//
+// Duktape objects have no internal slots, so the native state of an object is
+// referenced by a single hidden property that JavaScript cannot access. The
+// property holds a holder with the type of the object, so a method called on
+// an object of another type raises an error instead of crashing. Getting the
+// object (e.g., by each dukMethod call) costs one lookup of the property.
+inline constexpr const char* DUK_NATIVE_KEY = DUK_HIDDEN_SYMBOL( "native" );
+
+struct DukNativeHolder {
+    const void* type;
+    void* object;
+    void ( *destroy )( void* );
+};
+
+template < typename T >
+inline constexpr char dukTypeTag = 0;
+
+template < typename T >
+duk_ret_t dukNativeFinalizer( duk_context* ctx ) {
+    duk_get_prop_string( ctx, 0, DUK_NATIVE_KEY );
+    auto* holder = static_cast< DukNativeHolder* >( duk_get_pointer( ctx, -1 ) );
+    if ( holder ) {
+        holder->destroy( holder->object );
+        delete holder;
+        // The finalizer might run again if the object was rescued
+        duk_push_pointer( ctx, nullptr );
+        duk_put_prop_string( ctx, 0, DUK_NATIVE_KEY );
+    }
+    return 0;
+}
+
+// Attach the object to the JavaScript object on given offset; the object is
+// destroyed when the JavaScript object is garbage collected
+template < typename T >
+void dukSetNative( duk_context* ctx, int offset, std::unique_ptr< T > object ) {
+    offset = duk_normalize_index( ctx, offset );
+    // The finalizer ignores a missing holder, so set it first; if any of the
+    // calls throws, the holder and the object are still owned here
+    duk_push_c_lightfunc( ctx, dukNativeFinalizer< T >, 1, 1, 0 );
+    duk_set_finalizer( ctx, offset );
+    auto holder = std::make_unique< DukNativeHolder >( DukNativeHolder{ &dukTypeTag< T >,
+        object.get(), []( void* o ) { delete static_cast< T* >( o ); } } );
+    duk_push_pointer( ctx, holder.get() );
+    duk_put_prop_string( ctx, offset, DUK_NATIVE_KEY );
+    holder.release();
+    object.release();
+}
+
+// Get the native object of type T attached to the object on given offset;
+// raise an error if there is none
+template < typename T >
+T& dukGetNative( duk_context* ctx, int offset ) {
+    duk_get_prop_string( ctx, offset, DUK_NATIVE_KEY );
+    auto* holder = static_cast< DukNativeHolder* >( duk_get_pointer( ctx, -1 ) );
+    duk_pop( ctx );
+    if ( !holder || holder->type != &dukTypeTag< T > )
+        dukRaiseError( ctx, "Invalid native object" );
+    return *static_cast< T* >( holder->object );
+}
+
+template < typename Method >
+struct DukMethodClass;
+
+template < typename Class, typename R, typename... Args >
+struct DukMethodClass< R ( Class::* )( Args... ) > {
+    using Type = Class;
+};
+
+template < auto Method, size_t... Indices >
+duk_ret_t dukInvokeMethod( duk_context* ctx, std::index_sequence< Indices... > ) {
+    using Traits = DukFunctionTraits< decltype( Method ) >;
+    using Arguments = typename Traits::Arguments;
+    using Class = typename DukMethodClass< decltype( Method ) >::Type;
+    duk_push_this( ctx );
+    Class& object = dukGetNative< Class >( ctx, -1 );
+    duk_pop( ctx );
+    Arguments args{ DukType< std::tuple_element_t< Indices, Arguments > >::require( ctx, Indices )... };
+    return dukCallAndReturn< typename Traits::Return >( ctx, [&]() -> decltype( auto ) {
+        return ( object.*Method )( std::get< Indices >( std::move( args ) )... );
+    } );
+}
+
+// Duktape/C function that calls the member function on the native object of
+// this, e.g., dukMethod< &Counter::read >
+template < auto Method >
+duk_ret_t dukMethod( duk_context* ctx ) {
+    return dukInvokeMethod< Method >( ctx,
+        std::make_index_sequence< dukArgCount< Method > >() );
+}
+
+template < auto Method >
+constexpr duk_function_list_entry dukMethodEntry( const char* name ) {
+    return { name, dukMethod< Method >, dukArgCount< Method > };
+}
+
+// Object in the heap stash, e.g., an array of callbacks of a feature. The
+// object is pushed via its heap pointer, so no property lookup is needed. The
+// stash keeps the object reachable and Duktape does not move objects, so the
+// pointer stays valid for the lifetime of the heap.
+class DukStashSlot {
+public:
+    // Create the object (a bare array or a bare object) in the stash under
+    // given key
+    void create( duk_context* ctx, const char* key, bool array = true ) {
+        duk_push_heap_stash( ctx );
+        if ( array )
+            duk_push_bare_array( ctx );
+        else
+            duk_push_bare_object( ctx );
+        _object = duk_get_heapptr( ctx, -1 );
+        duk_put_prop_string( ctx, -2, key );
+        duk_pop( ctx );
+    }
+
+    void push( duk_context* ctx ) const {
+        duk_push_heapptr( ctx, _object );
+    }
+private:
+    void* _object = nullptr;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <duktape.h>
+
+#include <cstdint>
+
+namespace jac {
+
+// Hook invoked periodically by the Duktape executor while it runs bytecode
+// (see DUK_USE_EXEC_TIMEOUT_CHECK in duktape.yml). Duktape forbids any API
+// call from the hook, so it can only record data (e.g., via sampleCallstack)
+// to be processed later from the event loop. Return true to abort the
+// execution with a RangeError.
+using ExecInterruptHook = bool (*)( void* udata );
+
+// Register hook for the heap with given udata (i.e., the machine). There can
+// be only a single hook per heap and a few heaps in total; an exception is
+// thrown if there is no space left. Register the hooks from the machine task,
+// e.g., in the initialization of a feature.
+void registerExecInterruptHook( void* udata, ExecInterruptHook hook );
+void unregisterExecInterruptHook( void* udata );
+
+// Function of a call stack captured by sampleCallstack. Longer names are
+// truncated.
+struct SampledFrame {
+    static constexpr int NAME_SIZE = 31;
+    uint8_t nameLength;
+    char name[ NAME_SIZE ];
+};
+
+// Capture the call stack of the code running in the heap of given context,
+// innermost function first; return the number of captured frames and store
+// the line of the innermost one (0 if unknown). Functions without a name are
+// captured with an empty name. The capture reads the Duktape structures
+// directly, it neither calls the Duktape API nor allocates, so it can be used
+// from ExecInterruptHook. Implemented in src/callstackSample.inc, which is
+// compiled as a part of the Duktape translation unit.
+int sampleCallstack( duk_context* ctx, SampledFrame* frames, int maxFrames, int* line );
+
+} // namespace jac
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <heapArena.hpp>
+#include <esp_heap_caps.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace jac {
+
+// Implement a memory allocator that serves the whole Duktape heap from a single
+// contiguous arena (see HeapArena). The heap cannot grow beyond the arena, so
+// the machine leaves the rest of the RAM to the system and it runs out of
+// memory predictably.
+//
+// The arena is required by the low-memory build (JAC_LOW_MEMORY, see
+// duktape-lowmem.yml): Duktape then stores its heap pointers as 16-bit offsets
+// in the arena, which makes the arena at most HeapArena::MAX_COMPRESSED_SIZE
+// bytes large and allows only a single machine with the arena at a time.
+//
+// The arena is allocated on the first allocation (i.e., when the Duktape heap
+// is created) according to the configuration.
+template < typename Self >
+class ArenaAllocator {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        size_t arenaSize = 160 * 1024;
+        // Heap capabilities of the memory for the arena
+        uint32_t arenaHeapCaps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+    };
+
+    ~ArenaAllocator() {
+        _arena.reset();
+        heap_caps_free( _arenaMemory );
+    }
+
+    void initialize() {}
+
+    void onEventLoop() {}
+
+    static void *allocateMemory( void *udata, duk_size_t size ) {
+        auto& self = Self::fromUdata( udata );
+        if ( !self._ensureArena() )
+            return nullptr;
+        return self._arena->allocate( size );
+    }
+
+    static void *reallocateMemory( void *udata, void *ptr, duk_size_t size ) {
+        auto& self = Self::fromUdata( udata );
+        if ( !self._ensureArena() )
+            return nullptr;
+        return self._arena->reallocate( ptr, size );
+    }
+
+    static void freeMemory( void *udata, void *ptr ) {
+        auto& self = Self::fromUdata( udata );
+        if ( self._arena )
+            self._arena->release( ptr );
+    }
+
+    // The arena or nullptr if it could not be created
+    const HeapArena* heapArena() const {
+        return _arena.get();
+    }
+
+    // Usable size of a live allocation (in bytes)
+    size_t allocationSize( void *ptr ) {
+        return _arena->usableSize( ptr );
+    }
+
+    // Memory available to the Duktape heap (in bytes)
+    size_t allocatorFreeSize() {
+        return _arena ? _arena->freeSize() : 0;
+    }
+
+private:
+    bool _ensureArena() {
+        if ( _arena )
+            return true;
+        if ( _arenaFailed )
+            return false;
+        _arenaFailed = true;
+        _arenaMemory = heap_caps_malloc( self()._cfg.arenaSize, self()._cfg.arenaHeapCaps );
+        if ( !_arenaMemory )
+            return false;
+        std::unique_ptr< HeapArena > arena( new HeapArena( _arenaMemory, self()._cfg.arenaSize ) );
+#ifdef JAC_LOW_MEMORY
+        if ( !arena->attachPointerCompression() )
+            return false;
+#endif
+        _arena = std::move( arena );
+        _arenaFailed = false;
+        return true;
+    }
+
+    void *_arenaMemory = nullptr;
+    std::unique_ptr< HeapArena > _arena;
+    bool _arenaFailed = false;
+};
+
+} // namespace jac
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+#include <array>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+namespace jac {
+
+struct JobProfile {
+    // Bucket i counts times up to 16 << 2i microseconds (i.e., 16 us, 64 us,
+    // 256 us, ...), the last bucket counts all the longer ones
+    static constexpr int HISTOGRAM_BUCKETS = 8;
+    using Histogram = std::array< uint32_t, HISTOGRAM_BUCKETS >;
+
+    uint32_t count = 0;
+    int64_t totalLatency = 0;
+    int64_t maxLatency = 0;
+    int64_t totalDuration = 0;
+    int64_t maxDuration = 0;
+    Histogram latencyHistogram = {};
+    Histogram durationHistogram = {};
+
+    static int bucketOf( int64_t time ) {
+        int bucket = 0;
+        while ( bucket < HISTOGRAM_BUCKETS - 1 && time > ( int64_t( 16 ) << ( 2 * bucket ) ) )
+            bucket++;
+        return bucket;
+    }
+};
+
+struct FeatureProfile {
+    std::string_view name;
+    uint32_t calls = 0;
+    int64_t totalDuration = 0;
+    int64_t maxDuration = 0;
+};
+
+// Measure the latency and the duration of the event loop jobs and the time the
+// features spend in onEventLoop. All times are in microseconds.
+//
+// The feature registers native module "profiler" with function report() that
+// returns the collected statistics and function reset() that clears them. The
+// same statistics in text form are provided by writeProfile(), e.g., for the
+// PROFILE command of the uploader.
+template < typename Self >
+class EventLoopProfiler {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {};
+
+    void initialize() {
+        self().registerNativeModule( "profiler", [this]( duk_context *ctx ) {
+            return self()._initializeProfilerModule( ctx );
+        });
+    }
+
+    void onEventLoop() {}
+
+    void profileJob( JobKind kind, int64_t latency, int64_t duration ) {
+        portENTER_CRITICAL( &_profileLock );
+        JobProfile& p = _jobs[ int( kind ) ];
+        p.count++;
+        p.totalLatency += latency;
+        p.totalDuration += duration;
+        if ( latency > p.maxLatency )
+            p.maxLatency = latency;
+        if ( duration > p.maxDuration )
+            p.maxDuration = duration;
+        p.latencyHistogram[ JobProfile::bucketOf( latency ) ]++;
+        p.durationHistogram[ JobProfile::bucketOf( duration ) ]++;
+        portEXIT_CRITICAL( &_profileLock );
+    }
+
+    void profileFeature( int index, std::string_view name, int64_t duration ) {
+        // Grow the table outside of the critical section; only the machine
+        // task adds features, so checking the size is safe
+        if ( index >= int( _features.size() ) ) {
+            std::vector< FeatureProfile > features = featureProfiles();
+            features.resize( index + 1 );
+            portENTER_CRITICAL( &_profileLock );
+            _features.swap( features );
+            portEXIT_CRITICAL( &_profileLock );
+        }
+        portENTER_CRITICAL( &_profileLock );
+        FeatureProfile& p = _features[ index ];
+        p.name = name;
+        p.calls++;
+        p.totalDuration += duration;
+        if ( duration > p.maxDuration )
+            p.maxDuration = duration;
+        portEXIT_CRITICAL( &_profileLock );
+    }
+
+    std::array< JobProfile, JOB_KIND_COUNT > jobProfiles() {
+        portENTER_CRITICAL( &_profileLock );
+        auto jobs = _jobs;
+        portEXIT_CRITICAL( &_profileLock );
+        return jobs;
+    }
+
+    std::vector< FeatureProfile > featureProfiles() {
+        std::vector< FeatureProfile > features;
+        // Avoid allocation in the critical section
+        features.reserve( _features.size() );
+        portENTER_CRITICAL( &_profileLock );
+        for ( const auto& p : _features )
+            features.push_back( p );
+        portEXIT_CRITICAL( &_profileLock );
+        return features;
+    }
+
+    void resetProfile() {
+        portENTER_CRITICAL( &_profileLock );
+        _jobs = {};
+        for ( auto& p : _features )
+            p = { p.name };
+        portEXIT_CRITICAL( &_profileLock );
+    }
+
+    // Write the statistics in a line-oriented text form:
+    //   J <kind> <count> <avg latency> <max latency> <avg duration> <max duration>
+    //     <latency histogram> <duration histogram>
+    //   F <feature> <calls> <total duration> <max duration>
+    // Histograms are comma separated lists of bucket counts. Can be called
+    // from any task.
+    void writeProfile( std::ostream& o ) {
+        auto writeHistogram = [&]( const JobProfile::Histogram& h ) {
+            for ( int i = 0; i != JobProfile::HISTOGRAM_BUCKETS; i++ )
+                o << ( i ? "," : "" ) << h[ i ];
+        };
+        auto jobs = jobProfiles();
+        for ( int i = 0; i != JOB_KIND_COUNT; i++ ) {
+            const JobProfile& p = jobs[ i ];
+            o << "J " << jobKindName( JobKind( i ) ) << " " << p.count << " "
+              << ( p.count ? p.totalLatency / p.count : 0 ) << " " << p.maxLatency << " "
+              << ( p.count ? p.totalDuration / p.count : 0 ) << " " << p.maxDuration << " ";
+            writeHistogram( p.latencyHistogram );
+            o << " ";
+            writeHistogram( p.durationHistogram );
+            o << "\n";
+        }
+        for ( const FeatureProfile& p : featureProfiles() ) {
+            o << "F " << p.name << " " << p.calls << " " << p.totalDuration
+              << " " << p.maxDuration << "\n";
+        }
+    }
+
+private:
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeProfilerModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "report", dukReport, 0 },
+            { "reset", dukReset, 0 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static void dukPushHistogram( duk_context *ctx, const JobProfile::Histogram& h ) {
+        duk_push_bare_array( ctx );
+        for ( int i = 0; i != JobProfile::HISTOGRAM_BUCKETS; i++ ) {
+            duk_push_uint( ctx, h[ i ] );
+            duk_put_prop_index( ctx, -2, i );
+        }
+    }
+
+    static void dukPushJobProfile( duk_context *ctx, const JobProfile& p ) {
+        duk_push_bare_object( ctx );
+        duk_push_uint( ctx, p.count );
+        duk_put_prop_string( ctx, -2, "count" );
+        duk_push_number( ctx, p.totalLatency );
+        duk_put_prop_string( ctx, -2, "totalLatency" );
+        duk_push_number( ctx, p.maxLatency );
+        duk_put_prop_string( ctx, -2, "maxLatency" );
+        duk_push_number( ctx, p.totalDuration );
+        duk_put_prop_string( ctx, -2, "totalDuration" );
+        duk_push_number( ctx, p.maxDuration );
+        duk_put_prop_string( ctx, -2, "maxDuration" );
+        dukPushHistogram( ctx, p.latencyHistogram );
+        duk_put_prop_string( ctx, -2, "latencyHistogram" );
+        dukPushHistogram( ctx, p.durationHistogram );
+        duk_put_prop_string( ctx, -2, "durationHistogram" );
+    }
+
+    // Return object { jobs: { <kind>: profile, ... }, features: [ ... ] }
+    static duk_ret_t dukReport( duk_context *ctx ) {
+        Self& self = Self::fromContext( ctx );
+        duk_push_bare_object( ctx );
+
+        auto jobs = self.jobProfiles();
+        duk_push_bare_object( ctx );
+        for ( int i = 0; i != JOB_KIND_COUNT; i++ ) {
+            dukPushJobProfile( ctx, jobs[ i ] );
+            duk_put_prop_string( ctx, -2, jobKindName( JobKind( i ) ) );
+        }
+        duk_put_prop_string( ctx, -2, "jobs" );
+
+        auto features = self.featureProfiles();
+        duk_push_bare_array( ctx );
+        for ( size_t i = 0; i != features.size(); i++ ) {
+            const FeatureProfile& p = features[ i ];
+            duk_push_bare_object( ctx );
+            duk_push_lstring( ctx, p.name.data(), p.name.size() );
+            duk_put_prop_string( ctx, -2, "name" );
+            duk_push_uint( ctx, p.calls );
+            duk_put_prop_string( ctx, -2, "calls" );
+            duk_push_number( ctx, p.totalDuration );
+            duk_put_prop_string( ctx, -2, "totalDuration" );
+            duk_push_number( ctx, p.maxDuration );
+            duk_put_prop_string( ctx, -2, "maxDuration" );
+            duk_put_prop_index( ctx, -2, i );
+        }
+        duk_put_prop_string( ctx, -2, "features" );
+        return 1;
+    }
+
+    static duk_ret_t dukReset( duk_context *ctx ) {
+        Self::fromContext( ctx ).resetProfile();
+        return dukReturn( ctx );
+    }
+
+    std::array< JobProfile, JOB_KIND_COUNT > _jobs = {};
+    std::vector< FeatureProfile > _features;
+    portMUX_TYPE _profileLock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+} // namespace jac
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <filesystem.hpp>
+#include <bufferedFile.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace jac {
+
+// Provide native module "fs" with file access. The asynchronous functions run
+// on the NativeWorkers feature, so the event loop keeps running while a large
+// file is being read. Paths are relative to the base path of the machine;
+// paths resolving outside of it (e.g., "../x") are rejected.
+//
+// - readFile(path[, encoding]): return a promise of the file content as
+//   Uint8Array, or as a string when the encoding is "utf8"
+// - open(path[, flags]): open the file and return its descriptor. The flags
+//   are "r" (default), "r+", "w", "w+", "a" or "a+" as for fopen.
+// - read(fd, length): read up to length bytes, return them as Uint8Array; an
+//   empty array means the end of the file
+// - write(fd, data): write a string or a buffer
+// - flush(fd): pass the buffered data to the filesystem
+// - close(fd): flush and close the file
+// - readAsync(fd, length), writeAsync(fd, data): return a promise of the
+//   result of read or write
+//
+// The writes are collected in a write-back buffer of fsWriteBufferSize bytes
+// per file and passed to the filesystem in aligned blocks (see
+// fs::BufferedFile). Reads go straight to the memory of the returned array;
+// the asynchronous variants copy the data once, as the workers cannot
+// allocate Duktape memory.
+//
+// The operations on a file run in the order they were issued, no matter which
+// worker picks them up: the asynchronous operations wait in a queue of the
+// file and a worker runs all queued operations up to its own. The synchronous
+// functions run the queued operations first. The buffered file reports every write, flush and
+// close via fs::fileChanged, so the cached digests of the written files (see
+// storage::FileHashCache) are dropped.
+template < typename Self >
+class FsModule {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        // Use a multiple of the sector size of the filesystem
+        size_t fsWriteBufferSize = 4096;
+    };
+
+    void initialize() {
+        self().registerNativeModule( "fs", [this]( duk_context *ctx ) {
+            return self()._initializeFsModule( ctx );
+        });
+    }
+
+    void onEventLoop() {}
+
+private:
+    // Operation of readAsync or writeAsync waiting in the queue of the file
+    struct FileOperation {
+        std::function< void( fs::BufferedFile& ) > run;
+        bool done = false; // Guarded by OpenFile::lock
+        std::exception_ptr error;
+    };
+
+    struct OpenFile {
+        OpenFile( const std::string& path, int flags, size_t bufferSize )
+            : file( path, flags, bufferSize )
+        {}
+
+        // Run the queued operations up to the given one, or all of them if
+        // there is none; the file has to be locked
+        void runQueued( const FileOperation* last = nullptr ) {
+            while ( !( last && last->done ) ) {
+                std::shared_ptr< FileOperation > op;
+                {
+                    std::scoped_lock _( queueLock );
+                    if ( queue.empty() )
+                        return;
+                    op = std::move( queue.front() );
+                    queue.pop_front();
+                }
+                try {
+                    op->run( file );
+                }
+                catch( ... ) {
+                    op->error = std::current_exception();
+                }
+                op->done = true;
+            }
+        }
+
+        std::mutex lock; // The workers access the file as well
+        fs::BufferedFile file;
+        // Separate lock, so enqueuing does not wait for a running operation
+        std::mutex queueLock;
+        std::deque< std::shared_ptr< FileOperation > > queue; // Guarded by queueLock
+    };
+
+    // Indexed by the descriptor; the tasks on the workers share the files
+    std::vector< std::shared_ptr< OpenFile > > _fsFiles;
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeFsModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "readFile", dukReadFile, 2 },
+            { "open", dukOpen, 2 },
+            { "read", dukRead, 2 },
+            { "write", dukWrite, 2 },
+            { "flush", dukFlush, 1 },
+            { "close", dukClose, 1 },
+            { "readAsync", dukReadAsync, 2 },
+            { "writeAsync", dukWriteAsync, 2 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukReadFile( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        std::string path = _requirePath( ctx, 0 );
+        bool asString = false;
+        if ( !duk_is_undefined( ctx, 1 ) ) {
+            std::string_view encoding = duk_require_string( ctx, 1 );
+            if ( encoding != "utf8" && encoding != "utf-8" )
+                return DUK_RET_TYPE_ERROR;
+            asString = true;
+        }
+
+        self.offload( [path, asString]() -> typename Self::Completion {
+            auto content = std::make_shared< std::string >( fs::readFile( path ) );
+            return [content, asString]( duk_context *ctx ) {
+                if ( asString ) {
+                    duk_push_lstring( ctx, content->data(), content->size() );
+                    return;
+                }
+                void *buffer = duk_push_fixed_buffer( ctx, content->size() );
+                std::memcpy( buffer, content->data(), content->size() );
+                duk_push_buffer_object( ctx, -1, 0, content->size(), DUK_BUFOBJ_UINT8ARRAY );
+                duk_remove( ctx, -2 );
+            };
+        } );
+        return 1;
+    }
+
+    // Resolve a path given relative to the base path; paths resolving outside
+    // of it are an error
+    static std::string _requirePath( duk_context *ctx, int offset ) {
+        auto& self = Self::fromContext( ctx );
+        const char *userPath = duk_require_string( ctx, offset );
+        std::string relative;
+        bool valid = true;
+        try {
+            fs::appendNormalized( relative, userPath );
+        }
+        catch( const std::runtime_error& ) {
+            valid = false;
+        }
+        if ( !valid )
+            dukRaiseError( ctx, std::string( "Path is outside of the base path: " ) + userPath );
+        return relative.empty() ? self._cfg.basePath : fs::concatPath( self._cfg.basePath, relative );
+    }
+
+    static int _openFlags( std::string_view flags ) {
+        if ( flags == "r" )
+            return O_RDONLY;
+        if ( flags == "r+" )
+            return O_RDWR;
+        if ( flags == "w" )
+            return O_WRONLY | O_CREAT | O_TRUNC;
+        if ( flags == "w+" )
+            return O_RDWR | O_CREAT | O_TRUNC;
+        if ( flags == "a" )
+            return O_WRONLY | O_CREAT | O_APPEND;
+        if ( flags == "a+" )
+            return O_RDWR | O_CREAT | O_APPEND;
+        return -1;
+    }
+
+    static std::shared_ptr< OpenFile > _requireFile( duk_context *ctx, int offset ) {
+        auto& files = Self::fromContext( ctx )._fsFiles;
+        int fd = duk_require_int( ctx, offset );
+        if ( fd < 0 || fd >= int( files.size() ) || !files[ fd ] )
+            dukRaiseError( ctx, "Invalid file descriptor: " + std::to_string( fd ) );
+        return files[ fd ];
+    }
+
+    // Return data of a string or a buffer
+    static const uint8_t *_requireData( duk_context *ctx, int offset, duk_size_t *size ) {
+        if ( duk_is_string( ctx, offset ) )
+            return reinterpret_cast< const uint8_t * >( duk_require_lstring( ctx, offset, size ) );
+        return static_cast< const uint8_t * >( duk_require_buffer_data( ctx, offset, size ) );
+    }
+
+    // Run the operation on the locked file and turn its failure into an error
+    template < typename Operation >
+    static auto _withFile( duk_context *ctx, OpenFile& file, Operation op ) {
+        std::string error;
+        try {
+            std::scoped_lock _( file.lock );
+            file.runQueued();
+            return op( file.file );
+        }
+        catch( const std::runtime_error& e ) {
+            error = e.what();
+        }
+        dukRaiseError( ctx, error );
+        return decltype( op( file.file ) )();
+    }
+
+    static duk_ret_t dukOpen( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        std::string path = _requirePath( ctx, 0 );
+        int flags = _openFlags( duk_is_undefined( ctx, 1 ) ? "r" : duk_require_string( ctx, 1 ) );
+        if ( flags < 0 )
+            return DUK_RET_TYPE_ERROR;
+
+        std::shared_ptr< OpenFile > file;
+        try {
+            file = std::make_shared< OpenFile >( path, flags, self._cfg.fsWriteBufferSize );
+        }
+        catch( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        auto& files = self._fsFiles;
+        auto slot = std::find( files.begin(), files.end(), nullptr );
+        if ( slot == files.end() )
+            slot = files.insert( files.end(), nullptr );
+        *slot = std::move( file );
+        return dukReturn( ctx, int( slot - files.begin() ) );
+    }
+
+    static duk_ret_t dukRead( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        duk_uint_t length = duk_require_uint( ctx, 1 );
+        uint8_t *data = static_cast< uint8_t * >( duk_push_fixed_buffer( ctx, length ) );
+        size_t size = _withFile( ctx, *file, [&]( fs::BufferedFile& f ) {
+            return f.read( data, length );
+        } );
+        duk_push_buffer_object( ctx, -1, 0, size, DUK_BUFOBJ_UINT8ARRAY );
+        return 1;
+    }
+
+    static duk_ret_t dukWrite( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        duk_size_t size;
+        const uint8_t *data = _requireData( ctx, 1, &size );
+        _withFile( ctx, *file, [&]( fs::BufferedFile& f ) {
+            f.write( data, size );
+            return 0;
+        } );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukFlush( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        _withFile( ctx, *file, []( fs::BufferedFile& f ) {
+            f.flush();
+            return 0;
+        } );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukClose( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        // The descriptor is released even if the buffered data are lost
+        Self::fromContext( ctx )._fsFiles[ duk_get_int( ctx, 0 ) ].reset();
+        _withFile( ctx, *file, []( fs::BufferedFile& f ) {
+            f.close();
+            return 0;
+        } );
+        return dukReturn( ctx );
+    }
+
+    // Queue the operation on the file and offload running it, push the promise
+    // of the result. pushResult is called only if the operation succeeds.
+    template < typename PushResult >
+    static void _offloadOperation( duk_context *ctx, const std::shared_ptr< OpenFile >& file,
+        std::function< void( fs::BufferedFile& ) > run, PushResult pushResult )
+    {
+        auto op = std::make_shared< FileOperation >();
+        op->run = std::move( run );
+        {
+            std::scoped_lock _( file->queueLock );
+            file->queue.push_back( op );
+        }
+        bool queued = Self::fromContext( ctx ).offload( [file, op, pushResult]() -> typename Self::Completion {
+            {
+                std::scoped_lock _( file->lock );
+                file->runQueued( op.get() );
+            }
+            if ( op->error )
+                std::rethrow_exception( op->error );
+            return pushResult;
+        } );
+        if ( !queued ) {
+            // No worker runs operations past its own, so the rejected one is
+            // still queued
+            std::scoped_lock _( file->queueLock );
+            auto& queue = file->queue;
+            queue.erase( std::remove( queue.begin(), queue.end(), op ), queue.end() );
+        }
+    }
+
+    static duk_ret_t dukReadAsync( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        duk_uint_t length = duk_require_uint( ctx, 1 );
+
+        auto content = std::make_shared< std::vector< uint8_t > >();
+        _offloadOperation( ctx, file, [content, length]( fs::BufferedFile& f ) {
+            content->resize( length );
+            content->resize( f.read( content->data(), length ) );
+        }, [content]( duk_context *ctx ) {
+            void *buffer = duk_push_fixed_buffer( ctx, content->size() );
+            std::memcpy( buffer, content->data(), content->size() );
+            duk_push_buffer_object( ctx, -1, 0, content->size(), DUK_BUFOBJ_UINT8ARRAY );
+            duk_remove( ctx, -2 );
+        } );
+        return 1;
+    }
+
+    static duk_ret_t dukWriteAsync( duk_context *ctx ) {
+        auto file = _requireFile( ctx, 0 );
+        duk_size_t size;
+        const uint8_t *data = _requireData( ctx, 1, &size );
+        // JavaScript can modify the buffer while the worker writes it
+        auto content = std::make_shared< std::string >(
+            reinterpret_cast< const char * >( data ), size );
+
+        _offloadOperation( ctx, file, [content]( fs::BufferedFile& f ) {
+            f.write( reinterpret_cast< const uint8_t * >( content->data() ), content->size() );
+        }, []( duk_context *ctx ) {
+            duk_push_undefined( ctx );
+        } );
+        return 1;
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <voluntaryGc.hpp>
+#include <esp_system.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+
+namespace jac {
+
+struct GcProfile {
+    uint32_t count = 0;
+    int64_t totalPause = 0;
+    int64_t maxPause = 0;
+    int64_t lastPause = 0;
+};
+
+// Decide when Duktape runs the mark-and-sweep garbage collection. Reference
+// counting frees most of the garbage immediately, mark-and-sweep is needed
+// only for reference cycles. Duktape runs a voluntary collection after
+// a number of allocations proportional to the heap size, possibly in the
+// middle of a callback. Every collection restarts the count, so the feature
+// makes the voluntary ones rare by collecting:
+// - when the event loop runs out of jobs, at least gcIdleInterval milliseconds
+//   after the previous collection, only if no event is waiting and the
+//   requested wake up is not sooner than twice the last pause
+// - at the start of an event loop iteration when the memory available to the
+//   Duktape heap drops below gcLowMemoryThreshold bytes. The allocator feature
+//   reports it via allocatorFreeSize() (e.g., the free space of the arena or
+//   of the pools); allocators without it serve the heap from the system heap,
+//   so its free size is used instead. The collections are spaced by at least ten
+//   times the last pause, so a heap full of live objects does not make the
+//   machine collect all the time
+// Duktape still collects when an allocation fails.
+//
+// Native module "gc" provides:
+// - collect(): collect now
+// - pause(), resume(): postpone the idle and the voluntary collections during
+//   a latency-sensitive part; the calls nest. The allocations made meanwhile
+//   do not count towards the voluntary collection. The collections on low
+//   memory still run, so the garbage cycles cannot exhaust the memory.
+// - stats(): return { count, totalPause, maxPause, lastPause } in
+//   microseconds
+//
+// With EventLoopProfiler, the collections are also reported as jobs of kind
+// "gc"; the latency is the time the collection waited since it was due.
+template < typename Self >
+class GcPolicy {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        int gcIdleInterval = 1000;           // In milliseconds, negative disables
+        size_t gcLowMemoryThreshold = 16384; // In bytes, 0 disables
+    };
+
+    void initialize() {
+        _gcLastAt = esp_timer_get_time();
+        self().registerNativeModule( "gc", [this]( duk_context *ctx ) {
+            return self()._initializeGcModule( ctx );
+        });
+    }
+
+    void onEventLoop() {
+        if ( _gcPaused )
+            _gcHoldVoluntary();
+        if ( _gcHeapFreeSize() >= self()._cfg.gcLowMemoryThreshold )
+            return;
+        int64_t now = esp_timer_get_time();
+        if ( now - _gcLastAt < 10 * _gcProfile.lastPause )
+            return;
+        collectGarbage( now );
+    }
+
+    void onIdle() {
+        if ( _gcPaused || self()._cfg.gcIdleInterval < 0 )
+            return;
+        int64_t now = esp_timer_get_time();
+        int64_t dueAt = _gcLastAt + int64_t( self()._cfg.gcIdleInterval ) * 1000;
+        if ( now < dueAt || self().pendingEventTime() >= 0 )
+            return;
+        int64_t wakeUp = self().requestedWakeUp();
+        if ( wakeUp >= 0 && wakeUp - now < 2 * _gcProfile.lastPause )
+            return;
+        collectGarbage( dueAt );
+    }
+
+    // Run the collection now; dueAt is the time it was due (see
+    // esp_timer_get_time)
+    void collectGarbage( int64_t dueAt ) {
+        int64_t start = esp_timer_get_time();
+        duk_gc( self()._context, 0 );
+        int64_t end = esp_timer_get_time();
+        int64_t pause = end - start;
+        _gcLastAt = end;
+        _gcProfile.count++;
+        _gcProfile.totalPause += pause;
+        _gcProfile.lastPause = pause;
+        if ( pause > _gcProfile.maxPause )
+            _gcProfile.maxPause = pause;
+        if constexpr ( HasEventLoopProfiling< Self >::value )
+            self().profileJob( JobKind::Gc, std::max< int64_t >( start - dueAt, 0 ), pause );
+        if ( _gcPaused )
+            _gcHoldVoluntary();
+    }
+
+    void pauseGc() {
+        if ( _gcPaused++ == 0 )
+            _gcHoldVoluntary();
+    }
+
+    void resumeGc() {
+        if ( _gcPaused > 0 && --_gcPaused == 0 )
+            setVoluntaryGcTrigger( self()._context, _gcVoluntaryTrigger );
+    }
+
+    const GcProfile& gcProfile() const {
+        return _gcProfile;
+    }
+
+private:
+    template < typename T, typename = void >
+    struct HasAllocatorFreeSize: std::false_type {};
+
+    template < typename T >
+    struct HasAllocatorFreeSize< T, std::void_t< decltype( &T::allocatorFreeSize ) > >:
+        std::true_type {};
+
+    size_t _gcHeapFreeSize() {
+        if constexpr ( HasAllocatorFreeSize< Self >::value )
+            return self().allocatorFreeSize();
+        else
+            return esp_get_free_heap_size();
+    }
+
+    // Postpone the voluntary collection and remember the trigger counter to
+    // restore on resume. Any collection sets the counter again, so it is
+    // checked at every event loop iteration while paused.
+    void _gcHoldVoluntary() {
+        int trigger = voluntaryGcTrigger( self()._context );
+        if ( trigger >= VOLUNTARY_GC_POSTPONED / 2 )
+            return; // Still held
+        _gcVoluntaryTrigger = trigger;
+        setVoluntaryGcTrigger( self()._context, VOLUNTARY_GC_POSTPONED );
+    }
+
+    int64_t _gcLastAt = 0;
+    int _gcPaused = 0;
+    int _gcVoluntaryTrigger = 0; // Trigger counter to restore on resume
+    GcProfile _gcProfile;
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeGcModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "collect", dukCollect, 0 },
+            { "pause", dukPause, 0 },
+            { "resume", dukResume, 0 },
+            { "stats", dukStats, 0 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukCollect( duk_context *ctx ) {
+        Self::fromContext( ctx ).collectGarbage( esp_timer_get_time() );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukPause( duk_context *ctx ) {
+        Self::fromContext( ctx ).pauseGc();
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukResume( duk_context *ctx ) {
+        Self::fromContext( ctx ).resumeGc();
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukStats( duk_context *ctx ) {
+        const GcProfile& p = Self::fromContext( ctx ).gcProfile();
+        duk_push_bare_object( ctx );
+        duk_push_uint( ctx, p.count );
+        duk_put_prop_string( ctx, -2, "count" );
+        duk_push_number( ctx, p.totalPause );
+        duk_put_prop_string( ctx, -2, "totalPause" );
+        duk_push_number( ctx, p.maxPause );
+        duk_put_prop_string( ctx, -2, "maxPause" );
+        duk_push_number( ctx, p.lastPause );
+        duk_put_prop_string( ctx, -2, "lastPause" );
+        return 1;
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+
+#include <array>
+#include <initializer_list>
+#include <cstdint>
+#include <type_traits>
+
+// Define JAC_DISABLE_ALLOCATION_STATS to compile the instrumentation out. The
+// instrumented allocator then behaves exactly as the wrapped one and reports
+// no statistics. The low-memory build (JAC_LOW_MEMORY) always compiles it out,
+// the statistics do not pay off there.
+#if defined( JAC_DISABLE_ALLOCATION_STATS ) || defined( JAC_LOW_MEMORY )
+    #define JAC_ALLOCATION_STATS_ENABLED false
+#else
+    #define JAC_ALLOCATION_STATS_ENABLED true
+#endif
+
+namespace jac {
+
+struct AllocationStats {
+    // Bucket i counts allocations of size up to 16 << i bytes, the last bucket
+    // counts all the larger ones
+    static constexpr int HISTOGRAM_BUCKETS = 8;
+
+    uint32_t allocations = 0;
+    uint32_t frees = 0;
+    uint32_t reallocations = 0;
+    size_t liveBytes = 0;
+    size_t peakBytes = 0;
+    std::array< uint32_t, HISTOGRAM_BUCKETS > sizeHistogram = {};
+
+    static int bucketOf( size_t size ) {
+        int bucket = 0;
+        while ( bucket < HISTOGRAM_BUCKETS - 1 && size > ( 16u << bucket ) )
+            bucket++;
+        return bucket;
+    }
+};
+
+// Wrap an allocator feature and collect statistics about the allocations made
+// by Duktape. The statistics are collected in total and for the last event loop
+// iteration. Use it in the feature list in place of the allocator, e.g.:
+//
+//   JsMachineBase< ..., InstrumentedAllocator< PoolMemoryAllocator >::Feature, ... >
+//
+// The feature registers native module "process" with function memoryUsage()
+// that returns the statistics (similarly to process.memoryUsage() in Node.js)
+// and function resetPeak(). If the wrapped allocator provides member function
+// allocatorFreeSize(), memoryUsage() also reports it as allocatorFree; it is
+// available even with the instrumentation compiled out.
+//
+// The size of freed memory is taken from the wrapped allocator if it provides
+// member function allocationSize( ptr ), so the instrumentation does not change
+// the layout of the heap (e.g., it does not move allocations to a larger pool).
+// Otherwise each allocation is prefixed with a small header holding its size.
+template < template < typename > typename Allocator >
+struct InstrumentedAllocator {
+    template < typename Self >
+    class Feature: public Allocator< Self > {
+        using Base = Allocator< Self >;
+
+        template < typename T, typename = void >
+        struct HasAllocationSize: std::false_type {};
+
+        template < typename T >
+        struct HasAllocationSize< T, std::void_t< decltype( &T::allocationSize ) > >:
+            std::true_type {};
+
+        template < typename T, typename = void >
+        struct HasAllocatorFreeSize: std::false_type {};
+
+        template < typename T >
+        struct HasAllocatorFreeSize< T, std::void_t< decltype( &T::allocatorFreeSize ) > >:
+            std::true_type {};
+
+        static constexpr bool HAS_ALLOCATION_SIZE = HasAllocationSize< Base >::value;
+        // Keep the alignment the wrapped allocator provides
+        static constexpr size_t HEADER_SIZE = 8;
+        static constexpr bool ENABLED = JAC_ALLOCATION_STATS_ENABLED;
+    public:
+        MACHINE_FEATURE_SELF();
+
+        struct Configuration: public Base::Configuration {};
+
+        void initialize() {
+            Base::initialize();
+            self().registerNativeModule( "process", [this]( duk_context *ctx ) {
+                return self()._initializeProcessModule( ctx );
+            });
+        }
+
+        void onEventLoop() {
+            Base::onEventLoop();
+            if constexpr ( ENABLED ) {
+                _lastIteration = _iteration;
+                _iteration = AllocationStats();
+                _iteration.liveBytes = _iteration.peakBytes = _total.liveBytes;
+            }
+        }
+
+        // The statistics are plain counters: Duktape allocates only from the
+        // machine task, so they have to be read from it as well
+        AllocationStats totalAllocationStats() {
+            return _total;
+        }
+
+        AllocationStats lastIterationAllocationStats() {
+            return _lastIteration;
+        }
+
+        static void *allocateMemory( void *udata, duk_size_t size ) {
+            if constexpr ( !ENABLED )
+                return Base::allocateMemory( udata, size );
+
+            if constexpr ( HAS_ALLOCATION_SIZE ) {
+                void *ptr = Base::allocateMemory( udata, size );
+                if ( !ptr )
+                    return nullptr;
+                Self& self = Self::fromUdata( udata );
+                self._recordAllocation( size, self.allocationSize( ptr ) );
+                return ptr;
+            }
+            else {
+                auto *block = static_cast< uint8_t * >(
+                    Base::allocateMemory( udata, size + HEADER_SIZE ) );
+                if ( !block )
+                    return nullptr;
+                *reinterpret_cast< size_t * >( block ) = size;
+                Self::fromUdata( udata )._recordAllocation( size, size );
+                return block + HEADER_SIZE;
+            }
+        }
+
+        static void *reallocateMemory( void *udata, void *ptr, duk_size_t size ) {
+            if constexpr ( !ENABLED )
+                return Base::reallocateMemory( udata, ptr, size );
+
+            if ( !ptr )
+                return allocateMemory( udata, size );
+            if ( size == 0 ) {
+                freeMemory( udata, ptr );
+                return nullptr;
+            }
+            Self& self = Self::fromUdata( udata );
+            if constexpr ( HAS_ALLOCATION_SIZE ) {
+                size_t oldSize = self.allocationSize( ptr );
+                void *newPtr = Base::reallocateMemory( udata, ptr, size );
+                if ( !newPtr )
+                    return nullptr;
+                self._recordReallocation( oldSize, size, self.allocationSize( newPtr ) );
+                return newPtr;
+            }
+            else {
+                auto *block = static_cast< uint8_t * >( ptr ) - HEADER_SIZE;
+                size_t oldSize = *reinterpret_cast< size_t * >( block );
+                auto *newBlock = static_cast< uint8_t * >(
+                    Base::reallocateMemory( udata, block, size + HEADER_SIZE ) );
+                if ( !newBlock )
+                    return nullptr;
+                *reinterpret_cast< size_t * >( newBlock ) = size;
+                self._recordReallocation( oldSize, size, size );
+                return newBlock + HEADER_SIZE;
+            }
+        }
+
+        static void freeMemory( void *udata, void *ptr ) {
+            if constexpr ( !ENABLED ) {
+                Base::freeMemory( udata, ptr );
+                return;
+            }
+
+            if ( !ptr )
+                return;
+            Self& self = Self::fromUdata( udata );
+            if constexpr ( HAS_ALLOCATION_SIZE ) {
+                size_t size = self.allocationSize( ptr );
+                Base::freeMemory( udata, ptr );
+                self._recordFree( size );
+            }
+            else {
+                auto *block = static_cast< uint8_t * >( ptr ) - HEADER_SIZE;
+                size_t size = *reinterpret_cast< size_t * >( block );
+                Base::freeMemory( udata, block );
+                self._recordFree( size );
+            }
+        }
+
+    private:
+        template < typename Update >
+        void _record( Update update ) {
+            for ( AllocationStats *s : { &_total, &_iteration } ) {
+                update( *s );
+                if ( s->liveBytes > s->peakBytes )
+                    s->peakBytes = s->liveBytes;
+            }
+        }
+
+        // The histogram counts the requested sizes, the live bytes count the
+        // memory actually held by the allocations
+        void _recordAllocation( size_t size, size_t heldSize ) {
+            _record( [&]( AllocationStats& s ) {
+                s.allocations++;
+                s.liveBytes += heldSize;
+                s.sizeHistogram[ AllocationStats::bucketOf( size ) ]++;
+            } );
+        }
+
+        void _recordReallocation( size_t oldHeldSize, size_t newSize, size_t newHeldSize ) {
+            _record( [&]( AllocationStats& s ) {
+                s.reallocations++;
+                s.liveBytes += newHeldSize;
+                s.liveBytes = s.liveBytes > oldHeldSize ? s.liveBytes - oldHeldSize : 0;
+                s.sizeHistogram[ AllocationStats::bucketOf( newSize ) ]++;
+            } );
+        }
+
+        void _recordFree( size_t size ) {
+            _record( [&]( AllocationStats& s ) {
+                s.frees++;
+                // The iteration might free memory allocated before it started
+                s.liveBytes = s.liveBytes > size ? s.liveBytes - size : 0;
+            } );
+        }
+
+        // Initializes the module; there are the following arguments on the
+        // Duktape stack:
+        // - 0 requested module ID
+        // - 1 exports object
+        // - 2 module object
+        duk_ret_t _initializeProcessModule( duk_context *ctx ) {
+            const int exportOffset = 1;
+            duk_function_list_entry functions[] = {
+                { "memoryUsage", dukMemoryUsage, 0 },
+                { "resetPeak", dukResetPeak, 0 },
+                { nullptr, nullptr, 0 }
+            };
+            duk_put_function_list( ctx, exportOffset, functions );
+            return dukReturn( ctx );
+        }
+
+        static void dukPushStats( duk_context *ctx, const AllocationStats& stats ) {
+            duk_push_bare_object( ctx );
+            duk_push_uint( ctx, stats.allocations );
+            duk_put_prop_string( ctx, -2, "allocations" );
+            duk_push_uint( ctx, stats.frees );
+            duk_put_prop_string( ctx, -2, "frees" );
+            duk_push_uint( ctx, stats.reallocations );
+            duk_put_prop_string( ctx, -2, "reallocations" );
+            duk_push_uint( ctx, stats.liveBytes );
+            duk_put_prop_string( ctx, -2, "liveBytes" );
+            duk_push_uint( ctx, stats.peakBytes );
+            duk_put_prop_string( ctx, -2, "peakBytes" );
+            duk_push_bare_array( ctx );
+            for ( int i = 0; i != AllocationStats::HISTOGRAM_BUCKETS; i++ ) {
+                duk_push_uint( ctx, stats.sizeHistogram[ i ] );
+                duk_put_prop_index( ctx, -2, i );
+            }
+            duk_put_prop_string( ctx, -2, "sizeHistogram" );
+        }
+
+        // Return object with total statistics, statistics of the last event
+        // loop iteration (as property lastIteration), free memory of the
+        // allocator and system heap status
+        static duk_ret_t dukMemoryUsage( duk_context *ctx ) {
+            Self& self = Self::fromContext( ctx );
+            dukPushStats( ctx, self.totalAllocationStats() );
+            dukPushStats( ctx, self.lastIterationAllocationStats() );
+            duk_put_prop_string( ctx, -2, "lastIteration" );
+            duk_push_boolean( ctx, ENABLED );
+            duk_put_prop_string( ctx, -2, "enabled" );
+            if constexpr ( HasAllocatorFreeSize< Base >::value ) {
+                duk_push_uint( ctx, self.allocatorFreeSize() );
+                duk_put_prop_string( ctx, -2, "allocatorFree" );
+            }
+            duk_push_uint( ctx, esp_get_free_heap_size() );
+            duk_put_prop_string( ctx, -2, "heapFree" );
+            duk_push_uint( ctx, heap_caps_get_largest_free_block( MALLOC_CAP_8BIT ) );
+            duk_put_prop_string( ctx, -2, "heapLargestFreeBlock" );
+            return 1;
+        }
+
+        static duk_ret_t dukResetPeak( duk_context *ctx ) {
+            Self& self = Self::fromContext( ctx );
+            self._total.peakBytes = self._total.liveBytes;
+            return dukReturn( ctx );
+        }
+
+        AllocationStats _total;
+        AllocationStats _iteration;
+        AllocationStats _lastIteration;
+    };
+};
+
+} // namespace jac
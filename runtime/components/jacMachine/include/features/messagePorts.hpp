@@ -0,0 +1,215 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <messageChannel.hpp>
+
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace jac {
+
+// Exchange messages with other machines via message channels (see
+// messageChannel.hpp), similarly to postMessage of web workers.
+//
+// The ports are given in the configuration by name. The feature registers
+// native module "messaging" with function port(name) that returns an object
+// with the following methods:
+// - postMessage(value): send a copy of the value (serialized as JSON; buffers
+//   are sent as raw bytes and received as Uint8Array); return false if the
+//   ring of the peer is full
+// - onMessage(callback): invoke the callback with every received message.
+//   Messages are kept in the ring until a callback is set.
+//
+// Each message is copied twice: the sender encodes the value into a Duktape
+// string (or takes the buffer) and copies it into the ring of the peer, the
+// receiver copies it from the ring into a Duktape string (or buffer) and then
+// decodes it. The ring slot is released right after the second copy.
+template < typename Self >
+class MessagePorts {
+    static inline constexpr const char* SLOT = "messagePortsSlot";
+    static inline constexpr const char* PORT_INDEX = DUK_HIDDEN_SYMBOL( "portIndex" );
+    // Messages delivered in a single event; the rest waits for the next one
+    static constexpr int MESSAGE_BATCH = 16;
+
+    enum MessageKind: uint8_t { JSON = 0, BYTES = 1 };
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        std::vector< std::pair< std::string, utility::MessageChannel::Port > > messagePorts;
+    };
+
+    // The peers must not wake the machine once its members are destroyed
+    void onShutdown() {
+        for ( auto& [ name, port ] : self()._cfg.messagePorts )
+            port.setWaker( nullptr );
+    }
+
+    void initialize() {
+        _portCallbacks.create( self()._context, SLOT );
+
+        _portWaker.machine = &self();
+        _portListening.resize( self()._cfg.messagePorts.size(), false );
+        for ( auto& [ name, port ] : self()._cfg.messagePorts )
+            port.setWaker( &_portWaker );
+
+        self().registerNativeModule( "messaging", [this]( duk_context *ctx ) {
+            return self()._initializeMessagingModule( ctx );
+        });
+    }
+
+    // Deliver waiting messages of all ports that have a callback
+    void onEventLoop() {
+        duk_context *ctx = self()._context;
+        auto& ports = self()._cfg.messagePorts;
+        for ( size_t i = 0; i != ports.size(); i++ ) {
+            utility::MessageRing& ring = ports[ i ].second.incoming();
+            if ( !_portListening[ i ] || ring.empty() )
+                continue;
+            _portCallbacks.push( ctx );
+            duk_get_prop_index( ctx, -1, i );
+            const int callbackOffset = duk_get_top_index( ctx );
+
+            const uint8_t *message;
+            uint32_t size;
+            for ( int delivered = 0; delivered != MESSAGE_BATCH && ring.front( message, size ); delivered++ ) {
+                duk_require_stack( ctx, 4 );
+                duk_push_c_lightfunc( ctx, dukDeliverMessage, 3, 3, 0 );
+                duk_dup( ctx, callbackOffset );
+                duk_push_int( ctx, message[ 0 ] );
+                if ( message[ 0 ] == BYTES ) {
+                    void *buffer = duk_push_fixed_buffer( ctx, size - 1 );
+                    std::memcpy( buffer, message + 1, size - 1 );
+                }
+                else
+                    duk_push_lstring( ctx, reinterpret_cast< const char * >( message + 1 ), size - 1 );
+                ring.pop();
+                self().invoke( 3 );
+            }
+            duk_pop_2( ctx );
+            // Do not starve other work, continue in the next iteration
+            if ( !ring.empty() )
+                self().requestWakeUpAt( esp_timer_get_time() );
+        }
+    }
+
+private:
+    struct Waker: public utility::MessageWaker {
+        Self *machine = nullptr;
+
+        void wake() override {
+            machine->addEvent();
+        }
+    };
+
+    // Takes three arguments: the callback, the message kind and the payload
+    static duk_ret_t dukDeliverMessage( duk_context *ctx ) {
+        if ( duk_get_int( ctx, 1 ) == BYTES ) {
+            duk_push_buffer_object( ctx, 2, 0, duk_get_length( ctx, 2 ), DUK_BUFOBJ_UINT8ARRAY );
+            duk_replace( ctx, 2 );
+        }
+        else if ( duk_get_length( ctx, 2 ) == 0 )
+            duk_push_undefined( ctx ), duk_replace( ctx, 2 );
+        else
+            duk_json_decode( ctx, 2 );
+        duk_dup( ctx, 0 );
+        duk_dup( ctx, 2 );
+        duk_call( ctx, 1 );
+        return 0;
+    }
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeMessagingModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "port", dukPort, 1 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukPort( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        std::string_view name = duk_require_string( ctx, 0 );
+        auto& ports = self._cfg.messagePorts;
+        for ( size_t i = 0; i != ports.size(); i++ ) {
+            if ( ports[ i ].first != name )
+                continue;
+            duk_push_bare_object( ctx );
+            duk_function_list_entry methods[] = {
+                { "postMessage", dukPostMessage, 1 },
+                { "onMessage", dukOnMessage, 1 },
+                { nullptr, nullptr, 0 }
+            };
+            duk_put_function_list( ctx, -1, methods );
+            duk_push_uint( ctx, i );
+            duk_put_prop_string( ctx, -2, PORT_INDEX );
+            return 1;
+        }
+        dukRaiseError( ctx, "Unknown message port: " + std::string( name ) );
+        return 0;
+    }
+
+    static size_t _portIndexFromThis( duk_context *ctx ) {
+        duk_push_this( ctx );
+        duk_get_prop_string( ctx, -1, PORT_INDEX );
+        if ( !duk_is_number( ctx, -1 ) )
+            dukRaiseError( ctx, "Not a message port" );
+        size_t index = duk_get_uint( ctx, -1 );
+        duk_pop_2( ctx );
+        return index;
+    }
+
+    static duk_ret_t dukPostMessage( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        auto& port = self._cfg.messagePorts[ _portIndexFromThis( ctx ) ].second;
+
+        MessageKind kind = BYTES;
+        const void *payload;
+        duk_size_t size;
+        if ( duk_is_buffer_data( ctx, 0 ) )
+            payload = duk_get_buffer_data( ctx, 0, &size );
+        else {
+            kind = JSON;
+            duk_dup( ctx, 0 );
+            duk_json_encode( ctx, -1 );
+            // Values without JSON representation (e.g., undefined) are sent
+            // as an empty message
+            if ( duk_is_string( ctx, -1 ) )
+                payload = duk_get_lstring( ctx, -1, &size );
+            else
+                payload = "", size = 0;
+        }
+        bool sent = port.send( size + 1, [&]( uint8_t *message ) {
+            message[ 0 ] = kind;
+            std::memcpy( message + 1, payload, size );
+        } );
+        return dukReturn( ctx, sent );
+    }
+
+    static duk_ret_t dukOnMessage( duk_context *ctx ) {
+        duk_require_function( ctx, 0 );
+        auto& self = Self::fromContext( ctx );
+        size_t index = _portIndexFromThis( ctx );
+        self._portCallbacks.push( ctx );
+        duk_dup( ctx, 0 );
+        duk_put_prop_index( ctx, -2, index );
+        // Deliver the messages that arrived before
+        self._portListening[ index ] = true;
+        self.addEvent();
+        return dukReturn( ctx );
+    }
+
+    Waker _portWaker;
+    DukStashSlot _portCallbacks; // <stash>.messagePortsSlot
+    std::vector< bool > _portListening;
+};
+
+} // namespace jac
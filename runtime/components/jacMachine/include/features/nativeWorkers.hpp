@@ -0,0 +1,192 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <jsmachine.hpp>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace jac {
+
+// Run heavy native work (file reads, hashing, parsing...) on a pool of FreeRTOS
+// worker tasks, so it does not block the event loop. Requires the Promise
+// feature.
+//
+// A task runs on a worker and it must not touch Duktape. It returns
+// a completion which runs on the machine task and pushes the result; the
+// promise returned by offload is resolved with it. If the task or the
+// completion throws, the promise is rejected with an Error.
+//
+// The workers hand the finished requests back to the machine through a list
+// guarded by a mutex and wake up the event loop; the promises are settled in
+// onEventLoop. The pending promises are stored in <stash>.nativeWorkersSlot[id].
+template < typename Self >
+class NativeWorkers {
+    static inline constexpr const char* SLOT = "nativeWorkersSlot";
+public:
+    MACHINE_FEATURE_SELF();
+
+    // Pushes the result of the task, called on the machine task
+    using Completion = std::function< void( duk_context* ) >;
+    using Task = std::function< Completion() >;
+
+    struct Configuration {
+        int workerCount = 2;
+        uint32_t workerStackSize = 4096;
+        UBaseType_t workerPriority = 1;
+        BaseType_t workerCore = tskNO_AFFINITY;
+        // Number of tasks waiting for a worker; offload rejects tasks beyond it
+        int workerQueueLength = 16;
+    };
+
+    ~NativeWorkers() {
+        if ( !_requests || !_workerExited )
+            return;
+        // Let the workers finish their current task and quit
+        Request *quit = nullptr;
+        for ( int i = 0; i != _workerCount; i++ )
+            xQueueSend( _requests, &quit, portMAX_DELAY );
+        for ( int i = 0; i != _workerCount; i++ )
+            xSemaphoreTake( _workerExited, portMAX_DELAY );
+        Request *request;
+        while ( xQueueReceive( _requests, &request, 0 ) == pdTRUE )
+            delete request;
+        for ( Request *request : _done )
+            delete request;
+        vQueueDelete( _requests );
+        vSemaphoreDelete( _workerExited );
+    }
+
+    void initialize() {
+        _workerPromises.create( self()._context, SLOT );
+
+        const auto& cfg = self()._cfg;
+        _requests = xQueueCreate( cfg.workerQueueLength, sizeof( Request * ) );
+        _workerExited = xSemaphoreCreateCounting( cfg.workerCount, 0 );
+        if ( !_requests || !_workerExited )
+            throw std::runtime_error( "Cannot create native worker queue" );
+        for ( ; _workerCount != cfg.workerCount; _workerCount++ ) {
+            if ( xTaskCreatePinnedToCore( _workerLoop, "nativeWorker", cfg.workerStackSize,
+                    this, cfg.workerPriority, nullptr, cfg.workerCore ) != pdPASS )
+                throw std::runtime_error( "Cannot create native worker" );
+        }
+    }
+
+    void onEventLoop() {
+        std::vector< Request * > done;
+        {
+            std::scoped_lock _( _doneLock );
+            std::swap( done, _done );
+        }
+        for ( Request *request : done )
+            _settle( request );
+    }
+
+    // Run the task on a worker and push a promise of its result. Return false
+    // if the queue is full; the task is dropped and the promise rejected then.
+    // Can be called only from the machine task.
+    bool offload( Task task ) {
+        duk_context *ctx = self()._context;
+        self().pushPromise();
+
+        _workerPromises.push( ctx );
+        Request *request = new Request{ _allocateId(), std::move( task ), {}, {} };
+        duk_dup( ctx, -2 );
+        duk_put_prop_index( ctx, -2, request->id );
+        duk_pop( ctx );
+
+        if ( xQueueSend( _requests, &request, 0 ) != pdTRUE ) {
+            request->error = "Too many native tasks";
+            _settle( request );
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Request {
+        uint32_t id;
+        Task task;
+        Completion completion;
+        std::string error;
+    };
+
+    static void _workerLoop( void *arg ) {
+        auto& workers = *static_cast< NativeWorkers * >( arg );
+        Request *request;
+        while ( xQueueReceive( workers._requests, &request, portMAX_DELAY ) == pdTRUE && request ) {
+            try {
+                request->completion = request->task();
+            }
+            catch( const std::exception& e ) {
+                request->error = e.what();
+            }
+            request->task = nullptr;
+            {
+                std::scoped_lock _( workers._doneLock );
+                workers._done.push_back( request );
+            }
+            workers.self().addEvent();
+        }
+        xSemaphoreGive( workers._workerExited );
+        vTaskDelete( nullptr );
+    }
+
+    void _settle( Request *request ) {
+        duk_context *ctx = self()._context;
+        _workerPromises.push( ctx );
+        duk_get_prop_index( ctx, -1, request->id );
+        duk_del_prop_index( ctx, -2, request->id );
+        const int promiseOffset = duk_get_top_index( ctx );
+        _freeIds.push_back( request->id );
+
+        duk_push_c_lightfunc( ctx, dukComplete, 1, 1, 0 );
+        duk_push_pointer( ctx, request );
+        if ( duk_pcall( ctx, 1 ) == DUK_EXEC_SUCCESS )
+            self().resolvePromise( promiseOffset, -1 );
+        else
+            self().rejectPromise( promiseOffset, -1 );
+        duk_pop_3( ctx );
+        delete request;
+    }
+
+    // Push the result of the request given as a pointer
+    static duk_ret_t dukComplete( duk_context *ctx ) {
+        Request *request = static_cast< Request * >( duk_get_pointer( ctx, 0 ) );
+        if ( !request->completion )
+            dukRaiseError( ctx, request->error );
+        try {
+            request->completion( ctx );
+        }
+        catch( const std::exception& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        return 1;
+    }
+
+    uint32_t _allocateId() {
+        if ( _freeIds.empty() )
+            return _nextId++;
+        uint32_t id = _freeIds.back();
+        _freeIds.pop_back();
+        return id;
+    }
+
+    DukStashSlot _workerPromises; // <stash>.nativeWorkersSlot
+    QueueHandle_t _requests = nullptr;
+    SemaphoreHandle_t _workerExited = nullptr;
+    int _workerCount = 0;
+
+    std::mutex _doneLock;
+    std::vector< Request * > _done; // Guarded by _doneLock
+
+    uint32_t _nextId = 0;
+    std::vector< uint32_t > _freeIds;
+};
+
+} // namespace jac
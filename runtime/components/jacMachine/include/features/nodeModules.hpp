@@ -5,8 +5,16 @@
 
 #include <cstring>
 #include <map>
+#include <optional>
+#include <unordered_map>
 #include <functional>
+#include <iostream>
+#include <type_traits>
+#include <string_view>
 #include <filesystem.hpp>
+#include <packedImage.hpp>
+#include <gzipFile.hpp>
+#include <bytecodeCache.hpp>
 
 namespace jac {
 
@@ -21,8 +29,26 @@ public:
 
     struct Configuration {
         std::string basePath = "/";
+        // Store compiled modules and load them instead of parsing the source
+        // when it did not change
+        bool bytecodeCache = false;
+        // Directory (relative to basePath) holding the bytecode cache. It
+        // contains nothing else, so it can be removed to clear the cache.
+        std::string bytecodeCacheDir = "/__jbc";
+        // If set, modules are looked up in the image first. The image has to
+        // outlive the machine. Modules in the image are never cached.
+        const fs::PackedImage* moduleImage = nullptr;
+        // Number of cached module resolutions; the cache is cleared when it
+        // is full
+        int resolutionCacheSize = 64;
     };
 
+    // Module function wrapping the module source, the modules in the image
+    // are stored wrapped in it
+    static constexpr std::string_view MODULE_PREFIX =
+        "function (exports, require, module, __filename, __dirname) {";
+    static constexpr std::string_view MODULE_SUFFIX = "\n}";
+
     void initialize() {
         duk_push_object( self()._context );
         duk_push_c_function( self()._context, dukResolveModuleCb, DUK_VARARGS );
@@ -34,10 +60,25 @@ public:
 
     void onEventLoop() {}
 
+    // Evaluate the main module. When the bytecode cache is enabled or the
+    // module is in the image, the main module is loaded via the global require
+    // (so it can be loaded from the cache or compiled in place) and
+    // dukLoadModule marks it as require.main.
     void evaluateMain( const std::string& path ) {
-        std::string source = fs::readFile( resolvePath( path ) );
-        duk_push_string( self()._context, source.c_str() );
-        auto ret = duk_module_node_peval_main( self()._context, path.c_str() );
+        duk_int_t ret;
+        std::string id = path.front() == '/' ? path : "/" + path;
+        if ( self()._cfg.bytecodeCache || _imageModule( id ) ) {
+            _mainId = id;
+            duk_get_global_string( self()._context, "require" );
+            duk_push_string( self()._context, id.c_str() );
+            ret = duk_pcall( self()._context, 1 );
+        }
+        else {
+            withModuleSource( id, [&]( std::string_view source ) {
+                duk_push_lstring( self()._context, source.data(), source.size() );
+            } );
+            ret = duk_module_node_peval_main( self()._context, path.c_str() );
+        }
         if ( ret != 0 ) {
             std::string error = duk_safe_to_stacktrace( self()._context, -1 );
             duk_pop( self()._context );
@@ -71,50 +112,66 @@ private:
         /*
          *  Entry stack: [ requestedId parentId ]
          */
-        fs::Path requestedId = duk_get_string( ctx, 0 );
-        fs::Path parentId = duk_get_string( ctx, 1 );  /* calling module */
+        duk_size_t requestedLength, parentLength;
+        const char *requested = duk_get_lstring_default( ctx, 0, &requestedLength, "", 0 );
+        const char *parent = duk_get_lstring_default( ctx, 1, &parentLength, "", 0 );  /* calling module */
+        fs::PathView requestedId( std::string_view( requested, requestedLength ) );
+        fs::PathView parentId( std::string_view( parent, parentLength ) );
 
-        try {
-            Self& self = Self::fromContext( ctx );
-
-            fs::Path resolvedPath;
-
-            if ( requestedId.absolute() )
-                resolvedPath = requestedId;
-            else if ( requestedId[ 0 ] == "." || requestedId[ 0 ] == ".." )
-                resolvedPath = parentId.dirname() / requestedId;
-            else {
-                std::string id = duk_get_string( ctx, 0 );
-                auto registerIt = self._availableNativeModules.find( id );
-                if ( registerIt != self._availableNativeModules.end() )
-                    return dukReturn( ctx, id );
-                duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot resolve module %s from %s",
-                    requestedId.str().c_str(), parentId.str().c_str() );
-                __builtin_unreachable();
-            }
+        Self& self = Self::fromContext( ctx );
+        if ( const std::string* id = self._resolvedModule( requestedId, parentId ) )
+            return dukReturn( ctx, *id );
 
-            fs::Path basePath( self._cfg.basePath );
-            resolvedPath = basePath / resolvedPath;
+        std::string id;
+        if ( requestedId.absolute() || requestedId.front() == "." || requestedId.front() == ".." ) {
+            std::string error;
             try {
-                resolvedPath = resolvedPath.weakNormalForm();
-            } catch ( const std::runtime_error& e) {
-                duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot normalize path %s: %s",
-                    resolvedPath.str().c_str(), e.what() );
+                if ( !requestedId.absolute() )
+                    fs::appendNormalized( id, parentId.dirname() );
+                fs::appendNormalized( id, requestedId );
+            } catch ( const std::runtime_error& e ) {
+                error = e.what();
             }
+            if ( !error.empty() ) {
+                duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot normalize path %s from %s: %s",
+                    requested, parent, error.c_str() );
+            }
+        }
+        else {
+            std::string nativeId( requestedId.str() );
+            auto registerIt = self._availableNativeModules.find( nativeId );
+            if ( registerIt != self._availableNativeModules.end() ) {
+                self._cacheResolvedModule( nativeId );
+                return dukReturn( ctx, nativeId );
+            }
+            duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot resolve module %s from %s",
+                requested, parent );
+            __builtin_unreachable();
+        }
+        if ( id.empty() )
+            id = "/";
 
-            resolvedPath.cutFront( basePath.size() );
-            std::string id;
-            if ( resolvedPath.absolute() )
-                id = resolvedPath.str();
-            else
-                id = "/" + resolvedPath.str();
+        self._cacheResolvedModule( id );
+        return dukReturn( ctx, id );
+    }
 
-            return dukReturn( ctx, id );
-        } catch ( std::runtime_error& e ) {
-            duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot resolve module %s from %s: ",
-                    requestedId.str().c_str(), parentId.str().c_str(), e.what() );
-        }
-        __builtin_unreachable();
+    // Look up the resolution of (requestedId, parentId) in the cache. Returns
+    // nullptr if it is not there. The lookup key is kept for
+    // _cacheResolvedModule.
+    const std::string* _resolvedModule( fs::PathView requestedId, fs::PathView parentId ) {
+        // Relative ids are resolved against the parent, others are not
+        bool relative = !requestedId.absolute();
+        _resolutionKey.assign( relative ? parentId.dirname().str() : std::string_view() );
+        _resolutionKey.push_back( '\0' );
+        _resolutionKey.append( requestedId.str() );
+        auto it = _resolutionCache.find( _resolutionKey );
+        return it == _resolutionCache.end() ? nullptr : &it->second;
+    }
+
+    void _cacheResolvedModule( const std::string& id ) {
+        if ( int( _resolutionCache.size() ) >= self()._cfg.resolutionCacheSize )
+            _resolutionCache.clear();
+        _resolutionCache.emplace( _resolutionKey, id );
     }
 
     static duk_ret_t dukLoadModule( duk_context *ctx ) {
@@ -123,14 +180,27 @@ private:
          *  Entry stack: [ resolved_id exports module ]
          */
         const std::string requestedId = duk_get_string( ctx, 0 );
+        if ( !self._mainId.empty() && requestedId == self._mainId ) {
+            self._mainId.clear();
+            markMainModule( ctx );
+        }
         try {
             auto nativeModuleIt = self._availableNativeModules.find( requestedId );
             if ( nativeModuleIt != self._availableNativeModules.end() ) {
                 return nativeModuleIt->second( ctx );
             }
-            // The module is not a native one, try reading it from FS
-            std::string source = fs::readFile( self.resolvePath( requestedId ) );
-            return dukReturn( ctx, source );
+            // The module is not a native one, try the image first
+            if ( auto source = self._imageModule( requestedId ) ) {
+                evaluateImageModule( ctx, *source, requestedId );
+                return dukReturn( ctx );
+            }
+            return self.withModuleSource( requestedId, [&]( std::string_view source ) {
+                if ( !self._cfg.bytecodeCache )
+                    return dukReturn( ctx, source );
+                evaluateCachedModule( ctx, source, requestedId,
+                    self._cachePath( requestedId ) );
+                return dukReturn( ctx );
+            } );
         }
         catch ( std::exception& e ) {
             duk_error( ctx, DUK_ERR_TYPE_ERROR, "Cannot load module %s: %s",
@@ -139,13 +209,161 @@ private:
         __builtin_unreachable(); // as duk_error never returns
     }
 
+    // Make the module object in dukLoadModule the main module the same way as
+    // duk_module_node_peval_main does: require functions created from now on
+    // take require.main from the stash. The require function of the module
+    // itself already exists, so it is updated directly.
+    static void markMainModule( duk_context *ctx ) {
+        const int moduleOffset = 2;
+
+        duk_push_global_stash( ctx );
+        duk_dup( ctx, moduleOffset );
+        duk_put_prop_string( ctx, -2, "\xff" "mainModule" );
+        duk_pop( ctx );
+
+        duk_get_prop_string( ctx, moduleOffset, "require" );
+        duk_dup( ctx, moduleOffset );
+        duk_put_prop_string( ctx, -2, "main" );
+        duk_pop( ctx );
+    }
+
+    // Evaluate the module the same way as duk_module_node does, but compile
+    // the module wrapper via the bytecode cache. The Duktape stack is expected
+    // to be the same as for dukLoadModule. Module exports are populated via
+    // the module object, so the caller should return undefined.
+    static void evaluateCachedModule( duk_context *ctx, std::string_view source,
+        const std::string& id, const std::string& cachePath )
+    {
+        bytecode::compileFunction( ctx, MODULE_PREFIX, source, MODULE_SUFFIX, id, cachePath );
+        callModuleFunction( ctx, id );
+    }
+
+    // Evaluate a module from the image. Its source is already wrapped in the
+    // module function, so it is compiled in place: Duktape references the
+    // source in the image as an external string instead of copying it. There
+    // is no bytecode cache for such modules, the image is read-only.
+    static void evaluateImageModule( duk_context *ctx, std::string_view source,
+        const std::string& id )
+    {
+        duk_push_lstring( ctx, source.data(), source.size() );
+        duk_push_string( ctx, id.c_str() );
+        duk_compile( ctx, DUK_COMPILE_FUNCTION );
+        callModuleFunction( ctx, id );
+    }
+
+    // Call the compiled module function on top of the stack with the module
+    // object at the same offset as in dukLoadModule
+    static void callModuleFunction( duk_context *ctx, const std::string& id ) {
+        const int moduleOffset = 2;
+
+        duk_push_string( ctx, "name" );
+        duk_push_string( ctx, "main" );
+        duk_def_prop( ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_FORCE );
+
+        duk_get_prop_string( ctx, moduleOffset, "exports" );
+        duk_get_prop_string( ctx, moduleOffset, "require" );
+        duk_dup( ctx, moduleOffset );
+        duk_get_prop_string( ctx, moduleOffset, "filename" );
+        duk_push_undefined( ctx ); // __dirname
+        if ( duk_pcall( ctx, 5 ) != DUK_EXEC_SUCCESS ) {
+            // Failed module should not stay in the module cache; this mimics
+            // what duk_module_node does for source modules
+            duk_push_global_stash( ctx );
+            duk_get_prop_string( ctx, -1, "\xff" "requireCache" );
+            duk_del_prop_string( ctx, -1, id.c_str() );
+            duk_pop_2( ctx );
+            duk_throw( ctx );
+        }
+        duk_pop( ctx );
+    }
+
+    // Source of a module given by its id in the image (already wrapped in the
+    // module function, see tools/transfer.py), nullopt if it is not there
+    std::optional< std::string_view > _imageModule( const std::string& id ) {
+        if ( !self()._cfg.moduleImage )
+            return std::nullopt;
+        return self()._cfg.moduleImage->find( id );
+    }
+
+    // Invoke f with the source of a module given by its id read from the
+    // filesystem. If there is no such file, but there is its compressed
+    // version (see fs::GZIP_SUFFIX), it is inflated into a Duktape buffer
+    // that stays on the stack until f returns.
+    template < typename F >
+    auto withModuleSource( const std::string& id, F f ) {
+        std::string path = resolvePath( id );
+        std::string compressedPath = path + fs::GZIP_SUFFIX;
+        if ( !fs::fileExists( path ) && fs::fileExists( compressedPath ) )
+            return withCompressedSource( compressedPath, f );
+        std::string source = fs::readFile( path );
+        return f( std::string_view( source ) );
+    }
+
+    template < typename F >
+    auto withCompressedSource( const std::string& path, F f ) {
+        duk_context *ctx = self()._context;
+        duk_idx_t bufferIdx = duk_get_top( ctx );
+        std::string_view source;
+        try {
+            fs::inflateGzipFile( path, [&]( size_t size ) {
+                auto *buffer = static_cast< uint8_t* >( duk_push_fixed_buffer( ctx, size ) );
+                source = std::string_view( reinterpret_cast< const char* >( buffer ), size );
+                return buffer;
+            } );
+        } catch ( std::exception& ) {
+            duk_set_top( ctx, bufferIdx );
+            throw;
+        }
+        // f might leave its results on the stack, keep them
+        if constexpr ( std::is_void_v< decltype( f( source ) ) > ) {
+            f( source );
+            duk_remove( ctx, bufferIdx );
+        }
+        else {
+            auto result = f( source );
+            duk_remove( ctx, bufferIdx );
+            return result;
+        }
+    }
+
     std::string resolvePath( const std::string& id ) {
         assert( !id.empty() );
         auto path = fs::concatPath( self()._cfg.basePath, id );
         return path;
     }
 
+    // Path of the cache file of a module. The cache directory is flat, the
+    // module id is escaped into the file name ("/lib/a.js" is stored as
+    // "lib%2Fa.js.jbc"). An empty path (i.e., no caching) is returned if the
+    // directory cannot be created.
+    std::string _cachePath( const std::string& id ) {
+        std::string path = resolvePath( self()._cfg.bytecodeCacheDir );
+        path.push_back( '/' );
+        if ( !_cacheDirReady ) {
+            if ( !fs::ensurePath( path ) )
+                return {};
+            _cacheDirReady = true;
+        }
+        for ( char c : std::string_view( id ).substr( 1 ) ) {
+            if ( c == '%' )
+                path += "%25";
+            else if ( c == '/' )
+                path += "%2F";
+            else
+                path.push_back( c );
+        }
+        path += ".jbc";
+        return path;
+    }
+
     std::map< std::string, NativeModuleInit > _availableNativeModules;
+    // Resolved ids keyed by "<parent directory>\0<requested id>"; the parent
+    // directory is empty for ids not resolved relative to the parent
+    std::unordered_map< std::string, std::string > _resolutionCache;
+    std::string _resolutionKey;
+    // Id of the main module until it is loaded via the global require
+    std::string _mainId;
+    bool _cacheDirReady = false;
 };
 
 } // namespace jac
\ No newline at end of file
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <dukUtility.hpp>
+#include <esp_err.h>
+
+#include <string>
+
+namespace jac {
+
+// Raise a JavaScript error if a call of an ESP-IDF driver failed
+inline void dukCheckEsp( duk_context* ctx, esp_err_t error, const char* operation ) {
+    if ( error != ESP_OK )
+        dukRaiseError( ctx, std::string( operation ) + " failed: " + esp_err_to_name( error ) );
+}
+
+} // namespace jac
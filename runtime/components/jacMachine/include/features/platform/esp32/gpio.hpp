@@ -2,23 +2,59 @@
 
 #include <jsmachine.hpp>
 #include <driver/gpio.h>
+#include <soc/gpio_struct.h>
+#include <eventRing.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace jac {
 
 // Implement GPIO driver
 //
 // The driver exposes a function pin(identifier) that returns an object of type
-// Gpio.
+// Gpio. Constructing a Gpio with a pin number out of the range raises
+// a RangeError.
 //
 // The object has the following methods (for now):
 // - setMode(mode): change the pin mode
 // - digitalRead(): read the value of the GPIO
 // - digitalWrite(): set the GPIO status
-// - onChange(cb): attach a function on a callback, return handle
+// - onChange(cb): attach a function on a callback, return handle; the callback
+//   is invoked with the pin number, the level and the time of the change (in
+//   microseconds). The pin also wakes the chip from light sleep.
 // - clearInterrupt(handle): given a handle, unregister interrupt handler
+// - capture(cb, options): record the edges of the pin in the interrupt handler
+//   and pass them to the callback in batches. The callback is invoked with the
+//   pin number, a Float64Array of pairs ( time in microseconds, level ) and the
+//   number of edges dropped since the last batch because the buffer was full.
+//   A batch is delivered every options.interval milliseconds (default 100, 0
+//   to disable) or once options.highWater edges (default half of the
+//   buffer) are waiting. options.capacity sets the size of the buffer in edges
+//   (default 256). A pin with onChange handlers cannot be captured and vice
+//   versa; a captured pin does not wake the chip from light sleep.
+// - stopCapture(): stop the capture and deliver the remaining edges
+//
+// The module also provides functions working with multiple pins at once. The
+// pins are given as a bit mask of pins 0-31 and the registers are accessed
+// directly, so a single call takes about as long as a single pin operation:
+// - portRead(): return the levels of the pins as a mask
+// - portWrite(mask, levels): set the pins in the mask to the given levels
+// - playWaveform(mask, waveform): drive the pins in the mask according to the
+//   waveform and return once it finishes. The waveform is a buffer (e.g.,
+//   Uint32Array) of pairs ( time in microseconds since the start, levels ).
+//   The function busy-waits between the edges, so it blocks the event loop;
+//   thus the times are limited to MAX_WAVEFORM_DURATION (1 s), a longer wait
+//   would trip the task watchdog.
 template < typename Self >
 class GpioDriver {
     static inline constexpr const char* SLOT = "gpioDriverSlot";
+    // Capture callbacks indexed by the pin number
+    static inline constexpr const char* CAPTURE_SLOT = "gpioCaptureSlot";
 public:
     MACHINE_FEATURE_SELF();
 
@@ -28,13 +64,53 @@ public:
         setupSlot();
 
         gpio_install_isr_service( 0 );
+        _gpioEventHandler = self().registerEventHandler( onGpioEvent );
+        _captureEventHandler = self().registerEventHandler( onCaptureEvent );
 
         self().registerNativeModule( "gpio", [this]( duk_context *ctx ) {
             return self().initializeModule( ctx );
         });
     }
 
-    void onEventLoop() {}
+    // Deliver the batches of captures which are due
+    void onEventLoop() {
+        int64_t now = esp_timer_get_time();
+        for ( auto& capture : _gpioCaptures ) {
+            if ( !capture || capture->interval == 0 )
+                continue;
+            if ( now >= capture->nextDelivery ) {
+                _deliverCapture( *capture );
+                capture->nextDelivery = now + capture->interval;
+            }
+            self().requestWakeUpAt( capture->nextDelivery );
+        }
+    }
+
+    // Let the pins with onChange handlers wake the chip from light sleep (see
+    // PowerManager). Light sleep can be interrupted only by a level, so the
+    // interrupts of the pins are switched to the level opposite to the current
+    // one; the interrupt handler switches the pin back to edges once it fires.
+    void armGpioWakeUp() {
+        _gpioWakeArmed.store( true );
+        for ( int i = 0; i != GPIO_NUM_MAX; i++ ) {
+            if ( !( _gpioWakePins >> i & 1 ) )
+                continue;
+            gpio_num_t pin = gpio_num_t( i );
+            gpio_wakeup_enable( pin, gpio_get_level( pin ) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL );
+        }
+    }
+
+    // Restore the edge interrupts of the wake up pins
+    void disarmGpioWakeUp() {
+        for ( int i = 0; i != GPIO_NUM_MAX; i++ ) {
+            if ( !( _gpioWakePins >> i & 1 ) )
+                continue;
+            gpio_num_t pin = gpio_num_t( i );
+            gpio_wakeup_disable( pin );
+            gpio_set_intr_type( pin, GPIO_INTR_ANYEDGE );
+        }
+        _gpioWakeArmed.store( false );
+    }
 private:
     struct IsrId {
         Self *machine;
@@ -43,11 +119,39 @@ private:
         bool lastLevel;
     };
 
+    struct Edge {
+        int64_t time;
+        bool level;
+    };
+
+    struct Capture {
+        Capture( uint32_t capacity ): ring( capacity ) {}
+
+        Self *machine;
+        gpio_num_t pin;
+        bool lastLevel;
+        utility::EventRing< Edge > ring;
+        uint32_t highWater;
+        int64_t interval;     // In microseconds
+        int64_t nextDelivery;
+        std::atomic< uint32_t > waiting = 0;   // Edges in the ring
+        std::atomic< uint32_t > dropped = 0;
+        std::atomic< bool > signalled = false; // High water event posted
+    };
+
+    uint16_t _gpioEventHandler;
+    uint16_t _captureEventHandler;
+    DukStashSlot _gpioCallbacks;        // <stash>.gpioDriverSlot
+    DukStashSlot _gpioCaptureCallbacks; // <stash>.gpioCaptureSlot
+    std::unique_ptr< Capture > _gpioCaptures[ GPIO_NUM_MAX ];
+    // Pins with onChange handlers, they serve as light sleep wake up sources.
+    // The handlers cannot be removed yet.
+    uint64_t _gpioWakePins = 0;
+    std::atomic< bool > _gpioWakeArmed = false;
+
     void setupSlot() {
-        duk_push_heap_stash( self()._context );
-        duk_push_object( self()._context );
-        duk_put_prop_string( self()._context, -2, SLOT );
-        duk_pop( self()._context );
+        _gpioCallbacks.create( self()._context, SLOT, false );
+        _gpioCaptureCallbacks.create( self()._context, CAPTURE_SLOT );
     }
 
     // Initializes the module; there are the following arguments on the
@@ -62,9 +166,11 @@ private:
         dukPushClass( ctx, "Gpio", gpioConstructor, 1,
             {
                 { "setMode", gpioSetMode, 1 },
-                { "digitalRead", digitalRead, 0 },
+                dukMethodEntry< &Pin::digitalRead >( "digitalRead" ),
                 { "digitalWrite", digitalWrite, 1 },
                 { "onChange", onChange, 1},
+                { "capture", capture, 2 },
+                { "stopCapture", stopCapture, 0 },
                 { nullptr, nullptr, 0 }
             },
             {
@@ -76,24 +182,39 @@ private:
         duk_push_c_function( ctx, getPin, 1 );
         duk_put_prop_string( ctx, exportOffset, "getPin" );
 
+        duk_function_list_entry portFunctions[] = {
+            dukEntry< portRead >( "portRead" ),
+            dukEntry< _writePort >( "portWrite" ),
+            { "playWaveform", playWaveform, 2 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, portFunctions );
+
         return dukReturn( ctx );
     }
 
+    // Native state of a Gpio object, see dukSetNative
+    struct Pin {
+        gpio_num_t number;
+
+        bool digitalRead() {
+            return gpio_get_level( number );
+        }
+    };
+
     // The constructor takes pin number
     static duk_ret_t gpioConstructor( duk_context *ctx ) {
         if ( !duk_is_constructor_call( ctx ) ) {
             return DUK_RET_TYPE_ERROR;
         }
 
+        // Other methods index by the pin number, validate it once here
         int gpioIndex = duk_require_int( ctx, 0 );
-        // TBA: Validate the index
+        if ( gpioIndex < 0 || gpioIndex >= GPIO_NUM_MAX )
+            duk_error( ctx, DUK_ERR_RANGE_ERROR, "Invalid pin number: %d", gpioIndex );
 
         duk_push_this( ctx );
-        auto thisOffset = duk_get_top_index( ctx );
-
-        duk_push_int( ctx, gpioIndex );
-        duk_put_prop_string( ctx, thisOffset, "_pin" );
-
+        dukSetNative( ctx, -1, std::make_unique< Pin >( Pin{ static_cast< gpio_num_t >( gpioIndex ) } ) );
         duk_pop( ctx ); // Pop this
 
         return dukReturn( ctx );
@@ -122,8 +243,7 @@ private:
         }
 
         // Check if there is an interrupt handler attached:
-        duk_push_heap_stash( ctx );
-        duk_get_prop_string( ctx, -1, SLOT );
+        Self::fromContext( ctx )._gpioCallbacks.push( ctx );
         if ( duk_has_prop_index( ctx, -1, pinNumber ) ) {
             duk_get_prop_index( ctx, -1,  pinNumber );
             if ( duk_get_length( ctx, -1 ) ) {
@@ -136,13 +256,6 @@ private:
         return dukReturn( ctx );
     }
 
-    static duk_ret_t digitalRead( duk_context *ctx ) {
-        gpio_num_t pinNumber = getPinNumberFromThis( ctx );
-        bool level = gpio_get_level( pinNumber );
-
-        return dukReturn( ctx, level );
-    }
-
     static duk_ret_t digitalWrite( duk_context *ctx ) {
         duk_to_boolean( ctx, 0 );
         bool level = duk_require_boolean( ctx, -1 );
@@ -157,6 +270,8 @@ private:
         duk_require_function( ctx, 0 );
 
         gpio_num_t pinNumber = getPinNumberFromThis( ctx );
+        if ( Self::fromContext( ctx )._gpioCaptures[ pinNumber ] )
+            dukRaiseError( ctx, "The pin is captured" );
 
         // Isr id will be freed when the handler is removed
         IsrId *isrId = new IsrId;
@@ -166,8 +281,7 @@ private:
 
         // Ensure there is an array with callbacks and ensure the slot array is
         // on top of the stack
-        duk_push_heap_stash( ctx );
-        duk_get_prop_string( ctx, -1, SLOT );
+        Self::fromContext( ctx )._gpioCallbacks.push( ctx );
         if ( !duk_has_prop_index( ctx, -1, pinNumber ) ) {
             duk_push_array( ctx );
             duk_put_prop_index( ctx, -2, pinNumber );
@@ -190,45 +304,236 @@ private:
         gpio_isr_handler_add( pinNumber, isrHandler, isrId );
         gpio_set_intr_type( pinNumber, GPIO_INTR_ANYEDGE );
         gpio_intr_enable( pinNumber );
+        Self::fromContext( ctx )._gpioWakePins |= uint64_t( 1 ) << pinNumber;
 
         return dukReturn( ctx, pinNumber << 16 | cbArrayLength );
     }
 
+    // The event is posted directly to the machine event ring; the value holds
+    // the level in the lowest bit and the callback index in the rest
     static void isrHandler( void *arg ) {
         IsrId *isrId = reinterpret_cast< IsrId* >( arg );
+        Self& machine = *isrId->machine;
+        // A level interrupt would fire until the level changes again
+        if ( machine._gpioWakeArmed.load( std::memory_order_relaxed ) )
+            GPIO.pin[ isrId->pin ].int_type = GPIO_INTR_ANYEDGE;
         bool level = gpio_get_level( isrId->pin );
         if ( level == isrId->lastLevel )
             return;
         isrId->lastLevel = level;
-        isrId->machine->handleInterrupt([]( void *arg ) {
-            IsrId *isrId = reinterpret_cast< IsrId* >( arg );
-            isrId->machine->schedule([&isrId]( duk_context* ctx ) {
-                duk_require_stack( ctx, 4 );
-                duk_push_c_function( ctx, isrHandlerJs, 3 );
-                duk_push_int( ctx, isrId->cbIndex );
-                duk_push_int( ctx, isrId->pin );
-                duk_push_boolean( ctx, isrId->lastLevel );
-            });
-        }, arg );
+        machine.postEvent( {
+            machine._gpioEventHandler,
+            uint16_t( isrId->pin ),
+            uint32_t( isrId->cbIndex ) << 1 | level,
+            esp_timer_get_time()
+        } );
+    }
+
+    static void onGpioEvent( Self& self, const MachineEvent& e ) {
+        duk_context *ctx = self._context;
+        duk_require_stack( ctx, 5 );
+        duk_push_c_function( ctx, isrHandlerJs, 4 );
+        duk_push_int( ctx, e.value >> 1 );
+        duk_push_int( ctx, e.source );
+        duk_push_boolean( ctx, e.value & 1 );
+        duk_push_number( ctx, e.timestamp );
+        self.invoke( 4 );
     }
 
     static duk_ret_t isrHandlerJs( duk_context *ctx ) {
         int cbIndex = duk_require_int( ctx, 0 );
         int pinNumber = duk_require_int( ctx, 1 );
         // Simply obtain callback handler...
-        duk_push_heap_stash( ctx );
-        duk_get_prop_string( ctx, -1, SLOT );
+        Self::fromContext( ctx )._gpioCallbacks.push( ctx );
         duk_get_prop_index( ctx, -1, pinNumber );
         duk_get_prop_index( ctx, -1, cbIndex );
         duk_get_prop_string( ctx, -1, "cb" );
-        // ...and invoke it with pin number (0) and pin level (1)
+        // ...and invoke it with pin number (0), pin level (2) and time (3)
         duk_push_int( ctx, pinNumber );
         duk_dup( ctx, 2 );
-        duk_call( ctx, 2 );
+        duk_dup( ctx, 3 );
+        duk_call( ctx, 3 );
+
+        return dukReturn( ctx );
+    }
+
+    // The first argument is the callback, the second one optional options
+    static duk_ret_t capture( duk_context *ctx ) {
+        duk_require_function( ctx, 0 );
+        gpio_num_t pinNumber = getPinNumberFromThis( ctx );
+        auto& self = Self::fromContext( ctx );
+        if ( self._gpioCaptures[ pinNumber ] )
+            dukRaiseError( ctx, "The pin is already captured" );
+        // Both use the interrupt handler of the pin
+        if ( self._gpioWakePins >> pinNumber & 1 )
+            dukRaiseError( ctx, "The pin has onChange handlers" );
+
+        auto option = [&]( const char *name, double defaultValue ) {
+            if ( !duk_is_object( ctx, 1 ) || !duk_get_prop_string( ctx, 1, name ) ) {
+                if ( duk_is_object( ctx, 1 ) )
+                    duk_pop( ctx );
+                return defaultValue;
+            }
+            double value = duk_require_number( ctx, -1 );
+            duk_pop( ctx );
+            return value;
+        };
+        uint32_t capacity = std::max( option( "capacity", 256 ), 2.0 );
+        auto capture = std::make_unique< Capture >( capacity );
+        capture->machine = &self;
+        capture->pin = pinNumber;
+        capture->lastLevel = gpio_get_level( pinNumber );
+        // The ring rounds the capacity up, take the real one
+        capture->highWater = std::clamp< double >(
+            option( "highWater", capture->ring.capacity() / 2 ), 1, capture->ring.capacity() );
+        capture->interval = option( "interval", 100 ) * 1000;
+        capture->nextDelivery = esp_timer_get_time() + capture->interval;
+
+        self._gpioCaptureCallbacks.push( ctx );
+        duk_dup( ctx, 0 );
+        duk_put_prop_index( ctx, -2, pinNumber );
+
+        gpio_isr_handler_add( pinNumber, captureIsrHandler, capture.get() );
+        self._gpioCaptures[ pinNumber ] = std::move( capture );
+        gpio_set_intr_type( pinNumber, GPIO_INTR_ANYEDGE );
+        gpio_intr_enable( pinNumber );
+        // Wake up the event loop, so it schedules the first delivery
+        self.addEvent();
+
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t stopCapture( duk_context *ctx ) {
+        gpio_num_t pinNumber = getPinNumberFromThis( ctx );
+        auto& self = Self::fromContext( ctx );
+        if ( !self._gpioCaptures[ pinNumber ] )
+            return dukReturn( ctx );
+        gpio_intr_disable( pinNumber );
+        gpio_isr_handler_remove( pinNumber );
+        self._deliverCapture( *self._gpioCaptures[ pinNumber ] );
+        self._gpioCaptures[ pinNumber ].reset();
+
+        self._gpioCaptureCallbacks.push( ctx );
+        duk_del_prop_index( ctx, -1, pinNumber );
+        return dukReturn( ctx );
+    }
+
+    // Record the edge; post an event only once the high water mark is reached
+    static void IRAM_ATTR captureIsrHandler( void *arg ) {
+        Capture& capture = *reinterpret_cast< Capture* >( arg );
+        int64_t time = esp_timer_get_time();
+        bool level = capture.pin < 32
+            ? ( GPIO.in >> capture.pin ) & 1
+            : gpio_get_level( capture.pin );
+        // Coalesce interrupts that did not change the level
+        if ( level == capture.lastLevel )
+            return;
+        capture.lastLevel = level;
+        if ( !capture.ring.push( { time, level } ) ) {
+            capture.dropped.fetch_add( 1, std::memory_order_relaxed );
+            return;
+        }
+        uint32_t waiting = capture.waiting.fetch_add( 1, std::memory_order_relaxed ) + 1;
+        if ( waiting >= capture.highWater && !capture.signalled.exchange( true ) ) {
+            Self& machine = *capture.machine;
+            machine.postEvent( {
+                machine._captureEventHandler, uint16_t( capture.pin ), 0, time } );
+        }
+    }
 
+    static void onCaptureEvent( Self& self, const MachineEvent& e ) {
+        if ( auto& capture = self._gpioCaptures[ e.source ] )
+            self._deliverCapture( *capture );
+    }
+
+    // Let the interrupt handler signal the high water mark again. The handler
+    // might have crossed the mark while the signal was still set, and then it
+    // posted nothing, so check the mark once more.
+    void _rearmCapture( Capture& capture ) {
+        capture.signalled = false;
+        if ( capture.waiting.load() >= capture.highWater && !capture.signalled.exchange( true ) ) {
+            self().postEvent( {
+                _captureEventHandler, uint16_t( capture.pin ), 0, esp_timer_get_time() } );
+        }
+    }
+
+    // Invoke the capture callback with the edges waiting in the ring
+    void _deliverCapture( Capture& capture ) {
+        duk_context *ctx = self()._context;
+        // The edges arriving meanwhile wait for the next batch
+        uint32_t count = capture.waiting.load( std::memory_order_relaxed );
+        uint32_t dropped = capture.dropped.exchange( 0, std::memory_order_relaxed );
+        if ( count == 0 && dropped == 0 ) {
+            _rearmCapture( capture );
+            return;
+        }
+
+        duk_require_stack( ctx, 6 );
+        _gpioCaptureCallbacks.push( ctx );
+        duk_get_prop_index( ctx, -1, capture.pin );
+        duk_push_int( ctx, capture.pin );
+        double *pairs = static_cast< double * >(
+            duk_push_fixed_buffer( ctx, count * 2 * sizeof( double ) ) );
+        Edge edge;
+        uint32_t popped = 0;
+        while ( popped != count && capture.ring.pop( &edge, 1 ) ) {
+            pairs[ 2 * popped ] = edge.time;
+            pairs[ 2 * popped + 1 ] = edge.level;
+            popped++;
+        }
+        capture.waiting.fetch_sub( popped, std::memory_order_relaxed );
+        _rearmCapture( capture );
+        duk_push_buffer_object( ctx, -1, 0, popped * 2 * sizeof( double ), DUK_BUFOBJ_FLOAT64ARRAY );
+        duk_remove( ctx, -2 );
+        duk_push_uint( ctx, dropped );
+        self().invoke( 3 );
+        duk_pop( ctx );
+    }
+
+    static uint32_t portRead() {
+        return GPIO.in;
+    }
+
+    static constexpr uint32_t MAX_WAVEFORM_DURATION = 1000000; // in microseconds
+
+    static duk_ret_t playWaveform( duk_context *ctx ) {
+        uint32_t mask = duk_require_uint( ctx, 0 );
+        duk_size_t size;
+        // The buffer can be a view at any offset, so the pairs are copied out
+        // instead of accessed in place; unaligned loads fault on Xtensa
+        const uint8_t *waveform = static_cast< const uint8_t * >(
+            duk_require_buffer_data( ctx, 1, &size ) );
+        const size_t PAIR_SIZE = 2 * sizeof( uint32_t );
+        if ( size % PAIR_SIZE != 0 )
+            dukRaiseError( ctx, "Waveform has to consist of ( time, levels ) pairs" );
+        auto pairAt = [&]( size_t offset ) {
+            std::pair< uint32_t, uint32_t > pair;
+            std::memcpy( &pair.first, waveform + offset, sizeof( uint32_t ) );
+            std::memcpy( &pair.second, waveform + offset + sizeof( uint32_t ), sizeof( uint32_t ) );
+            return pair;
+        };
+        for ( size_t offset = 0; offset != size; offset += PAIR_SIZE ) {
+            if ( pairAt( offset ).first > MAX_WAVEFORM_DURATION ) {
+                duk_error( ctx, DUK_ERR_RANGE_ERROR, "Waveform cannot be longer than %u us",
+                    unsigned( MAX_WAVEFORM_DURATION ) );
+            }
+        }
+
+        int64_t start = esp_timer_get_time();
+        for ( size_t offset = 0; offset != size; offset += PAIR_SIZE ) {
+            auto [ time, levels ] = pairAt( offset );
+            int64_t at = start + time;
+            while ( esp_timer_get_time() < at );
+            _writePort( mask, levels );
+        }
         return dukReturn( ctx );
     }
 
+    static void IRAM_ATTR _writePort( uint32_t mask, uint32_t levels ) {
+        GPIO.out_w1ts = mask & levels;
+        GPIO.out_w1tc = mask & ~levels;
+    }
+
     static duk_ret_t getPin( duk_context *ctx ) {
         // TBA: implement
         return DUK_RET_TYPE_ERROR;
@@ -236,10 +541,9 @@ private:
 
     static gpio_num_t getPinNumberFromThis( duk_context *ctx ) {
         duk_push_this( ctx );
-        duk_get_prop_string( ctx, -1, "_pin" );
-        int pinNumber = duk_require_int( ctx, -1 );
-        duk_pop_2( ctx );
-        return static_cast< gpio_num_t >( pinNumber );
+        gpio_num_t pinNumber = dukGetNative< Pin >( ctx, -1 ).number;
+        duk_pop( ctx );
+        return pinNumber;
     }
 };
 
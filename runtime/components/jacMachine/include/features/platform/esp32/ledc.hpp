@@ -0,0 +1,162 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <driver/ledc.h>
+#include "espError.hpp"
+
+#include <algorithm>
+#include <string>
+
+namespace jac {
+
+// Implement PWM output by the LEDC peripheral
+//
+// The driver exposes native module "ledc" with the following functions. All
+// timers and channels use the high speed mode; there are 4 timers and 8
+// channels. The duty is given as a fraction between 0 and 1.
+// - configureTimer(timer, frequency[, resolution]): set up the timer with the
+//   frequency in Hz and the duty resolution in bits (default 10)
+// - configureChannel(channel, pin, timer[, duty]): output PWM of the timer to
+//   the pin
+// - setDuty(channel, duty)
+// - setFrequency(timer, frequency)
+// - fade(channel, duty, time): gradually change the duty within given time in
+//   milliseconds; the hardware performs the fade
+// - stop(channel[, level]): stop the output and keep the pin at the level
+template < typename Self >
+class LedcDriver {
+    static constexpr ledc_mode_t MODE = LEDC_HIGH_SPEED_MODE;
+    static constexpr int TIMER_COUNT = 4;
+    static constexpr int CHANNEL_COUNT = 8;
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {};
+
+    void initialize() {
+        ledc_fade_func_install( 0 );
+        self().registerNativeModule( "ledc", [this]( duk_context *ctx ) {
+            return self()._initializeLedcModule( ctx );
+        });
+    }
+
+    void onEventLoop() {}
+private:
+    // Duty resolution of the timers and timers of the channels
+    int _ledcResolution[ TIMER_COUNT ] = {};
+    int _ledcTimerOf[ CHANNEL_COUNT ] = {};
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeLedcModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "configureTimer", dukConfigureTimer, 3 },
+            { "configureChannel", dukConfigureChannel, 4 },
+            { "setDuty", dukSetDuty, 2 },
+            { "setFrequency", dukSetFrequency, 2 },
+            { "fade", dukFade, 3 },
+            { "stop", dukStop, 2 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static int _requireIndex( duk_context *ctx, int offset, int count, const char *what ) {
+        int index = duk_require_int( ctx, offset );
+        if ( index < 0 || index >= count )
+            dukRaiseError( ctx, std::string( "Invalid LEDC " ) + what + ": " + std::to_string( index ) );
+        return index;
+    }
+
+    static ledc_timer_t _requireTimer( duk_context *ctx, int offset ) {
+        return ledc_timer_t( _requireIndex( ctx, offset, TIMER_COUNT, "timer" ) );
+    }
+
+    static ledc_channel_t _requireChannel( duk_context *ctx, int offset ) {
+        return ledc_channel_t( _requireIndex( ctx, offset, CHANNEL_COUNT, "channel" ) );
+    }
+
+    // Convert the duty fraction on given offset to the raw duty of the channel
+    uint32_t _rawDuty( duk_context *ctx, int offset, ledc_channel_t channel ) {
+        double duty = std::clamp( duk_require_number( ctx, offset ), 0.0, 1.0 );
+        return duty * ( ( 1u << _ledcResolution[ _ledcTimerOf[ channel ] ] ) - 1 );
+    }
+
+    static duk_ret_t dukConfigureTimer( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        ledc_timer_t timer = _requireTimer( ctx, 0 );
+        uint32_t frequency = duk_require_uint( ctx, 1 );
+        int resolution = duk_is_undefined( ctx, 2 ) ? 10 : duk_require_int( ctx, 2 );
+        if ( resolution < 1 || resolution >= LEDC_TIMER_BIT_MAX )
+            dukRaiseError( ctx, "Invalid LEDC resolution: " + std::to_string( resolution ) );
+
+        ledc_timer_config_t config{};
+        config.speed_mode = MODE;
+        config.duty_resolution = ledc_timer_bit_t( resolution );
+        config.timer_num = timer;
+        config.freq_hz = frequency;
+        config.clk_cfg = LEDC_AUTO_CLK;
+        dukCheckEsp( ctx, ledc_timer_config( &config ), "LEDC timer configuration" );
+        self._ledcResolution[ timer ] = resolution;
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukConfigureChannel( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        ledc_channel_t channel = _requireChannel( ctx, 0 );
+        int pin = duk_require_int( ctx, 1 );
+        ledc_timer_t timer = _requireTimer( ctx, 2 );
+        if ( self._ledcResolution[ timer ] == 0 )
+            dukRaiseError( ctx, "LEDC timer is not configured" );
+        self._ledcTimerOf[ channel ] = timer;
+
+        ledc_channel_config_t config{};
+        config.gpio_num = pin;
+        config.speed_mode = MODE;
+        config.channel = channel;
+        config.intr_type = LEDC_INTR_DISABLE;
+        config.timer_sel = timer;
+        config.duty = duk_is_undefined( ctx, 3 ) ? 0 : self._rawDuty( ctx, 3, channel );
+        config.hpoint = 0;
+        dukCheckEsp( ctx, ledc_channel_config( &config ), "LEDC channel configuration" );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukSetDuty( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        ledc_channel_t channel = _requireChannel( ctx, 0 );
+        dukCheckEsp( ctx, ledc_set_duty( MODE, channel, self._rawDuty( ctx, 1, channel ) ), "LEDC duty" );
+        dukCheckEsp( ctx, ledc_update_duty( MODE, channel ), "LEDC duty" );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukSetFrequency( duk_context *ctx ) {
+        ledc_timer_t timer = _requireTimer( ctx, 0 );
+        dukCheckEsp( ctx, ledc_set_freq( MODE, timer, duk_require_uint( ctx, 1 ) ), "LEDC frequency" );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukFade( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        ledc_channel_t channel = _requireChannel( ctx, 0 );
+        uint32_t duty = self._rawDuty( ctx, 1, channel );
+        int time = duk_require_int( ctx, 2 );
+        dukCheckEsp( ctx, ledc_set_fade_with_time( MODE, channel, duty, time ), "LEDC fade" );
+        dukCheckEsp( ctx, ledc_fade_start( MODE, channel, LEDC_FADE_NO_WAIT ), "LEDC fade" );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukStop( duk_context *ctx ) {
+        ledc_channel_t channel = _requireChannel( ctx, 0 );
+        uint32_t level = duk_to_boolean( ctx, 1 );
+        dukCheckEsp( ctx, ledc_stop( MODE, channel, level ), "LEDC stop" );
+        return dukReturn( ctx );
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <driver/pcnt.h>
+#include "espError.hpp"
+
+#include <atomic>
+#include <string>
+
+namespace jac {
+
+// Implement pulse counting by the PCNT peripheral
+//
+// The driver exposes native module "pcnt" with the following functions; the
+// unit is the number of the PCNT unit (0-7):
+// - configure(unit, pin, options): count edges on the pin. options.edge is
+//   "rising" (default), "falling" or "both"; options.filter ignores pulses
+//   shorter than given number of APB clock cycles (at most 1023, 0 disables
+//   the filter). The counter starts right away.
+// - read(unit): return the number of counted edges
+// - clear(unit), pause(unit), resume(unit)
+//
+// The hardware counter has 16 bits; the driver extends it in software on each
+// overflow of the counter, so read() returns the total count.
+template < typename Self >
+class PcntDriver {
+    static constexpr int16_t COUNTER_LIMIT = 32767;
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {};
+
+    void initialize() {
+        pcnt_isr_service_install( 0 );
+        self().registerNativeModule( "pcnt", [this]( duk_context *ctx ) {
+            return self()._initializePcntModule( ctx );
+        });
+    }
+
+    ~PcntDriver() {
+        for ( int unit = 0; unit != PCNT_UNIT_MAX; unit++ ) {
+            if ( _pcntConfigured[ unit ] ) {
+                pcnt_counter_pause( pcnt_unit_t( unit ) );
+                pcnt_isr_handler_remove( pcnt_unit_t( unit ) );
+            }
+        }
+    }
+
+    void onEventLoop() {}
+private:
+    // Number of overflows of the hardware counters
+    std::atomic< uint32_t > _pcntOverflows[ PCNT_UNIT_MAX ] = {};
+    bool _pcntConfigured[ PCNT_UNIT_MAX ] = {};
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializePcntModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "configure", dukConfigure, 3 },
+            { "read", dukRead, 1 },
+            { "clear", dukClear, 1 },
+            { "pause", dukPause, 1 },
+            { "resume", dukResume, 1 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static pcnt_unit_t _requireUnit( duk_context *ctx, int offset ) {
+        int unit = duk_require_int( ctx, offset );
+        if ( unit < 0 || unit >= PCNT_UNIT_MAX )
+            dukRaiseError( ctx, "Invalid PCNT unit: " + std::to_string( unit ) );
+        return pcnt_unit_t( unit );
+    }
+
+    static duk_ret_t dukConfigure( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        pcnt_unit_t unit = _requireUnit( ctx, 0 );
+        int pin = duk_require_int( ctx, 1 );
+
+        std::string edge = "rising";
+        int filter = 0;
+        if ( duk_is_object( ctx, 2 ) ) {
+            if ( duk_get_prop_string( ctx, 2, "edge" ) )
+                edge = duk_require_string( ctx, -1 );
+            if ( duk_get_prop_string( ctx, 2, "filter" ) )
+                filter = duk_require_int( ctx, -1 );
+            duk_pop_2( ctx );
+        }
+        if ( edge != "rising" && edge != "falling" && edge != "both" )
+            dukRaiseError( ctx, "Unknown edge: " + edge );
+
+        pcnt_config_t config{};
+        config.pulse_gpio_num = pin;
+        config.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+        config.lctrl_mode = PCNT_MODE_KEEP;
+        config.hctrl_mode = PCNT_MODE_KEEP;
+        config.pos_mode = edge != "falling" ? PCNT_COUNT_INC : PCNT_COUNT_DIS;
+        config.neg_mode = edge != "rising" ? PCNT_COUNT_INC : PCNT_COUNT_DIS;
+        config.counter_h_lim = COUNTER_LIMIT;
+        config.counter_l_lim = -COUNTER_LIMIT;
+        config.unit = unit;
+        config.channel = PCNT_CHANNEL_0;
+        dukCheckEsp( ctx, pcnt_unit_config( &config ), "PCNT configuration" );
+
+        if ( filter > 0 ) {
+            dukCheckEsp( ctx, pcnt_set_filter_value( unit, filter ), "PCNT filter" );
+            pcnt_filter_enable( unit );
+        }
+        else
+            pcnt_filter_disable( unit );
+
+        pcnt_counter_pause( unit );
+        pcnt_counter_clear( unit );
+        self._pcntOverflows[ unit ] = 0;
+        if ( !self._pcntConfigured[ unit ] ) {
+            pcnt_event_enable( unit, PCNT_EVT_H_LIM );
+            pcnt_isr_handler_add( unit, overflowHandler, &self._pcntOverflows[ unit ] );
+            self._pcntConfigured[ unit ] = true;
+        }
+        pcnt_counter_resume( unit );
+        return dukReturn( ctx );
+    }
+
+    // The counter resets to zero once it reaches the limit
+    static void IRAM_ATTR overflowHandler( void *arg ) {
+        auto& overflows = *static_cast< std::atomic< uint32_t > * >( arg );
+        overflows.fetch_add( 1, std::memory_order_relaxed );
+    }
+
+    static duk_ret_t dukRead( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        pcnt_unit_t unit = _requireUnit( ctx, 0 );
+        // Make sure the counter did not overflow between reading the parts
+        uint32_t overflows;
+        int16_t count;
+        do {
+            overflows = self._pcntOverflows[ unit ].load( std::memory_order_relaxed );
+            dukCheckEsp( ctx, pcnt_get_counter_value( unit, &count ), "PCNT read" );
+        } while ( overflows != self._pcntOverflows[ unit ].load( std::memory_order_relaxed ) );
+        return dukReturn( ctx, double( overflows ) * COUNTER_LIMIT + count );
+    }
+
+    static duk_ret_t dukClear( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        pcnt_unit_t unit = _requireUnit( ctx, 0 );
+        dukCheckEsp( ctx, pcnt_counter_clear( unit ), "PCNT clear" );
+        self._pcntOverflows[ unit ] = 0;
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukPause( duk_context *ctx ) {
+        dukCheckEsp( ctx, pcnt_counter_pause( _requireUnit( ctx, 0 ) ), "PCNT pause" );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukResume( duk_context *ctx ) {
+        dukCheckEsp( ctx, pcnt_counter_resume( _requireUnit( ctx, 0 ) ), "PCNT resume" );
+        return dukReturn( ctx );
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+
+#if !CONFIG_PM_ENABLE
+    #warning "PowerManager: CONFIG_PM_ENABLE is not set, the CPU frequency is not scaled"
+#elif !CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    #warning "PowerManager: CONFIG_FREERTOS_USE_TICKLESS_IDLE is not set, the chip does not enter light sleep"
+#endif
+
+namespace jac {
+
+template < typename T, typename = void >
+struct HasGpioWakeUp: std::false_type {};
+
+template < typename T >
+struct HasGpioWakeUp< T, std::void_t< decltype( &T::armGpioWakeUp ) > >:
+    std::true_type {};
+
+struct WakeUpProfile {
+    uint32_t count = 0;
+    int64_t totalLatency = 0;
+    int64_t maxLatency = 0;
+
+    void add( int64_t latency ) {
+        count++;
+        totalLatency += latency;
+        if ( latency > maxLatency )
+            maxLatency = latency;
+    }
+};
+
+// Let the chip save power while the event loop waits for events.
+//
+// The event loop already waits exactly until the earliest requested wake up
+// (e.g., the nearest timer), so with tickless idle the FreeRTOS idle task can
+// keep the chip in light sleep for the whole wait. The feature holds the CPU
+// frequency at the maximum while the machine runs and releases it when the
+// loop becomes idle; the chip then scales the frequency down or enters light
+// sleep. The pins with GPIO onChange handlers (see GpioDriver) wake the chip.
+//
+// Power management requires CONFIG_PM_ENABLE, light sleep additionally
+// CONFIG_FREERTOS_USE_TICKLESS_IDLE; the shipped sdkconfig enables both.
+// Without them, the feature only measures the latencies and says so at build
+// time and on startup.
+//
+// The wake up latency is the time between the cause of the wake up and the
+// resumption of the event loop; the cause is either the requested wake up
+// time, or the timestamp of the oldest event posted via postEvent. All times
+// are in microseconds. Native module "power" provides:
+// - stats(): return { idleTime, awakeTime, timerWakeUp, eventWakeUp }, the
+//   wake ups are given as { count, totalLatency, maxLatency }
+// - reset(): clear the statistics
+template < typename Self >
+class PowerManager {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        int maxCpuFrequency = 240; // In MHz
+        int minCpuFrequency = 80;
+        bool lightSleep = true;
+    };
+
+    void initialize() {
+#if CONFIG_PM_ENABLE
+        esp_pm_config_esp32_t config{};
+        config.max_freq_mhz = self()._cfg.maxCpuFrequency;
+        config.min_freq_mhz = self()._cfg.minCpuFrequency;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+        config.light_sleep_enable = self()._cfg.lightSleep;
+#endif
+        if ( esp_pm_configure( &config ) != ESP_OK )
+            throw std::runtime_error( "Cannot configure power management" );
+        if ( config.light_sleep_enable )
+            esp_sleep_enable_gpio_wakeup();
+        _lightSleep = config.light_sleep_enable;
+        if ( esp_pm_lock_create( ESP_PM_CPU_FREQ_MAX, 0, "jsMachine", &_pmLock ) != ESP_OK )
+            throw std::runtime_error( "Cannot create power management lock" );
+        esp_pm_lock_acquire( _pmLock );
+#else
+        std::cout << "PowerManager: power management is disabled (CONFIG_PM_ENABLE)\n";
+#endif
+        _awakeSince = esp_timer_get_time();
+        self().registerNativeModule( "power", [this]( duk_context *ctx ) {
+            return self()._initializePowerModule( ctx );
+        });
+    }
+
+    ~PowerManager() {
+#if CONFIG_PM_ENABLE
+        if ( _pmLock ) {
+            esp_pm_lock_release( _pmLock );
+            esp_pm_lock_delete( _pmLock );
+        }
+#endif
+    }
+
+    void onEventLoop() {}
+
+    void enterIdle( int64_t deadline ) {
+        if constexpr ( HasGpioWakeUp< Self >::value ) {
+            if ( _lightSleep )
+                self().armGpioWakeUp();
+        }
+        _idleDeadline = deadline;
+        _idleSince = esp_timer_get_time();
+        _awakeTime += _idleSince - _awakeSince;
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_release( _pmLock );
+#endif
+    }
+
+    void leaveIdle() {
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_acquire( _pmLock );
+#endif
+        int64_t now = esp_timer_get_time();
+        _idleTime += now - _idleSince;
+        _awakeSince = now;
+        if constexpr ( HasGpioWakeUp< Self >::value ) {
+            if ( _lightSleep )
+                self().disarmGpioWakeUp();
+        }
+
+        // Events posted before the wait were not the reason to wake up
+        int64_t eventTime = self().pendingEventTime();
+        if ( eventTime >= _idleSince )
+            _eventWakeUp.add( now - eventTime );
+        else if ( _idleDeadline >= 0 && now >= _idleDeadline )
+            _timerWakeUp.add( now - _idleDeadline );
+    }
+
+    void resetPowerStats() {
+        _idleTime = 0;
+        _awakeTime = 0;
+        _timerWakeUp = {};
+        _eventWakeUp = {};
+    }
+private:
+    bool _lightSleep = false;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t _pmLock = nullptr;
+#endif
+    int64_t _idleDeadline = -1;
+    int64_t _idleSince = 0;
+    int64_t _awakeSince = 0;
+    int64_t _idleTime = 0;
+    int64_t _awakeTime = 0;
+    WakeUpProfile _timerWakeUp;
+    WakeUpProfile _eventWakeUp;
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializePowerModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "stats", dukStats, 0 },
+            { "reset", dukReset, 0 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static void dukPushWakeUpProfile( duk_context *ctx, const WakeUpProfile& p ) {
+        duk_push_bare_object( ctx );
+        duk_push_uint( ctx, p.count );
+        duk_put_prop_string( ctx, -2, "count" );
+        duk_push_number( ctx, p.totalLatency );
+        duk_put_prop_string( ctx, -2, "totalLatency" );
+        duk_push_number( ctx, p.maxLatency );
+        duk_put_prop_string( ctx, -2, "maxLatency" );
+    }
+
+    static duk_ret_t dukStats( duk_context *ctx ) {
+        Self& self = Self::fromContext( ctx );
+        duk_push_bare_object( ctx );
+        duk_push_number( ctx, self._idleTime );
+        duk_put_prop_string( ctx, -2, "idleTime" );
+        // Include the ongoing awake period
+        duk_push_number( ctx, self._awakeTime + esp_timer_get_time() - self._awakeSince );
+        duk_put_prop_string( ctx, -2, "awakeTime" );
+        dukPushWakeUpProfile( ctx, self._timerWakeUp );
+        duk_put_prop_string( ctx, -2, "timerWakeUp" );
+        dukPushWakeUpProfile( ctx, self._eventWakeUp );
+        duk_put_prop_string( ctx, -2, "eventWakeUp" );
+        return 1;
+    }
+
+    static duk_ret_t dukReset( duk_context *ctx ) {
+        Self& self = Self::fromContext( ctx );
+        self.resetPowerStats();
+        self._awakeSince = esp_timer_get_time();
+        return dukReturn( ctx );
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <driver/rmt.h>
+#include "espError.hpp"
+
+#include <string>
+#include <vector>
+
+namespace jac {
+
+// Implement pulse train output by the RMT peripheral
+//
+// The driver exposes native module "rmt" with the following functions; the
+// channel is the number of the RMT channel (0-7):
+// - configure(channel, pin, options): set up the channel for output.
+//   options.clockDivider divides the 80 MHz clock to get the tick (default
+//   80, i.e., 1 µs ticks), options.idleLevel is the level between
+//   transmissions (default false) and options.carrier enables a carrier of
+//   given frequency in Hz (e.g., for IR remotes).
+// - write(channel, durations[, level]): transmit pulses with given durations
+//   in ticks (an array or a typed array); the level starts at the given level
+//   (default true) and alternates
+// - writeBytes(channel, bytes, timing): transmit the bits of the bytes (MSB
+//   first); timing is [ zeroHigh, zeroLow, oneHigh, oneLow ] in ticks. With
+//   clockDivider 2, the timing [ 16, 34, 32, 18 ] drives WS2812 LEDs.
+// - wait(channel): block until the transmission finishes
+//
+// The transmission runs in the background; the pulses are converted to RMT
+// items owned by the driver, so the JavaScript buffer can be reused right away.
+// Writing to a busy channel waits for the previous transmission.
+template < typename Self >
+class RmtDriver {
+    static constexpr int CHANNEL_COUNT = RMT_CHANNEL_MAX;
+    static constexpr uint32_t MAX_DURATION = 32767;
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {};
+
+    void initialize() {
+        self().registerNativeModule( "rmt", [this]( duk_context *ctx ) {
+            return self()._initializeRmtModule( ctx );
+        });
+    }
+
+    ~RmtDriver() {
+        for ( int channel = 0; channel != CHANNEL_COUNT; channel++ ) {
+            if ( _rmtInstalled[ channel ] )
+                rmt_driver_uninstall( rmt_channel_t( channel ) );
+        }
+    }
+
+    void onEventLoop() {}
+private:
+    bool _rmtInstalled[ CHANNEL_COUNT ] = {};
+    // Items being transmitted by the channels
+    std::vector< rmt_item32_t > _rmtItems[ CHANNEL_COUNT ];
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeRmtModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "configure", dukConfigure, 3 },
+            { "write", dukWrite, 3 },
+            { "writeBytes", dukWriteBytes, 3 },
+            { "wait", dukWait, 1 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static rmt_channel_t _requireChannel( duk_context *ctx, int offset ) {
+        int channel = duk_require_int( ctx, offset );
+        if ( channel < 0 || channel >= CHANNEL_COUNT )
+            dukRaiseError( ctx, "Invalid RMT channel: " + std::to_string( channel ) );
+        return rmt_channel_t( channel );
+    }
+
+    // Return the channel if it is configured
+    static rmt_channel_t _requireConfigured( duk_context *ctx, int offset ) {
+        rmt_channel_t channel = _requireChannel( ctx, offset );
+        if ( !Self::fromContext( ctx )._rmtInstalled[ channel ] )
+            dukRaiseError( ctx, "RMT channel is not configured" );
+        return channel;
+    }
+
+    static duk_ret_t dukConfigure( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        rmt_channel_t channel = _requireChannel( ctx, 0 );
+        int pin = duk_require_int( ctx, 1 );
+
+        int clockDivider = 80;
+        bool idleLevel = false;
+        uint32_t carrier = 0;
+        if ( duk_is_object( ctx, 2 ) ) {
+            if ( duk_get_prop_string( ctx, 2, "clockDivider" ) )
+                clockDivider = duk_require_int( ctx, -1 );
+            if ( duk_get_prop_string( ctx, 2, "idleLevel" ) )
+                idleLevel = duk_to_boolean( ctx, -1 );
+            if ( duk_get_prop_string( ctx, 2, "carrier" ) )
+                carrier = duk_require_uint( ctx, -1 );
+            duk_pop_3( ctx );
+        }
+        if ( clockDivider < 1 || clockDivider > 255 )
+            dukRaiseError( ctx, "Invalid RMT clock divider: " + std::to_string( clockDivider ) );
+
+        if ( self._rmtInstalled[ channel ] ) {
+            rmt_wait_tx_done( channel, portMAX_DELAY );
+            rmt_driver_uninstall( channel );
+            self._rmtInstalled[ channel ] = false;
+        }
+
+        rmt_config_t config{};
+        config.rmt_mode = RMT_MODE_TX;
+        config.channel = channel;
+        config.gpio_num = pin;
+        config.clk_div = clockDivider;
+        config.mem_block_num = 1;
+        config.tx_config.idle_output_en = true;
+        config.tx_config.idle_level = idleLevel ? RMT_IDLE_LEVEL_HIGH : RMT_IDLE_LEVEL_LOW;
+        config.tx_config.carrier_en = carrier != 0;
+        config.tx_config.carrier_freq_hz = carrier;
+        config.tx_config.carrier_duty_percent = 33;
+        config.tx_config.carrier_level = RMT_CARRIER_LEVEL_HIGH;
+        dukCheckEsp( ctx, rmt_config( &config ), "RMT configuration" );
+        dukCheckEsp( ctx, rmt_driver_install( channel, 0, 0 ), "RMT driver installation" );
+        self._rmtInstalled[ channel ] = true;
+        return dukReturn( ctx );
+    }
+
+    // Store a pulse to the items; each item holds two pulses
+    static void _appendPulse( std::vector< rmt_item32_t >& items, bool& half,
+        uint32_t duration, bool level )
+    {
+        if ( !half ) {
+            items.emplace_back();
+            items.back().val = 0;
+            items.back().duration0 = duration;
+            items.back().level0 = level;
+        }
+        else {
+            items.back().duration1 = duration;
+            items.back().level1 = level;
+        }
+        half = !half;
+    }
+
+    // Wait for the previous transmission and start transmitting the items
+    static void _transmit( duk_context *ctx, rmt_channel_t channel,
+        std::vector< rmt_item32_t >& items )
+    {
+        auto& self = Self::fromContext( ctx );
+        // A zero duration terminates the transmission
+        items.emplace_back();
+        items.back().val = 0;
+        rmt_wait_tx_done( channel, portMAX_DELAY );
+        std::swap( self._rmtItems[ channel ], items );
+        auto& pending = self._rmtItems[ channel ];
+        dukCheckEsp( ctx, rmt_write_items( channel, pending.data(), pending.size(), false ), "RMT write" );
+    }
+
+    static duk_ret_t dukWrite( duk_context *ctx ) {
+        rmt_channel_t channel = _requireConfigured( ctx, 0 );
+        bool level = duk_is_undefined( ctx, 2 ) ? true : duk_to_boolean( ctx, 2 );
+
+        std::vector< rmt_item32_t > items;
+        bool half = false;
+        auto append = [&]( double duration ) {
+            if ( duration < 1 || duration > MAX_DURATION )
+                dukRaiseError( ctx, "RMT pulse duration out of range" );
+            _appendPulse( items, half, duration, level );
+            level = !level;
+        };
+        // Both arrays and typed arrays are accepted
+        if ( !duk_is_array( ctx, 1 ) )
+            duk_require_buffer_data( ctx, 1, nullptr );
+        duk_size_t length = duk_get_length( ctx, 1 );
+        items.reserve( length / 2 + 2 );
+        for ( duk_size_t i = 0; i != length; i++ ) {
+            duk_get_prop_index( ctx, 1, i );
+            append( duk_require_number( ctx, -1 ) );
+            duk_pop( ctx );
+        }
+        _transmit( ctx, channel, items );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukWriteBytes( duk_context *ctx ) {
+        rmt_channel_t channel = _requireConfigured( ctx, 0 );
+        duk_size_t size;
+        const uint8_t *bytes = static_cast< const uint8_t * >(
+            duk_require_buffer_data( ctx, 1, &size ) );
+        uint32_t timing[ 4 ];
+        for ( int i = 0; i != 4; i++ ) {
+            duk_get_prop_index( ctx, 2, i );
+            double value = duk_require_number( ctx, -1 );
+            if ( value < 1 || value > MAX_DURATION )
+                dukRaiseError( ctx, "RMT pulse duration out of range" );
+            timing[ i ] = value;
+            duk_pop( ctx );
+        }
+
+        // A bit takes exactly one item
+        std::vector< rmt_item32_t > items( size * 8 );
+        items.reserve( size * 8 + 1 );
+        for ( duk_size_t i = 0; i != size * 8; i++ ) {
+            bool one = bytes[ i / 8 ] & ( 0x80 >> ( i % 8 ) );
+            items[ i ].duration0 = timing[ one ? 2 : 0 ];
+            items[ i ].level0 = 1;
+            items[ i ].duration1 = timing[ one ? 3 : 1 ];
+            items[ i ].level1 = 0;
+        }
+        _transmit( ctx, channel, items );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukWait( duk_context *ctx ) {
+        rmt_channel_t channel = _requireConfigured( ctx, 0 );
+        dukCheckEsp( ctx, rmt_wait_tx_done( channel, portMAX_DELAY ), "RMT wait" );
+        return dukReturn( ctx );
+    }
+};
+
+} // namespace jac
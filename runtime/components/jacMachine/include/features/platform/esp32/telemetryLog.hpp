@@ -0,0 +1,181 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <logStore.hpp>
+#include <esp_timer.h>
+
+#include <cstring>
+#include <iostream>
+#include <string_view>
+
+namespace jac {
+
+// Expose the telemetry log store (see storage::LogStore) given in the
+// configuration as native module "telemetry":
+// - append(data): append a record, a string or a buffer of at most 1024 bytes
+// - flush(): write the appended records to the flash and erase the segment
+//   the log continues in (see storage::LogStore::prepare)
+// - forEach(cb[, encoding]): invoke the callback with every record from the
+//   oldest one as Uint8Array, or as a string when the encoding is "utf8"; the
+//   iteration stops when the callback returns false. Return the number of
+//   records skipped because they were damaged.
+// - clear(): remove all the records
+// - stats(): return { capacity, used } in bytes
+//
+// Appended records are flushed at latest telemetryFlushInterval milliseconds
+// after they were appended; the next segment is erased at the same time, so
+// append() does not erase the flash itself. The log is also available to the
+// uploader via the TELEMETRY command.
+template < typename Self >
+class TelemetryLog {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        storage::LogStore* telemetryLog = nullptr;
+        int telemetryFlushInterval = 1000;
+    };
+
+    void initialize() {
+        if ( !self()._cfg.telemetryLog || !self()._cfg.telemetryLog->isOpen() )
+            return;
+        self().registerNativeModule( "telemetry", [this]( duk_context *ctx ) {
+            return self()._initializeTelemetryModule( ctx );
+        });
+    }
+
+    void onEventLoop() {
+        if ( !_telemetryPending )
+            return;
+        if ( esp_timer_get_time() < _telemetryFlushAt ) {
+            self().requestWakeUpAt( _telemetryFlushAt );
+            return;
+        }
+        _telemetryPending = false;
+        try {
+            self()._cfg.telemetryLog->flush();
+            self()._cfg.telemetryLog->prepare();
+        }
+        catch ( const std::runtime_error& e ) {
+            std::cout << e.what() << "\n";
+        }
+    }
+
+private:
+    bool _telemetryPending = false;
+    int64_t _telemetryFlushAt = 0;
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeTelemetryModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "append", dukAppend, 1 },
+            { "flush", dukFlush, 0 },
+            { "forEach", dukForEach, 2 },
+            { "clear", dukClear, 0 },
+            { "stats", dukStats, 0 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static storage::LogStore& _log( duk_context *ctx ) {
+        return *Self::fromContext( ctx )._cfg.telemetryLog;
+    }
+
+    static duk_ret_t dukAppend( duk_context *ctx ) {
+        auto& self = Self::fromContext( ctx );
+        duk_size_t size;
+        const void *data = duk_is_string( ctx, 0 )
+            ? static_cast< const void * >( duk_require_lstring( ctx, 0, &size ) )
+            : duk_require_buffer_data( ctx, 0, &size );
+        try {
+            _log( ctx ).append( static_cast< const uint8_t * >( data ), size );
+        }
+        catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        if ( !self._telemetryPending ) {
+            self._telemetryPending = true;
+            self._telemetryFlushAt = esp_timer_get_time()
+                + int64_t( self._cfg.telemetryFlushInterval ) * 1000;
+            self.requestWakeUpAt( self._telemetryFlushAt );
+        }
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukFlush( duk_context *ctx ) {
+        Self::fromContext( ctx )._telemetryPending = false;
+        try {
+            _log( ctx ).flush();
+            _log( ctx ).prepare();
+        }
+        catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukForEach( duk_context *ctx ) {
+        duk_require_function( ctx, 0 );
+        bool asString = false;
+        if ( !duk_is_undefined( ctx, 1 ) ) {
+            std::string_view encoding = duk_require_string( ctx, 1 );
+            if ( encoding != "utf8" && encoding != "utf-8" )
+                return DUK_RET_TYPE_ERROR;
+            asString = true;
+        }
+        Self::fromContext( ctx )._telemetryPending = false;
+
+        int damaged = 0;
+        try {
+            // Errors of the callback propagate through the store
+            damaged = _log( ctx ).forEach( [&]( const uint8_t *data, size_t size ) {
+                duk_dup( ctx, 0 );
+                if ( asString )
+                    duk_push_lstring( ctx, reinterpret_cast< const char * >( data ), size );
+                else {
+                    void *buffer = duk_push_fixed_buffer( ctx, size );
+                    std::memcpy( buffer, data, size );
+                    duk_push_buffer_object( ctx, -1, 0, size, DUK_BUFOBJ_UINT8ARRAY );
+                    duk_remove( ctx, -2 );
+                }
+                duk_call( ctx, 1 );
+                bool proceed = !duk_is_boolean( ctx, -1 ) || duk_get_boolean( ctx, -1 );
+                duk_pop( ctx );
+                return proceed;
+            } );
+        }
+        catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        return dukReturn( ctx, damaged );
+    }
+
+    static duk_ret_t dukClear( duk_context *ctx ) {
+        Self::fromContext( ctx )._telemetryPending = false;
+        try {
+            _log( ctx ).clear();
+        }
+        catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukStats( duk_context *ctx ) {
+        duk_push_bare_object( ctx );
+        duk_push_number( ctx, _log( ctx ).capacity() );
+        duk_put_prop_string( ctx, -2, "capacity" );
+        duk_push_number( ctx, _log( ctx ).used() );
+        duk_put_prop_string( ctx, -2, "used" );
+        return 1;
+    }
+};
+
+} // namespace jac
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+namespace jac {
+
+// Implement a memory allocator that serves small allocations from pools of
+// fixed-size blocks. Duktape performs a lot of tiny short-lived allocations;
+// serving them from dedicated pools keeps them from fragmenting the system
+// heap. Allocations that do not fit any pool (or when the pool is exhausted)
+// fall back to the system heap.
+//
+// The pools are allocated on the first allocation (i.e., when the Duktape heap
+// is created) according to the configuration and they are never resized.
+// Placement of the pools and of the fallback allocations can be chosen via
+// heap capabilities, e.g., pools in the internal RAM and large allocations in
+// PSRAM.
+//
+// The fallback allocations carry a small header with their size, so the
+// allocator knows the size of every allocation (see allocationSize). The pool
+// blocks have no header.
+template < typename Self >
+class PoolMemoryAllocator {
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct SizeClass {
+        uint16_t blockSize;
+        uint16_t blockCount;
+    };
+
+    struct Configuration {
+        // The classes have to be sorted by the block size. The default values
+        // cover the most common Duktape object sizes on a 32-bit target
+        // (strings, objects, property tables of small objects), tune them
+        // according to your application.
+        std::vector< SizeClass > poolSizeClasses = {
+            { 16, 256 }, { 32, 256 }, { 48, 128 }, { 64, 128 }, { 96, 64 }, { 128, 32 }
+        };
+        // Heap capabilities of memory for the pools
+        uint32_t poolHeapCaps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+        // Heap capabilities of memory for allocations not served from the pools,
+        // use MALLOC_CAP_SPIRAM to place them in PSRAM
+        uint32_t fallbackHeapCaps = MALLOC_CAP_8BIT;
+    };
+
+    ~PoolMemoryAllocator() {
+        for ( Pool& p : _pools )
+            heap_caps_free( p.begin );
+    }
+
+    void initialize() {}
+
+    void onEventLoop() {}
+
+    static void *allocateMemory( void *udata, duk_size_t size ) {
+        return Self::fromUdata( udata )._poolAllocate( size );
+    }
+
+    static void *reallocateMemory( void *udata, void *ptr, duk_size_t size ) {
+        return Self::fromUdata( udata )._poolReallocate( ptr, size );
+    }
+
+    static void freeMemory( void *udata, void *ptr ) {
+        Self::fromUdata( udata )._poolFree( ptr );
+    }
+
+    // Usable size of a live allocation (in bytes)
+    size_t allocationSize( void *ptr ) {
+        if ( Pool *owner = _poolOf( ptr ) )
+            return owner->blockSize;
+        return *_fallbackHeader( ptr );
+    }
+
+    // Memory available to the Duktape heap (in bytes): the free pool blocks
+    // and the free memory of the fallback heap
+    size_t allocatorFreeSize() {
+        size_t free = heap_caps_get_free_size( self()._cfg.fallbackHeapCaps );
+        portENTER_CRITICAL( &_poolLock );
+        for ( const Pool& p : _pools )
+            free += p.freeBlocks * p.blockSize;
+        portEXIT_CRITICAL( &_poolLock );
+        return free;
+    }
+
+private:
+    struct Pool {
+        uint8_t *begin;
+        uint8_t *end;
+        size_t blockSize;
+        void *freeList; // Free blocks form a singly linked list
+        size_t freeBlocks;
+    };
+
+    static constexpr size_t BLOCK_ALIGNMENT = 8;
+    // Keep the alignment of the system heap
+    static constexpr size_t FALLBACK_HEADER_SIZE = 8;
+
+    void _ensurePools() {
+        if ( _poolsReady )
+            return;
+        _poolsReady = true;
+        for ( const SizeClass& c : self()._cfg.poolSizeClasses ) {
+            if ( c.blockSize == 0 || c.blockCount == 0 )
+                continue;
+            size_t blockSize = ( c.blockSize + BLOCK_ALIGNMENT - 1 ) / BLOCK_ALIGNMENT * BLOCK_ALIGNMENT;
+            auto *arena = static_cast< uint8_t * >(
+                heap_caps_malloc( blockSize * c.blockCount, self()._cfg.poolHeapCaps ) );
+            if ( !arena )
+                continue; // Without the pool, the size is served by the fallback
+            Pool p{ arena, arena + blockSize * c.blockCount, blockSize, nullptr, c.blockCount };
+            for ( int i = c.blockCount - 1; i >= 0; i-- ) {
+                void *block = arena + i * blockSize;
+                *reinterpret_cast< void ** >( block ) = p.freeList;
+                p.freeList = block;
+            }
+            _pools.push_back( p );
+        }
+    }
+
+    // Find the smallest pool that can serve the request
+    Pool *_poolFor( size_t size ) {
+        for ( Pool& p : _pools ) {
+            if ( size <= p.blockSize )
+                return &p;
+        }
+        return nullptr;
+    }
+
+    // Find the pool owning the pointer
+    Pool *_poolOf( void *ptr ) {
+        auto *p = static_cast< uint8_t * >( ptr );
+        for ( Pool& pool : _pools ) {
+            if ( p >= pool.begin && p < pool.end )
+                return &pool;
+        }
+        return nullptr;
+    }
+
+    void *_poolAllocate( size_t size ) {
+        _ensurePools();
+        if ( size != 0 ) {
+            if ( Pool *pool = _poolFor( size ) ) {
+                portENTER_CRITICAL( &_poolLock );
+                void *block = pool->freeList;
+                if ( block ) {
+                    pool->freeList = *reinterpret_cast< void ** >( block );
+                    pool->freeBlocks--;
+                }
+                portEXIT_CRITICAL( &_poolLock );
+                if ( block )
+                    return block;
+            }
+        }
+        return _fallbackAllocate( size );
+    }
+
+    static size_t *_fallbackHeader( void *ptr ) {
+        return reinterpret_cast< size_t * >( static_cast< uint8_t * >( ptr ) - FALLBACK_HEADER_SIZE );
+    }
+
+    void *_fallbackAllocate( size_t size ) {
+        if ( size == 0 )
+            return nullptr;
+        auto *block = static_cast< uint8_t * >(
+            heap_caps_malloc( size + FALLBACK_HEADER_SIZE, self()._cfg.fallbackHeapCaps ) );
+        if ( !block )
+            return nullptr;
+        *reinterpret_cast< size_t * >( block ) = size;
+        return block + FALLBACK_HEADER_SIZE;
+    }
+
+    void *_fallbackReallocate( void *ptr, size_t size ) {
+        auto *block = static_cast< uint8_t * >( heap_caps_realloc( _fallbackHeader( ptr ),
+            size + FALLBACK_HEADER_SIZE, self()._cfg.fallbackHeapCaps ) );
+        if ( !block )
+            return nullptr;
+        *reinterpret_cast< size_t * >( block ) = size;
+        return block + FALLBACK_HEADER_SIZE;
+    }
+
+    void _fallbackFree( void *ptr ) {
+        heap_caps_free( _fallbackHeader( ptr ) );
+    }
+
+    void _release( Pool *pool, void *ptr ) {
+        portENTER_CRITICAL( &_poolLock );
+        *reinterpret_cast< void ** >( ptr ) = pool->freeList;
+        pool->freeList = ptr;
+        pool->freeBlocks++;
+        portEXIT_CRITICAL( &_poolLock );
+    }
+
+    void *_poolReallocate( void *ptr, size_t size ) {
+        if ( !ptr )
+            return _poolAllocate( size );
+        Pool *owner = _poolOf( ptr );
+        if ( !owner ) {
+            if ( size == 0 ) {
+                _fallbackFree( ptr );
+                return nullptr;
+            }
+            return _fallbackReallocate( ptr, size );
+        }
+        if ( size == 0 ) {
+            _release( owner, ptr );
+            return nullptr;
+        }
+        if ( size <= owner->blockSize )
+            return ptr;
+        void *newPtr = _poolAllocate( size );
+        if ( !newPtr )
+            return nullptr; // The original allocation is left untouched
+        memcpy( newPtr, ptr, owner->blockSize );
+        _release( owner, ptr );
+        return newPtr;
+    }
+
+    void _poolFree( void *ptr ) {
+        if ( !ptr )
+            return;
+        if ( Pool *owner = _poolOf( ptr ) )
+            _release( owner, ptr );
+        else
+            _fallbackFree( ptr );
+    }
+
+    std::vector< Pool > _pools;
+    bool _poolsReady = false;
+    portMUX_TYPE _poolLock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+} // namespace jac
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <jsmachine.hpp>
+#include <bytecodeCache.hpp>
+#include <romBuiltins.hpp>
+#include <string_view>
 
 extern "C" {
     extern const uint8_t regeneratorRuntimeStart[]
@@ -17,81 +20,126 @@ namespace jac {
 //
 // Note that we intentionally implement the Promise in native language to save
 // some RAM although the whole implementation could be easily implemented in
-// in Javascript (probably more easily).
+// in Javascript (probably more easily). When built with JAC_ROM_BUILTINS, the
+// Promise constructor and prototype are ROM objects (see romBuiltins.hpp) and
+// the feature only provides their implementation.
+//
+// The state of a promise is kept in a single bare array (the record) stored in
+// a hidden property of the promise:
+// - [ STATE ] pending, fulfilled or rejected
+// - [ VALUE ] the settled value
+// - [ LOCKED ] true once the resolving functions were used (the promise might
+//   still be pending while it follows another promise)
+// - followed by reactions as triples ( onFulfilled, onRejected, derived
+//   promise ); the handlers and the derived promise might be undefined
+//
+// Reactions run as microtasks of the machine. Promises created by then() and
+// by the Promise functions are settled natively, so no resolving functions
+// or closures are created for them.
+//
+// The Promise functions take arbitrary values and work with the record on the
+// Duktape stack, so they are plain Duktape/C functions rather than typed
+// bindings (see dukNative); only the class is built by dukPushClass.
 template < typename Self >
 class Promise {
-    static inline constexpr const char* SLOT = "promiseSlot";
+    static inline constexpr const char* RECORD = DUK_HIDDEN_SYMBOL( "promise" );
+    // Promise resolved by a resolving function
+    static inline constexpr const char* TARGET = DUK_HIDDEN_SYMBOL( "target" );
+    // Aggregation state and index of a Promise.all element
+    static inline constexpr const char* AGGREGATE = DUK_HIDDEN_SYMBOL( "aggregate" );
+    static inline constexpr const char* INDEX = DUK_HIDDEN_SYMBOL( "index" );
+
+    enum State { PENDING = 0, FULFILLED = 1, REJECTED = 2 };
+    enum RecordIndex { STATE = 0, VALUE = 1, LOCKED = 2, REACTIONS = 3 };
+    enum ResolvingKind { RESOLVE = 0, REJECT = 1 };
+    // Aggregate of Promise.all: [ results, remaining count, derived promise ]
+    enum AggregateIndex { RESULTS = 0, REMAINING = 1, DERIVED = 2 };
 public:
     MACHINE_FEATURE_SELF();
 
-    struct Configuration {};
+    struct Configuration {
+        // If not empty, the compiled regenerator runtime is cached in this file
+        std::string regeneratorCachePath;
+    };
 
     void initialize() {
-        _setupSlot();
-        _registerPromise();
+        if constexpr ( romBuiltins )
+            _registerRomNatives();
+        else
+            _registerPromise();
         _registerRuntime();
     }
 
+    // The heap is already destroyed, so no ROM built-in can be called
+    ~Promise() {
+        if constexpr ( romBuiltins )
+            unregisterRomNatives( &self() );
+    }
+
     void onEventLoop() {}
 
-private:
-    void _setupSlot() {
-        duk_push_heap_stash( self()._context );
-        duk_push_object( self()._context );
-        duk_put_prop_string( self()._context, -2, SLOT );
-        duk_pop( self()._context );
+    // Push a new pending promise; settle it later via resolvePromise or
+    // rejectPromise. Can be called only from the machine task.
+    void pushPromise() {
+        _pushNewPromise( self()._context );
+    }
+
+    // Resolve the promise on given offset with the value on given offset
+    void resolvePromise( int promiseOffset, int valueOffset ) {
+        _lock( self()._context, promiseOffset );
+        _resolve( self()._context, promiseOffset, valueOffset );
     }
 
+    // Reject the promise on given offset with the value on given offset
+    void rejectPromise( int promiseOffset, int valueOffset ) {
+        _lock( self()._context, promiseOffset );
+        _settle( self()._context, promiseOffset, REJECTED, valueOffset );
+    }
+
+private:
     void _registerPromise() {
         duk_context* ctx = self()._context;
 
         auto stackSize = duk_get_top( ctx );
 
-        duk_push_global_object( ctx );
-        auto globalObjectOffset = duk_get_top_index( ctx );
-
-        duk_push_c_function( ctx, dukPromiseConstructor, 1 );
-        auto constructorOffset = duk_get_top_index( ctx );
-
-        // Add pretty name to the constructor
-        duk_push_string( ctx, "name" );
-        duk_push_string( ctx, "Promise" );
-        duk_def_prop( ctx, constructorOffset, DUK_DEFPROP_HAVE_VALUE );
-
-        // Add constructor methods
-        duk_function_list_entry constructorMethods[] = {
-            { "resolve", dukPromiseResolve, 1 },
-            { "reject", dukPromiseReject, 1 },
-            { "all", dukPromiseAll, 1 },
-            { "race", dukPromiseRace, 1 },
-            { nullptr, nullptr, 0 }
-        };
-        duk_put_function_list( ctx, constructorOffset, constructorMethods );
-
-        // Build prototype
-        duk_function_list_entry objectMethods[] = {
-            { "catch", dukPromiseCatch, 1 },
-            { "then", dukPromiseThen, DUK_VARARGS },
-            { nullptr, nullptr, 0 }
-        };
-        duk_push_bare_object( ctx );
-        duk_put_function_list( ctx, -1, objectMethods );
-        duk_put_prop_string( ctx, constructorOffset, "prototype" );
-
+        dukPushClass( ctx, "Promise", dukPromiseConstructor, 1,
+            {
+                { "catch", dukPromiseCatch, 1 },
+                { "then", dukPromiseThen, 2 },
+                { nullptr, nullptr, 0 }
+            },
+            {
+                { "resolve", dukPromiseResolve, 1 },
+                { "reject", dukPromiseReject, 1 },
+                { "all", dukPromiseAll, 1 },
+                { "race", dukPromiseRace, 1 },
+                { nullptr, nullptr, 0 }
+            } );
         // Register the promise to the global namespace
-        duk_put_prop_string( ctx, globalObjectOffset, "Promise" );
+        duk_put_global_string( ctx, "Promise" );
 
         while ( duk_get_top( ctx ) != stackSize )
             duk_pop( ctx );
     }
 
+    void _registerRomNatives() {
+        duk_context* ctx = self()._context;
+        registerRomNative( ctx, RomNative::PromiseConstructor, dukPromiseConstructor );
+        registerRomNative( ctx, RomNative::PromiseResolve, dukPromiseResolve );
+        registerRomNative( ctx, RomNative::PromiseReject, dukPromiseReject );
+        registerRomNative( ctx, RomNative::PromiseAll, dukPromiseAll );
+        registerRomNative( ctx, RomNative::PromiseRace, dukPromiseRace );
+        registerRomNative( ctx, RomNative::PromiseCatch, dukPromiseCatch );
+        registerRomNative( ctx, RomNative::PromiseThen, dukPromiseThen );
+    }
+
     void _registerRuntime() {
         duk_context* ctx = self()._context;
-        duk_push_lstring( ctx, reinterpret_cast< const char * >( regeneratorRuntimeStart ),
+        std::string_view source( reinterpret_cast< const char * >( regeneratorRuntimeStart ),
             regeneratorRuntimeEnd - regeneratorRuntimeStart );
-        duk_push_string( ctx, "/builtin/regeneratorRuntime.js" );
-        duk_compile( ctx, DUK_COMPILE_EVAL );
-	    duk_call( ctx, 0 );
+        bytecode::compileFunction( ctx, "function () {", source, "\n}",
+            "/builtin/regeneratorRuntime.js", self()._cfg.regeneratorCachePath );
+        duk_call( ctx, 0 );
         duk_pop( ctx );
     }
 
@@ -99,305 +147,397 @@ private:
         // Constructor takes a single argument - a function (executor) taking
         // two callbacks - resolve and reject. Therefore the executor has offset
         // 0
-
-        if ( !duk_is_constructor_call( ctx ) ) {
+        if ( !duk_is_constructor_call( ctx ) || !duk_is_callable( ctx, 0 ) )
             return DUK_RET_TYPE_ERROR;
-        }
 
         duk_push_this( ctx );
-        auto thisOffset = duk_get_top_index( ctx );
-
-        // We use int to represent promise status: pending (0), resolved (1),
-        // rejected (-1). We also need an arrays to store consumers of the
-        // promise.  We are verbose about _promiseStatus name as we use it to
-        // recognize if object is a promise or not
-        duk_push_int( ctx, 0 );
-        duk_put_prop_string( ctx, thisOffset, "_promiseStatus" );
-        duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, thisOffset, "_onResolved" );
-        duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, thisOffset, "_onRejected" );
-
-        duk_pop( ctx ); // Pop this
-
-        // Now we have to create binded reject and resolve handlers
-        dukBindAsLightfuncToThis( ctx, dukResolveInternal, 1 );
-        dukBindAsLightfuncToThis( ctx, dukRejectInternal, 1 );
-
-        // Invoke executor (-3) on dukResolveInternal (-2) and dukRejectInternal (-1)
-        int status = duk_pcall( ctx, 2 );
-        if ( status != DUK_EXEC_SUCCESS ) {
-            dukDumpLast( ctx, "Cannot evaluate executor" );
-            // If executor fails, the error is on stack, just reject the promise
-            dukBindAsLightfuncToThis( ctx, dukRejectInternal, 1 );
-            duk_dup( ctx, -2 );
-            duk_call( ctx, 1 );
-        }
+        const int promiseOffset = 1;
+        _initRecord( ctx, promiseOffset );
 
+        duk_dup( ctx, 0 );
+        _pushResolvingFunction( ctx, promiseOffset, RESOLVE );
+        _pushResolvingFunction( ctx, promiseOffset, REJECT );
+        if ( duk_pcall( ctx, 2 ) != DUK_EXEC_SUCCESS ) {
+            // The executor failed, reject with the error unless it already
+            // resolved the promise
+            if ( !_locked( ctx, promiseOffset ) ) {
+                _lock( ctx, promiseOffset );
+                _settle( ctx, promiseOffset, REJECTED, -1 );
+            }
+        }
         return 0;
     }
 
     static duk_ret_t dukPromiseResolve( duk_context *ctx ) {
-        bool isArgAPromise = duk_is_object( ctx, 0 ) && duk_has_prop_string( ctx, 0, "_promiseStatus" );
-        if ( isArgAPromise )
+        if ( _isPromise( ctx, 0 ) ) {
+            duk_dup( ctx, 0 );
             return 1;
-
-        duk_push_global_object( ctx );
-        duk_get_prop_string( ctx, -1, "Promise" );
-        duk_get_prop_string( ctx, -1, "prototype" );
-
-        duk_push_bare_object( ctx );
-        auto promiseOffset = duk_get_top_index( ctx );
-        duk_dup( ctx, -2 );
-        duk_set_prototype( ctx, -2 );
-
-        duk_push_int( ctx, 1 );
-        duk_put_prop_string( ctx, promiseOffset, "_promiseStatus" );
-        duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, promiseOffset, "_onResolved" );
-        duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, promiseOffset, "_onRejected" );
-        duk_dup( ctx, 0 );
-        duk_put_prop_string( ctx, promiseOffset, "_value" );
-
+        }
+        _pushNewPromise( ctx );
+        _resolve( ctx, -1, 0 );
         return 1;
     }
 
     static duk_ret_t dukPromiseReject( duk_context *ctx ) {
-        duk_push_global_object( ctx );
-        duk_get_prop_string( ctx, -1, "Promise" );
-        duk_get_prop_string( ctx, -1, "prototype" );
+        _pushNewPromise( ctx );
+        _settle( ctx, -1, REJECTED, 0 );
+        return 1;
+    }
 
-        duk_push_bare_object( ctx );
-        auto promiseOffset = duk_get_top_index( ctx );
-        duk_dup( ctx, -2 );
-        duk_set_prototype( ctx, -2 );
+    // Takes an array of values or promises and returns a promise of an array
+    // of the results
+    static duk_ret_t dukPromiseAll( duk_context *ctx ) {
+        if ( !duk_is_array( ctx, 0 ) )
+            return DUK_RET_TYPE_ERROR;
+        int count = duk_get_length( ctx, 0 );
 
-        duk_push_int( ctx, -1 );
-        duk_put_prop_string( ctx, promiseOffset, "_promiseStatus" );
+        _pushNewPromise( ctx );
+        const int derivedOffset = 1;
         duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, promiseOffset, "_onResolved" );
-        duk_push_bare_array( ctx );
-        duk_put_prop_string( ctx, promiseOffset, "_onRejected" );
-        duk_dup( ctx, 0 );
-        duk_put_prop_string( ctx, promiseOffset, "_value" );
+        const int resultsOffset = 2;
+        if ( count == 0 ) {
+            _settle( ctx, derivedOffset, FULFILLED, resultsOffset );
+            duk_dup( ctx, derivedOffset );
+            return 1;
+        }
 
+        duk_push_bare_array( ctx );
+        const int aggregateOffset = 3;
+        duk_dup( ctx, resultsOffset );
+        duk_put_prop_index( ctx, aggregateOffset, RESULTS );
+        duk_push_int( ctx, count );
+        duk_put_prop_index( ctx, aggregateOffset, REMAINING );
+        duk_dup( ctx, derivedOffset );
+        duk_put_prop_index( ctx, aggregateOffset, DERIVED );
+
+        // A single reject function suffices; the first rejection wins
+        _pushResolvingFunction( ctx, derivedOffset, REJECT );
+        const int rejectOffset = 4;
+
+        for ( int i = 0; i != count; i++ ) {
+            duk_get_prop_index( ctx, 0, i );
+            _pushAsPromise( ctx, -1 );
+            duk_push_c_function( ctx, dukAllElement, 1 );
+            duk_dup( ctx, aggregateOffset );
+            duk_put_prop_string( ctx, -2, AGGREGATE );
+            duk_push_int( ctx, i );
+            duk_put_prop_string( ctx, -2, INDEX );
+            duk_dup( ctx, rejectOffset );
+            duk_push_undefined( ctx );
+            _addReaction( ctx, -4 );
+            duk_pop_2( ctx );
+        }
+        duk_dup( ctx, derivedOffset );
         return 1;
     }
 
-    static duk_ret_t dukPromiseAll( duk_context *ctx ) {
-        // TBA: Implement
-        return DUK_RET_TYPE_ERROR;
+    // Takes a single argument, the value of a Promise.all element
+    static duk_ret_t dukAllElement( duk_context *ctx ) {
+        duk_push_current_function( ctx );
+        duk_get_prop_string( ctx, -1, AGGREGATE );
+        const int aggregateOffset = 2;
+        duk_get_prop_string( ctx, 1, INDEX );
+        int index = duk_get_int( ctx, -1 );
+
+        duk_get_prop_index( ctx, aggregateOffset, RESULTS );
+        const int resultsOffset = 4;
+        duk_dup( ctx, 0 );
+        duk_put_prop_index( ctx, resultsOffset, index );
+
+        duk_get_prop_index( ctx, aggregateOffset, REMAINING );
+        int remaining = duk_get_int( ctx, -1 ) - 1;
+        duk_push_int( ctx, remaining );
+        duk_put_prop_index( ctx, aggregateOffset, REMAINING );
+        if ( remaining == 0 ) {
+            duk_get_prop_index( ctx, aggregateOffset, DERIVED );
+            _settle( ctx, -1, FULFILLED, resultsOffset );
+        }
+        return 0;
     }
 
+    // Takes an array of values or promises and returns a promise settled the
+    // same way as the first settled one
     static duk_ret_t dukPromiseRace( duk_context *ctx ) {
-        // TBA: Implement
-        return DUK_RET_TYPE_ERROR;
+        if ( !duk_is_array( ctx, 0 ) )
+            return DUK_RET_TYPE_ERROR;
+        int count = duk_get_length( ctx, 0 );
+
+        _pushNewPromise( ctx );
+        const int derivedOffset = 1;
+        _pushResolvingFunction( ctx, derivedOffset, RESOLVE );
+        _pushResolvingFunction( ctx, derivedOffset, REJECT );
+        for ( int i = 0; i != count; i++ ) {
+            duk_get_prop_index( ctx, 0, i );
+            _pushAsPromise( ctx, -1 );
+            duk_dup( ctx, 2 );
+            duk_dup( ctx, 3 );
+            duk_push_undefined( ctx );
+            _addReaction( ctx, -4 );
+            duk_pop_2( ctx );
+        }
+        duk_dup( ctx, derivedOffset );
+        return 1;
     }
 
     static duk_ret_t dukPromiseCatch( duk_context *ctx ) {
-        // TBA: Implement
-        return DUK_RET_TYPE_ERROR;
+        duk_push_this( ctx );
+        if ( !_isPromise( ctx, -1 ) )
+            return DUK_RET_TYPE_ERROR;
+        _pushNewPromise( ctx );
+        duk_push_undefined( ctx );
+        duk_dup( ctx, 0 );
+        duk_dup( ctx, -3 );
+        _addReaction( ctx, 1 );
+        return 1;
     }
 
-    // Take a value, transform it via transform. If the transformed value is a
-    // value, directly pass it settle, otherwise, if it is a promise, resolve it
-    // or reject it. Takes a single argument: the resolved value. The function
-    // also expects that the following properties are set:
-    // - transform: the function that tranforms the value
-    // - resolve: a callback called with a resolved value from a promise
-    // - reject: a callback called with a rejected value from a promise
-    // - settle: a callback called with a settled value (one of resolve or
-    //   reject)
-    static duk_ret_t dukSettleValueOrPromise( duk_context *ctx ) {
-        duk_push_current_function( ctx );
-        auto funcOffset = duk_get_top_index( ctx );
-
-        // Transform value
-        duk_get_prop_string( ctx, funcOffset, "transform" );
+    // Takes two arguments: fulfillment handler and rejection handler
+    static duk_ret_t dukPromiseThen( duk_context *ctx ) {
+        duk_push_this( ctx );
+        if ( !_isPromise( ctx, -1 ) )
+            return DUK_RET_TYPE_ERROR;
+        _pushNewPromise( ctx );
         duk_dup( ctx, 0 );
-        if ( duk_pcall( ctx, 1 ) != DUK_EXEC_SUCCESS ) {
-            // The transform failed, reject the error (on top of the stack)
-            duk_get_prop_string( ctx, funcOffset, "reject" );
-            duk_dup( ctx, -2 );
-            duk_call( ctx, 1 );
+        duk_dup( ctx, 1 );
+        duk_dup( ctx, -3 );
+        _addReaction( ctx, 2 );
+        return 1;
+    }
+
+    // Resolving function passed to the executor; the magic distinguishes
+    // between resolve and reject. Takes a single argument: the value.
+    static duk_ret_t dukResolvingFunction( duk_context *ctx ) {
+        duk_push_current_function( ctx );
+        int kind = duk_get_current_magic( ctx );
+        duk_get_prop_string( ctx, -1, TARGET );
+        const int promiseOffset = 2;
+        if ( _locked( ctx, promiseOffset ) )
             return 0;
+        _lock( ctx, promiseOffset );
+        if ( kind == RESOLVE )
+            _resolve( ctx, promiseOffset, 0 );
+        else
+            _settle( ctx, promiseOffset, REJECTED, 0 );
+        return 0;
+    }
+
+    // Microtask running a reaction. Takes four arguments: handler, derived
+    // promise, settled value and the state of the source promise.
+    static duk_ret_t dukReactionJob( duk_context *ctx ) {
+        const int handlerOffset = 0;
+        const int derivedOffset = 1;
+        const int valueOffset = 2;
+        bool hasDerived = !duk_is_undefined( ctx, derivedOffset );
+        if ( duk_is_callable( ctx, handlerOffset ) ) {
+            duk_dup( ctx, handlerOffset );
+            duk_dup( ctx, valueOffset );
+            bool success = duk_pcall( ctx, 1 ) == DUK_EXEC_SUCCESS;
+            if ( !hasDerived )
+                return 0;
+            if ( success )
+                _resolve( ctx, derivedOffset, -1 );
+            else
+                _settle( ctx, derivedOffset, REJECTED, -1 );
         }
-        bool isPromise = duk_is_object( ctx, -1 ) && duk_has_prop_string( ctx, -1, "_promiseStatus" );
-        if ( isPromise ) {
-            duk_get_prop_string( ctx, -1, "this" );
-            duk_get_prop_string( ctx, funcOffset, "resolve" );
-            duk_get_prop_string( ctx, funcOffset, "reject" );
-            duk_call( ctx, 2 );
-        }
-        else {
-            duk_get_prop_string( ctx, funcOffset, "settle" );
-            duk_dup( ctx, -2 );
-            duk_call( ctx, 1 );
+        else if ( hasDerived ) {
+            // No handler, pass the value through
+            _settle( ctx, derivedOffset, State( duk_get_int( ctx, 3 ) ), valueOffset );
         }
         return 0;
     }
 
-    static duk_ret_t dukDoNothing( duk_context *ctx ) {
+    // Microtask following a foreign thenable. Takes three arguments: the
+    // thenable, its then function and the promise to resolve.
+    static duk_ret_t dukThenableJob( duk_context *ctx ) {
+        const int promiseOffset = 2;
+        duk_dup( ctx, 1 );
+        duk_dup( ctx, 0 );
+        _pushResolvingFunction( ctx, promiseOffset, RESOLVE );
+        _pushResolvingFunction( ctx, promiseOffset, REJECT );
+        if ( duk_pcall_method( ctx, 2 ) != DUK_EXEC_SUCCESS && !_locked( ctx, promiseOffset ) ) {
+            _lock( ctx, promiseOffset );
+            _settle( ctx, promiseOffset, REJECTED, -1 );
+        }
         return 0;
     }
 
-    // Takes two arguments: resolve handler and reject handler
-    // We follow roughly the following guide: https://medium.com/swlh/implement-a-simple-promise-in-javascript-20c9705f197a
-    static duk_ret_t dukPromiseThen( duk_context *ctx ) {
-        int argCount = duk_get_top( ctx );
-        if ( argCount == 0 || argCount > 2 )
-            return DUK_RET_ERROR;
-
-        const int resolveArgOffset = 0;
-        const int rejectArgOffset = 1;
-        if ( argCount == 1 ) {
-            // Push dummy instead of the second argument
-            duk_push_c_lightfunc( ctx, dukDoNothing, 1, 1, 0 );
+    static void _initRecord( duk_context *ctx, int promiseOffset ) {
+        promiseOffset = duk_normalize_index( ctx, promiseOffset );
+        duk_push_bare_array( ctx );
+        duk_push_int( ctx, PENDING );
+        duk_put_prop_index( ctx, -2, STATE );
+        duk_push_undefined( ctx );
+        duk_put_prop_index( ctx, -2, VALUE );
+        duk_push_false( ctx );
+        duk_put_prop_index( ctx, -2, LOCKED );
+        duk_put_prop_string( ctx, promiseOffset, RECORD );
+    }
+
+    // Push a new pending promise with the prototype of the Promise
+    static void _pushNewPromise( duk_context *ctx ) {
+        duk_push_object( ctx );
+        duk_get_global_string( ctx, "Promise" );
+        duk_get_prop_string( ctx, -1, "prototype" );
+        duk_set_prototype( ctx, -3 );
+        duk_pop( ctx );
+        _initRecord( ctx, -1 );
+    }
+
+    // Push the value if it is a promise, otherwise push a new promise
+    // resolved with the value
+    static void _pushAsPromise( duk_context *ctx, int valueOffset ) {
+        valueOffset = duk_normalize_index( ctx, valueOffset );
+        if ( _isPromise( ctx, valueOffset ) ) {
+            duk_dup( ctx, valueOffset );
+            return;
         }
+        _pushNewPromise( ctx );
+        _resolve( ctx, -1, valueOffset );
+    }
 
-        // Push constructor, so we can call it with the executor
-        duk_push_c_function( ctx, dukPromiseConstructor, 1 );
+    static void _pushResolvingFunction( duk_context *ctx, int promiseOffset, ResolvingKind kind ) {
+        promiseOffset = duk_normalize_index( ctx, promiseOffset );
+        duk_push_c_function( ctx, dukResolvingFunction, 1 );
+        duk_set_magic( ctx, -1, kind );
+        duk_dup( ctx, promiseOffset );
+        duk_put_prop_string( ctx, -2, TARGET );
+    }
 
-        // Prepare new promise executor
-        duk_push_c_function( ctx, dukPromiseThenImpl, 2 );
-        duk_push_this( ctx );
-        duk_put_prop_string( ctx, -2, "sourcePromise" );
-        duk_dup( ctx, resolveArgOffset );
-        duk_put_prop_string( ctx, -2, "onResolved" );
-        duk_dup( ctx, rejectArgOffset );
-        duk_put_prop_string( ctx, -2, "onRejected" );
-
-        // Invoke Promise contructor
-        duk_new( ctx, 1 );
-        return 1;
+    static bool _isPromise( duk_context *ctx, int offset ) {
+        if ( !duk_is_object( ctx, offset ) )
+            return false;
+        return duk_has_prop_string( ctx, offset, RECORD );
     }
 
-    // A function that is passed into a Promise constructor in dukPromiseThen.
-    // Therefore it takes two arguments: resolve and reject.
-    // The function expects also the following properties:
-    // - sourcePromise: the promise being chained
-    // - onResolved: a resolve callback following the chain
-    // - onRejected: a reject callback following the chain
-    static duk_ret_t dukPromiseThenImpl( duk_context *ctx ) {
-        duk_push_current_function( ctx );
-        auto funcOffset = duk_get_top_index( ctx );
+    // Push the record of the promise
+    static void _pushRecord( duk_context *ctx, int promiseOffset ) {
+        duk_get_prop_string( ctx, promiseOffset, RECORD );
+    }
 
-        // Construct the resolve callback
-        duk_push_c_function( ctx, dukSettleValueOrPromise, 1 );
-        auto resolveCbOffset = duk_get_top_index( ctx );
-        duk_get_prop_string( ctx, funcOffset, "onResolved" );
-        duk_put_prop_string( ctx, -2, "transform" );
-        duk_dup( ctx, 0 );
-        duk_put_prop_string( ctx, -2, "resolve" );
-        duk_dup( ctx, 1 );
-        duk_put_prop_string( ctx, -2, "reject" );
-        duk_dup( ctx, 0 );
-        duk_put_prop_string( ctx, -2, "settle" );
+    static bool _locked( duk_context *ctx, int promiseOffset ) {
+        _pushRecord( ctx, promiseOffset );
+        duk_get_prop_index( ctx, -1, LOCKED );
+        bool locked = duk_get_boolean( ctx, -1 );
+        duk_pop_2( ctx );
+        return locked;
+    }
 
-        // Construct the reject callback
-        duk_push_c_function( ctx, dukSettleValueOrPromise, 1 );
-        auto rejectCbOffset = duk_get_top_index( ctx );
-        duk_get_prop_string( ctx, funcOffset, "onRejected" );
-        duk_put_prop_string( ctx, -2, "transform" );
-        duk_dup( ctx, 0 );
-        duk_put_prop_string( ctx, -2, "resolve" );
-        duk_dup( ctx, 1 );
-        duk_put_prop_string( ctx, -2, "reject" );
-        duk_dup( ctx, 1 );
-        duk_put_prop_string( ctx, -2, "settle" );
-
-        duk_get_prop_string( ctx, funcOffset, "sourcePromise" );
-        auto sourcePromiseOffset = duk_get_top_index( ctx );
-        duk_get_prop_string( ctx, -1, "_promiseStatus" );
-        int status = duk_require_int( ctx, -1 );
-        if ( status == 0 ) {
-            // Unresolved
-            duk_get_prop_string( ctx, sourcePromiseOffset, "_onResolved" );
-            duk_dup( ctx, resolveCbOffset );
-            dukAppendArray( ctx, -2 );
-            duk_get_prop_string( ctx, sourcePromiseOffset, "_onRejected" );
-            duk_dup( ctx, rejectCbOffset );
-            dukAppendArray( ctx, -2 );
+    static void _lock( duk_context *ctx, int promiseOffset ) {
+        _pushRecord( ctx, promiseOffset );
+        duk_push_true( ctx );
+        duk_put_prop_index( ctx, -2, LOCKED );
+        duk_pop( ctx );
+    }
+
+    // Resolve the promise with the value, i.e., follow the value if it is
+    // a promise or a thenable, otherwise fulfill the promise
+    static void _resolve( duk_context *ctx, int promiseOffset, int valueOffset ) {
+        promiseOffset = duk_normalize_index( ctx, promiseOffset );
+        valueOffset = duk_normalize_index( ctx, valueOffset );
+        if ( duk_strict_equals( ctx, promiseOffset, valueOffset ) ) {
+            duk_push_error_object( ctx, DUK_ERR_TYPE_ERROR, "Promise resolved with itself" );
+            _settle( ctx, promiseOffset, REJECTED, -1 );
+            duk_pop( ctx );
+            return;
         }
-        else if ( status == 1 ) {
-            // Resolved, invoke callback directly
-            duk_dup( ctx, resolveCbOffset );
-            duk_get_prop_string( ctx, sourcePromiseOffset, "_value" );
-            duk_call( ctx, 1 );
+        if ( _isPromise( ctx, valueOffset ) ) {
+            // Native promise, follow it without any intermediate functions
+            duk_push_undefined( ctx );
+            duk_push_undefined( ctx );
+            duk_dup( ctx, promiseOffset );
+            _addReaction( ctx, valueOffset );
+            return;
         }
-        else if ( status == -1 ) {
-            // Rejected, invoke callback directly
-            duk_dup( ctx, rejectCbOffset );
-            duk_get_prop_string( ctx, sourcePromiseOffset, "_value" );
-            duk_call( ctx, 1 );
+        if ( duk_is_object( ctx, valueOffset ) ) {
+            auto &self = Self::fromContext( ctx );
+            duk_get_prop_string( ctx, valueOffset, "then" );
+            if ( duk_is_callable( ctx, -1 ) ) {
+                self.scheduleMicrotask( [&]( duk_context *jobContext ) {
+                    duk_push_c_lightfunc( ctx, dukThenableJob, 3, 3, 0 );
+                    duk_dup( ctx, valueOffset );
+                    duk_dup( ctx, -3 ); // then
+                    duk_dup( ctx, promiseOffset );
+                    duk_xmove_top( jobContext, ctx, 4 );
+                } );
+                duk_pop( ctx );
+                return;
+            }
+            duk_pop( ctx );
         }
-
-        return 0;
+        _settle( ctx, promiseOffset, FULFILLED, valueOffset );
     }
 
-    // Takes a single argument: value
-    static duk_ret_t dukResolveInternal( duk_context *ctx ) {
-        auto& self = Self::fromContext( ctx );
-        duk_push_this( ctx );
-        auto thisOffset = duk_get_top_index( ctx );
-
-        duk_get_prop_string( ctx, -1, "_promiseStatus" );
-        if ( duk_require_int( ctx, -1 ) != 0 )
-            duk_error( ctx, DUK_ERR_TYPE_ERROR,
-                       "Promise was rejected/resolved multiple times" );
-        // Set status to resolved
-        duk_push_int( ctx, 1 );
-        duk_put_prop_string( ctx, thisOffset, "_promiseStatus" );
-        // Set value to the error
-        duk_dup( ctx, 0 ); // resolve value (the argument of dukResolveInternal)
-        duk_put_prop_string( ctx, -3, "_value" );
-
-        // Invoke onRejected
-        duk_get_prop_string( ctx, thisOffset, "_onResolved" );
-        dukForEach( ctx, [&]( int idx ) {
-            self.schedule([&]( duk_context *jobContext ) {
-                // There is already the function
-                duk_dup( ctx, 0 ); // resolve value
-                duk_xmove_top( jobContext, ctx, 2 );
-            } );
-        });
-
-        return 0;
+    // Settle a pending promise and schedule its reactions. Settling a promise
+    // that is not pending does nothing.
+    static void _settle( duk_context *ctx, int promiseOffset, State state, int valueOffset ) {
+        promiseOffset = duk_normalize_index( ctx, promiseOffset );
+        valueOffset = duk_normalize_index( ctx, valueOffset );
+        _pushRecord( ctx, promiseOffset );
+        const int recordOffset = duk_get_top_index( ctx );
+        duk_get_prop_index( ctx, recordOffset, STATE );
+        bool pending = duk_get_int( ctx, -1 ) == PENDING;
+        duk_pop( ctx );
+        if ( !pending ) {
+            duk_pop( ctx );
+            return;
+        }
+        duk_push_int( ctx, state );
+        duk_put_prop_index( ctx, recordOffset, STATE );
+        duk_dup( ctx, valueOffset );
+        duk_put_prop_index( ctx, recordOffset, VALUE );
+
+        int length = duk_get_length( ctx, recordOffset );
+        for ( int i = REACTIONS; i < length; i += 3 ) {
+            duk_get_prop_index( ctx, recordOffset, i + ( state == FULFILLED ? 0 : 1 ) );
+            duk_get_prop_index( ctx, recordOffset, i + 2 );
+            _scheduleReaction( ctx, state, valueOffset );
+        }
+        // Release the reactions
+        duk_set_length( ctx, recordOffset, REACTIONS );
+        duk_pop( ctx );
     }
 
-    // Takes a single argument: error
-    static duk_ret_t dukRejectInternal( duk_context *ctx ) {
-        auto& self = Self::fromContext( ctx );
-        duk_push_this( ctx );
-        auto thisOffset = duk_get_top_index( ctx );
-
-        dukDumpStack( ctx, "dukRejectInternal" );
-        dukRaiseError( ctx, "In dukRejectInternal");
-
-        duk_get_prop_string( ctx, -1, "_promiseStatus" );
-        if ( duk_require_int( ctx, -1 ) != 0 )
-            duk_error( ctx, DUK_ERR_TYPE_ERROR,
-                       "Promise was rejected/resolved multiple times" );
-        // Set status to rejected
-        duk_push_int( ctx, -1 );
-        duk_put_prop_string( ctx, thisOffset, "_promiseStatus" );
-        // Set value to the error
-        duk_dup( ctx, 0 ); // Error value (the argument of dukRejectInternal)
-        duk_put_prop_string( ctx, -3, "_value" );
-
-        // Invoke onRejected
-        duk_get_prop_string( ctx, thisOffset, "_onRejected" );
-        dukForEach( ctx, [&]( int idx ) {
-            self.schedule([&]( duk_context *jobContext ) {
-                // There is already the function
-                duk_dup( ctx, 0 ); // Error value
-                duk_xmove_top( jobContext, ctx, 2 );
-            } );
-        });
+    // Schedule a reaction job for handler (-2) and derived promise (-1) on top
+    // of the stack; pops them
+    static void _scheduleReaction( duk_context *ctx, State state, int valueOffset ) {
+        auto &self = Self::fromContext( ctx );
+        self.scheduleMicrotask( [&]( duk_context *jobContext ) {
+            duk_push_c_lightfunc( ctx, dukReactionJob, 4, 4, 0 );
+            duk_insert( ctx, -3 );
+            duk_dup( ctx, valueOffset );
+            duk_push_int( ctx, state );
+            duk_xmove_top( jobContext, ctx, 5 );
+        } );
+    }
 
-        return 0;
+    // Add a reaction to the promise. The reaction is on top of the stack as
+    // onFulfilled (-3), onRejected (-2) and the derived promise (-1); it is
+    // popped. If the promise is already settled, the reaction is scheduled
+    // right away.
+    static void _addReaction( duk_context *ctx, int promiseOffset ) {
+        promiseOffset = duk_normalize_index( ctx, promiseOffset );
+        _pushRecord( ctx, promiseOffset );
+        const int recordOffset = duk_get_top_index( ctx );
+        duk_get_prop_index( ctx, recordOffset, STATE );
+        State state = State( duk_get_int( ctx, -1 ) );
+        duk_pop( ctx );
+        if ( state == PENDING ) {
+            int length = duk_get_length( ctx, recordOffset );
+            for ( int i = 0; i != 3; i++ ) {
+                duk_dup( ctx, recordOffset - 3 + i );
+                duk_put_prop_index( ctx, recordOffset, length + i );
+            }
+            duk_pop_n( ctx, 4 );
+            return;
+        }
+        duk_get_prop_index( ctx, recordOffset, VALUE );
+        const int valueOffset = duk_get_top_index( ctx );
+        // Keep the handler for the state and the derived promise
+        duk_dup( ctx, recordOffset - ( state == FULFILLED ? 3 : 2 ) );
+        duk_dup( ctx, recordOffset - 1 );
+        _scheduleReaction( ctx, state, valueOffset );
+        duk_pop_n( ctx, 5 );
     }
 };
 
-} // namespace jac
\ No newline at end of file
+} // namespace jac
@@ -4,113 +4,283 @@
 #include <freertos/timers.h>
 #include <jsmachine.hpp>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 namespace jac {
 
 // Implement timers functionality for the JsMachine.
 //
-// Internally keeps a list of timer structures. The corresponding callback for
-// the timer is stored in <stash>.timerSlot[String(id)].
+// The feature keeps a pool of FreeRTOS timers. The timers are created once and
+// re-armed via xTimerChangePeriod, so creating a JavaScript timer requires
+// neither a heap allocation nor a timer creation. Each pool slot has a small
+// integer id which is used as the timer identifier in JavaScript. The
+// corresponding callback for the timer is stored in <stash>.timerSlot[id].
+//
+// FreeRTOS fixes the auto-reload mode on timer creation, so there are separate
+// pools for one-shot and periodic timers. The pools grow when exhausted.
+//
+// Expired timers do not go through the event ring, which can be full (e.g., of
+// GPIO events) and would drop them: the timer task only flags the slot and
+// wakes up the event loop, which then schedules the callbacks of the flagged
+// slots as timer jobs (see JobPriority::Timer). Multiple expirations of a
+// periodic timer before the loop gets to it invoke the callback once.
 template < typename Self >
 class RtosTimers {
     static inline constexpr const char* SLOT = "timerSlot";
+
+    struct TimerSlot {
+        Self* owner;
+        int id;
+        bool oneShot;
+        TimerHandle_t handle;
+        bool active = false; // Accessed only from the machine task
+        TimerSlot* nextReclaimed = nullptr;
+        // Set by the timer task when the timer expires
+        std::atomic< bool > fired = false;
+        // Distinguishes individual uses of the slot, so a callback of a timer
+        // that fired right before it was cleared is not invoked
+        std::atomic< uint32_t > generation = 0;
+    };
 public:
     MACHINE_FEATURE_SELF();
 
-    struct Configuration {};
+    struct Configuration {
+        // Number of timers created in advance
+        int oneShotTimerPoolSize = 8;
+        int periodicTimerPoolSize = 2;
+    };
+
+    ~RtosTimers() {
+        // The timers are stopped and the timer task is done with them, see
+        // onShutdown
+        for ( auto& slot : _slots )
+            xTimerDelete( slot->handle, portMAX_DELAY );
+    }
+
+    // Timer callbacks wake up the event loop and pended reclaimSlot calls touch
+    // the slots, so stop the timers and wait until the timer task processed
+    // all commands issued so far. The commands are processed in order and
+    // callbacks run on the timer task, so once the pended sync call runs, no
+    // callback is running and none will fire.
+    void onShutdown() {
+        if ( _slots.empty() )
+            return;
+        for ( auto& slot : _slots )
+            xTimerStop( slot->handle, portMAX_DELAY );
+        std::atomic< bool > synced = false;
+        xTimerPendFunctionCall( []( void* synced, uint32_t ) {
+            static_cast< std::atomic< bool >* >( synced )->store( true );
+        }, &synced, 0, portMAX_DELAY );
+        while ( !synced.load() )
+            vTaskDelay( 1 );
+    }
 
     void initialize() {
         setupSlot();
         registerFunctions();
+        for ( int i = 0; i != self()._cfg.oneShotTimerPoolSize; i++ )
+            _freeSlots[ true ].push_back( createSlot( true ) );
+        for ( int i = 0; i != self()._cfg.periodicTimerPoolSize; i++ )
+            _freeSlots[ false ].push_back( createSlot( false ) );
     }
 
-    void onEventLoop() {}
+    void onEventLoop() {
+        if ( !_timersFired.exchange( false ) )
+            return;
+        for ( auto& s : _slots ) {
+            if ( !s->fired.exchange( false ) || !s->active )
+                continue;
+            uint32_t generation = s->generation;
+            self().schedule( [&]( duk_context* ctx ) {
+                duk_push_c_function( ctx, dukInvokeTimer, 2 );
+                duk_push_int( ctx, s->id );
+                duk_push_uint( ctx, generation );
+            }, JobPriority::Timer );
+        }
+    }
 private:
     void setupSlot() {
-        duk_push_heap_stash( self()._context );
-        duk_push_object( self()._context );
-        duk_put_prop_string( self()._context, -2, SLOT );
-        duk_pop( self()._context );
+        _timerCallbacks.create( self()._context, SLOT, false );
     }
 
     void registerFunctions() {
-        duk_push_c_function( self()._context, dukCreateTimer, 3 );
+        duk_push_c_function( self()._context, dukNative< dukCreateTimer >,
+            dukArgCount< dukCreateTimer > );
         duk_put_global_string( self()._context, "createTimer" );
+        duk_push_c_function( self()._context, dukNative< dukClearTimer >,
+            dukArgCount< dukClearTimer > );
+        duk_put_global_string( self()._context, "clearTimer" );
+    }
+
+    TimerSlot* createSlot( bool oneShot ) {
+        auto slot = std::make_unique< TimerSlot >();
+        slot->owner = &self();
+        slot->id = _slots.size() + 1;
+        slot->oneShot = oneShot;
+        // The period is set when the timer is armed
+        slot->handle = xTimerCreate( nullptr, 1, !oneShot, slot.get(),
+            timerCallback );
+        if ( !slot->handle )
+            throw std::runtime_error( "Cannot create timer" );
+        _slots.push_back( std::move( slot ) );
+        return _slots.back().get();
+    }
+
+    TimerSlot* slot( int id ) {
+        if ( id < 1 || id > int( _slots.size() ) )
+            return nullptr;
+        return _slots[ id - 1 ].get();
     }
 
-    TimerHandle_t createTimer( int period, bool oneShot ) {
+    TimerSlot* allocateSlot( bool oneShot ) {
+        reclaimSlots();
+        auto& freeSlots = _freeSlots[ oneShot ];
+        if ( freeSlots.empty() )
+            return createSlot( oneShot );
+        TimerSlot* s = freeSlots.back();
+        freeSlots.pop_back();
+        return s;
+    }
+
+    // Move slots of cleared timers, which the timer task is done with, back to
+    // the pool
+    void reclaimSlots() {
+        portENTER_CRITICAL( &_reclaimedLock );
+        TimerSlot* s = _reclaimed;
+        _reclaimed = nullptr;
+        portEXIT_CRITICAL( &_reclaimedLock );
+        for ( ; s; s = s->nextReclaimed )
+            _freeSlots[ s->oneShot ].push_back( s );
+    }
+
+    // Invoked in the timer task once it processed the stop command of a
+    // cleared timer
+    static void reclaimSlot( void* param, uint32_t ) {
+        auto* s = static_cast< TimerSlot* >( param );
+        RtosTimers& timers = *s->owner;
+        portENTER_CRITICAL( &timers._reclaimedLock );
+        // Avoid allocation in the critical section, the slots form a list
+        s->nextReclaimed = timers._reclaimed;
+        timers._reclaimed = s;
+        portEXIT_CRITICAL( &timers._reclaimedLock );
+    }
+
+    TimerSlot* createTimer( int period, bool oneShot ) {
         if ( period == 0 ) {
             throw std::runtime_error( "Timers with no period are not implemented yet" );
         }
-        if ( oneShot )
-            return xTimerCreate(
-                nullptr, pdMS_TO_TICKS( period ),
-                !oneShot, &self(), timerCallback< false > );
-        else
-            return xTimerCreate(
-                nullptr, pdMS_TO_TICKS( period ),
-                !oneShot, &self(), timerCallback< true > );
+        TimerSlot* s = allocateSlot( oneShot );
+        s->active = true;
+        s->generation++;
+        // The timer task is done with the slot, but the previous use might
+        // have fired right before it was cleared
+        s->fired = false;
+        return s;
     }
 
-    template < bool AutoReload >
-    static void timerCallback( TimerHandle_t timer ) {
-        int timerId = reinterpret_cast< int >( timer );
-        auto& self = Self::fromUdata( pvTimerGetTimerID( timer ) );
-
-        self.schedule( [&]( duk_context* ctx ) {
-            duk_push_c_function( ctx, dukInvokeTimer, 2 );
-            duk_push_int( ctx, timerId );
-            duk_push_boolean( ctx, !AutoReload );
-        } );
+    void armTimer( TimerSlot* s, int period ) {
+        // Changing the period of a dormant timer also starts it
+        xTimerChangePeriod( s->handle, pdMS_TO_TICKS( period ), portMAX_DELAY );
+    }
 
-        if ( !AutoReload ) {
-            xTimerDelete( timer, portMAX_DELAY );
+    // Release slot of a timer, the callback is expected to be removed by the
+    // caller
+    void releaseTimer( TimerSlot* s, bool stop ) {
+        s->active = false;
+        s->generation++;
+        if ( !stop ) {
+            // One-shot timer that already fired is dormant
+            _freeSlots[ s->oneShot ].push_back( s );
+            return;
         }
+        // The timer might be just firing, so we cannot reuse the slot until
+        // the timer task processes the stop command. Timer commands are
+        // processed in order, so the pended call notifies us.
+        xTimerStop( s->handle, portMAX_DELAY );
+        xTimerPendFunctionCall( reclaimSlot, s, 0, portMAX_DELAY );
     }
 
-    // Accepts the following duk arguments:
-    // - period: number - period in milliseconds
-    // - oneShot: bool  - declare if the timer is one shot or not
-    // - callback: fun  - timer callback
-    static duk_ret_t dukCreateTimer( duk_context* ctx ) {
-        Self& self = Self::fromContext( ctx );
-        // Validate arguments
-        int period = duk_require_number( ctx, 0 );
-        bool oneShot = duk_require_boolean( ctx, 1 );
-        duk_require_function( ctx, 2 );
+    // Flag the slot and wake up the event loop, it schedules the callback
+    static void timerCallback( TimerHandle_t timer ) {
+        auto* s = static_cast< TimerSlot* >( pvTimerGetTimerID( timer ) );
+        Self& machine = *s->owner;
+        s->fired = true;
+        machine._timersFired = true;
+        machine.addEvent();
+    }
 
-        TimerHandle_t t = self.createTimer( period, oneShot );
-        xTimerStart( t, portMAX_DELAY );
-        int timerId = reinterpret_cast< int >( t );
+    static void dukRemoveCallback( duk_context* ctx, int id ) {
+        Self::fromContext( ctx )._timerCallbacks.push( ctx );
+        duk_del_prop_index( ctx, -1, id );
+        duk_pop( ctx );
+    }
 
-        duk_push_heap_stash( ctx );
-        duk_get_prop_string( ctx, -1, SLOT );
+    // Create a timer with given period (in milliseconds) invoking the callback
+    // and return its id
+    static int dukCreateTimer( duk_context* ctx, int period, bool oneShot, DukCallable callback ) {
+        Self& self = Self::fromContext( ctx );
+        TimerSlot* t;
+        try {
+            t = self.createTimer( period, oneShot );
+        } catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
+
+        self._timerCallbacks.push( ctx );
         auto slotOffset = duk_get_top_index( ctx );
-        duk_dup( ctx, 2 );
-        duk_put_prop_index( ctx, slotOffset, timerId );
+        duk_dup( ctx, callback.offset );
+        duk_put_prop_index( ctx, slotOffset, t->id );
+        duk_pop( ctx );
+
+        self.armTimer( t, period );
+        return t->id;
+    }
 
-        return dukReturn( ctx, timerId );
+    // Cancel the timer with given id; unknown ids are ignored
+    static void dukClearTimer( duk_context* ctx, int id ) {
+        Self& self = Self::fromContext( ctx );
+        TimerSlot* s = self.slot( id );
+        if ( s && s->active ) {
+            self.releaseTimer( s, true );
+            dukRemoveCallback( ctx, s->id );
+        }
     }
 
     // Accepts the following duk arguments:
-    // - timer: number - timer identifier
-    // - cleanup: bool - declare if the timer callback should be cleaned or not
+    // - timer: number      - timer identifier
+    // - generation: number - generation of the timer when it fired
     static duk_ret_t dukInvokeTimer( duk_context* ctx ) {
+        Self& self = Self::fromContext( ctx );
+        TimerSlot* s = self.slot( duk_require_int( ctx, 0 ) );
+        // The timer was cleared after it fired
+        if ( !s || !s->active || s->generation != duk_require_uint( ctx, 1 ) )
+            return 0;
+
         // Extract time callback
-        duk_push_heap_stash( ctx );
-        duk_get_prop_string( ctx, -1, SLOT );
-        auto slotOffset = duk_get_top_index( ctx );
-        duk_dup( ctx, 0 );
-        duk_get_prop( ctx, slotOffset );
-        // Invoke callback
+        self._timerCallbacks.push( ctx );
+        duk_get_prop_index( ctx, -1, s->id );
         duk_require_callable( ctx, -1 );
-        duk_call( ctx, 0 );
 
-        if ( duk_require_boolean( ctx, 1 ) ) {
-            duk_dup( ctx, 0 );
-            duk_del_prop( ctx, slotOffset );
+        // One shot timers are done, the callback is already on the stack
+        if ( s->oneShot ) {
+            self.releaseTimer( s, false );
+            dukRemoveCallback( ctx, s->id );
         }
+
+        // Invoke callback
+        duk_call( ctx, 0 );
         return 0;
     }
+
+    DukStashSlot _timerCallbacks; // <stash>.timerSlot
+    std::vector< std::unique_ptr< TimerSlot > > _slots; // Indexed by id - 1
+    std::vector< TimerSlot* > _freeSlots[ 2 ]; // Indexed by oneShot
+    TimerSlot* _reclaimed = nullptr;
+    // Set by the timer task when any slot is flagged as fired
+    std::atomic< bool > _timersFired = false;
+    portMUX_TYPE _reclaimedLock = portMUX_INITIALIZER_UNLOCKED;
 };
 
-} // namespace jac
\ No newline at end of file
+} // namespace jac
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <jsmachine.hpp>
+#include <execInterrupt.hpp>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace jac {
+
+// Implement a sampling profiler of the JavaScript code.
+//
+// A periodic timer requests a sample and the sample is taken the next time the
+// Duktape executor checks for interrupts (see execInterrupt.hpp). The
+// interrupt only copies the call stack into a preallocated buffer, the
+// samples are processed in the event loop. Samples that do not fit the buffer
+// before the event loop gets to them are counted as DROPPED_STACK. Samples
+// are aggregated on the device as folded stacks ("outer;inner;leaf:line") and
+// they are periodically sent to the debug client as AppNotify messages
+// ["jac-profile", stack, count, stack, count, ...]. Samples are kept until the
+// debugger is attached. Use tools/profile.py to collect them.
+//
+// Note that the executor checks for interrupts only once in a while, so the
+// actual sampling rate might be lower than the configured one for long running
+// code with few function calls.
+//
+// The feature also registers native module "samplingProfiler" with functions
+// start() and stop().
+template < typename Self >
+class SamplingProfiler {
+    static inline constexpr const char* NOTIFY_TAG = "jac-profile";
+    static inline constexpr const char* TRUNCATED_STACK = "[truncated]";
+    static inline constexpr const char* DROPPED_STACK = "[dropped]";
+    // Stacks sent in a single notification
+    static constexpr int NOTIFY_STACKS = 32;
+public:
+    MACHINE_FEATURE_SELF();
+
+    struct Configuration {
+        int samplingPeriod = 1000;        // in microseconds
+        int profileFlushInterval = 1000;  // in milliseconds
+        int maxSampleDepth = 16;
+        // Samples of different stacks are merged into TRUNCATED_STACK
+        int maxProfileStacks = 128;
+        // Samples taken during a single event loop iteration
+        int pendingSampleCount = 32;
+    };
+
+    ~SamplingProfiler() {
+        if ( _samplingTimer ) {
+            stopSampling();
+            esp_timer_delete( _samplingTimer );
+        }
+        unregisterExecInterruptHook( &self() );
+    }
+
+    void initialize() {
+        esp_timer_create_args_t args{};
+        args.callback = samplingTimerCallback;
+        args.arg = this;
+        args.name = "jacSampler";
+        if ( esp_timer_create( &args, &_samplingTimer ) != ESP_OK )
+            throw std::runtime_error( "Cannot create sampling timer" );
+        _pendingSamples.resize( self()._cfg.pendingSampleCount );
+        _pendingFrames.resize( self()._cfg.pendingSampleCount * self()._cfg.maxSampleDepth );
+        registerExecInterruptHook( &self(), execInterrupt );
+
+        self().registerNativeModule( "samplingProfiler", [this]( duk_context *ctx ) {
+            return self()._initializeSamplingProfilerModule( ctx );
+        });
+    }
+
+    void onEventLoop() {
+        processSamples();
+        if ( _stacks.empty() )
+            return;
+        int64_t flushTime = _lastFlush + self()._cfg.profileFlushInterval * 1000ll;
+        if ( esp_timer_get_time() >= flushTime )
+            flushProfile();
+        else
+            self().requestWakeUpAt( flushTime );
+    }
+
+    void startSampling() {
+        if ( _sampling )
+            return;
+        _lastFlush = esp_timer_get_time();
+        esp_timer_start_periodic( _samplingTimer, self()._cfg.samplingPeriod );
+        _sampling = true;
+    }
+
+    void stopSampling() {
+        if ( !_sampling )
+            return;
+        esp_timer_stop( _samplingTimer );
+        _sampling = false;
+        _sampleRequested = false;
+        processSamples();
+    }
+
+    // Send the aggregated samples to the debug client. The samples are kept
+    // if no client is attached.
+    void flushProfile() {
+        duk_context *ctx = self()._context;
+        _lastFlush = esp_timer_get_time();
+        while ( !_stacks.empty() ) {
+            int count = 0;
+            duk_require_stack( ctx, 1 + 2 * NOTIFY_STACKS );
+            duk_push_string( ctx, NOTIFY_TAG );
+            for ( auto it = _stacks.begin(); it != _stacks.end() && count != NOTIFY_STACKS; ++it, count++ ) {
+                duk_push_lstring( ctx, it->first.data(), it->first.size() );
+                duk_push_uint( ctx, it->second );
+            }
+            if ( !duk_debugger_notify( ctx, 1 + 2 * count ) )
+                return;
+            for ( int i = 0; i != count; i++ )
+                _stacks.erase( _stacks.begin() );
+        }
+    }
+
+private:
+    static void samplingTimerCallback( void *arg ) {
+        auto *profiler = static_cast< SamplingProfiler* >( arg );
+        profiler->_sampleRequested.store( true, std::memory_order_relaxed );
+    }
+
+    static bool execInterrupt( void *udata ) {
+        Self& self = Self::fromUdata( udata );
+        if ( self._sampleRequested.exchange( false, std::memory_order_relaxed ) )
+            self.takeSample();
+        return false;
+    }
+
+    struct PendingSample {
+        int depth;
+        int line;
+    };
+
+    // Copy the call stack of the running code to the buffer of pending
+    // samples. Called from the executor interrupt, so it must neither throw
+    // nor use the Duktape API.
+    void takeSample() {
+        if ( _pendingCount == int( _pendingSamples.size() ) ) {
+            _droppedSamples++;
+            return;
+        }
+        int maxDepth = self()._cfg.maxSampleDepth;
+        PendingSample& sample = _pendingSamples[ _pendingCount ];
+        sample.depth = sampleCallstack( self()._context,
+            _pendingFrames.data() + _pendingCount * maxDepth, maxDepth, &sample.line );
+        _pendingCount++;
+    }
+
+    // Record the pending samples as folded stacks
+    void processSamples() {
+        int maxDepth = self()._cfg.maxSampleDepth;
+        for ( int s = 0; s != _pendingCount; s++ ) {
+            const PendingSample& sample = _pendingSamples[ s ];
+            const SampledFrame* frames = _pendingFrames.data() + s * maxDepth;
+            std::string stack;
+            // The innermost frame is the first one
+            for ( int i = sample.depth - 1; i >= 0; i-- ) {
+                if ( !stack.empty() )
+                    stack += ';';
+                if ( frames[ i ].nameLength )
+                    stack.append( frames[ i ].name, frames[ i ].nameLength );
+                else
+                    stack += "(anonymous)";
+                if ( i == 0 )
+                    stack += ":" + std::to_string( sample.line );
+            }
+            if ( !stack.empty() )
+                recordSample( std::move( stack ) );
+        }
+        _pendingCount = 0;
+        if ( _droppedSamples ) {
+            _stacks[ DROPPED_STACK ] += _droppedSamples;
+            _droppedSamples = 0;
+        }
+    }
+
+    void recordSample( std::string stack ) {
+        auto it = _stacks.find( stack );
+        if ( it != _stacks.end() ) {
+            it->second++;
+            return;
+        }
+        if ( int( _stacks.size() ) >= self()._cfg.maxProfileStacks )
+            stack = TRUNCATED_STACK;
+        _stacks[ stack ]++;
+    }
+
+    // Initializes the module; there are the following arguments on the
+    // Duktape stack:
+    // - 0 requested module ID
+    // - 1 exports object
+    // - 2 module object
+    duk_ret_t _initializeSamplingProfilerModule( duk_context *ctx ) {
+        const int exportOffset = 1;
+        duk_function_list_entry functions[] = {
+            { "start", dukStart, 0 },
+            { "stop", dukStop, 0 },
+            { nullptr, nullptr, 0 }
+        };
+        duk_put_function_list( ctx, exportOffset, functions );
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukStart( duk_context *ctx ) {
+        Self::fromContext( ctx ).startSampling();
+        return dukReturn( ctx );
+    }
+
+    static duk_ret_t dukStop( duk_context *ctx ) {
+        Self::fromContext( ctx ).stopSampling();
+        return dukReturn( ctx );
+    }
+
+    esp_timer_handle_t _samplingTimer = nullptr;
+    std::atomic< bool > _sampleRequested = false;
+    bool _sampling = false;
+    int64_t _lastFlush = 0;
+    std::unordered_map< std::string, uint32_t > _stacks;
+    // Written from the executor interrupt; it runs in the machine task, so
+    // the buffers need no locking
+    std::vector< PendingSample > _pendingSamples;
+    std::vector< SampledFrame > _pendingFrames;
+    int _pendingCount = 0;
+    uint32_t _droppedSamples = 0;
+};
+
+} // namespace jac
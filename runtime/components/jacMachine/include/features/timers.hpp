@@ -1,23 +1,30 @@
 #pragma once
 
 #include <jsmachine.hpp>
+#include <timerQueue.hpp>
+#include <esp_timer.h>
+
+#include <optional>
+#include <vector>
 
 namespace jac {
 
 // Implement timers functionality for the JsMachine.
 //
-// Internally keeps a list of timer structures. The corresponding callback for
-// the timer is stored in <stash>.timerSlot[String(id)].
+// Armed timers are kept in a binary min-heap ordered by their deadline (see
+// utility::TimerQueue), so the event loop only inspects the earliest timer and
+// it asks the machine to wake up exactly at its deadline. A timer can be
+// cancelled in O(log n). The corresponding callback for the timer is stored in
+// <stash>.timerSlot[id].
 template < typename Self >
 class Timers {
     static inline constexpr const char* SLOT = "timerSlot";
 
     struct Timer {
-        int id;
-        unsigned long long targetTime;
-        int period;
+        int period;          // in milliseconds
         bool oneShot;
-        bool deleted; // Note that we cannot
+        bool active;         // false if the id is free
+        uint32_t generation; // distinguishes individual uses of the same id
     };
 public:
     MACHINE_FEATURE_SELF();
@@ -30,16 +37,16 @@ public:
     }
 
     void onEventLoop() {
-        deleteDeadTimers();
-
-        auto now = pdTICKS_TO_MS( xTaskGetTickCount() );
-        for ( Timer& t : _timers ) {
-            if ( t.targetTime > now )
-                continue;
-            self().schedule( { SLOT, t.id } );
-            t.deleted = t.oneShot;
-            t.targetTime = now + t.period;
-        }
+        int64_t now = esp_timer_get_time();
+        // Deadlines are in microseconds, see esp_timer_get_time
+        _queue.expire( now, [&]( int id ) -> std::optional< int64_t > {
+            Timer& t = timer( id );
+            scheduleInvocation( id, t.generation );
+            if ( t.oneShot )
+                return std::nullopt;
+            return now + t.period * 1000ll;
+        } );
+        requestNextWakeUp();
     }
 private:
     void setupSlot() {
@@ -52,33 +59,62 @@ private:
     void registerFunctions() {
         duk_push_c_function( self()._context, dukCreateTimer, 3 );
         duk_put_global_string( self()._context, "createTimer" );
+        duk_push_c_function( self()._context, dukClearTimer, 1 );
+        duk_put_global_string( self()._context, "clearTimer" );
     }
 
-    const Timer& createTimer( int period, bool oneShot ) {
-        _timers.push_back({
-            allocateId(),
-            pdTICKS_TO_MS( xTaskGetTickCount() ) + period,
-            period,
-            oneShot,
-            false });
-        return _timers.back();
+    Timer& timer( int id ) {
+        return _timers[ id - 1 ];
     }
 
-    void deleteTimer( const Timer& t ) {
-        releaseId( t.id );
+    bool isAlive( int id, uint32_t generation ) {
+        return id >= 1 && id <= int( _timers.size() )
+            && timer( id ).active && timer( id ).generation == generation;
+    }
+
+    int createTimer( int period, bool oneShot ) {
+        // A periodic timer has to advance, otherwise it would fire forever
+        if ( period <= 0 && !oneShot ) {
+            throw std::runtime_error( "Periodic timers need a positive period" );
+        }
+        if ( period < 0 )
+            period = 0;
+        int id = allocateId();
+        Timer& t = timer( id );
+        t.period = period;
+        t.oneShot = oneShot;
+        t.active = true;
+        _queue.push( id, esp_timer_get_time() + period * 1000ll );
+        requestNextWakeUp();
+        return id;
+    }
+
+    // Cancel the timer and release its id
+    void deleteTimer( int id ) {
+        Timer& t = timer( id );
+        if ( _queue.contains( id ) )
+            _queue.remove( id );
+        t.active = false;
+        t.generation++;
+        releaseId( id );
 
         duk_push_heap_stash( self()._context );
         duk_get_prop_string( self()._context, -1, SLOT );
-        duk_del_prop_index( self()._context, -1, t.id );
+        duk_del_prop_index( self()._context, -1, id );
         duk_pop_2( self()._context );
     }
 
-    void deleteDeadTimers() {
-        auto toDelete = std::remove_if( _timers.begin(), _timers.end(),
-            []( auto t ) { return t.deleted; } );
-        for ( auto i = toDelete; i != _timers.end(); i++ )
-            deleteTimer( *i );
-        _timers.erase( toDelete, _timers.end() );
+    void scheduleInvocation( int id, uint32_t generation ) {
+        self().schedule( [&]( duk_context* ctx ) {
+            duk_push_c_function( ctx, dukInvokeTimer, 2 );
+            duk_push_int( ctx, id );
+            duk_push_uint( ctx, generation );
+        }, JobPriority::Timer );
+    }
+
+    void requestNextWakeUp() {
+        if ( !_queue.empty() )
+            self().requestWakeUpAt( _queue.topDeadline() );
     }
 
     int allocateId() {
@@ -87,7 +123,8 @@ private:
             _freeIds.pop_back();
             return id;
         }
-        return _timers.size() + 1;
+        _timers.push_back( { 0, false, false, 0 } );
+        return _timers.size();
     }
 
     void releaseId( int id ) {
@@ -105,20 +142,61 @@ private:
         bool oneShot = duk_require_boolean( ctx, 1 );
         duk_require_function( ctx, 2 );
 
-        const Timer& t = self.createTimer( period, oneShot );
+        int id;
+        try {
+            id = self.createTimer( period, oneShot );
+        } catch ( const std::runtime_error& e ) {
+            dukRaiseError( ctx, e.what() );
+        }
 
-        auto callbackOffset = duk_get_top_index( ctx );
         duk_push_heap_stash( ctx );
         duk_get_prop_string( ctx, -1, SLOT );
         auto slotOffset = duk_get_top_index( ctx );
-        duk_dup( ctx, callbackOffset );
-        duk_put_prop_index( ctx, slotOffset, t.id );
+        duk_dup( ctx, 2 );
+        duk_put_prop_index( ctx, slotOffset, id );
+
+        return dukReturn( ctx, id );
+    }
+
+    // Accepts the following duk arguments:
+    // - timer: number - timer identifier
+    static duk_ret_t dukClearTimer( duk_context* ctx ) {
+        Self& self = Self::fromContext( ctx );
+        int id = duk_require_int( ctx, 0 );
+        if ( id >= 1 && id <= int( self._timers.size() ) && self.timer( id ).active )
+            self.deleteTimer( id );
+        return dukReturn( ctx );
+    }
+
+    // Accepts the following duk arguments:
+    // - timer: number      - timer identifier
+    // - generation: number - generation of the timer when it was fired
+    static duk_ret_t dukInvokeTimer( duk_context* ctx ) {
+        Self& self = Self::fromContext( ctx );
+        int id = duk_require_int( ctx, 0 );
+        uint32_t generation = duk_require_uint( ctx, 1 );
+        // The timer was cleared after it was fired
+        if ( !self.isAlive( id, generation ) )
+            return 0;
+
+        // Extract time callback
+        duk_push_heap_stash( ctx );
+        duk_get_prop_string( ctx, -1, SLOT );
+        duk_get_prop_index( ctx, -1, id );
+        duk_require_callable( ctx, -1 );
+
+        // One shot timers are done, the callback is already on the stack
+        if ( self.timer( id ).oneShot )
+            self.deleteTimer( id );
 
-        return dukReturn( ctx, t.id );
+        // Invoke callback
+        duk_call( ctx, 0 );
+        return 0;
     }
 
-    std::vector< Timer > _timers;
+    std::vector< Timer > _timers; // Indexed by id - 1
     std::vector< int > _freeIds;
+    utility::TimerQueue _queue;
 };
 
-} // namespace jac
\ No newline at end of file
+} // namespace jac
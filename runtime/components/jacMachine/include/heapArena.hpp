@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace jac {
+
+// Allocator managing a single contiguous block of memory. The block is split
+// into blocks with a 4-byte header carrying the size; free blocks are kept in
+// segregated lists (exact sizes up to 256 bytes, powers of two above) and
+// coalesced with their free neighbours, so both the per-allocation overhead
+// and the fragmentation stay low. Allocations are aligned to 8 bytes and all
+// operations take time bounded by the number of lists, except for a first
+// fit scan of a single list of large blocks.
+//
+// The arena is not locked; it is meant for a single Duktape heap, which is
+// used from one task at a time.
+//
+// Since all the allocations lie in one block, a pointer to an allocation can
+// be stored as a 16-bit offset in units of 4 bytes. The low-memory build of
+// Duktape uses this for its heap pointers, see heapPointers.h.
+class HeapArena {
+public:
+    static constexpr size_t ALIGNMENT = 8;
+    // Largest arena that can serve as the base of the compressed pointers;
+    // the higher values are reserved for the ROM objects
+    static constexpr size_t MAX_COMPRESSED_SIZE = size_t( 0xF800 ) * 4;
+
+    // Manage given memory; it has to outlive the arena
+    HeapArena( void* memory, size_t size );
+    HeapArena( const HeapArena& ) = delete;
+    HeapArena& operator=( const HeapArena& ) = delete;
+    ~HeapArena();
+
+    // Return nullptr if there is no space; the requests follow the semantics
+    // of malloc, realloc and free
+    void* allocate( size_t size );
+    void* reallocate( void* ptr, size_t size );
+    void release( void* ptr );
+
+    // Size of the payload of an allocated block, at least the requested size
+    size_t usableSize( const void* ptr ) const {
+        return _sizeOf( _blockOf( ptr ) ) - 4;
+    }
+
+    bool contains( const void* ptr ) const {
+        auto p = static_cast< const uint8_t* >( ptr );
+        return p >= _begin && p < _begin + _size;
+    }
+
+    // Capacity and free space of the arena including the block headers (in
+    // bytes)
+    size_t capacity() const { return _capacity; }
+    size_t freeSize() const { return _freeSize; }
+    size_t minimumFreeSize() const { return _minimumFreeSize; }
+    size_t largestFreeBlock() const;
+
+    // Make the arena the base of the compressed heap pointers. There can be
+    // only a single base, return false if there is another one or if the arena
+    // is larger than MAX_COMPRESSED_SIZE.
+    bool attachPointerCompression();
+    void detachPointerCompression();
+
+private:
+    static constexpr int SMALL_BIN_COUNT = 31; // Sizes 16 to 256 bytes
+    static constexpr int BIN_COUNT = SMALL_BIN_COUNT + 11;
+
+    static int _binOf( size_t size );
+
+    uint32_t& _header( uint32_t block ) const {
+        return *reinterpret_cast< uint32_t* >( _begin + block );
+    }
+    uint32_t* _links( uint32_t block ) const {
+        return reinterpret_cast< uint32_t* >( _begin + block + 4 );
+    }
+    uint32_t _sizeOf( uint32_t block ) const {
+        return _header( block ) & ~uint32_t( 7 );
+    }
+    uint32_t _blockOf( const void* ptr ) const {
+        return uint32_t( static_cast< const uint8_t* >( ptr ) - _begin ) - 4;
+    }
+    void* _payloadOf( uint32_t block ) {
+        return _begin + block + 4;
+    }
+
+    void _insert( uint32_t block, uint32_t size );
+    void _remove( uint32_t block );
+    void _markUsed( uint32_t block, uint32_t size );
+    uint32_t _find( uint32_t size );
+    void _split( uint32_t block, uint32_t size );
+    void _freeBlock( uint32_t block );
+
+    uint8_t* _begin;
+    size_t _size;
+    size_t _capacity = 0;
+    size_t _freeSize = 0;
+    size_t _minimumFreeSize = 0;
+    uint64_t _binMask = 0;
+    uint32_t _bins[ BIN_COUNT ] = {};
+};
+
+} // namespace jac
@@ -0,0 +1,49 @@
+#pragma once
+
+// Compressed heap pointers of the low-memory build of Duktape, see
+// duktape-lowmem.yml. The header is included by duk_config.h, so it has to be
+// valid C.
+//
+// A pointer into the heap arena (see HeapArena) is encoded as its offset from
+// the arena base in units of 4 bytes; 0 is the null pointer. Pointers to the
+// ROM strings and objects are encoded as JAC_ROM_PTRCOMP_FIRST plus their
+// index in duk_rom_compressed_pointers.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Has to match DUK_USE_ROM_PTRCOMP_FIRST
+#define JAC_ROM_PTRCOMP_FIRST 0xF800
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern uint8_t *jac_arena_base;
+extern size_t jac_arena_size;
+extern const void * const duk_rom_compressed_pointers[];
+
+// Encode a pointer outside the arena; abort for unknown pointers
+uint16_t jac_heapptr_enc16_rom( const void *ptr );
+
+static inline uint16_t jac_heapptr_enc16( const void *ptr ) {
+    uintptr_t offset;
+    if ( ptr == NULL )
+        return 0;
+    offset = (uintptr_t) ( (const uint8_t *) ptr - jac_arena_base );
+    if ( offset < jac_arena_size )
+        return (uint16_t) ( offset >> 2 );
+    return jac_heapptr_enc16_rom( ptr );
+}
+
+static inline void *jac_heapptr_dec16( uint16_t value ) {
+    if ( value == 0 )
+        return NULL;
+    if ( value >= JAC_ROM_PTRCOMP_FIRST )
+        return (void *) duk_rom_compressed_pointers[ value - JAC_ROM_PTRCOMP_FIRST ];
+    return jac_arena_base + ( (uintptr_t) value << 2 );
+}
+
+#ifdef __cplusplus
+}
+#endif
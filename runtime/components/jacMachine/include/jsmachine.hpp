@@ -1,14 +1,20 @@
 #pragma once
 
 #include <duktape.h>
+#include <cassert>
 #include <stdexcept>
-#include <mutex>
 #include <vector>
+#include <atomic>
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
 
 #include <freertos/semphr.h>
+#include <esp_timer.h>
 
 #include <dukUtility.hpp>
 #include <freeRtos.hpp>
+#include <eventRing.hpp>
 
 // Define this macro to avoid tedious writing of a repetitive code
 // Note that macro is much easire solution than any other "proper C++" solution
@@ -18,6 +24,109 @@
 
 namespace jac {
 
+// Plain record of an event posted from an interrupt handler or another task.
+// The meaning of source and value is given by the handler, e.g., pin number and
+// level for a GPIO event.
+struct MachineEvent {
+    uint16_t handler;  // Handler identifier, see registerEventHandler
+    uint16_t source;
+    uint32_t value;
+    int64_t timestamp; // In microseconds, see esp_timer_get_time
+};
+
+// Priority classes of jobs. Each iteration of the event loop runs all
+// interrupt jobs and then the other classes in the order of priority until the
+// budget of the iteration is exhausted.
+enum class JobPriority {
+    Interrupt, // Never deferred by the budget
+    Timer,
+    Io,
+    Normal
+};
+
+// Kinds of work the event loop performs; the first kinds match JobPriority.
+// Used for profiling, see EventLoopProfiler.
+enum class JobKind {
+    Interrupt,
+    Timer,
+    Io,
+    Normal,
+    Microtask,
+    Event,     // Event posted via postEvent
+    Gc         // Garbage collection, see GcPolicy
+};
+
+inline constexpr int JOB_KIND_COUNT = int( JobKind::Gc ) + 1;
+
+inline const char* jobKindName( JobKind kind ) {
+    static const char* names[ JOB_KIND_COUNT ] = {
+        "interrupt", "timer", "io", "normal", "microtask", "event", "gc"
+    };
+    return names[ int( kind ) ];
+}
+
+// A feature can observe the event loop by implementing the following methods
+// (all times are in microseconds):
+// - profileJob( JobKind kind, int64_t latency, int64_t duration ) is invoked
+//   after every job; latency is the time between scheduling and start
+// - profileFeature( int index, std::string_view name, int64_t duration ) is
+//   invoked after onEventLoop of every feature
+// The hooks cost nothing when no feature implements them.
+template < typename T, typename = void >
+struct HasEventLoopProfiling: std::false_type {};
+
+template < typename T >
+struct HasEventLoopProfiling< T, std::void_t< decltype( &T::profileJob ) > >:
+    std::true_type {};
+
+// A feature can manage the idle time of the machine (e.g., lower the CPU
+// frequency or allow light sleep) by implementing the following methods:
+// - enterIdle( int64_t deadline ) is invoked before the event loop waits for
+//   events; deadline is the requested wake up time (see requestWakeUpAt) or -1
+//   if the loop waits for events only
+// - leaveIdle() is invoked right after the event loop wakes up, before any
+//   event is processed
+// Only a single feature can implement the hooks.
+template < typename T, typename = void >
+struct HasIdleHooks: std::false_type {};
+
+template < typename T >
+struct HasIdleHooks< T, std::void_t< decltype( &T::enterIdle ) > >:
+    std::true_type {};
+
+// A feature can use the time when the event loop runs out of jobs (e.g., for
+// housekeeping) by implementing onIdle(). It is invoked before the event loop
+// waits for events, events posted meanwhile are processed afterwards. Only
+// a single feature can implement the method.
+template < typename T, typename = void >
+struct HasIdleWork: std::false_type {};
+
+template < typename T >
+struct HasIdleWork< T, std::void_t< decltype( &T::onIdle ) > >:
+    std::true_type {};
+
+// A feature can stop other tasks from calling into the machine (e.g., unset
+// wakers it handed out) by implementing onShutdown(). It is invoked at the
+// start of the machine destructor, while the Duktape heap and the members of
+// the machine are still alive; feature destructors run only after the members
+// are destroyed. Any number of features can implement it.
+template < typename T, typename = void >
+struct HasShutdown: std::false_type {};
+
+template < typename T >
+struct HasShutdown< T, std::void_t< decltype( &T::onShutdown ) > >:
+    std::true_type {};
+
+// The low-memory build (JAC_LOW_MEMORY) stores the heap pointers as offsets in
+// a single arena, so the machine has to allocate via ArenaAllocator, which
+// provides heapArena().
+template < typename T, typename = void >
+struct HasHeapArena: std::false_type {};
+
+template < typename T >
+struct HasHeapArena< T, std::void_t< decltype( &T::heapArena ) > >:
+    std::true_type {};
+
 template< template < typename > typename... Features >
 class JsMachineBase: public Features< JsMachineBase < Features... > >... {
 public:
@@ -26,13 +135,24 @@ public:
     struct Configuration:
         public Features< Self >::Configuration...
     {
-        int eventLoopLimit = 128;
-        int interruptQueueSize = 32;
+        int eventRingSize = 64;
+        // Budget of a single event loop iteration for non-interrupt jobs. The
+        // jobs left are run in the next iteration.
+        int jobBudget = 32;
+        int jobTimeBudget = 10000; // in microseconds
     };
 
+    // Event handlers are invoked from the event loop, so they can freely
+    // access the Duktape context
+    using EventHandler = void (*)( Self&, const MachineEvent& );
+
     JsMachineBase( Configuration cfg = Configuration() )
-        : _cfg( cfg ), _isrService( cfg.interruptQueueSize )
+        : _cfg( cfg ), _eventRing( cfg.eventRingSize )
     {
+#ifdef JAC_LOW_MEMORY
+        static_assert( HasHeapArena< Self >::value,
+            "The low-memory build requires ArenaAllocator" );
+#endif
         _context = duk_create_heap(
             Self::allocateMemory,
             Self::reallocateMemory,
@@ -42,13 +162,25 @@ public:
         );
         if ( !_context )
             throw std::runtime_error( "Cannot initialize Duktape context" );
-        // Create another thread for jobs and keep a reference
+        // Create threads holding the jobs and keep a reference to them
         duk_push_heap_stash( _context );
-        _nextJobs = duk_get_context( _context, duk_push_thread( _context ) );
-        duk_put_prop_string( _context, -2, "_nextJobsContext" );
+        duk_push_bare_array( _context );
+        int threadCount = 0;
+        auto createThread = [&]() {
+            duk_push_thread( _context );
+            auto *thread = duk_get_context( _context, -1 );
+            duk_put_prop_index( _context, -2, threadCount++ );
+            return thread;
+        };
+        for ( int i = 0; i != JOB_PRIORITY_COUNT; i++ ) {
+            _pendingJobs[ i ].jobs = createThread();
+            _runningJobs[ i ].jobs = createThread();
+        }
+        _microtasks.jobs = createThread();
+        duk_put_prop_string( _context, -2, "_jobQueues" );
         duk_pop( _context );
 
-        _eventsPending = xSemaphoreCreateCounting( _cfg.eventLoopLimit, 0 );
+        _eventsPending = xSemaphoreCreateBinary();
 
         ( Features< Self >::initialize(), ... );
     }
@@ -56,6 +188,7 @@ public:
     JsMachineBase( const JsMachineBase& ) = delete;
 
     ~JsMachineBase() {
+        ( _shutdownFeature< Features< Self > >(), ... );
         duk_destroy_heap( _context );
     }
 
@@ -80,77 +213,330 @@ public:
         duk_pop( _context );
     }
 
-    void finishEvent() {
-        bool ret = xSemaphoreTake( _eventsPending, 0 );
-        assert( ret && "There were no pending events." );
-    }
-
+    // Wake up the event loop
     void addEvent() {
         xSemaphoreGive( _eventsPending );
     }
 
-    void IRAM_ATTR handleInterrupt( freertos::IsrDeferrer::Handler h,
-                                    freertos::IsrDeferrer::Arg a )
-    {
-        _isrService.isr( h, a );
+    // Request the event loop to wake up no later than at given time (in
+    // microseconds, see esp_timer_get_time) even if there are no events. The
+    // request holds only for the nearest wait for events, so features should
+    // renew it in onEventLoop if they still need it.
+    void requestWakeUpAt( int64_t time ) {
+        if ( !_wakeUpRequested || time < _wakeUpTime )
+            _wakeUpTime = time;
+        _wakeUpRequested = true;
     }
 
-    // Schedule a new job. The function f will be invoked with a _nextJobs
-    // context and it should push function and arguments to it. Just like if
-    // duk_call should be called.
-    template < typename Fn >
-    void schedule( Fn f ) {
-        std::scoped_lock _( _globalLock );
-        auto stackSize = duk_get_top( _nextJobs );
-        f( _nextJobs );
-        auto pushedCount = duk_get_top( _nextJobs ) - stackSize;
+    // The wake up time requested for the nearest wait for events so far or -1
+    // if there is none
+    int64_t requestedWakeUp() const {
+        return _wakeUpRequested ? _wakeUpTime : -1;
+    }
+
+    // Register handler for events posted via postEvent and return its
+    // identifier. Handlers have to be registered during the initialization.
+    uint16_t registerEventHandler( EventHandler handler ) {
+        _eventHandlers.push_back( handler );
+        return _eventHandlers.size() - 1;
+    }
+
+    // Post an event to the event loop. The function does not take any lock and
+    // it can be called from interrupt handlers. Return false if the event ring
+    // is full; the event is dropped in such case.
+    bool IRAM_ATTR postEvent( const MachineEvent& event ) {
+        if ( !_eventRing.push( event ) ) {
+            _droppedEvents.fetch_add( 1, std::memory_order_relaxed );
+            return false;
+        }
+        // Wake up the event loop only if it has not been notified since it
+        // last drained the ring
+        if ( !_eventRingSignalled.exchange( true ) ) {
+            if ( xPortInIsrContext() ) {
+                BaseType_t higherPriorityTaskWoken = pdFALSE;
+                xSemaphoreGiveFromISR( _eventsPending, &higherPriorityTaskWoken );
+                if ( higherPriorityTaskWoken )
+                    portYIELD_FROM_ISR();
+            }
+            else
+                addEvent();
+        }
+        return true;
+    }
 
-        // Push number of arguments
-        duk_push_int( _nextJobs, pushedCount - 1 );
+    // Timestamp of the oldest event waiting for dispatch or -1 if there is
+    // none. Can be called only from the machine task.
+    int64_t pendingEventTime() const {
+        const MachineEvent *event = _eventRing.front();
+        return event ? event->timestamp : -1;
+    }
+
+    // Number of events dropped because the event ring was full
+    uint32_t droppedEvents() const {
+        return _droppedEvents.load( std::memory_order_relaxed );
+    }
 
-        // Mark the event
-        _jobsPending++;
+    // Schedule a new job. The function f will be invoked with a job context
+    // and it should push function and arguments to it. Just like if duk_call
+    // should be called. Jobs of the same priority are run in the order they
+    // were scheduled. The job context belongs to the Duktape heap, so it can be
+    // called only from the machine task; other tasks (and interrupts) post
+    // plain data via postEvent and schedule jobs from the event handler.
+    template < typename Fn >
+    void schedule( Fn f, JobPriority priority = JobPriority::Normal ) {
+        _pushJob( _pendingJobs[ int( priority ) ], f );
         addEvent();
     }
 
+    // Schedule a microtask (e.g., a promise reaction). Microtasks run after
+    // the currently running job, before any other job. Can be called only
+    // from the machine task. The function f behaves as in schedule.
+    template < typename Fn >
+    void scheduleMicrotask( Fn f ) {
+        _pushJob( _microtasks, f );
+    }
+
     void runEventLoop() {
         while ( !_shouldExit ) {
-            // Wait for some events
-            xSemaphoreTake( _eventsPending, portMAX_DELAY );
-            xSemaphoreGive( _eventsPending );
+            // Wait for some events or for the requested wake up
+            if constexpr ( _idleHooked() ) {
+                static_cast< Self& >( *this ).enterIdle( requestedWakeUp() );
+                xSemaphoreTake( _eventsPending, _waitTimeout() );
+                static_cast< Self& >( *this ).leaveIdle();
+            }
+            else
+                xSemaphoreTake( _eventsPending, _waitTimeout() );
+            _wakeUpRequested = false;
 
             // Process the events
-            (Features< Self >::onEventLoop(), ...);
-
-            // Run scheduled jobs
-            std::scoped_lock _( _globalLock );
-            while ( _jobsPending != 0 ) {
-                auto argCount = duk_require_int( _nextJobs, -1 );
-                duk_pop( _nextJobs );
-
-                duk_require_stack( _context, argCount + 1 );
-                duk_xmove_top( _context, _nextJobs, argCount + 1 );
-                if ( duk_pcall( _context, argCount ) != 0 ) {
-                    this->reportError( duk_safe_to_stacktrace( _context, -1) );
-                }
-                duk_pop( _context );
-
-                _jobsPending--;
-                finishEvent();
+            _dispatchRingEvents();
+            if constexpr ( _profiled() ) {
+                int featureIndex = 0;
+                ( _profiledOnEventLoop< Features >( featureIndex++ ), ... );
             }
+            else
+                (Features< Self >::onEventLoop(), ...);
+            _runMicrotasks();
+
+            // Run scheduled jobs; if the budget did not suffice, do not wait
+            // in the next iteration
+            if ( _runJobs() )
+                addEvent();
+            else if constexpr ( _idleWorked() )
+                static_cast< Self& >( *this ).onIdle();
+        }
+    }
+
+    // Make runEventLoop return after the current iteration. Can be called
+    // from any task.
+    void stopEventLoop() {
+        _shouldExit = true;
+        addEvent();
+    }
+
+    // Call function with given number of arguments on top of the stack of the
+    // main context. Report any error and discard the result.
+    void invoke( int argCount ) {
+        if ( duk_pcall( _context, argCount ) != 0 ) {
+            this->reportError( duk_safe_to_stacktrace( _context, -1) );
         }
+        duk_pop( _context );
     }
 
     duk_context *_context = nullptr;
-    duk_context *_nextJobs = nullptr;
     Configuration _cfg;
 protected:
-    bool _shouldExit = false;
-    SemaphoreHandle_t _eventsPending;
-    int _jobsPending = 0;
-    std::recursive_mutex _globalLock; // The mutex has to be recursive to properly implement scheduleJob
+    static constexpr int EVENT_BATCH_SIZE = 16;
+    static constexpr int JOB_PRIORITY_COUNT = int( JobPriority::Normal ) + 1;
+
+    // Jobs are stored in a thread one after another; each job consists of the
+    // function and its arguments
+    struct JobQueue {
+        duk_context *jobs = nullptr;
+        std::vector< int > argCounts;
+        std::vector< int64_t > scheduledAt; // Only when profiling
+        size_t next = 0; // Index of the next job to run
+        int offset = 0;  // Stack offset of the next job to run
+
+        bool empty() const { return next == argCounts.size(); }
+    };
+
+    static constexpr bool _profiled() {
+        return HasEventLoopProfiling< Self >::value;
+    }
+
+    static constexpr bool _idleHooked() {
+        return HasIdleHooks< Self >::value;
+    }
+
+    static constexpr bool _idleWorked() {
+        return HasIdleWork< Self >::value;
+    }
+
+    template < typename Feature >
+    void _shutdownFeature() {
+        if constexpr ( HasShutdown< Feature >::value )
+            Feature::onShutdown();
+    }
+
+    // Return name of the feature, e.g., "RtosTimers". We cannot rely on RTTI,
+    // so extract it from the signature of this function.
+    template < template < typename > typename Feature >
+    static std::string_view _featureName() {
+        std::string_view signature = __PRETTY_FUNCTION__;
+        auto start = signature.find( "Feature = " );
+        if ( start == std::string_view::npos )
+            return "unknown";
+        start += std::string_view( "Feature = " ).size();
+        auto end = signature.find_first_of( ";]", start );
+        auto name = signature.substr( start, end - start );
+        if ( name.substr( 0, 5 ) == "jac::" )
+            name.remove_prefix( 5 );
+        return name;
+    }
+
+    template < template < typename > typename Feature >
+    void _profiledOnEventLoop( int index ) {
+        int64_t start = esp_timer_get_time();
+        Feature< Self >::onEventLoop();
+        static_cast< Self& >( *this ).profileFeature( index,
+            _featureName< Feature >(), esp_timer_get_time() - start );
+    }
+
+    template < typename Fn >
+    static void _pushJob( JobQueue& q, Fn& f ) {
+        auto stackSize = duk_get_top( q.jobs );
+        f( q.jobs );
+        q.argCounts.push_back( duk_get_top( q.jobs ) - stackSize - 1 );
+        if constexpr ( _profiled() )
+            q.scheduledAt.push_back( esp_timer_get_time() );
+    }
+
+    void _runJob( JobQueue& q, JobKind kind ) {
+        int64_t scheduledAt = 0;
+        if constexpr ( _profiled() )
+            scheduledAt = q.scheduledAt[ q.next ];
+        int argCount = q.argCounts[ q.next++ ];
+        int base = q.offset;
+        q.offset += argCount + 1;
+
+        duk_require_stack( q.jobs, argCount + 1 );
+        for ( int i = 0; i <= argCount; i++ )
+            duk_dup( q.jobs, base + i );
+        duk_require_stack( _context, argCount + 1 );
+        duk_xmove_top( _context, q.jobs, argCount + 1 );
+        _profiledInvoke( argCount, kind, scheduledAt );
+
+        if ( q.empty() ) {
+            // Release references to the functions and the arguments
+            duk_set_top( q.jobs, 0 );
+            q.argCounts.clear();
+            q.scheduledAt.clear();
+            q.next = 0;
+            q.offset = 0;
+        }
+    }
+
+    void _profiledInvoke( int argCount, JobKind kind, int64_t scheduledAt ) {
+        if constexpr ( _profiled() ) {
+            int64_t start = esp_timer_get_time();
+            invoke( argCount );
+            static_cast< Self& >( *this ).profileJob( kind, start - scheduledAt,
+                esp_timer_get_time() - start );
+        }
+        else
+            invoke( argCount );
+    }
+
+    void _runMicrotasks() {
+        // Microtasks scheduled meanwhile are run as well
+        while ( !_microtasks.empty() )
+            _runJob( _microtasks, JobKind::Microtask );
+    }
+
+    // Run jobs according to their priority and the budget. Return true if
+    // there are jobs left.
+    bool _runJobs() {
+        // Take all the jobs scheduled so far, the jobs scheduled while running
+        // them wait for the next iteration. This keeps a job from starving the
+        // lower priorities by rescheduling itself.
+        for ( int i = 0; i != JOB_PRIORITY_COUNT; i++ ) {
+            if ( _runningJobs[ i ].empty() )
+                std::swap( _runningJobs[ i ], _pendingJobs[ i ] );
+        }
+
+        int64_t start = esp_timer_get_time();
+        int budget = _cfg.jobBudget;
+        for ( int i = 0; i != JOB_PRIORITY_COUNT; i++ ) {
+            JobQueue& q = _runningJobs[ i ];
+            bool limited = i != int( JobPriority::Interrupt );
+            while ( !q.empty() ) {
+                if ( limited && ( budget <= 0 || esp_timer_get_time() - start >= _cfg.jobTimeBudget ) )
+                    return true;
+                _runJob( q, JobKind( i ) );
+                _runMicrotasks();
+                budget--;
+            }
+        }
+        return false;
+    }
+
+    void _dispatchRingEvents() {
+        // Events posted from now on have to signal the loop again
+        _eventRingSignalled.store( false );
+
+        // Dispatch only events present in the ring now, so a flood of
+        // interrupts cannot starve the rest of the event loop
+        uint32_t remaining = _eventRing.capacity();
+        MachineEvent batch[ EVENT_BATCH_SIZE ];
+        while ( remaining != 0 ) {
+            uint32_t count = _eventRing.pop( batch,
+                std::min< uint32_t >( remaining, EVENT_BATCH_SIZE ) );
+            if ( count == 0 )
+                break;
+            remaining -= count;
+            for ( uint32_t i = 0; i != count; i++ ) {
+                const MachineEvent& e = batch[ i ];
+                assert( e.handler < _eventHandlers.size() );
+                if constexpr ( _profiled() ) {
+                    int64_t start = esp_timer_get_time();
+                    _eventHandlers[ e.handler ]( static_cast< Self& >( *this ), e );
+                    static_cast< Self& >( *this ).profileJob( JobKind::Event,
+                        start - e.timestamp, esp_timer_get_time() - start );
+                }
+                else
+                    _eventHandlers[ e.handler ]( static_cast< Self& >( *this ), e );
+                _runMicrotasks();
+            }
+        }
+        // Events left in the ring are handled in the next iteration
+        if ( remaining == 0 && !_eventRingSignalled.exchange( true ) )
+            addEvent();
+    }
+
+    TickType_t _waitTimeout() const {
+        if ( !_wakeUpRequested )
+            return portMAX_DELAY;
+        int64_t remaining = _wakeUpTime - esp_timer_get_time();
+        if ( remaining <= 0 )
+            return 0;
+        // Round up, so we do not wake up too early and spin
+        int64_t periodUs = portTICK_PERIOD_MS * 1000;
+        return ( remaining + periodUs - 1 ) / periodUs;
+    }
+
+    std::atomic< bool > _shouldExit = false;
+    bool _wakeUpRequested = false;
+    int64_t _wakeUpTime = 0;
+    SemaphoreHandle_t _eventsPending; // Binary semaphore waking the loop
+    JobQueue _pendingJobs[ JOB_PRIORITY_COUNT ];
+    JobQueue _runningJobs[ JOB_PRIORITY_COUNT ];
+    JobQueue _microtasks;
 
-    freertos::IsrDeferrer _isrService;
+    std::vector< EventHandler > _eventHandlers;
+    utility::EventRing< MachineEvent > _eventRing;
+    std::atomic< bool > _eventRingSignalled = false;
+    std::atomic< uint32_t > _droppedEvents = 0;
 };
 
 } // namespace jac
\ No newline at end of file
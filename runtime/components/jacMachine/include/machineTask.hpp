@@ -0,0 +1,57 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace jac {
+
+// Run a machine in its own FreeRTOS task pinned to the given core. The task
+// owns the machine: it constructs it from the configuration, calls setup
+// (e.g., to install extensions), evaluates the main module and runs the event
+// loop. A failure of the machine is reported and only its task ends; other
+// machines keep running.
+//
+// Return false if the task cannot be created.
+template < typename Machine >
+bool spawnMachine( const char *name, typename Machine::Configuration cfg,
+    std::string mainModule, BaseType_t core,
+    std::function< void( Machine& ) > setup = {},
+    uint32_t stackSize = 16384, UBaseType_t priority = 1 )
+{
+    struct Task {
+        std::string name;
+        typename Machine::Configuration cfg;
+        std::string mainModule;
+        std::function< void( Machine& ) > setup;
+
+        static void run( void *arg ) {
+            Task *task = static_cast< Task * >( arg );
+            try {
+                Machine machine( task->cfg );
+                if ( task->setup )
+                    task->setup( machine );
+                machine.evaluateMain( task->mainModule );
+                machine.runEventLoop();
+            }
+            catch( const std::exception& e ) {
+                std::cerr << "Machine " << task->name << " FAILED: " << e.what() << "\n";
+            }
+            delete task;
+            vTaskDelete( nullptr );
+        }
+    };
+
+    Task *task = new Task{ name, std::move( cfg ), std::move( mainModule ), std::move( setup ) };
+    if ( xTaskCreatePinnedToCore( Task::run, name, stackSize, task, priority, nullptr, core ) != pdPASS ) {
+        delete task;
+        return false;
+    }
+    return true;
+}
+
+} // namespace jac
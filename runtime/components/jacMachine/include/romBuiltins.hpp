@@ -0,0 +1,50 @@
+#pragma once
+
+#include <duktape.h>
+
+namespace jac {
+
+// Built-ins placed into Duktape ROM objects when the runtime is built with
+// JAC_ROM_BUILTINS (see rom/builtins.yml). The objects live in flash, so they
+// are neither built on every boot nor they take RAM; note that they are
+// read-only.
+//
+// ROM objects can refer only to plain native functions, therefore they call
+// trampolines (rom/natives.inc) that dispatch to the implementation registered
+// at runtime. The implementations are registered per Duktape heap, so
+// machines of different types can use the ROM built-ins at the same time. The
+// trampolines find the table of the heap by its udata (i.e., the machine)
+// without touching the heap; there can be at most a few heaps at once.
+// Duktape.errCreate does not depend on the machine, its trampoline calls
+// dukErrCreate directly.
+enum class RomNative {
+    PromiseConstructor,
+    PromiseResolve,
+    PromiseReject,
+    PromiseAll,
+    PromiseRace,
+    PromiseCatch,
+    PromiseThen,
+    Count
+};
+
+#ifdef JAC_ROM_BUILTINS
+inline constexpr bool romBuiltins = true;
+#else
+inline constexpr bool romBuiltins = false;
+#endif
+
+// Register the implementation of a ROM native for the heap of given context;
+// throw std::runtime_error if there is no space for another heap
+void registerRomNative( duk_context *ctx, RomNative native, duk_c_function function );
+// Release the natives of the heap with given udata once the heap is destroyed
+void unregisterRomNatives( void *udata );
+
+// Implementation of Duktape.errCreate appending the line number to the
+// message of created errors
+duk_ret_t dukErrCreate( duk_context *ctx );
+
+// Install Duktape.errCreate; does nothing if it is a ROM built-in
+void installErrCreate( duk_context *ctx );
+
+} // namespace jac
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <duktape.h>
+
+namespace jac {
+
+// Duktape runs the voluntary mark-and-sweep once the trigger counter of the
+// heap, decremented by each allocation, drops below zero; every collection
+// sets the counter again according to the size of the heap. The counter is
+// not a part of the Duktape API, so it is accessed by the functions below
+// implemented in src/voluntaryGc.inc, which is compiled as a part of the
+// Duktape translation unit. Without DUK_USE_VOLUNTARY_GC the getter returns 0
+// and the setter does nothing.
+int voluntaryGcTrigger( duk_context* ctx );
+void setVoluntaryGcTrigger( duk_context* ctx, int count );
+
+// Value of the trigger counter that practically never runs out
+inline constexpr int VOLUNTARY_GC_POSTPONED = 0x7FFFFFFF;
+
+} // namespace jac
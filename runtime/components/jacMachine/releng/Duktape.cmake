@@ -4,7 +4,12 @@ if (NOT ${Python2_FOUND})
 endif()
 
 function(duktape_library)
-    cmake_parse_arguments(A "" "TARGET;VERSION;CONFIGURATION" "" ${ARGN})
+    # BUILTINS is an optional file with user built-ins (passed to configure.py
+    # as --builtin-file); NATIVES are optional files compiled as a part of
+    # the Duktape translation unit, e.g., the native functions the built-ins
+    # refer to or code accessing the Duktape internals. CONFIGURATION takes
+    # one or more option files, the later ones override the earlier ones.
+    cmake_parse_arguments(A "" "TARGET;VERSION;BUILTINS" "CONFIGURATION;NATIVES" ${ARGN})
 
     FetchContent_Declare(
         duktape_${A_VERSION}
@@ -21,6 +26,16 @@ function(duktape_library)
     file(GLOB_RECURSE duktape_input_sources ${duktape_${A_VERSION}_SOURCE_DIR})
     set(DUKTAPE_CONFIGURED_DIR ${CMAKE_CURRENT_BINARY_DIR}/duktape)
 
+    set(DUKTAPE_OPTION_ARGS "")
+    foreach(option_file ${A_CONFIGURATION})
+        list(APPEND DUKTAPE_OPTION_ARGS --option-file ${option_file})
+    endforeach()
+
+    set(DUKTAPE_BUILTIN_ARGS "")
+    if(A_BUILTINS)
+        set(DUKTAPE_BUILTIN_ARGS --builtin-file ${A_BUILTINS})
+    endif()
+
     add_custom_command(
         COMMENT "Configuring duktape_${A_VERSION}"
         OUTPUT ${DUKTAPE_CONFIGURED_DIR}/duktape.h
@@ -30,17 +45,48 @@ function(duktape_library)
         COMMAND ${Python2_EXECUTABLE}
                     ${DUKTAPE_SOURCE}/tools/configure.py
                     --output-directory ${DUKTAPE_CONFIGURED_DIR}
-                    --rom-support --option-file ${A_CONFIGURATION}
+                    --rom-support ${DUKTAPE_OPTION_ARGS}
+                    ${DUKTAPE_BUILTIN_ARGS}
         COMMAND ${CMAKE_COMMAND} -E copy
                     ${DUKTAPE_CONFIGURED_DIR}/duktape.c
                     ${DUKTAPE_CONFIGURED_DIR}/duktape.cpp
         COMMAND ${CMAKE_COMMAND} -E remove ${DUKTAPE_CONFIGURED_DIR}/duktape.c
         WORKING_DIRECTORY ${DUKTAPE_SOURCE}
-        DEPENDS ${duktape_input_sources} ${A_CONFIGURATION})
+        DEPENDS ${duktape_input_sources} ${A_CONFIGURATION} ${A_BUILTINS})
 
-    add_library(duktape STATIC ${DUKTAPE_CONFIGURED_DIR}/duktape.cpp)
+    if(A_NATIVES)
+        set(DUKTAPE_UNIT ${DUKTAPE_CONFIGURED_DIR}/duktape_natives.cpp)
+        set(DUKTAPE_UNIT_SOURCE "#include \"duktape.cpp\"\n")
+        foreach(native ${A_NATIVES})
+            string(APPEND DUKTAPE_UNIT_SOURCE "#include \"${native}\"\n")
+        endforeach()
+        file(WRITE ${DUKTAPE_UNIT} ${DUKTAPE_UNIT_SOURCE})
+        set_source_files_properties(${DUKTAPE_UNIT} PROPERTIES
+            OBJECT_DEPENDS "${A_NATIVES}")
+        # Keep the generated source in the target, so it is generated first
+        set_source_files_properties(${DUKTAPE_CONFIGURED_DIR}/duktape.cpp PROPERTIES
+            HEADER_FILE_ONLY TRUE)
+    else()
+        set(DUKTAPE_UNIT "")
+    endif()
+
+    add_library(duktape STATIC ${DUKTAPE_CONFIGURED_DIR}/duktape.cpp ${DUKTAPE_UNIT})
     target_include_directories(${A_TARGET} PUBLIC ${DUKTAPE_CONFIGURED_DIR})
 
+    # Fingerprint of the configuration (version, options and built-ins), e.g.,
+    # for rejecting bytecode dumped by a differently configured build
+    set(DUKTAPE_CONFIG_INPUT ${A_VERSION})
+    foreach(input ${A_CONFIGURATION} ${A_BUILTINS})
+        file(READ ${input} input_content)
+        string(APPEND DUKTAPE_CONFIG_INPUT "\n${input_content}")
+    endforeach()
+    string(SHA256 DUKTAPE_CONFIG_HASH "${DUKTAPE_CONFIG_INPUT}")
+    string(SUBSTRING ${DUKTAPE_CONFIG_HASH} 0 8 DUKTAPE_CONFIG_HASH)
+    target_compile_definitions(${A_TARGET} PUBLIC
+        JAC_DUKTAPE_CONFIG_HASH=0x${DUKTAPE_CONFIG_HASH})
+    set_property(DIRECTORY APPEND PROPERTY CMAKE_CONFIGURE_DEPENDS
+        ${A_CONFIGURATION} ${A_BUILTINS})
+
     # Duktape triggers several warnings
     target_compile_options(${A_TARGET} PRIVATE
         -Wno-maybe-uninitialized
@@ -0,0 +1,52 @@
+#include <execInterrupt.hpp>
+
+#include <atomic>
+#include <stdexcept>
+
+namespace {
+
+struct HookEntry {
+    std::atomic< void* > udata = nullptr;
+    jac::ExecInterruptHook hook = nullptr;
+};
+
+// The registry is read from the executor of every heap, so it has to be cheap
+// and it cannot take any lock
+const int MAX_HOOKS = 4;
+HookEntry hooks[ MAX_HOOKS ];
+
+} // namespace
+
+void jac::registerExecInterruptHook( void* udata, ExecInterruptHook hook ) {
+    for ( HookEntry& e : hooks ) {
+        if ( e.udata.load() == udata ) {
+            e.hook = hook;
+            return;
+        }
+    }
+    for ( HookEntry& e : hooks ) {
+        if ( e.udata.load() == nullptr ) {
+            // Publish the hook before the entry can be matched
+            e.hook = hook;
+            e.udata.store( udata, std::memory_order_release );
+            return;
+        }
+    }
+    throw std::runtime_error( "Too many interrupt hooks" );
+}
+
+void jac::unregisterExecInterruptHook( void* udata ) {
+    for ( HookEntry& e : hooks ) {
+        if ( e.udata.load() == udata )
+            e.udata.store( nullptr );
+    }
+}
+
+// Called by Duktape, see DUK_USE_EXEC_TIMEOUT_CHECK in duktape.yml
+int jac_exec_timeout_check( void* udata ) {
+    for ( HookEntry& e : hooks ) {
+        if ( e.udata.load( std::memory_order_acquire ) == udata )
+            return e.hook( udata );
+    }
+    return 0;
+}
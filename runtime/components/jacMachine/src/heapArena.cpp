@@ -0,0 +1,268 @@
+#include <heapArena.hpp>
+#include <heapPointers.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+namespace {
+
+// Bits of a block header; the rest is the size of the block
+constexpr uint32_t USED = 1;
+constexpr uint32_t PREV_USED = 2;
+
+// Header, two links of the free list and the footer
+constexpr uint32_t MIN_BLOCK = 16;
+
+} // namespace
+
+extern "C" {
+    // The base of the compressed pointers, see attachPointerCompression
+    uint8_t *jac_arena_base = nullptr;
+    size_t jac_arena_size = 0;
+}
+
+// Blocks start at offsets 4 mod 8, so their payloads are aligned. The first
+// 4 bytes of the arena are unused, so no payload is encoded as 0. The arena
+// ends with the header of an empty used block, so the last block has a used
+// neighbour.
+jac::HeapArena::HeapArena( void* memory, size_t size ) {
+    auto address = reinterpret_cast< uintptr_t >( memory );
+    uintptr_t aligned = ( address + ALIGNMENT - 1 ) & ~uintptr_t( ALIGNMENT - 1 );
+    size_t padding = aligned - address;
+    _begin = reinterpret_cast< uint8_t* >( aligned );
+    _size = size > padding ? ( size - padding ) & ~( ALIGNMENT - 1 ) : 0;
+    _size = std::min< size_t >( _size, UINT32_MAX & ~uint32_t( ALIGNMENT - 1 ) );
+    if ( _size < MIN_BLOCK + 8 ) {
+        _size = 0;
+        return;
+    }
+    uint32_t blockSize = _size - 8;
+    _header( _size - 4 ) = USED;
+    _header( 4 ) = PREV_USED;
+    _insert( 4, blockSize );
+    _capacity = _freeSize = _minimumFreeSize = blockSize;
+}
+
+jac::HeapArena::~HeapArena() {
+    detachPointerCompression();
+}
+
+void* jac::HeapArena::allocate( size_t size ) {
+    if ( size == 0 || size > _capacity )
+        return nullptr;
+    uint32_t blockSize = std::max< uint32_t >( MIN_BLOCK, ( size + 4 + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 ) );
+    uint32_t block = _find( blockSize );
+    if ( !block )
+        return nullptr;
+    _remove( block );
+    _markUsed( block, _sizeOf( block ) );
+    _split( block, blockSize );
+    _minimumFreeSize = std::min( _minimumFreeSize, _freeSize );
+    return _payloadOf( block );
+}
+
+void* jac::HeapArena::reallocate( void* ptr, size_t size ) {
+    if ( !ptr )
+        return allocate( size );
+    if ( size == 0 ) {
+        release( ptr );
+        return nullptr;
+    }
+    if ( size > _capacity )
+        return nullptr;
+    uint32_t blockSize = std::max< uint32_t >( MIN_BLOCK, ( size + 4 + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 ) );
+    uint32_t block = _blockOf( ptr );
+    uint32_t current = _sizeOf( block );
+    if ( blockSize <= current ) {
+        _split( block, blockSize );
+        return ptr;
+    }
+
+    // Grow in place if the following block is free and large enough
+    uint32_t next = block + current;
+    if ( !( _header( next ) & USED ) && current + _sizeOf( next ) >= blockSize ) {
+        uint32_t nextSize = _sizeOf( next );
+        _remove( next );
+        _markUsed( next, nextSize );
+        _header( block ) = ( current + nextSize ) | ( _header( block ) & ( USED | PREV_USED ) );
+        _split( block, blockSize );
+        _minimumFreeSize = std::min( _minimumFreeSize, _freeSize );
+        return ptr;
+    }
+
+    void* moved = allocate( size );
+    if ( !moved )
+        return nullptr; // The original allocation is left untouched
+    std::memcpy( moved, ptr, current - 4 );
+    release( ptr );
+    return moved;
+}
+
+void jac::HeapArena::release( void* ptr ) {
+    if ( ptr )
+        _freeBlock( _blockOf( ptr ) );
+}
+
+size_t jac::HeapArena::largestFreeBlock() const {
+    if ( !_binMask )
+        return 0;
+    uint32_t largest = 0;
+    for ( uint32_t b = _bins[ 63 - __builtin_clzll( _binMask ) ]; b; b = _links( b )[ 0 ] )
+        largest = std::max( largest, _sizeOf( b ) );
+    return largest - 4;
+}
+
+bool jac::HeapArena::attachPointerCompression() {
+    if ( ( jac_arena_base && jac_arena_base != _begin ) || _size == 0 || _size > MAX_COMPRESSED_SIZE )
+        return false;
+    jac_arena_base = _begin;
+    jac_arena_size = _size;
+    return true;
+}
+
+void jac::HeapArena::detachPointerCompression() {
+    if ( jac_arena_base != _begin )
+        return;
+    jac_arena_base = nullptr;
+    jac_arena_size = 0;
+}
+
+int jac::HeapArena::_binOf( size_t size ) {
+    if ( size <= 256 )
+        return size / 8 - 2;
+    int magnitude = 31 - __builtin_clz( uint32_t( size ) );
+    return std::min( SMALL_BIN_COUNT + magnitude - 8, BIN_COUNT - 1 );
+}
+
+// Put the block to its free list; the PREV_USED bit of the header is kept
+void jac::HeapArena::_insert( uint32_t block, uint32_t size ) {
+    _header( block ) = size | ( _header( block ) & PREV_USED );
+    _header( block + size - 4 ) = size;
+    _header( block + size ) &= ~PREV_USED;
+
+    int bin = _binOf( size );
+    uint32_t* links = _links( block );
+    links[ 0 ] = _bins[ bin ];
+    links[ 1 ] = 0;
+    if ( _bins[ bin ] )
+        _links( _bins[ bin ] )[ 1 ] = block;
+    _bins[ bin ] = block;
+    _binMask |= uint64_t( 1 ) << bin;
+}
+
+void jac::HeapArena::_remove( uint32_t block ) {
+    int bin = _binOf( _sizeOf( block ) );
+    uint32_t next = _links( block )[ 0 ];
+    uint32_t prev = _links( block )[ 1 ];
+    if ( prev )
+        _links( prev )[ 0 ] = next;
+    else
+        _bins[ bin ] = next;
+    if ( next )
+        _links( next )[ 1 ] = prev;
+    if ( !_bins[ bin ] )
+        _binMask &= ~( uint64_t( 1 ) << bin );
+}
+
+// Mark a block taken out of a free list as used
+void jac::HeapArena::_markUsed( uint32_t block, uint32_t size ) {
+    _freeSize -= size;
+    _header( block ) |= USED;
+    _header( block + size ) |= PREV_USED;
+}
+
+// Find a free block of at least given size, return 0 if there is none. The
+// small lists hold blocks of a single size; in the list of the requested size
+// class we have to search for a large enough block, in the following ones any
+// block does.
+uint32_t jac::HeapArena::_find( uint32_t size ) {
+    int bin = _binOf( size );
+    if ( bin >= SMALL_BIN_COUNT ) {
+        for ( uint32_t b = _bins[ bin ]; b; b = _links( b )[ 0 ] ) {
+            if ( _sizeOf( b ) >= size )
+                return b;
+        }
+        bin++;
+    }
+    if ( bin >= BIN_COUNT )
+        return 0;
+    uint64_t candidates = _binMask & ( ~uint64_t( 0 ) << bin );
+    return candidates ? _bins[ __builtin_ctzll( candidates ) ] : 0;
+}
+
+// Shrink a used block to given size and free the rest if it is large enough
+void jac::HeapArena::_split( uint32_t block, uint32_t size ) {
+    uint32_t full = _sizeOf( block );
+    if ( full - size < MIN_BLOCK )
+        return;
+    _header( block ) = size | ( _header( block ) & ( USED | PREV_USED ) );
+    uint32_t rest = block + size;
+    _header( rest ) = ( full - size ) | USED | PREV_USED;
+    _freeBlock( rest );
+}
+
+// Free a used block and coalesce it with its free neighbours
+void jac::HeapArena::_freeBlock( uint32_t block ) {
+    uint32_t size = _sizeOf( block );
+    _freeSize += size;
+    uint32_t next = block + size;
+    if ( !( _header( next ) & USED ) ) {
+        size += _sizeOf( next );
+        _remove( next );
+    }
+    if ( !( _header( block ) & PREV_USED ) ) {
+        uint32_t prevSize = _header( block - 4 );
+        block -= prevSize;
+        size += prevSize;
+        _remove( block );
+    }
+    _insert( block, size );
+}
+
+#ifdef JAC_LOW_MEMORY
+
+namespace {
+
+struct RomPointers {
+    size_t count = 0;
+    bool sorted = true;
+};
+
+// The table is terminated by a null pointer. The pointers are usually sorted
+// by address, so they can be searched by bisection.
+RomPointers scanRomPointers() {
+    RomPointers rom;
+    std::less< const void* > less;
+    for ( ; duk_rom_compressed_pointers[ rom.count ]; rom.count++ ) {
+        if ( rom.count && !less( duk_rom_compressed_pointers[ rom.count - 1 ],
+                duk_rom_compressed_pointers[ rom.count ] ) )
+            rom.sorted = false;
+    }
+    return rom;
+}
+
+} // namespace
+
+uint16_t jac_heapptr_enc16_rom( const void *ptr ) {
+    static const RomPointers rom = scanRomPointers();
+    const void* const* begin = duk_rom_compressed_pointers;
+    const void* const* end = begin + rom.count;
+    const void* const* found;
+    if ( rom.sorted ) {
+        found = std::lower_bound( begin, end, ptr, std::less< const void* >() );
+        if ( found != end && *found != ptr )
+            found = end;
+    }
+    else
+        found = std::find( begin, end, ptr );
+    if ( found == end ) {
+        std::cerr << "Pointer " << ptr << " is outside of the heap arena\n";
+        std::abort();
+    }
+    return uint16_t( JAC_ROM_PTRCOMP_FIRST + ( found - begin ) );
+}
+
+#endif
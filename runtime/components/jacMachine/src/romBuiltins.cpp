@@ -0,0 +1,100 @@
+#include <romBuiltins.hpp>
+
+#include <atomic>
+#include <stdexcept>
+
+namespace {
+
+duk_ret_t augmentMessage( duk_context *ctx, void * ) {
+    duk_get_prop_string( ctx, 0, "message" );
+    duk_get_prop_string( ctx, 0, "lineNumber" );
+    if ( duk_is_undefined( ctx, -2 ) || !duk_is_number( ctx, -1 ) )
+        return 0;
+    duk_push_string( ctx, " (line " );
+    duk_swap_top( ctx, -2 );
+    duk_push_string( ctx, ")" );
+    duk_concat( ctx, 4 );
+    duk_put_prop_string( ctx, 0, "message" );
+    return 0;
+}
+
+struct NativeTable {
+    std::atomic< void* > udata = nullptr;
+    duk_c_function natives[ int( jac::RomNative::Count ) ] = {};
+};
+
+// The tables are looked up on every call of a ROM built-in, so they are kept
+// outside of the heaps and found by the udata of the heap (i.e., the machine).
+// A heap registers its natives from its own task, so a table is complete
+// before the heap can call it.
+const int MAX_HEAPS = 4;
+NativeTable tables[ MAX_HEAPS ];
+
+void *heapUdata( duk_context *ctx ) {
+    duk_memory_functions funs;
+    duk_get_memory_functions( ctx, &funs );
+    return funs.udata;
+}
+
+NativeTable *findTable( void *udata ) {
+    for ( NativeTable& t : tables ) {
+        if ( t.udata.load( std::memory_order_relaxed ) == udata )
+            return &t;
+    }
+    return nullptr;
+}
+
+} // namespace
+
+extern "C" {
+    // Used by the trampolines in rom/natives.inc; return nullptr if the
+    // native is not registered for the heap
+    duk_c_function jac_rom_native( duk_context *ctx, int native ) {
+        NativeTable *table = findTable( heapUdata( ctx ) );
+        return table ? table->natives[ native ] : nullptr;
+    }
+}
+
+void jac::registerRomNative( duk_context *ctx, RomNative native, duk_c_function function ) {
+    void *udata = heapUdata( ctx );
+    NativeTable *table = findTable( udata );
+    for ( NativeTable& t : tables ) {
+        if ( table )
+            break;
+        void *expected = nullptr;
+        // Machines on the other core might claim tables at the same time
+        if ( t.udata.compare_exchange_strong( expected, udata ) )
+            table = &t;
+    }
+    if ( !table )
+        throw std::runtime_error( "Too many heaps with ROM natives" );
+    table->natives[ int( native ) ] = function;
+}
+
+void jac::unregisterRomNatives( void *udata ) {
+    if ( NativeTable *table = findTable( udata ) ) {
+        for ( auto& native : table->natives )
+            native = nullptr;
+        table->udata.store( nullptr );
+    }
+}
+
+duk_ret_t jac::dukErrCreate( duk_context *ctx ) {
+    if ( duk_is_object( ctx, 0 ) ) {
+        // Ignore failures, e.g., when the message is not writable
+        duk_dup( ctx, 0 );
+        duk_safe_call( ctx, augmentMessage, nullptr, 1, 1 );
+        duk_pop( ctx );
+    }
+    duk_dup( ctx, 0 );
+    return 1;
+}
+
+void jac::installErrCreate( duk_context *ctx ) {
+    if constexpr ( romBuiltins )
+        return;
+    duk_get_global_string( ctx, "Duktape" );
+    duk_push_c_function( ctx, dukErrCreate, 1 );
+    duk_put_prop_string( ctx, -2, "errCreate" );
+    duk_pop( ctx );
+}
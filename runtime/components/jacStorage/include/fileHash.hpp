@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+namespace jac::storage {
+
+using FileDigest = std::array< uint8_t, 32 >; // SHA-256
+
+std::string digestToHex( const FileDigest& digest );
+
+// Compute the digest of the file content. Return false if the file cannot be
+// read.
+bool hashFile( const std::string& path, FileDigest& digest );
+
+// Compute digests of consecutive blocks of the file content; the last block
+// can be shorter. Return false if the file cannot be read.
+bool hashFileBlocks( const std::string& path, int blockSize,
+    const std::function< void( const FileDigest& ) >& yield );
+
+// Cache of file digests. An entry is valid as long as the file size and the
+// modification time do not change, so a warm query only reads the file
+// metadata. FAT stores the modification time with a 2-second resolution and
+// there is no RTC, so a rewrite of the same size can keep both; therefore
+// every writer has to invalidate the entry. The writers outside of the storage
+// report their writes via fs::fileChanged, which is connected to the cache by
+// initializeFatFs. The cache can be used from multiple tasks.
+class FileHashCache {
+public:
+    // Get the digest and the size of the file. Return false if the file
+    // cannot be read.
+    bool digest( const std::string& path, FileDigest& digest, off_t& size );
+    void invalidate( const std::string& path );
+
+private:
+    struct Entry {
+        off_t size;
+        time_t mtime;
+        FileDigest digest;
+    };
+
+    std::mutex _lock;
+    std::unordered_map< std::string, Entry > _entries;
+    uint32_t _generation = 0; // Incremented by every invalidation
+};
+
+FileHashCache& fileHashCache();
+
+} // namespace jac::storage
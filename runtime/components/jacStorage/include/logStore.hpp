@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <esp_partition.h>
+
+namespace jac::storage {
+
+// Label of the partition holding the telemetry log
+inline constexpr const char* TELEMETRY_PARTITION = "telemetry";
+
+// Append-only store of records in a raw flash partition, intended for
+// telemetry written at a high rate.
+//
+// The partition is split into segments of one flash sector. The segments form
+// a ring: records are appended to the head segment and once it is full, the
+// next segment becomes the head. The segment following the head is erased in
+// advance by prepare(), so append() does not wait for the erase (unless the
+// head fills up before prepare() is called); the oldest segment is dropped
+// when it is the one to be erased. Thus each sector is erased once per lap of
+// the ring, which spreads the wear evenly.
+//
+// Each segment starts with a header carrying an increasing sequence number.
+// Each record consists of its length, the inverted length and CRC-32 of the
+// payload; records are aligned to 4 bytes. Appended records are collected in
+// a RAM batch and written to the flash at once when the batch is full or on
+// flush(); records in the batch are lost on a reset.
+//
+// On opening, the store reads the segment headers to find the ring and scans
+// the record headers of the head segment to find the end of the log. A
+// record damaged by a reset is skipped while iterating.
+//
+// The store can be used from multiple tasks. The methods throw
+// std::runtime_error on flash failures.
+class LogStore {
+public:
+    static constexpr size_t MAX_RECORD_SIZE = 1024;
+
+    // Open the log in the partition with given label; if there is no such
+    // partition, the store stays closed
+    LogStore( const char* partitionLabel, size_t batchSize = 512 );
+    LogStore( const LogStore& ) = delete;
+    LogStore& operator=( const LogStore& ) = delete;
+
+    bool isOpen() const { return _partition; }
+
+    // Append a record of 1 to MAX_RECORD_SIZE bytes
+    void append( const uint8_t* data, size_t size );
+    // Write the batch to the flash
+    void flush();
+    // Erase the segment following the head unless it is erased already. The
+    // erase takes tens of milliseconds, call it outside of time-critical code.
+    void prepare();
+    // Number of bytes waiting in the batch
+    size_t batched() const;
+
+    // Invoke the callback for the records from the oldest one until it returns
+    // false. The log is not locked while the callback runs, so records can be
+    // appended meanwhile; records dropped from the ring meanwhile are skipped.
+    // Return the number of damaged records.
+    using Visitor = std::function< bool( const uint8_t*, size_t ) >;
+    uint32_t forEach( const Visitor& visitor );
+
+    // Remove all the records
+    void clear();
+
+    // Size of the space for records and the space used (in bytes)
+    size_t capacity() const;
+    size_t used() const;
+
+private:
+    struct SegmentHeader;
+    struct RecordHeader;
+
+    void _recover();
+    void _format();
+    void _startSegment( uint32_t segment, uint32_t sequence );
+    void _advanceSegment();
+    void _eraseNext();
+    void _flush();
+    uint32_t _segmentOf( uint32_t sequence ) const;
+    size_t _usedLocked() const;
+
+    const esp_partition_t* _partition = nullptr;
+    uint32_t _segmentCount = 0;
+
+    mutable std::mutex _lock;
+    // Sequence numbers of the oldest and the head segment
+    uint32_t _tailSequence = 0;
+    uint32_t _headSequence = 0;
+    uint32_t _head = 0;   // Index of the head segment
+    size_t _offset = 0;   // End of the log in the head segment
+    bool _nextErased = false;
+    std::unique_ptr< uint8_t[] > _batch;
+    size_t _batchCapacity;
+    size_t _batchUsed = 0;
+};
+
+// The telemetry log shared by the machine and the uploader, opened on the
+// first call
+LogStore& telemetryLog();
+
+} // namespace jac::storage
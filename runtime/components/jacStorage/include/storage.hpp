@@ -1,8 +1,15 @@
 #pragma once
 
+#include <packedImage.hpp>
+
 namespace jac::storage {
 
 void initializeFatFs( const char* path );
 void unmountPartition();
 
+// Memory-map a module image stored in a partition with given label. The
+// mapping lives until the program ends. If there is no such partition or
+// the partition does not contain a valid image, return an empty image.
+const fs::PackedImage& mapModuleImage( const char* partitionLabel );
+
 } // namespace jac::storage
\ No newline at end of file
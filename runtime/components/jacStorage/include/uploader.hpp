@@ -1,9 +1,67 @@
 #pragma once
 
+#include <driver/uart.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <utility>
+
 namespace jac::storage {
 
-void initializeUploader( const char *storagePrefix );
+// Label of the partition holding the packed module image
+inline constexpr const char* MODULE_IMAGE_PARTITION = "modules";
+
+// UART the uploader communicates over; has to match the UART used for stdio
+inline constexpr uart_port_t UPLOADER_UART = UART_NUM_0;
+
+// Default TCP port of the network uploader
+inline constexpr uint16_t NETWORK_UPLOADER_PORT = 17531;
+
+// Start the uploader task serving the UART; a session starts with
+// enterUploader(). The task calls sessionEnded, if given, after each session
+// (e.g., to enable the interrupt which called enterUploader again). The chip
+// does not enter light sleep during a session, as the UART cannot receive in
+// it.
+void initializeUploader( const char *storagePrefix, std::function< void() > sessionEnded = {} );
 void enterUploader();
+// Minimal length of the network uploader secret
+inline constexpr size_t MIN_UPLOADER_SECRET_LENGTH = 16;
+
+// Serve the uploader protocol over TCP on given port, one connection at
+// a time. The network is expected to be up. A connection is refused while
+// the UART uploader is active and vice versa the UART uploader waits for the
+// connection to finish.
+//
+// Whoever can use the uploader can replace the program, so a client has to
+// prove it knows the shared secret before any command is interpreted. The
+// uploader is not started if the secret is missing or shorter than
+// MIN_UPLOADER_SECRET_LENGTH. The traffic itself is not encrypted.
+void initializeNetworkUploader( uint16_t port, const char* secret );
 const char *getStoragePrefix();
 
+// Set function writing the event loop profile for the PROFILE command (see
+// EventLoopProfiler::writeProfile). Pass an empty function to unset it.
+using ProfileReporter = std::function< void( std::ostream& ) >;
+void setProfileReporter( ProfileReporter reporter );
+// Write the profile using the reporter, return false if there is none
+bool reportProfile( std::ostream& o );
+
+// Set the reporter for the lifetime of the object. The reporter usually
+// references the machine, so declare the guard after it: the reporter is then
+// unset before the machine is destroyed, also when an exception leaves the
+// scope.
+class ScopedProfileReporter {
+public:
+    explicit ScopedProfileReporter( ProfileReporter reporter ) {
+        setProfileReporter( std::move( reporter ) );
+    }
+    ~ScopedProfileReporter() {
+        setProfileReporter( {} );
+    }
+    ScopedProfileReporter( const ScopedProfileReporter& ) = delete;
+    ScopedProfileReporter& operator=( const ScopedProfileReporter& ) = delete;
+};
+
 } // namespace jac::storage
\ No newline at end of file
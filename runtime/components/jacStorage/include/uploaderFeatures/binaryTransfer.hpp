@@ -0,0 +1,420 @@
+#pragma once
+
+#include <uploader.hpp>
+
+#include <string>
+#include <string_view>
+#include <iostream>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <esp_rom_crc.h>
+
+extern "C" {
+    #include <esp_vfs.h>
+    #include <esp_vfs_fat.h>
+}
+
+#include <filesystem.hpp>
+#include <fileHash.hpp>
+
+namespace jac::storage {
+
+using namespace std::string_literals;
+
+// Implement the binary framed transfer mode of the uploader. The mode is
+// entered by the BINARY command; once the uploader replies "OK", both sides
+// exchange frames until the host sends the END frame.
+//
+// Frame layout (integers are little endian):
+// - magic byte 0xA5
+// - type: u8
+// - sequence number: u16
+// - payload length: u16 (at most MAX_PAYLOAD)
+// - payload
+// - CRC-32 of type, sequence number, length and payload: u32
+//
+// Host frames are numbered consecutively and processed strictly in order. The
+// uploader acknowledges every processed frame by an ACK frame carrying its
+// sequence number, so the host can keep a window of unacknowledged frames. A
+// corrupted or an out-of-order frame is answered by a NAK frame carrying the
+// expected sequence number; the host then resends the frames starting with
+// the expected one. Duplicate frames are acknowledged again, but not
+// processed.
+//
+// Host frames:
+// - OPEN: payload is mode (u8, 0 write, 1 read or 2 patch) and the path. When
+//   reading, the uploader acknowledges the frame and then it sends the file
+//   content as DATA frames terminated by an empty DATA frame. In the patch
+//   mode, the path is preceded by the final size of the file (u32) and the
+//   existing file is rewritten in place, so only the changed ranges (see the
+//   HASH command) have to be sent.
+// - DATA: content of the file opened for writing
+// - SEEK: payload is the offset (u32) of the following data, patch mode only
+// - CLOSE: finish writing the file
+// - END: leave the binary mode
+//
+// Uploader frames: ACK, NAK, DATA (file content) and ERROR (payload is the
+// error message; the sequence number is of the failed frame, the frame is
+// still considered processed).
+template < typename Self >
+class BinaryTransfer {
+public:
+    static constexpr uint8_t FRAME_MAGIC = 0xA5;
+    static constexpr int MAX_PAYLOAD = 1024;
+
+    enum FrameType: uint8_t {
+        FRAME_OPEN = 0x01,
+        FRAME_DATA = 0x02,
+        FRAME_CLOSE = 0x03,
+        FRAME_END = 0x04,
+        FRAME_SEEK = 0x05,
+        FRAME_ACK = 0x10,
+        FRAME_NAK = 0x11,
+        FRAME_ERROR = 0x12
+    };
+
+    enum OpenMode: uint8_t {
+        OPEN_WRITE = 0,
+        OPEN_READ = 1,
+        OPEN_PATCH = 2
+    };
+
+    Self& self() {
+        return *static_cast< Self* >( this );
+    }
+
+    // Serve frames until the END frame is received or the host stops sending
+    void runBinarySession() {
+        self().output() << "OK\n";
+        self().flushOutput( SESSION_TIMEOUT );
+
+        _rx.reset( new uint8_t[ RX_BUFFER_SIZE ] );
+        _payload.reset( new uint8_t[ MAX_PAYLOAD ] );
+        _rxBegin = _rxEnd = 0;
+        _expectedSeq = 0;
+        _nakSent = false;
+
+        while ( true ) {
+            uint8_t type;
+            uint16_t seq, length;
+            switch ( _readFrame( type, seq, length ) ) {
+                case ReadResult::Timeout:
+                    _closeFile();
+                    return;
+                case ReadResult::Corrupted:
+                    _nak();
+                    continue;
+                case ReadResult::Valid:
+                    break;
+            }
+            int16_t diff = int16_t( seq - _expectedSeq );
+            if ( diff < 0 ) {
+                // Our acknowledgement probably got lost
+                _sendFrame( FRAME_ACK, uint16_t( _expectedSeq - 1 ), nullptr, 0 );
+                continue;
+            }
+            if ( diff > 0 ) {
+                _nak();
+                continue;
+            }
+            _expectedSeq++;
+            _nakSent = false;
+            if ( !_processFrame( type, seq, length ) )
+                return;
+        }
+    }
+
+private:
+    static constexpr int RX_BUFFER_SIZE = 2048;
+    static constexpr int HEADER_SIZE = 6;
+    // The host sends frames continuously during a transfer, a longer pause
+    // means it is gone
+    static constexpr TickType_t SESSION_TIMEOUT = pdMS_TO_TICKS( 10000 );
+
+    enum class ReadResult { Valid, Corrupted, Timeout };
+
+    // Return false if the session should end
+    bool _processFrame( uint8_t type, uint16_t seq, uint16_t length ) {
+        switch ( type ) {
+            case FRAME_OPEN:
+                _open( seq, length );
+                return true;
+            case FRAME_DATA:
+                _write( seq, length );
+                return true;
+            case FRAME_SEEK:
+                _seek( seq, length );
+                return true;
+            case FRAME_CLOSE:
+                _commit( seq );
+                return true;
+            case FRAME_END:
+                _closeFile();
+                _ack( seq );
+                // Let the host read the acknowledgement before it switches
+                // back to the text mode
+                self().flushOutput( SESSION_TIMEOUT );
+                return false;
+            default:
+                _error( seq, "Unknown frame type" );
+                return true;
+        }
+    }
+
+    void _open( uint16_t seq, uint16_t length ) {
+        _closeFile();
+        if ( length < 2 ) {
+            _error( seq, "Missing path" );
+            return;
+        }
+        uint8_t mode = _payload[ 0 ];
+        int pathOffset = mode == OPEN_PATCH ? 5 : 1;
+        if ( length <= pathOffset ) {
+            _error( seq, "Missing path" );
+            return;
+        }
+        _targetPath = Self::fsPath( std::string(
+            reinterpret_cast< const char* >( _payload.get() + pathOffset ), length - pathOffset ) );
+        if ( mode == OPEN_READ ) {
+            int fd = open( _targetPath.c_str(), O_RDONLY );
+            if ( fd < 0 ) {
+                _error( seq, std::strerror( errno ) );
+                return;
+            }
+            _ack( seq );
+            _sendFile( fd );
+            close( fd );
+            return;
+        }
+        if ( mode != OPEN_WRITE && mode != OPEN_PATCH ) {
+            _error( seq, "Unknown open mode" );
+            return;
+        }
+        _patching = mode == OPEN_PATCH;
+        if ( _patching ) {
+            _patchSize = _readU32( _payload.get() + 1 );
+            _fd = open( _targetPath.c_str(), O_WRONLY );
+        }
+        else
+            _fd = open( Self::workingFilename().c_str(), O_TRUNC | O_WRONLY | O_CREAT );
+        if ( _fd < 0 ) {
+            _error( seq, std::strerror( errno ) );
+            return;
+        }
+        _sector.reset( new uint8_t[ CONFIG_WL_SECTOR_SIZE ] );
+        _sectorFill = 0;
+        _writeFailed = false;
+        _ack( seq );
+    }
+
+    // Collect data into a sector-sized buffer, so the filesystem is written
+    // whole sectors at once
+    void _write( uint16_t seq, uint16_t length ) {
+        if ( _fd < 0 ) {
+            _error( seq, "No file is open for writing" );
+            return;
+        }
+        int offset = 0;
+        while ( offset != length ) {
+            int chunk = std::min< int >( length - offset, CONFIG_WL_SECTOR_SIZE - _sectorFill );
+            memcpy( _sector.get() + _sectorFill, _payload.get() + offset, chunk );
+            _sectorFill += chunk;
+            offset += chunk;
+            if ( _sectorFill == CONFIG_WL_SECTOR_SIZE )
+                _flushSector();
+        }
+        if ( _writeFailed ) {
+            _error( seq, std::strerror( errno ) );
+            return;
+        }
+        _ack( seq );
+    }
+
+    void _seek( uint16_t seq, uint16_t length ) {
+        if ( _fd < 0 || !_patching ) {
+            _error( seq, "No file is open for patching" );
+            return;
+        }
+        if ( length != 4 ) {
+            _error( seq, "Invalid seek" );
+            return;
+        }
+        _flushSector();
+        if ( !_writeFailed && lseek( _fd, _readU32( _payload.get() ), SEEK_SET ) < 0 )
+            _writeFailed = true;
+        if ( _writeFailed ) {
+            _error( seq, std::strerror( errno ) );
+            return;
+        }
+        _ack( seq );
+    }
+
+    void _flushSector() {
+        if ( _sectorFill != 0 && !_writeFailed ) {
+            if ( ::write( _fd, _sector.get(), _sectorFill ) != _sectorFill )
+                _writeFailed = true;
+        }
+        _sectorFill = 0;
+    }
+
+    void _commit( uint16_t seq ) {
+        if ( _fd < 0 ) {
+            _error( seq, "No file is open for writing" );
+            return;
+        }
+        _flushSector();
+        close( _fd );
+        _fd = -1;
+        _sector.reset();
+        fileHashCache().invalidate( _targetPath );
+        if ( _writeFailed ) {
+            _error( seq, std::strerror( errno ) );
+            return;
+        }
+        if ( _patching ) {
+            if ( truncate( _targetPath.c_str(), _patchSize ) < 0 ) {
+                _error( seq, "Cannot finalize patch: "s + std::strerror( errno ) );
+                return;
+            }
+            _ack( seq );
+            return;
+        }
+        if ( !jac::fs::ensurePath( _targetPath ) ) {
+            _error( seq, "Cannot create path " + _targetPath + ": " + std::strerror( errno ) );
+            return;
+        }
+        remove( _targetPath.c_str() );
+        if ( rename( Self::workingFilename().c_str(), _targetPath.c_str() ) < 0 ) {
+            _error( seq, "Cannot finalize push: "s + std::strerror( errno ) );
+            return;
+        }
+        _ack( seq );
+    }
+
+    // Abandon the session without committing it. An interrupted patch leaves
+    // the target partially written, so its cached digest is stale.
+    void _closeFile() {
+        if ( _fd >= 0 ) {
+            close( _fd );
+            _fd = -1;
+            fileHashCache().invalidate( _targetPath );
+        }
+        _sector.reset();
+    }
+
+    void _sendFile( int fd ) {
+        uint16_t seq = 0;
+        int bytesRead;
+        while ( ( bytesRead = read( fd, _payload.get(), MAX_PAYLOAD ) ) > 0 )
+            _sendFrame( FRAME_DATA, seq++, _payload.get(), bytesRead );
+        _sendFrame( FRAME_DATA, seq, nullptr, 0 );
+    }
+
+    void _ack( uint16_t seq ) {
+        _sendFrame( FRAME_ACK, seq, nullptr, 0 );
+    }
+
+    // Report the expected frame once per gap, so a burst of frames following
+    // a lost one does not produce a burst of NAKs
+    void _nak() {
+        if ( _nakSent )
+            return;
+        _nakSent = true;
+        _sendFrame( FRAME_NAK, _expectedSeq, nullptr, 0 );
+    }
+
+    void _error( uint16_t seq, std::string_view message ) {
+        _sendFrame( FRAME_ERROR, seq, message.data(),
+            std::min< size_t >( message.size(), MAX_PAYLOAD ) );
+    }
+
+    static uint32_t _readU32( const uint8_t* data ) {
+        return data[ 0 ] | data[ 1 ] << 8 | data[ 2 ] << 16 | uint32_t( data[ 3 ] ) << 24;
+    }
+
+    static uint32_t _crc( uint32_t crc, const void* data, size_t size ) {
+        return esp_rom_crc32_le( crc, static_cast< const uint8_t* >( data ), size );
+    }
+
+    void _sendFrame( uint8_t type, uint16_t seq, const void* payload, uint16_t length ) {
+        uint8_t header[ HEADER_SIZE + 1 ] = {
+            FRAME_MAGIC, type,
+            uint8_t( seq ), uint8_t( seq >> 8 ),
+            uint8_t( length ), uint8_t( length >> 8 )
+        };
+        uint32_t crc = _crc( 0, header + 1, HEADER_SIZE - 1 );
+        crc = _crc( crc, payload, length );
+        uint8_t trailer[ 4 ] = {
+            uint8_t( crc ), uint8_t( crc >> 8 ), uint8_t( crc >> 16 ), uint8_t( crc >> 24 )
+        };
+        self().writeBytes( header, HEADER_SIZE );
+        if ( length )
+            self().writeBytes( payload, length );
+        self().writeBytes( trailer, 4 );
+    }
+
+    // Read a frame; the payload is stored in _payload
+    ReadResult _readFrame( uint8_t& type, uint16_t& seq, uint16_t& length ) {
+        // Find the start of a frame first
+        uint8_t byte;
+        do {
+            if ( !_readExactly( &byte, 1 ) )
+                return ReadResult::Timeout;
+        } while ( byte != FRAME_MAGIC );
+
+        uint8_t header[ HEADER_SIZE - 1 ];
+        if ( !_readExactly( header, sizeof( header ) ) )
+            return ReadResult::Timeout;
+        type = header[ 0 ];
+        seq = header[ 1 ] | header[ 2 ] << 8;
+        length = header[ 3 ] | header[ 4 ] << 8;
+        // A corrupted length would make us lose the following frames
+        if ( length > MAX_PAYLOAD )
+            return ReadResult::Corrupted;
+
+        uint8_t trailer[ 4 ];
+        if ( !_readExactly( _payload.get(), length ) || !_readExactly( trailer, 4 ) )
+            return ReadResult::Timeout;
+        uint32_t crc = _crc( 0, header, sizeof( header ) );
+        crc = _crc( crc, _payload.get(), length );
+        return crc == _readU32( trailer ) ? ReadResult::Valid : ReadResult::Corrupted;
+    }
+
+    // Read from the transport in large blocks - take everything available at once
+    bool _readExactly( uint8_t* buffer, int size ) {
+        while ( size > 0 ) {
+            if ( _rxBegin == _rxEnd ) {
+                _rxBegin = _rxEnd = 0;
+                int bytesRead = self().readBytes( _rx.get(), RX_BUFFER_SIZE, SESSION_TIMEOUT );
+                if ( bytesRead <= 0 )
+                    return false;
+                _rxEnd = bytesRead;
+            }
+            int chunk = std::min( size, _rxEnd - _rxBegin );
+            memcpy( buffer, _rx.get() + _rxBegin, chunk );
+            _rxBegin += chunk;
+            buffer += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+
+    std::unique_ptr< uint8_t[] > _rx;
+    int _rxBegin = 0;
+    int _rxEnd = 0;
+    std::unique_ptr< uint8_t[] > _payload;
+    uint16_t _expectedSeq = 0;
+    bool _nakSent = false;
+
+    int _fd = -1;
+    std::string _targetPath;
+    std::unique_ptr< uint8_t[] > _sector;
+    int _sectorFill = 0;
+    bool _writeFailed = false;
+    bool _patching = false;
+    uint32_t _patchSize = 0;
+};
+
+} // namespace jac::storage
@@ -13,9 +13,12 @@ extern "C" {
     #include <esp_vfs.h>
     #include <esp_vfs_fat.h>
     #include <esp_system.h>
+    #include <esp_partition.h>
 }
 
 #include <filesystem.hpp>
+#include <fileHash.hpp>
+#include <logStore.hpp>
 #include <jacUtility.hpp>
 
 
@@ -46,19 +49,58 @@ public:
                 if ( jac::utility::startswith( entityName, "__" ) )
                     return;
                 if ( type == FileType::Directory )
-                    std::cout << "D";
+                    self().output() << "D";
                 else if ( type == FileType::File )
-                    std::cout << "F";
+                    self().output() << "F";
                 else
-                    std::cout << "?";
+                    self().output() << "?";
 
-                std::cout << " " << std::string_view( path ).substr( prefixLen )
-                          << "/" << entityName << "\n";
+                self().output() << " " << std::string_view( path ).substr( prefixLen )
+                                << "/" << entityName << "\n";
             },
             [&]( const std::string& error ) {
                 self().yieldError( error );
             });
-        std::cout << "\n";
+        self().output() << "\n";
+    }
+
+    // Print "<path> <size> <sha256>" for every file (as listed by doList)
+    // terminated by an empty line. Digests are served from the hash cache.
+    void doManifest( const std::string& prefix ) {
+        using namespace jac::fs;
+        const int prefixLen = strlen( getStoragePrefix() ) + 1;
+        listDirectory( getStoragePrefix() + prefix,
+            [&]( FileType type, const std::string& path, const std::string& entityName ) {
+                if ( type != FileType::File || jac::utility::startswith( entityName, "__" ) )
+                    return;
+                FileDigest digest;
+                off_t size;
+                if ( !fileHashCache().digest( path + "/" + entityName, digest, size ) ) {
+                    self().yieldError( "Cannot read " + entityName + ": " + std::strerror( errno ) );
+                    return;
+                }
+                self().output() << std::string_view( path ).substr( prefixLen ) << "/" << entityName
+                                << " " << size << " " << digestToHex( digest ) << "\n";
+            },
+            [&]( const std::string& error ) {
+                self().yieldError( error );
+            });
+        self().output() << "\n";
+    }
+
+    // Print the SHA-256 digests of the file blocks, one per line, terminated
+    // by an empty line. A client can use them to transfer only the changed
+    // blocks (see BinaryTransfer).
+    void doHash( const std::string& filename, int blockSize ) {
+        bool success = hashFileBlocks( fsPath( filename ), blockSize,
+            [&]( const FileDigest& digest ) {
+                self().output() << digestToHex( digest ) << "\n";
+            });
+        if ( !success ) {
+            self().yieldError( std::strerror( errno ) );
+            return;
+        }
+        self().output() << "\n";
     }
 
     void doPull( const std::string& filename ) {
@@ -81,18 +123,19 @@ public:
                 encBuffer.get(), ENCODED_SIZE, &proccessed,
                 fileBuffer.get(), bytesRead );
             assert( result != MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL );
-            std::cout.write( reinterpret_cast< char * >( encBuffer.get() ), proccessed );
+            self().output().write( reinterpret_cast< char * >( encBuffer.get() ), proccessed );
         }
-        std::cout << "\n";
+        self().output() << "\n";
 
         close( fd );
     }
 
     void doRemove( const std::string& filename ) {
         const auto filePath = fsPath( filename );
+        fileHashCache().invalidate( filePath );
         if ( remove( filePath.c_str() ) < 0 )
             self().yieldError( std::strerror( errno ) );
-        std::cout << "OK\n";
+        self().output() << "OK\n";
     }
 
     void startFilePush() {
@@ -117,6 +160,7 @@ public:
         _workingFd = -1;
 
         auto path = fsPath( filename );
+        fileHashCache().invalidate( path );
         if ( !jac::fs::ensurePath( path ) )
             self().yieldError( "Cannot create path " + path + ": " + std::strerror( errno ) );
         remove( path.c_str() );
@@ -128,11 +172,55 @@ public:
         int res = rename( workingFilename().c_str(), path.c_str() );
         if ( res < 0 )
             self().yieldError( "Cannot finalize push: "s + std::strerror( errno ));
-        std::cout << "OK\n";
+        self().output() << "OK\n";
+    }
+
+    // Start writing a module image (see fs::PackedImage) into the module
+    // partition. The whole partition is erased first. Return false on error.
+    bool startImagePush() {
+        _imagePartition = esp_partition_find_first(
+            ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, MODULE_IMAGE_PARTITION );
+        if ( !_imagePartition ) {
+            self().yieldError( "There is no partition for module image"s );
+            return false;
+        }
+        esp_err_t res = esp_partition_erase_range( _imagePartition, 0, _imagePartition->size );
+        if ( res != ESP_OK ) {
+            self().yieldError( "Cannot erase image partition: "s + esp_err_to_name( res ) );
+            _imagePartition = nullptr;
+            return false;
+        }
+        _imageOffset = 0;
+        return true;
+    }
+
+    void addImageChunk( unsigned char* buffer, int size ) {
+        if ( !_imagePartition )
+            return; // The error was already reported
+        if ( _imageOffset + size > _imagePartition->size ) {
+            self().yieldError( "Image does not fit into the partition" );
+            _imagePartition = nullptr;
+            return;
+        }
+        esp_err_t res = esp_partition_write( _imagePartition, _imageOffset, buffer, size );
+        if ( res != ESP_OK ) {
+            self().yieldError( "Cannot write image: "s + esp_err_to_name( res ) );
+            _imagePartition = nullptr;
+            return;
+        }
+        _imageOffset += size;
+    }
+
+    // The new image is used after restart
+    void commitImagePush() {
+        if ( !_imagePartition )
+            return;
+        _imagePartition = nullptr;
+        self().output() << "OK\n";
     }
 
     void performExit() {
-        std::cout << "OK\n";
+        self().output() << "OK\n";
         _finished = true;
     }
 
@@ -148,11 +236,49 @@ public:
         }
         int totalSectors = (fs->n_fatent - 2) * fs->csize;
         int freeSectors = freeClusters * fs->csize;
-        std::cout << freeSectors * CONFIG_WL_SECTOR_SIZE << " "
-                  << totalSectors * CONFIG_WL_SECTOR_SIZE << "\n";
+        self().output() << freeSectors * CONFIG_WL_SECTOR_SIZE << " "
+                        << totalSectors * CONFIG_WL_SECTOR_SIZE << "\n";
+    }
+
+    // Print the event loop profile terminated by an empty line
+    void doProfile() {
+        if ( !reportProfile( self().output() ) ) {
+            self().yieldError( "Profiling is not enabled" );
+            return;
+        }
+        self().output() << "\n";
+    }
+
+    // Print the records of the telemetry log, one base64-encoded record per
+    // line, terminated by an empty line. Clear the log afterwards if asked.
+    void doTelemetry( bool clear ) {
+        LogStore& log = telemetryLog();
+        if ( !log.isOpen() ) {
+            self().yieldError( "There is no telemetry partition" );
+            return;
+        }
+        const int ENCODED_SIZE = 4 * ( LogStore::MAX_RECORD_SIZE + 2 ) / 3 + 1;
+        std::unique_ptr< unsigned char[] > encBuffer( new unsigned char[ ENCODED_SIZE ] );
+        try {
+            log.forEach( [&]( const uint8_t* data, size_t size ) {
+                size_t proccessed;
+                int result = mbedtls_base64_encode(
+                    encBuffer.get(), ENCODED_SIZE, &proccessed, data, size );
+                assert( result != MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL );
+                self().output().write( reinterpret_cast< char * >( encBuffer.get() ), proccessed );
+                self().output() << "\n";
+                return true;
+            } );
+            if ( clear )
+                log.clear();
+        }
+        catch ( const std::runtime_error& e ) {
+            self().yieldError( e.what() );
+            return;
+        }
+        self().output() << "\n";
     }
 
-private:
     static std::string workingFilename() {
         return getStoragePrefix() + "/__tmp.txt"s;
     }
@@ -165,8 +291,12 @@ private:
         return path;
     }
 
+private:
+
     bool _finished = false;
     int _workingFd = -1;
+    const esp_partition_t* _imagePartition = nullptr;
+    size_t _imageOffset = 0;
 };
 
 } // namespace jac::storage
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdlib>
 #include <memory>
 #include <string>
 #include <mbedtls/base64.h>
@@ -35,14 +36,26 @@ public:
         discardWhitespace();
         if ( command == "LIST" )
             return interpretList();
+        if ( command == "MANIFEST" )
+            return interpretManifest();
+        if ( command == "HASH" )
+            return interpretHash();
         if ( command == "PULL" )
             return interpretPull();
         if ( command == "PUSH" )
             return interpretPush();
+        if ( command == "IMAGE" )
+            return interpretImage();
         if ( command == "REMOVE" )
             return interpretRemove();
         if ( command == "STATS" )
             return interpretStats();
+        if ( command == "PROFILE" )
+            return interpretProfile();
+        if ( command == "TELEMETRY" )
+            return interpretTelemetry();
+        if ( command == "BINARY" )
+            return interpretBinary();
         if ( command == "EXIT" )
             return interpretExit();
         if ( !command.empty() )
@@ -58,6 +71,33 @@ public:
         discardRest();
     }
 
+    void interpretManifest() {
+        std::string prefix = readWord();
+        if ( prefix.empty() || prefix.front() != '/' )
+            prefix.insert( 0, "/" );
+        self().doManifest( prefix );
+        discardRest();
+    }
+
+    void interpretHash() {
+        std::string filename = readWord();
+        if ( filename.empty() ) {
+            self().yieldError( "Missing name of the file to hash" );
+            discardRest();
+            return;
+        }
+        discardWhitespace();
+        std::string blockSize = readWord();
+        int size = blockSize.empty() ? 0 : atoi( blockSize.c_str() );
+        if ( size <= 0 ) {
+            self().yieldError( "Invalid block size '" + blockSize + "'" );
+            discardRest();
+            return;
+        }
+        self().doHash( filename, size );
+        discardRest();
+    }
+
     void interpretPull() {
         std::string filename = readWord();
         if ( filename.empty() ) {
@@ -77,7 +117,30 @@ public:
             return;
         }
         self().startFilePush();
+        bool success = readBase64Content( [&]( unsigned char* buffer, int size ) {
+            self().addFileChunk( buffer, size );
+        } );
+        if ( success )
+            self().commitFilePush( filename );
+    }
+
+    void interpretImage() {
+        if ( !self().startImagePush() ) {
+            discardRest();
+            return;
+        }
+        bool success = readBase64Content( [&]( unsigned char* buffer, int size ) {
+            self().addImageChunk( buffer, size );
+        } );
+        if ( success )
+            self().commitImagePush();
+    }
 
+    // Read base64 encoded content terminated by a newline and pass the decoded
+    // data in blocks to yield. Return true if the whole content was read
+    // correctly, in such case the newline is also consumed.
+    template < typename Yield >
+    bool readBase64Content( Yield yield ) {
         discardWhitespace();
         const int BLOCK_SIZE = 63;
         std::string chunk;
@@ -94,18 +157,21 @@ public:
             if ( retcode == MBEDTLS_ERR_BASE64_INVALID_CHARACTER ) {
                 self().yieldError( "Invalid characted in base64 encoding specified" );
                 discardRest();
-                return;
+                return false;
             }
-            self().addFileChunk( chunkBuffer.get(), chunklength );
+            yield( chunkBuffer.get(), chunklength );
         } while ( !chunk.empty() );
+        // The content is incomplete, there is nobody to report to
+        if ( self().inputClosed() )
+            return false;
 
         discardWhitespace();
         if ( !shift('\n') ) {
             self().yieldError(" Nothing was expected" );
             discardRest();
-            return;
+            return false;
         }
-        self().commitFilePush( filename );
+        return true;
     }
 
     void interpretRemove() {
@@ -129,6 +195,30 @@ public:
         discardRest();
     }
 
+    void interpretProfile() {
+        self().doProfile();
+        discardRest();
+    }
+
+    // TELEMETRY [CLEAR]: stream the telemetry log, optionally clear it then
+    void interpretTelemetry() {
+        std::string option = readWord();
+        if ( !option.empty() && option != "CLEAR" ) {
+            self().yieldError( "Unknown option '" + option + "'" );
+            discardRest();
+            return;
+        }
+        self().doTelemetry( option == "CLEAR" );
+        discardRest();
+    }
+
+    // Switch to the binary transfer mode (see BinaryTransfer) until the host
+    // ends the session
+    void interpretBinary() {
+        discardRest();
+        self().runBinarySession();
+    }
+
     // Consume rest of the command
     void discardRest() {
         while ( self().read() != '\n' );
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <freertos/FreeRTOS.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+
+namespace jac::storage {
+
+// Output buffer sending its content to a connected socket. Once sending
+// fails, the output is discarded.
+class SocketBuffer: public std::streambuf {
+public:
+    SocketBuffer() {
+        setp( _buffer, _buffer + sizeof( _buffer ) );
+    }
+
+    void attach( int socket ) {
+        _socket = socket;
+        setp( _buffer, _buffer + sizeof( _buffer ) );
+    }
+
+protected:
+    int overflow( int c ) override {
+        if ( sync() < 0 )
+            return traits_type::eof();
+        if ( !traits_type::eq_int_type( c, traits_type::eof() ) ) {
+            *pptr() = traits_type::to_char_type( c );
+            pbump( 1 );
+        }
+        return traits_type::not_eof( c );
+    }
+
+    int sync() override {
+        bool sent = _send( pbase(), pptr() - pbase() );
+        setp( _buffer, _buffer + sizeof( _buffer ) );
+        return sent ? 0 : -1;
+    }
+
+private:
+    bool _send( const char* data, size_t size ) {
+        while ( size > 0 && _socket >= 0 ) {
+            int sent = ::send( _socket, data, size, 0 );
+            if ( sent < 0 && errno == EINTR )
+                continue;
+            if ( sent <= 0 )
+                _socket = -1;
+            else {
+                data += sent;
+                size -= sent;
+            }
+        }
+        return _socket >= 0;
+    }
+
+    // One TCP segment
+    char _buffer[ 1460 ];
+    int _socket = -1;
+};
+
+// Read the uploader input from a connected TCP socket. The pending output is
+// flushed whenever the reader has to wait for the input, so replies to
+// a command are sent at once and binary acknowledgements are batched.
+//
+// A closed connection reads as an endless sequence of newlines, so the
+// interpreter finishes the current command; see inputClosed(). A connection
+// idle for IDLE_TIMEOUT in the text mode is considered closed.
+template < typename Self >
+class SocketReader {
+public:
+    Self& self() {
+        return *static_cast< Self* >( this );
+    }
+
+    // Read from given socket; the socket is not owned
+    void attachInput( int socket ) {
+        _inputSocket = socket;
+        _inputBegin = _inputEnd = 0;
+        _inputClosed = false;
+    }
+
+    char read() {
+        if ( !_fillInput( IDLE_TIMEOUT, true ) )
+            return '\n';
+        return _input[ _inputBegin++ ];
+    }
+
+    char peek() {
+        if ( !_fillInput( IDLE_TIMEOUT, true ) )
+            return '\n';
+        return _input[ _inputBegin ];
+    }
+
+    bool inputClosed() const {
+        return _inputClosed;
+    }
+
+    // Read at least one and at most size bytes, wait at most timeout for the
+    // first one. Return the number of bytes read, 0 on timeout.
+    int readBytes( uint8_t* buffer, int size, TickType_t timeout ) {
+        if ( !_fillInput( timeout, false ) )
+            return 0;
+        int chunk = std::min( size, _inputEnd - _inputBegin );
+        std::memcpy( buffer, _input + _inputBegin, chunk );
+        _inputBegin += chunk;
+        return chunk;
+    }
+
+private:
+    static constexpr TickType_t IDLE_TIMEOUT = pdMS_TO_TICKS( 5 * 60 * 1000 );
+
+    // Return false if there is no input
+    bool _fillInput( TickType_t timeout, bool closeOnTimeout ) {
+        if ( _inputBegin != _inputEnd )
+            return true;
+        if ( _inputClosed )
+            return false;
+        self().output().flush();
+
+        pollfd request{ _inputSocket, POLLIN, 0 };
+        int ready;
+        do {
+            ready = poll( &request, 1, timeout * portTICK_PERIOD_MS );
+        } while ( ready < 0 && errno == EINTR );
+        if ( ready == 0 ) {
+            _inputClosed = closeOnTimeout;
+            return false;
+        }
+        int received = ready < 0 ? -1 : recv( _inputSocket, _input, sizeof( _input ), 0 );
+        if ( received <= 0 ) {
+            _inputClosed = true;
+            return false;
+        }
+        _inputBegin = 0;
+        _inputEnd = received;
+        return true;
+    }
+
+    int _inputSocket = -1;
+    char _input[ 1460 ];
+    int _inputBegin = 0;
+    int _inputEnd = 0;
+    bool _inputClosed = false;
+};
+
+// Write the uploader output to a connected TCP socket. Both the text and the
+// binary output go through one buffer, which is sent when it is full or when
+// SocketReader waits for the input.
+template < typename Self >
+class SocketReporter {
+public:
+    // Write to given socket; the socket is not owned
+    void attachOutput( int socket ) {
+        _outputBuffer.attach( socket );
+        _outputStream.clear();
+    }
+
+    void yieldError( const std::string& s ) {
+        _outputStream << "ERROR " << s << "\n";
+    }
+
+    void yieldWarning( const std::string& s ) {
+        _outputStream << "WARNING " << s << "\n";
+    }
+
+    std::ostream& output() {
+        return _outputStream;
+    }
+
+    void writeBytes( const void* data, size_t size ) {
+        _outputStream.write( static_cast< const char* >( data ), size );
+    }
+
+    // Sending over a blocking socket waits until the data are passed to the
+    // TCP stack, which then delivers them reliably
+    void flushOutput( TickType_t ) {
+        _outputStream.flush();
+    }
+
+private:
+    SocketBuffer _outputBuffer;
+    std::ostream _outputStream{ &_outputBuffer };
+};
+
+} // namespace jac::storage
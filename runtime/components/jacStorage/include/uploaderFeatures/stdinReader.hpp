@@ -1,9 +1,16 @@
 #pragma once
 
+#include <uploader.hpp>
+
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
+#include <freertos/FreeRTOS.h>
 
 namespace jac::storage {
 
+// Read the uploader input from stdin. The text commands are read via stdio,
+// the binary transfer reads the UART directly.
 template < typename Self >
 class StdinReader {
 public:
@@ -17,6 +24,20 @@ public:
         ungetc( c, stdin );
         return c;
     }
+
+    // The UART is never closed
+    bool inputClosed() const {
+        return false;
+    }
+
+    // Read at least one and at most size bytes, wait at most timeout for the
+    // first one. Return the number of bytes read, 0 on timeout.
+    int readBytes( uint8_t* buffer, int size, TickType_t timeout ) {
+        size_t available = 0;
+        uart_get_buffered_data_len( UPLOADER_UART, &available );
+        int toRead = std::clamp< int >( available, 1, size );
+        return std::max( uart_read_bytes( UPLOADER_UART, buffer, toRead, timeout ), 0 );
+    }
 };
 
-} // namespace jac::storage
\ No newline at end of file
+} // namespace jac::storage
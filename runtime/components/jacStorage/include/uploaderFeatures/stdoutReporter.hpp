@@ -1,9 +1,15 @@
 #pragma once
 
+#include <uploader.hpp>
+
+#include <cstdio>
 #include <iostream>
+#include <freertos/FreeRTOS.h>
 
 namespace jac::storage {
 
+// Write the uploader output to stdout. The binary transfer writes the UART
+// directly.
 template < typename Self >
 class StdoutReporter {
 public:
@@ -15,6 +21,21 @@ public:
         std::cout << "WARNING " << s << "\n";
     }
 
+    std::ostream& output() {
+        return std::cout;
+    }
+
+    // Write raw data; the text output has to be flushed before
+    void writeBytes( const void* data, size_t size ) {
+        uart_write_bytes( UPLOADER_UART, data, size );
+    }
+
+    // Wait at most timeout until all the output is sent
+    void flushOutput( TickType_t timeout ) {
+        std::cout.flush();
+        fflush( stdout );
+        uart_wait_tx_done( UPLOADER_UART, timeout );
+    }
 };
 
-} // namespace jac::storage
\ No newline at end of file
+} // namespace jac::storage
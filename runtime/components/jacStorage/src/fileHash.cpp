@@ -0,0 +1,141 @@
+#include <fileHash.hpp>
+
+#include <mbedtls/sha256.h>
+
+#include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+const int READ_BUFFER_SIZE = 1024;
+
+jac::storage::FileHashCache hashCache;
+
+class Sha256 {
+public:
+    Sha256() {
+        mbedtls_sha256_init( &_ctx );
+        mbedtls_sha256_starts_ret( &_ctx, 0 );
+    }
+
+    ~Sha256() {
+        mbedtls_sha256_free( &_ctx );
+    }
+
+    void update( const unsigned char* data, size_t size ) {
+        mbedtls_sha256_update_ret( &_ctx, data, size );
+    }
+
+    jac::storage::FileDigest finish() {
+        jac::storage::FileDigest digest;
+        mbedtls_sha256_finish_ret( &_ctx, digest.data() );
+        mbedtls_sha256_starts_ret( &_ctx, 0 );
+        return digest;
+    }
+
+private:
+    mbedtls_sha256_context _ctx;
+};
+
+} // namespace
+
+std::string jac::storage::digestToHex( const FileDigest& digest ) {
+    static const char* DIGITS = "0123456789abcdef";
+    std::string hex;
+    hex.reserve( 2 * digest.size() );
+    for ( uint8_t byte : digest ) {
+        hex.push_back( DIGITS[ byte >> 4 ] );
+        hex.push_back( DIGITS[ byte & 0xF ] );
+    }
+    return hex;
+}
+
+bool jac::storage::hashFile( const std::string& path, FileDigest& digest ) {
+    int fd = open( path.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+    std::unique_ptr< unsigned char[] > buffer( new unsigned char[ READ_BUFFER_SIZE ] );
+    Sha256 sha;
+    int bytesRead;
+    while ( ( bytesRead = read( fd, buffer.get(), READ_BUFFER_SIZE ) ) > 0 )
+        sha.update( buffer.get(), bytesRead );
+    close( fd );
+    if ( bytesRead < 0 )
+        return false;
+    digest = sha.finish();
+    return true;
+}
+
+bool jac::storage::hashFileBlocks( const std::string& path, int blockSize,
+    const std::function< void( const FileDigest& ) >& yield )
+{
+    int fd = open( path.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return false;
+    std::unique_ptr< unsigned char[] > buffer( new unsigned char[ READ_BUFFER_SIZE ] );
+    Sha256 sha;
+    int blockFill = 0;
+    int bytesRead;
+    while ( ( bytesRead = read( fd, buffer.get(),
+        std::min( READ_BUFFER_SIZE, blockSize - blockFill ) ) ) > 0 )
+    {
+        sha.update( buffer.get(), bytesRead );
+        blockFill += bytesRead;
+        if ( blockFill == blockSize ) {
+            yield( sha.finish() );
+            blockFill = 0;
+        }
+    }
+    close( fd );
+    if ( bytesRead < 0 )
+        return false;
+    if ( blockFill != 0 )
+        yield( sha.finish() );
+    return true;
+}
+
+bool jac::storage::FileHashCache::digest( const std::string& path,
+    FileDigest& digest, off_t& size )
+{
+    uint32_t generation;
+    {
+        std::scoped_lock _( _lock );
+        generation = _generation;
+    }
+    struct stat fileStat;
+    if ( stat( path.c_str(), &fileStat ) < 0 )
+        return false;
+    size = fileStat.st_size;
+    {
+        std::scoped_lock _( _lock );
+        auto it = _entries.find( path );
+        if ( it != _entries.end()
+            && it->second.size == fileStat.st_size
+            && it->second.mtime == fileStat.st_mtime )
+        {
+            digest = it->second.digest;
+            return true;
+        }
+    }
+    // Do not hold the lock while reading the file
+    if ( !hashFile( path, digest ) )
+        return false;
+    std::scoped_lock _( _lock );
+    // The file might have been written while hashing it
+    if ( _generation == generation )
+        _entries[ path ] = { fileStat.st_size, fileStat.st_mtime, digest };
+    return true;
+}
+
+void jac::storage::FileHashCache::invalidate( const std::string& path ) {
+    std::scoped_lock _( _lock );
+    _entries.erase( path );
+    _generation++;
+}
+
+jac::storage::FileHashCache& jac::storage::fileHashCache() {
+    return hashCache;
+}
@@ -0,0 +1,291 @@
+#include <logStore.hpp>
+
+#include <esp_rom_crc.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+using namespace std::string_literals;
+
+namespace {
+
+constexpr size_t SEGMENT_SIZE = SPI_FLASH_SEC_SIZE;
+constexpr uint32_t SEGMENT_MAGIC = 0x4a4c4f47; // "JLOG"
+constexpr uint16_t ERASED_LENGTH = 0xFFFF;
+
+size_t align4( size_t size ) {
+    return ( size + 3 ) & ~size_t( 3 );
+}
+
+void check( esp_err_t result, const char* operation ) {
+    if ( result != ESP_OK )
+        throw std::runtime_error( "Cannot "s + operation + " telemetry log: " + esp_err_to_name( result ) );
+}
+
+} // namespace
+
+struct jac::storage::LogStore::SegmentHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t sequenceCheck; // Inverted sequence
+    uint32_t reserved;
+
+    bool valid() const {
+        return magic == SEGMENT_MAGIC && sequenceCheck == ~sequence;
+    }
+};
+
+struct jac::storage::LogStore::RecordHeader {
+    uint16_t length;
+    uint16_t lengthCheck; // Inverted length
+    uint32_t crc;         // Of the payload
+
+    bool erased() const {
+        return length == ERASED_LENGTH && lengthCheck == ERASED_LENGTH && crc == 0xFFFFFFFF;
+    }
+
+    bool valid( size_t space ) const {
+        return lengthCheck == uint16_t( ~length ) && length <= MAX_RECORD_SIZE
+            && align4( sizeof( RecordHeader ) + length ) <= space;
+    }
+};
+
+jac::storage::LogStore::LogStore( const char* partitionLabel, size_t batchSize )
+    : _batchCapacity( std::max( batchSize, align4( sizeof( RecordHeader ) + MAX_RECORD_SIZE ) ) )
+{
+    const esp_partition_t* partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel );
+    if ( !partition || partition->size / SEGMENT_SIZE < 2 )
+        return;
+    _partition = partition;
+    _segmentCount = partition->size / SEGMENT_SIZE;
+    _batch.reset( new uint8_t[ _batchCapacity ] );
+    _recover();
+}
+
+void jac::storage::LogStore::append( const uint8_t* data, size_t size ) {
+    if ( size == 0 || size > MAX_RECORD_SIZE )
+        throw std::runtime_error( "Telemetry record has to have 1 to "
+            + std::to_string( MAX_RECORD_SIZE ) + " bytes" );
+    std::scoped_lock _( _lock );
+    if ( !_partition )
+        throw std::runtime_error( "There is no telemetry partition" );
+
+    size_t recordSize = align4( sizeof( RecordHeader ) + size );
+    if ( _offset + _batchUsed + recordSize > SEGMENT_SIZE ) {
+        _flush();
+        _advanceSegment();
+    }
+    if ( _batchUsed + recordSize > _batchCapacity )
+        _flush();
+
+    RecordHeader header{ uint16_t( size ), uint16_t( ~size ), esp_rom_crc32_le( 0, data, size ) };
+    uint8_t* record = _batch.get() + _batchUsed;
+    std::memcpy( record, &header, sizeof( header ) );
+    std::memcpy( record + sizeof( header ), data, size );
+    std::memset( record + sizeof( header ) + size, 0xFF, recordSize - sizeof( header ) - size );
+    _batchUsed += recordSize;
+}
+
+void jac::storage::LogStore::flush() {
+    std::scoped_lock _( _lock );
+    _flush();
+}
+
+void jac::storage::LogStore::prepare() {
+    std::scoped_lock _( _lock );
+    if ( _partition && !_nextErased )
+        _eraseNext();
+}
+
+size_t jac::storage::LogStore::batched() const {
+    std::scoped_lock _( _lock );
+    return _batchUsed;
+}
+
+uint32_t jac::storage::LogStore::forEach( const Visitor& visitor ) {
+    if ( !_partition )
+        return 0;
+    std::unique_ptr< uint8_t[] > segment( new uint8_t[ SEGMENT_SIZE ] );
+    uint32_t damaged = 0;
+    uint32_t sequence;
+    {
+        std::scoped_lock _( _lock );
+        _flush();
+        sequence = _tailSequence;
+    }
+    while ( true ) {
+        // Copy the segment, so the callback runs without the lock
+        size_t end;
+        {
+            std::scoped_lock _( _lock );
+            if ( int32_t( sequence - _headSequence ) > 0 )
+                break;
+            // The ring has wrapped meanwhile
+            if ( int32_t( sequence - _tailSequence ) < 0 )
+                sequence = _tailSequence;
+            _flush();
+            end = sequence == _headSequence ? _offset : SEGMENT_SIZE;
+            check( esp_partition_read( _partition, _segmentOf( sequence ) * SEGMENT_SIZE,
+                segment.get(), end ), "read" );
+        }
+        size_t offset = sizeof( SegmentHeader );
+        while ( offset + sizeof( RecordHeader ) <= end ) {
+            RecordHeader header;
+            std::memcpy( &header, segment.get() + offset, sizeof( header ) );
+            if ( header.erased() )
+                break;
+            if ( !header.valid( end - offset ) ) {
+                // The rest of the segment cannot be parsed
+                damaged++;
+                break;
+            }
+            const uint8_t* payload = segment.get() + offset + sizeof( header );
+            offset += align4( sizeof( header ) + header.length );
+            if ( esp_rom_crc32_le( 0, payload, header.length ) != header.crc ) {
+                damaged++;
+                continue;
+            }
+            if ( !visitor( payload, header.length ) )
+                return damaged;
+        }
+        sequence++;
+    }
+    return damaged;
+}
+
+void jac::storage::LogStore::clear() {
+    std::scoped_lock _( _lock );
+    if ( !_partition )
+        return;
+    _batchUsed = 0;
+    check( esp_partition_erase_range( _partition, 0, _partition->size ), "erase" );
+    _format();
+    _nextErased = true;
+}
+
+size_t jac::storage::LogStore::capacity() const {
+    return _segmentCount * ( SEGMENT_SIZE - sizeof( SegmentHeader ) );
+}
+
+size_t jac::storage::LogStore::used() const {
+    std::scoped_lock _( _lock );
+    return _usedLocked();
+}
+
+size_t jac::storage::LogStore::_usedLocked() const {
+    if ( !_partition )
+        return 0;
+    size_t fullSegments = _headSequence - _tailSequence;
+    return fullSegments * ( SEGMENT_SIZE - sizeof( SegmentHeader ) )
+        + _offset + _batchUsed - sizeof( SegmentHeader );
+}
+
+void jac::storage::LogStore::_recover() {
+    // Find the head as the segment with the highest sequence number
+    std::unique_ptr< SegmentHeader[] > headers( new SegmentHeader[ _segmentCount ] );
+    bool found = false;
+    for ( uint32_t i = 0; i != _segmentCount; i++ ) {
+        check( esp_partition_read( _partition, i * SEGMENT_SIZE, &headers[ i ],
+            sizeof( SegmentHeader ) ), "read" );
+        if ( !headers[ i ].valid() )
+            continue;
+        if ( !found || int32_t( headers[ i ].sequence - _headSequence ) > 0 ) {
+            _head = i;
+            _headSequence = headers[ i ].sequence;
+        }
+        found = true;
+    }
+    if ( !found ) {
+        check( esp_partition_erase_range( _partition, 0, SEGMENT_SIZE ), "erase" );
+        _format();
+        return;
+    }
+
+    // The log continues backwards while the sequence numbers decrease by one
+    _tailSequence = _headSequence;
+    for ( uint32_t i = 1; i != _segmentCount; i++ ) {
+        const SegmentHeader& previous = headers[ ( _head + _segmentCount - i ) % _segmentCount ];
+        if ( !previous.valid() || previous.sequence != _tailSequence - 1 )
+            break;
+        _tailSequence--;
+    }
+
+    // Find the end of the log in the head segment
+    std::unique_ptr< uint8_t[] > segment( new uint8_t[ SEGMENT_SIZE ] );
+    check( esp_partition_read( _partition, _head * SEGMENT_SIZE, segment.get(), SEGMENT_SIZE ), "read" );
+    _offset = sizeof( SegmentHeader );
+    while ( _offset + sizeof( RecordHeader ) <= SEGMENT_SIZE ) {
+        RecordHeader header;
+        std::memcpy( &header, segment.get() + _offset, sizeof( header ) );
+        if ( header.erased() )
+            break;
+        if ( !header.valid( SEGMENT_SIZE - _offset ) ) {
+            // Do not write after a damaged header, continue in a new segment
+            _offset = SEGMENT_SIZE;
+            break;
+        }
+        _offset += align4( sizeof( header ) + header.length );
+    }
+
+    // The segment following the head was possibly erased in advance; a
+    // partially erased one (by a reset) is erased again
+    uint32_t next = ( _head + 1 ) % _segmentCount;
+    check( esp_partition_read( _partition, next * SEGMENT_SIZE, segment.get(), SEGMENT_SIZE ), "read" );
+    _nextErased = std::all_of( segment.get(), segment.get() + SEGMENT_SIZE,
+        []( uint8_t byte ) { return byte == 0xFF; } );
+}
+
+// Start the log in the first segment; it has to be erased
+void jac::storage::LogStore::_format() {
+    _nextErased = false;
+    _head = 0;
+    _tailSequence = _headSequence = 1;
+    _startSegment( 0, 1 );
+}
+
+void jac::storage::LogStore::_startSegment( uint32_t segment, uint32_t sequence ) {
+    SegmentHeader header{ SEGMENT_MAGIC, sequence, ~sequence, 0xFFFFFFFF };
+    check( esp_partition_write( _partition, segment * SEGMENT_SIZE, &header, sizeof( header ) ), "write" );
+    _offset = sizeof( SegmentHeader );
+}
+
+void jac::storage::LogStore::_advanceSegment() {
+    // Erase synchronously only if prepare() did not make it in time
+    if ( !_nextErased )
+        _eraseNext();
+    _nextErased = false;
+    _head = ( _head + 1 ) % _segmentCount;
+    _headSequence++;
+    _startSegment( _head, _headSequence );
+}
+
+void jac::storage::LogStore::_eraseNext() {
+    uint32_t next = ( _head + 1 ) % _segmentCount;
+    // Drop the oldest segment if it is the next one
+    if ( _headSequence - _tailSequence + 1 == _segmentCount )
+        _tailSequence++;
+    check( esp_partition_erase_range( _partition, next * SEGMENT_SIZE, SEGMENT_SIZE ), "erase" );
+    _nextErased = true;
+}
+
+void jac::storage::LogStore::_flush() {
+    if ( _batchUsed == 0 )
+        return;
+    size_t size = _batchUsed;
+    // The batch is dropped even if it cannot be written
+    _batchUsed = 0;
+    check( esp_partition_write( _partition, _head * SEGMENT_SIZE + _offset, _batch.get(), size ), "write" );
+    _offset += size;
+}
+
+uint32_t jac::storage::LogStore::_segmentOf( uint32_t sequence ) const {
+    return ( _head + _segmentCount - ( _headSequence - sequence ) % _segmentCount ) % _segmentCount;
+}
+
+jac::storage::LogStore& jac::storage::telemetryLog() {
+    static LogStore log( TELEMETRY_PARTITION );
+    return log;
+}
@@ -1,4 +1,6 @@
 #include <storage.hpp>
+#include <fileHash.hpp>
+#include <filesystem.hpp>
 
 // There are missing guards, fixed in
 // https://github.com/espressif/esp-idf/commit/cbf207bfb83156ece449a10908cad0615d66ec52
@@ -6,13 +8,19 @@ extern "C" {
     #include <esp_vfs.h>
     #include <esp_vfs_fat.h>
     #include <esp_system.h>
+    #include <esp_partition.h>
 }
 
+#include <iostream>
+
 namespace {
 
 wl_handle_t s_wl_handle = WL_INVALID_HANDLE;
 const char *base_path = nullptr;
 
+jac::fs::PackedImage moduleImage;
+spi_flash_mmap_handle_t moduleImageHandle;
+
 } // namespace
 
 void jac::storage::initializeFatFs( const char* path ) {
@@ -24,8 +32,35 @@ void jac::storage::initializeFatFs( const char* path ) {
     base_path = path;
 
     ESP_ERROR_CHECK( esp_vfs_fat_spiflash_mount(path, "storage", &mountConfig, &s_wl_handle) );
+    fs::setFileChangeListener( []( const std::string& changedPath ) {
+        fileHashCache().invalidate( changedPath );
+    } );
 }
 
 void jac::storage::unmountPartition() {
     ESP_ERROR_CHECK( esp_vfs_fat_spiflash_unmount( base_path, s_wl_handle ) );
 }
+
+const jac::fs::PackedImage& jac::storage::mapModuleImage( const char* partitionLabel ) {
+    const esp_partition_t* partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel );
+    if ( !partition )
+        return moduleImage;
+
+    // Read the header first, so we do not map more than we need
+    fs::PackedImage::Header header;
+    ESP_ERROR_CHECK( esp_partition_read( partition, 0, &header, sizeof( header ) ) );
+    if ( !fs::PackedImage::isImage( &header, partition->size ) )
+        return moduleImage;
+
+    const void* data;
+    ESP_ERROR_CHECK( esp_partition_mmap( partition, 0, header.size,
+        SPI_FLASH_MMAP_DATA, &data, &moduleImageHandle ) );
+    try {
+        moduleImage = fs::PackedImage( data, header.size );
+    } catch ( const std::runtime_error& e ) {
+        std::cout << "Ignoring module image: " << e.what() << "\n";
+        spi_flash_munmap( moduleImageHandle );
+    }
+    return moduleImage;
+}
@@ -1,14 +1,34 @@
+#include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#if CONFIG_PM_ENABLE
+    #include <esp_pm.h>
+#endif
 
+#include <fileHash.hpp>
 #include <uploader.hpp>
+#include <uploaderFeatures/binaryTransfer.hpp>
 #include <uploaderFeatures/commandImplementation.hpp>
 #include <uploaderFeatures/commandInterpreter.hpp>
+#include <uploaderFeatures/socketTransport.hpp>
 #include <uploaderFeatures/stdinReader.hpp>
 #include <uploaderFeatures/stdoutReporter.hpp>
 
 #include <jacUtility.hpp>
 
+#include <esp_system.h>
+#include <mbedtls/md.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+
 using namespace jac;
 using namespace jac::storage;
 using namespace jac::utility;
@@ -16,13 +36,57 @@ using namespace jac::utility;
 namespace {
     TaskHandle_t uploaderTask;
     const char* basePath = nullptr;
+    std::mutex profileReporterLock;
+    ProfileReporter profileReporter;
+    // Only one uploader session can run at a time, they share the working file
+    std::mutex sessionLock;
+    uint16_t networkUploaderPort;
+    std::string networkUploaderSecret;
+    std::function< void() > uploaderSessionEnded;
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_handle_t sessionPmLock;
+#endif
+}
+
+// Keep the chip out of light sleep for the lifetime of the object
+class SessionAwake {
+public:
+    SessionAwake() {
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_acquire( sessionPmLock );
+#endif
+    }
+
+    ~SessionAwake() {
+#if CONFIG_PM_ENABLE
+        esp_pm_lock_release( sessionPmLock );
+#endif
+    }
+
+    SessionAwake( const SessionAwake& ) = delete;
+    SessionAwake& operator=( const SessionAwake& ) = delete;
+};
+
+void createSessionPmLock() {
+#if CONFIG_PM_ENABLE
+    if ( sessionPmLock == nullptr )
+        esp_pm_lock_create( ESP_PM_NO_LIGHT_SLEEP, 0, "uploader", &sessionPmLock );
+#endif
 }
 
 using UploaderInterface = Mixin<
     StdinReader,
     StdoutReporter,
     CommandInterpreter,
-    CommandImplementation >;
+    CommandImplementation,
+    BinaryTransfer >;
+
+using NetworkUploaderInterface = Mixin<
+    SocketReader,
+    SocketReporter,
+    CommandInterpreter,
+    CommandImplementation,
+    BinaryTransfer >;
 
 void discardBufferedStdin() {
     std::cin.ignore( std::cin.rdbuf()->in_avail() );
@@ -32,22 +96,135 @@ void uploaderRoutine( void * ) {
     std::cout << "Uploader started\n";
     while ( true ) {
         ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
-        discardBufferedStdin();
+        {
+            SessionAwake awake;
+            discardBufferedStdin();
+
+            std::scoped_lock _( sessionLock );
+            UploaderInterface interface;
+            do {
+                interface.interpretCommand();
+            } while ( !interface.finished() );
+        }
+        if ( uploaderSessionEnded )
+            uploaderSessionEnded();
+    }
+}
+
+// Challenge the client with a random nonce and expect
+// HMAC-SHA256( secret, nonce ) in hex, so the secret never crosses the network.
+// No command is interpreted before the client passes.
+bool authenticateClient( NetworkUploaderInterface& interface ) {
+    FileDigest nonce;
+    esp_fill_random( nonce.data(), nonce.size() );
+    std::string nonceHex = digestToHex( nonce );
+    interface.output() << "AUTH " << nonceHex << "\n";
+
+    std::string response;
+    for ( char c = interface.read(); c != '\n'; c = interface.read() ) {
+        if ( response.size() > 2 * nonce.size() )
+            break;
+        if ( c != '\r' )
+            response.push_back( c );
+    }
 
-        UploaderInterface interface;
-        do {
-            interface.interpretCommand();
-        } while ( !interface.finished() );
+    FileDigest expected;
+    mbedtls_md_hmac( mbedtls_md_info_from_type( MBEDTLS_MD_SHA256 ),
+        reinterpret_cast< const unsigned char* >( networkUploaderSecret.data() ),
+        networkUploaderSecret.size(),
+        reinterpret_cast< const unsigned char* >( nonceHex.data() ), nonceHex.size(),
+        expected.data() );
+    std::string expectedHex = digestToHex( expected );
 
+    // Compare in constant time
+    uint8_t difference = response.size() != expectedHex.size();
+    for ( size_t i = 0; i < expectedHex.size() && i < response.size(); i++ )
+        difference |= response[ i ] ^ expectedHex[ i ];
+    if ( difference != 0 ) {
+        interface.yieldError( "Authentication failed" );
+        return false;
     }
+    interface.output() << "OK\n";
+    return true;
 }
 
-void jac::storage::initializeUploader( const char *path ) {
+void serveNetworkConnection( int client ) {
+    SessionAwake awake;
+    int noDelay = 1;
+    setsockopt( client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+
+    // The interface carries the socket buffers, keep it off the task stack
+    auto interface = std::make_unique< NetworkUploaderInterface >();
+    interface->attachInput( client );
+    interface->attachOutput( client );
+    if ( !authenticateClient( *interface ) ) {
+        interface->output().flush();
+        // Slow down guessing
+        vTaskDelay( pdMS_TO_TICKS( 1000 ) );
+        return;
+    }
+    std::unique_lock session( sessionLock, std::try_to_lock );
+    if ( !session ) {
+        interface->yieldError( "Uploader is busy" );
+        interface->output().flush();
+        return;
+    }
+    do {
+        interface->interpretCommand();
+    } while ( !interface->finished() && !interface->inputClosed() );
+    interface->output().flush();
+}
+
+void networkUploaderRoutine( void * ) {
+    int server = socket( AF_INET, SOCK_STREAM, 0 );
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+    addr.sin_port = htons( networkUploaderPort );
+    if ( server < 0
+        || bind( server, reinterpret_cast< sockaddr * >( &addr ), sizeof( addr ) ) < 0
+        || listen( server, 1 ) < 0 )
+    {
+        std::cout << "Cannot start network uploader: " << std::strerror( errno ) << "\n";
+        if ( server >= 0 )
+            close( server );
+        vTaskDelete( nullptr );
+        return;
+    }
+    std::cout << "Network uploader started on port " << networkUploaderPort << "\n";
+    while ( true ) {
+        int client = accept( server, nullptr, nullptr );
+        if ( client < 0 ) {
+            vTaskDelay( pdMS_TO_TICKS( 100 ) );
+            continue;
+        }
+        serveNetworkConnection( client );
+        close( client );
+    }
+}
+
+void jac::storage::initializeUploader( const char *path, std::function< void() > sessionEnded ) {
     assert( uploaderTask == nullptr );
     basePath = path;
+    uploaderSessionEnded = std::move( sessionEnded );
+    createSessionPmLock();
     xTaskCreate( uploaderRoutine, "uploader", 3584, nullptr, 1, &uploaderTask );
 }
 
+void jac::storage::initializeNetworkUploader( uint16_t port, const char* secret ) {
+    static TaskHandle_t networkUploaderTask;
+    assert( networkUploaderTask == nullptr );
+    if ( secret == nullptr || std::strlen( secret ) < MIN_UPLOADER_SECRET_LENGTH ) {
+        std::cout << "Network uploader disabled: the secret has to have at least "
+                  << MIN_UPLOADER_SECRET_LENGTH << " characters\n";
+        return;
+    }
+    networkUploaderPort = port;
+    networkUploaderSecret = secret;
+    createSessionPmLock();
+    xTaskCreate( networkUploaderRoutine, "netUploader", 4096, nullptr, 1, &networkUploaderTask );
+}
+
 void jac::storage::enterUploader() {
     if ( xPortInIsrContext() )
         vTaskNotifyGiveFromISR( uploaderTask, nullptr );
@@ -58,3 +235,16 @@ void jac::storage::enterUploader() {
 const char* jac::storage::getStoragePrefix() {
     return basePath;
 }
+
+void jac::storage::setProfileReporter( ProfileReporter reporter ) {
+    std::scoped_lock _( profileReporterLock );
+    profileReporter = std::move( reporter );
+}
+
+bool jac::storage::reportProfile( std::ostream& o ) {
+    std::scoped_lock _( profileReporterLock );
+    if ( !profileReporter )
+        return false;
+    profileReporter( o );
+    return true;
+}
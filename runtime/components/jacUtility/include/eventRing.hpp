@@ -0,0 +1,100 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace jac::utility {
+
+// Bounded lock-free ring of trivially copyable records with multiple
+// producers and a single consumer.
+//
+// Pushing never blocks and does not take any lock, so it can be used from
+// interrupt handlers and tasks on both cores. When the ring is full, the record
+// is rejected. Each cell carries a sequence number that says whether the cell
+// is free or contains a published record; a producer claims a cell by
+// advancing the head and publishes the record by updating the sequence.
+template < typename T >
+class EventRing {
+    static_assert( std::is_trivially_copyable_v< T >,
+        "Ring records have to be plain data" );
+
+    struct Cell {
+        std::atomic< uint32_t > sequence;
+        T data;
+    };
+public:
+    // The capacity is rounded up to the nearest power of two
+    EventRing( uint32_t capacity ) {
+        uint32_t size = 1;
+        while ( size < capacity )
+            size *= 2;
+        _mask = size - 1;
+        _cells.reset( new Cell[ size ] );
+        for ( uint32_t i = 0; i != size; i++ )
+            _cells[ i ].sequence.store( i, std::memory_order_relaxed );
+    }
+    EventRing( const EventRing& ) = delete;
+    EventRing& operator=( const EventRing& ) = delete;
+
+    // Insert a record, return false if the ring is full. Safe to call from
+    // any context.
+    bool IRAM_ATTR push( const T& record ) {
+        uint32_t pos = _head.load( std::memory_order_relaxed );
+        Cell* cell;
+        while ( true ) {
+            cell = &_cells[ pos & _mask ];
+            uint32_t seq = cell->sequence.load( std::memory_order_acquire );
+            int32_t diff = int32_t( seq - pos );
+            if ( diff == 0 ) {
+                if ( _head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                    break;
+            }
+            else if ( diff < 0 )
+                return false;
+            else
+                pos = _head.load( std::memory_order_relaxed );
+        }
+        cell->data = record;
+        cell->sequence.store( pos + 1, std::memory_order_release );
+        return true;
+    }
+
+    // Remove up to count records and store them to out, return the number of
+    // removed records. Has to be called only from the consumer.
+    uint32_t pop( T* out, uint32_t count ) {
+        uint32_t popped = 0;
+        while ( popped != count ) {
+            Cell& cell = _cells[ _tail & _mask ];
+            uint32_t seq = cell.sequence.load( std::memory_order_acquire );
+            // The record is not published yet (or the ring is empty)
+            if ( seq != _tail + 1 )
+                break;
+            out[ popped++ ] = cell.data;
+            cell.sequence.store( _tail + _mask + 1, std::memory_order_release );
+            _tail++;
+        }
+        return popped;
+    }
+
+    // Return the oldest record without removing it, or nullptr if there is
+    // none. Has to be called only from the consumer.
+    const T* front() const {
+        const Cell& cell = _cells[ _tail & _mask ];
+        if ( cell.sequence.load( std::memory_order_acquire ) != _tail + 1 )
+            return nullptr;
+        return &cell.data;
+    }
+
+    uint32_t capacity() const { return _mask + 1; }
+private:
+    std::unique_ptr< Cell[] > _cells;
+    uint32_t _mask;
+    std::atomic< uint32_t > _head = 0;
+    uint32_t _tail = 0; // Owned by the consumer
+};
+
+} // namespace jac::utility
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <messageRing.hpp>
+#include <freertos/task.h>
+
+#include <atomic>
+
+namespace jac::utility {
+
+// Receiving side of a port; woken up whenever a message arrives
+struct MessageWaker {
+    virtual void wake() = 0;
+protected:
+    ~MessageWaker() = default;
+};
+
+// Bidirectional channel between two machines, e.g., running on different
+// cores. The channel consists of one message ring in each direction and it has
+// to outlive both machines. Each machine gets one of the ports; only the task
+// of the machine can use the port.
+class MessageChannel {
+    struct Direction {
+        Direction( uint32_t capacity ): ring( capacity ) {}
+
+        MessageRing ring;
+        std::atomic< MessageWaker* > waker = nullptr;
+        // Number of senders using the waker right now
+        std::atomic< int > waking = 0;
+    };
+public:
+    class Port {
+    public:
+        Port() = default;
+
+        // Send a message of given size: fill is called with a pointer to the
+        // message in the ring. Return false if the peer's ring is full.
+        template < typename Fill >
+        bool send( uint32_t size, Fill fill ) {
+            uint8_t* message = _outgoing->ring.reserve( size );
+            if ( !message )
+                return false;
+            fill( message );
+            _outgoing->ring.commit();
+            _outgoing->waking.fetch_add( 1, std::memory_order_seq_cst );
+            if ( MessageWaker* waker = _outgoing->waker.load( std::memory_order_acquire ) )
+                waker->wake();
+            _outgoing->waking.fetch_sub( 1, std::memory_order_release );
+            return true;
+        }
+
+        MessageRing& incoming() { return _incoming->ring; }
+
+        // Set the waker notified about incoming messages, nullptr to unset it.
+        // Once unset, the previous waker is not used anymore, so it can be
+        // destroyed even if the peer is still sending.
+        void setWaker( MessageWaker* waker ) {
+            _incoming->waker.store( waker, std::memory_order_seq_cst );
+            while ( _incoming->waking.load( std::memory_order_seq_cst ) != 0 )
+                taskYIELD();
+        }
+
+        bool valid() const { return _incoming; }
+    private:
+        friend class MessageChannel;
+        Port( Direction* incoming, Direction* outgoing )
+            : _incoming( incoming ), _outgoing( outgoing )
+        {}
+
+        Direction* _incoming = nullptr;
+        Direction* _outgoing = nullptr;
+    };
+
+    // The capacity of each direction in bytes
+    MessageChannel( uint32_t capacity ): _directions{ capacity, capacity } {}
+    MessageChannel( const MessageChannel& ) = delete;
+    MessageChannel& operator=( const MessageChannel& ) = delete;
+
+    // Get one of the ports (side 0 or 1) of the channel
+    Port port( int side ) {
+        return Port( &_directions[ side ], &_directions[ 1 - side ] );
+    }
+private:
+    Direction _directions[ 2 ];
+};
+
+} // namespace jac::utility
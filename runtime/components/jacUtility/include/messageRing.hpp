@@ -0,0 +1,111 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+namespace jac::utility {
+
+// Bounded lock-free ring of variable-sized messages with a single producer and
+// a single consumer, e.g., two machines running on different cores.
+//
+// Messages are stored contiguously, so the producer writes a message directly
+// into the ring (reserve and commit) and the consumer reads it in place (front
+// and pop); no intermediate copy is made. Each message is prefixed with its
+// size; a message that does not fit before the end of the buffer is preceded
+// by a wrap marker and it is stored at the beginning of the buffer.
+class MessageRing {
+    static constexpr uint32_t HEADER_SIZE = sizeof( uint32_t );
+    static constexpr uint32_t WRAP_MARKER = 0xFFFFFFFF;
+
+    static uint32_t aligned( uint32_t size ) {
+        return ( size + HEADER_SIZE - 1 ) & ~( HEADER_SIZE - 1 );
+    }
+public:
+    // The capacity (in bytes) is rounded up to the nearest power of two
+    MessageRing( uint32_t capacity ) {
+        uint32_t size = 64;
+        while ( size < capacity )
+            size *= 2;
+        _capacity = size;
+        _buffer.reset( new uint32_t[ size / HEADER_SIZE ] );
+    }
+    MessageRing( const MessageRing& ) = delete;
+    MessageRing& operator=( const MessageRing& ) = delete;
+
+    // Reserve space for a message of given size and return a pointer to it, or
+    // nullptr if there is not enough free space. The message becomes visible
+    // to the consumer after commit(). Has to be called only from the producer.
+    uint8_t* reserve( uint32_t size ) {
+        if ( size > _capacity - HEADER_SIZE )
+            return nullptr;
+        uint32_t need = HEADER_SIZE + aligned( size );
+        uint32_t free = _capacity - ( _head - _tail.load( std::memory_order_acquire ) );
+        uint32_t pos = _head & ( _capacity - 1 );
+        uint32_t skip = 0;
+        if ( _capacity - pos < need )
+            skip = _capacity - pos;
+        if ( free < skip + need )
+            return nullptr;
+        if ( skip ) {
+            _word( pos ) = WRAP_MARKER;
+            pos = 0;
+        }
+        _word( pos ) = size;
+        _reserved = skip + need;
+        return _bytes() + pos + HEADER_SIZE;
+    }
+
+    // Publish the message reserved last
+    void commit() {
+        _head += _reserved;
+        _reserved = 0;
+        _published.store( _head, std::memory_order_release );
+    }
+
+    // Get the oldest message, return false if there is none. The message stays
+    // valid until pop(). Has to be called only from the consumer.
+    bool front( const uint8_t*& data, uint32_t& size ) {
+        uint32_t tail = _tail.load( std::memory_order_relaxed );
+        if ( tail == _published.load( std::memory_order_acquire ) )
+            return false;
+        uint32_t pos = tail & ( _capacity - 1 );
+        if ( _word( pos ) == WRAP_MARKER ) {
+            tail += _capacity - pos;
+            _tail.store( tail, std::memory_order_release );
+            pos = 0;
+        }
+        size = _word( pos );
+        data = _bytes() + pos + HEADER_SIZE;
+        return true;
+    }
+
+    // Remove the message returned by front()
+    void pop() {
+        uint32_t tail = _tail.load( std::memory_order_relaxed );
+        uint32_t size = _word( tail & ( _capacity - 1 ) );
+        _tail.store( tail + HEADER_SIZE + aligned( size ), std::memory_order_release );
+    }
+
+    bool empty() const {
+        return _tail.load( std::memory_order_relaxed )
+            == _published.load( std::memory_order_acquire );
+    }
+
+    uint32_t capacity() const { return _capacity; }
+private:
+    uint8_t* _bytes() { return reinterpret_cast< uint8_t* >( _buffer.get() ); }
+    uint32_t& _word( uint32_t pos ) { return _buffer[ pos / HEADER_SIZE ]; }
+
+    std::unique_ptr< uint32_t[] > _buffer;
+    uint32_t _capacity;
+    uint32_t _head = 0;     // Owned by the producer
+    uint32_t _reserved = 0; // Owned by the producer
+    std::atomic< uint32_t > _published = 0;
+    std::atomic< uint32_t > _tail = 0;
+};
+
+} // namespace jac::utility
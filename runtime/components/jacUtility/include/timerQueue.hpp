@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace jac::utility {
+
+// Binary min-heap of timer ids (1, 2, ...) ordered by their deadline. Each
+// timer knows its position in the heap, so it can be removed in O(log n). We
+// implement it manually instead of using std::push_heap and friends as we have
+// to keep track of the positions.
+class TimerQueue {
+    struct Entry {
+        int64_t deadline = 0;
+        int heapIndex = -1; // -1 if the timer is not queued
+    };
+public:
+    bool empty() const { return _heap.empty(); }
+    size_t size() const { return _heap.size(); }
+
+    bool contains( int id ) const {
+        return id >= 1 && id <= int( _entries.size() ) && entry( id ).heapIndex >= 0;
+    }
+
+    // The earliest timer; the queue must not be empty
+    int top() const { return _heap[ 0 ]; }
+    int64_t topDeadline() const { return entry( top() ).deadline; }
+
+    void push( int id, int64_t deadline ) {
+        assert( id >= 1 && !contains( id ) );
+        if ( id > int( _entries.size() ) )
+            _entries.resize( id );
+        entry( id ).deadline = deadline;
+        _heap.push_back( id );
+        entry( id ).heapIndex = _heap.size() - 1;
+        _siftUp( _heap.size() - 1 );
+    }
+
+    void remove( int id ) {
+        assert( contains( id ) );
+        int idx = entry( id ).heapIndex;
+        int last = _heap.size() - 1;
+        if ( idx != last )
+            _swap( idx, last );
+        _heap.pop_back();
+        entry( id ).heapIndex = -1;
+        if ( idx != last ) {
+            _siftUp( idx );
+            _siftDown( idx );
+        }
+    }
+
+    // Pop the timers whose deadline is not after now, earliest first. Expire
+    // returns the next deadline of the timer (it has to be after now, so the
+    // loop terminates) or nullopt to drop it. Expire must not modify the
+    // queue.
+    template < typename Expire >
+    void expire( int64_t now, Expire expire ) {
+        while ( !empty() && topDeadline() <= now ) {
+            int id = top();
+            std::optional< int64_t > next = expire( id );
+            if ( !next ) {
+                remove( id );
+                continue;
+            }
+            assert( *next > now );
+            entry( id ).deadline = *next;
+            _siftDown( 0 );
+        }
+    }
+
+private:
+    Entry& entry( int id ) { return _entries[ id - 1 ]; }
+    const Entry& entry( int id ) const { return _entries[ id - 1 ]; }
+
+    bool _less( int a, int b ) const {
+        return entry( _heap[ a ] ).deadline < entry( _heap[ b ] ).deadline;
+    }
+
+    void _swap( int a, int b ) {
+        std::swap( _heap[ a ], _heap[ b ] );
+        entry( _heap[ a ] ).heapIndex = a;
+        entry( _heap[ b ] ).heapIndex = b;
+    }
+
+    void _siftUp( int idx ) {
+        while ( idx > 0 ) {
+            int parent = ( idx - 1 ) / 2;
+            if ( !_less( idx, parent ) )
+                break;
+            _swap( idx, parent );
+            idx = parent;
+        }
+    }
+
+    void _siftDown( int idx ) {
+        int size = _heap.size();
+        while ( true ) {
+            int smallest = idx;
+            for ( int child : { 2 * idx + 1, 2 * idx + 2 } ) {
+                if ( child < size && _less( child, smallest ) )
+                    smallest = child;
+            }
+            if ( smallest == idx )
+                break;
+            _swap( idx, smallest );
+            idx = smallest;
+        }
+    }
+
+    std::vector< Entry > _entries; // Indexed by id - 1
+    std::vector< int > _heap;
+};
+
+} // namespace jac::utility
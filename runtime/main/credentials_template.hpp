@@ -2,3 +2,6 @@
 
 const char *SSID = "YourSSID";
 const char *password = "password";
+// Shared secret of the network uploader, at least 16 characters; the network
+// uploader is disabled while it is empty
+const char *uploaderSecret = "";
@@ -1,6 +1,7 @@
 #include "sdkconfig.h"
 
 #include <esp_system.h>
+#include <esp_sleep.h>
 // This shouldn't be necessary, but ESP-IDF has broken guards.
 // Relevant issue: https://github.com/espressif/esp-idf/issues/7204
 extern "C" {
@@ -13,27 +14,65 @@ extern "C" {
 
 #include <duk_console.h>
 #include <jsmachine.hpp>
-#include <features/cMemoryAllocator.hpp>
+#include <features/poolMemoryAllocator.hpp>
+#include <features/arenaAllocator.hpp>
+#include <features/instrumentedAllocator.hpp>
 #include <features/nodeModules.hpp>
 #include <features/socketDebugger.hpp>
 #include <features/stdoutErrorHandler.hpp>
 #include <features/rtosTimers.hpp>
 #include <features/promise.hpp>
+#include <features/nativeWorkers.hpp>
+#include <features/fsModule.hpp>
 #include <features/platform/esp32/gpio.hpp>
+#include <features/platform/esp32/pcnt.hpp>
+#include <features/platform/esp32/rmt.hpp>
+#include <features/platform/esp32/ledc.hpp>
+#include <features/platform/esp32/powerManager.hpp>
+#include <features/platform/esp32/telemetryLog.hpp>
+#include <features/eventLoopProfiler.hpp>
+#include <features/gcPolicy.hpp>
+#include <features/messagePorts.hpp>
+#include <features/cMemoryAllocator.hpp>
+#include <machineTask.hpp>
+#include <messageChannel.hpp>
+#include <romBuiltins.hpp>
 
 #include <storage.hpp>
 #include <uploader.hpp>
+#include <logStore.hpp>
 
 #include "wifi.h"
 
 // Uncomment the following line to enable the proof-of-concept debugger
 // #define ENABLE_TEMPORARY_DEBUGGER
 
-#ifdef ENABLE_TEMPORARY_DEBUGGER
+// Uncomment the following line to run worker.js in a second machine on the
+// other core. The machines talk via require("messaging").port("worker") and
+// require("messaging").port("main") respectively.
+// #define ENABLE_WORKER_MACHINE
+
+// Uncomment the following line to connect to WiFi and serve the uploader also
+// over TCP (see storage::NETWORK_UPLOADER_PORT). Anyone who can connect and
+// knows uploaderSecret from credentials.hpp can replace the program.
+// #define ENABLE_NETWORK_UPLOADER
+
+#if defined( ENABLE_TEMPORARY_DEBUGGER ) || defined( ENABLE_NETWORK_UPLOADER )
     #include "credentials.hpp"
 #endif
 
+// The low-memory build (JAC_LOW_MEMORY, see duktape-lowmem.yml) serves the
+// Duktape heap from a single arena, which only one machine can use
+#if defined( JAC_LOW_MEMORY ) && defined( ENABLE_WORKER_MACHINE )
+    #error "The worker machine is not supported by the low-memory build"
+#endif
+
+// Light sleep (see PowerManager) does not detect edges, so the uploader is
+// entered on the low level of GPIO 0, which also wakes the chip. The interrupt
+// would fire until the pin is released, so it is enabled again only once the
+// uploader session ends.
 void gpioIntr(void *arg) {
+    gpio_intr_disable( GPIO_NUM_0 );
     jac::storage::enterUploader();
 }
 
@@ -42,11 +81,14 @@ void setupGpio() {
     gpio_config_t io_conf;
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
-    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+    io_conf.intr_type = GPIO_INTR_LOW_LEVEL;
     io_conf.pin_bit_mask = 1ULL << GPIO_NUM_0;
     gpio_config( &io_conf );
 
     gpio_isr_handler_add( GPIO_NUM_0, gpioIntr, (void*) GPIO_NUM_0 );
+    gpio_wakeup_enable( GPIO_NUM_0, GPIO_INTR_LOW_LEVEL );
+    esp_sleep_enable_gpio_wakeup();
 }
 
 void setupUartDriver() {
@@ -71,59 +113,109 @@ extern "C" void app_main() {
     // Define javascript machines capabilities
     using JsMachine = JsMachineBase<
             StdoutErrorHandler,
-            CMemoryAllocator,
+        #ifdef JAC_LOW_MEMORY
+            // No statistics in this build, it only reports the free arena
+            InstrumentedAllocator< ArenaAllocator >::Feature,
+        #else
+            InstrumentedAllocator< PoolMemoryAllocator >::Feature,
+        #endif
             RtosTimers,
             NodeModuleLoader,
             SocketDebugger,
             Promise,
-            GpioDriver
+            NativeWorkers,
+            FsModule,
+            GpioDriver,
+            PcntDriver,
+            RmtDriver,
+            LedcDriver,
+            MessagePorts,
+            PowerManager,
+            TelemetryLog,
+            GcPolicy,
+            EventLoopProfiler // Remove to disable profiling
         >;
 
+    #ifdef ENABLE_WORKER_MACHINE
+        // The worker allocates from the system heap, the pool belongs to the
+        // main machine
+        using WorkerMachine = JsMachineBase<
+                StdoutErrorHandler,
+                CMemoryAllocator,
+                RtosTimers,
+                NodeModuleLoader,
+                Promise,
+                MessagePorts,
+                GcPolicy
+            >;
+        // The channel has to outlive both machines
+        static utility::MessageChannel workerChannel( 4096 );
+    #endif
+
     setupUartDriver(); // Without UART drive stdio is non-blocking
     setupGpio();
     storage::initializeFatFs( "/spiflash" );
-    storage::initializeUploader( "/spiflash" );
+    storage::initializeUploader( "/spiflash", [] {
+        gpio_intr_enable( GPIO_NUM_0 );
+    } );
     initNvs();
 
-    #ifdef ENABLE_TEMPORARY_DEBUGGER
+    #if defined( ENABLE_TEMPORARY_DEBUGGER ) || defined( ENABLE_NETWORK_UPLOADER )
         WiFiConnector connector;
         if ( !connector.sync().connect( SSID, password ) ) {
             std::cout << "WiFi connection failed\n";
         } else {
             connector.waitForIp();
             std::cout << "IP address: " << connector.ipAddrStr() << "\n";
+            #ifdef ENABLE_NETWORK_UPLOADER
+                storage::initializeNetworkUploader( storage::NETWORK_UPLOADER_PORT, uploaderSecret );
+            #endif
         }
     #endif
 
     try {
         JsMachine::Configuration cfg;
         cfg.basePath = "/spiflash";
+        cfg.bytecodeCache = true;
+        const auto& moduleImage = storage::mapModuleImage( storage::MODULE_IMAGE_PARTITION );
+        fs::useAsExternalStrings( moduleImage );
+        cfg.moduleImage = &moduleImage;
+        cfg.regeneratorCachePath = "/spiflash/__regeneratorRuntime.jbc";
+        cfg.telemetryLog = &storage::telemetryLog();
+
+        #ifdef ENABLE_WORKER_MACHINE
+            cfg.messagePorts.push_back( { "worker", workerChannel.port( 0 ) } );
+
+            WorkerMachine::Configuration workerCfg;
+            workerCfg.basePath = "/spiflash";
+            workerCfg.moduleImage = &moduleImage;
+            // Each machine writes its own cache
+            workerCfg.regeneratorCachePath = "/spiflash/__regeneratorRuntime.worker.jbc";
+            workerCfg.messagePorts.push_back( { "main", workerChannel.port( 1 ) } );
+            spawnMachine< WorkerMachine >( "worker", workerCfg, "worker.js", 1,
+                []( WorkerMachine& machine ) {
+                    machine.extend( []( WorkerMachine* machine, duk_context* ctx ) {
+                        duk_console_init( ctx, 0 );
+                        installErrCreate( ctx );
+                    });
+                } );
+        #endif
+
         JsMachine machine( cfg );
 
         machine.extend( []( JsMachine* machine, duk_context* ctx) {
             duk_console_init( ctx, 0 );
+            // Make stacktraces richer
+            installErrCreate( ctx );
         });
 
         #ifdef ENABLE_TEMPORARY_DEBUGGER
             machine.waitForDebugger();
         #endif
 
-        // The following code makes stacktraces richer
-        // TBA: Refactor into a separate machine feature
-        machine.evalString( R"(
-            Duktape.errCreate = function (err) {
-                try {
-                    if (typeof err === 'object' &&
-                        typeof err.message !== 'undefined' &&
-                        typeof err.lineNumber === 'number') {
-                        err.message = err.message + ' (line ' + err.lineNumber + ')';
-                    }
-                } catch (e) {
-                    // ignore; for cases such as where "message" is not writable etc
-                }
-                return err;
-            }
-        )" );
+        storage::ScopedProfileReporter profileReporter( [&]( std::ostream& o ) {
+            machine.writeProfile( o );
+        } );
 
         machine.evaluateMain( "index.js" );
         machine.runEventLoop();
@@ -0,0 +1,126 @@
+// Run a JavaScript program (e.g., one of tests/javascript) in the runtime built
+// for the host. The machine has the same features as on the device except for
+// the peripherals and the debugger, so the event loop, the module loader and
+// the promise implementation can be profiled by perf or valgrind.
+//
+// Usage: jac_bench [--cache] [--profile] <program directory> [<main module>]
+//
+// The program can end itself by calling exit(); otherwise the runner runs
+// until interrupted, just like the device.
+
+#include <duk_console.h>
+#include <jsmachine.hpp>
+#include <features/arenaAllocator.hpp>
+#include <features/instrumentedAllocator.hpp>
+#include <features/nodeModules.hpp>
+#include <features/stdoutErrorHandler.hpp>
+#include <features/rtosTimers.hpp>
+#include <features/promise.hpp>
+#include <features/nativeWorkers.hpp>
+#include <features/fsModule.hpp>
+#include <features/eventLoopProfiler.hpp>
+#include <features/gcPolicy.hpp>
+#include <romBuiltins.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <climits>
+
+using namespace jac;
+
+using JsMachine = JsMachineBase<
+        StdoutErrorHandler,
+        InstrumentedAllocator< ArenaAllocator >::Feature,
+        RtosTimers,
+        NodeModuleLoader,
+        Promise,
+        NativeWorkers,
+        FsModule,
+        GcPolicy,
+        EventLoopProfiler
+    >;
+
+static duk_ret_t dukExit( duk_context *ctx ) {
+    JsMachine::fromContext( ctx ).stopEventLoop();
+    return 0;
+}
+
+static void usage( const char *name ) {
+    std::cerr << "Usage: " << name << " [--cache] [--profile] <program directory> [<main module>]\n"
+              << "  --cache    store compiled modules next to their sources\n"
+              << "  --profile  print the event loop profile on exit\n";
+}
+
+int main( int argc, char **argv ) {
+    bool cache = false;
+    bool profile = false;
+    std::string directory;
+    std::string mainModule = "index.js";
+    int positional = 0;
+    for ( int i = 1; i != argc; i++ ) {
+        if ( std::strcmp( argv[ i ], "--cache" ) == 0 )
+            cache = true;
+        else if ( std::strcmp( argv[ i ], "--profile" ) == 0 )
+            profile = true;
+        else if ( positional == 0 && argv[ i ][ 0 ] != '-' )
+            directory = argv[ i ], positional++;
+        else if ( positional == 1 && argv[ i ][ 0 ] != '-' )
+            mainModule = argv[ i ], positional++;
+        else {
+            usage( argv[ 0 ] );
+            return EXIT_FAILURE;
+        }
+    }
+    if ( directory.empty() ) {
+        usage( argv[ 0 ] );
+        return EXIT_FAILURE;
+    }
+    char basePath[ PATH_MAX ];
+    if ( !realpath( directory.c_str(), basePath ) ) {
+        std::cerr << "Invalid program directory: " << directory << "\n";
+        return EXIT_FAILURE;
+    }
+
+    try {
+        JsMachine::Configuration cfg;
+        cfg.basePath = basePath;
+        cfg.bytecodeCache = cache;
+        // Both builds serve the heap from an arena, so their footprints are
+        // measured the same way
+    #ifdef JAC_LOW_MEMORY
+        cfg.arenaSize = HeapArena::MAX_COMPRESSED_SIZE;
+    #else
+        cfg.arenaSize = 64 * 1024 * 1024;
+    #endif
+        JsMachine machine( cfg );
+
+        machine.extend( []( JsMachine* machine, duk_context* ctx ) {
+            duk_console_init( ctx, 0 );
+            installErrCreate( ctx );
+            duk_push_c_function( ctx, dukExit, 0 );
+            duk_put_global_string( ctx, "exit" );
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        machine.evaluateMain( mainModule );
+        machine.runEventLoop();
+        auto duration = std::chrono::steady_clock::now() - start;
+
+        std::cerr << "Finished in "
+                  << std::chrono::duration_cast< std::chrono::milliseconds >( duration ).count()
+                  << " ms\n";
+        if ( const HeapArena* arena = machine.heapArena() )
+            std::cerr << "Heap arena: " << arena->capacity() << " B, minimum free "
+                      << arena->minimumFreeSize() << " B\n";
+        if ( profile )
+            machine.writeProfile( std::cerr );
+    }
+    catch( const std::exception& e ) {
+        std::cerr << "FAILED: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
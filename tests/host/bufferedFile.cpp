@@ -0,0 +1,114 @@
+#include <catch2/catch.hpp>
+
+#include <bufferedFile.hpp>
+#include <filesystem.hpp>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using jac::fs::BufferedFile;
+
+namespace {
+
+std::string temporaryPath() {
+    char path[] = "/tmp/jacBufferedFileXXXXXX";
+    int fd = mkstemp( path );
+    REQUIRE( fd >= 0 );
+    close( fd );
+    return path;
+}
+
+const uint8_t* bytes( const std::string& s ) {
+    return reinterpret_cast< const uint8_t* >( s.data() );
+}
+
+} // namespace
+
+TEST_CASE( "Buffered file writes whole blocks" ) {
+    std::string path = temporaryPath();
+    std::string expected;
+    {
+        BufferedFile file( path, O_WRONLY | O_TRUNC, 16 );
+        file.write( bytes( "hello" ), 5 );
+        REQUIRE( file.buffered() == 5 );
+        REQUIRE( jac::fs::readFile( path ).empty() );
+
+        // Fills the block, the rest stays in the buffer
+        std::string chunk( 20, 'a' );
+        file.write( bytes( chunk ), chunk.size() );
+        REQUIRE( file.buffered() == 9 );
+        REQUIRE( jac::fs::readFile( path ).size() == 16 );
+
+        // Large writes bypass the buffer up to the last boundary (at 64)
+        file.flush();
+        std::string large( 40, 'b' );
+        file.write( bytes( large ), large.size() );
+        REQUIRE( file.buffered() == 1 );
+        REQUIRE( jac::fs::readFile( path ).size() == 64 );
+        expected = "hello" + chunk + large;
+    }
+    REQUIRE( jac::fs::readFile( path ) == expected );
+    unlink( path.c_str() );
+}
+
+TEST_CASE( "Buffered file aligns appends to the end of the file" ) {
+    std::string path = temporaryPath();
+    {
+        BufferedFile file( path, O_WRONLY | O_TRUNC, 0 );
+        file.write( bytes( "0123456789" ), 10 );
+    }
+    BufferedFile file( path, O_RDWR | O_APPEND, 16 );
+    file.write( bytes( "abc" ), 3 );
+    REQUIRE( file.buffered() == 3 );
+    file.write( bytes( "def" ), 3 );
+    REQUIRE( file.buffered() == 0 );
+    file.write( bytes( "g" ), 1 );
+    REQUIRE( jac::fs::readFile( path ) == "0123456789abcdef" );
+
+    file.close();
+    REQUIRE_FALSE( file.isOpen() );
+    REQUIRE_THROWS_AS( file.write( bytes( "x" ), 1 ), std::runtime_error );
+    REQUIRE( jac::fs::readFile( path ) == "0123456789abcdefg" );
+    unlink( path.c_str() );
+}
+
+TEST_CASE( "Buffered file flushes before reading" ) {
+    std::string path = temporaryPath();
+    {
+        BufferedFile file( path, O_WRONLY | O_TRUNC, 0 );
+        file.write( bytes( "0123456789" ), 10 );
+    }
+    BufferedFile file( path, O_RDWR, 16 );
+    file.write( bytes( "ab" ), 2 );
+    uint8_t content[ 4 ];
+    REQUIRE( file.read( content, 4 ) == 4 );
+    REQUIRE( std::string( content, content + 4 ) == "2345" );
+    file.close();
+    REQUIRE( jac::fs::readFile( path ) == "ab23456789" );
+    unlink( path.c_str() );
+}
+
+TEST_CASE( "Buffered file reports its writes" ) {
+    static std::vector< std::string > changed;
+    changed.clear();
+    jac::fs::setFileChangeListener( []( const std::string& p ) {
+        changed.push_back( p );
+    } );
+    std::string path = temporaryPath();
+    {
+        BufferedFile file( path, O_RDONLY, 16 );
+        uint8_t data[ 4 ];
+        file.read( data, sizeof( data ) );
+    }
+    REQUIRE( changed.empty() );
+    {
+        BufferedFile file( path, O_WRONLY | O_APPEND, 16 );
+        file.write( bytes( "hello" ), 5 );
+        REQUIRE( changed.empty() ); // Only buffered so far
+    }
+    REQUIRE_FALSE( changed.empty() );
+    REQUIRE( changed.back() == path );
+    jac::fs::setFileChangeListener( nullptr );
+    unlink( path.c_str() );
+}
@@ -0,0 +1,25 @@
+#include <catch2/catch.hpp>
+
+#include <filesystem.hpp>
+
+#include <stdexcept>
+#include <string>
+
+using jac::fs::appendNormalized;
+
+TEST_CASE( "Normalized paths resolve dots" ) {
+    std::string out;
+    appendNormalized( out, "/a/./b//c/../d" );
+    REQUIRE( out == "/a/b/d" );
+    appendNormalized( out, "../../e" );
+    REQUIRE( out == "/a/e" );
+    appendNormalized( out, "../.." );
+    REQUIRE( out.empty() );
+}
+
+TEST_CASE( "Normalized paths cannot go above the root" ) {
+    std::string out;
+    REQUIRE_THROWS_AS( appendNormalized( out, "/.." ), std::runtime_error );
+    out = "/a";
+    REQUIRE_THROWS_AS( appendNormalized( out, "../../b" ), std::runtime_error );
+}
@@ -0,0 +1,103 @@
+#include <catch2/catch.hpp>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <esp_timer.h>
+
+#include <atomic>
+
+TEST_CASE( "Queue keeps the order of items" ) {
+    QueueHandle_t q = xQueueCreate( 3, sizeof( int ) );
+    for ( int i = 1; i <= 3; i++ )
+        REQUIRE( xQueueSend( q, &i, 0 ) == pdPASS );
+    int item = 4;
+    REQUIRE( xQueueSend( q, &item, 0 ) == errQUEUE_FULL );
+    item = 0;
+    REQUIRE( xQueueSendToFront( q, &item, 0 ) == errQUEUE_FULL );
+
+    for ( int i = 1; i <= 3; i++ ) {
+        REQUIRE( xQueueReceive( q, &item, 0 ) == pdPASS );
+        REQUIRE( item == i );
+    }
+    REQUIRE( xQueueReceive( q, &item, pdMS_TO_TICKS( 10 ) ) == errQUEUE_EMPTY );
+    vQueueDelete( q );
+}
+
+TEST_CASE( "Binary semaphore wakes up a task" ) {
+    SemaphoreHandle_t s = xSemaphoreCreateBinary();
+    REQUIRE( xSemaphoreTake( s, 0 ) == pdFALSE );
+    xTaskCreate( []( void *arg ) {
+        vTaskDelay( pdMS_TO_TICKS( 10 ) );
+        xSemaphoreGive( static_cast< SemaphoreHandle_t >( arg ) );
+        vTaskDelete( nullptr );
+    }, "giver", 2048, s, 1, nullptr );
+    REQUIRE( xSemaphoreTake( s, portMAX_DELAY ) == pdTRUE );
+    // The semaphore is binary
+    xSemaphoreGive( s );
+    xSemaphoreGive( s );
+    REQUIRE( uxSemaphoreGetCount( s ) == 1 );
+    vSemaphoreDelete( s );
+}
+
+TEST_CASE( "Task notifications count" ) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    xTaskNotifyGive( self );
+    xTaskNotifyGive( self );
+    REQUIRE( ulTaskNotifyTake( pdFALSE, 0 ) == 2 );
+    REQUIRE( ulTaskNotifyTake( pdTRUE, 0 ) == 1 );
+    REQUIRE( ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( 10 ) ) == 0 );
+}
+
+TEST_CASE( "Timers fire in the service task" ) {
+    static std::atomic< int > fired;
+    static SemaphoreHandle_t done;
+    fired = 0;
+    done = xSemaphoreCreateBinary();
+
+    TimerHandle_t t = xTimerCreate( "test", pdMS_TO_TICKS( 5 ), pdTRUE, nullptr,
+        []( TimerHandle_t t ) {
+            if ( ++fired == 3 ) {
+                xTimerStop( t, 0 );
+                xSemaphoreGive( done );
+            }
+        } );
+    REQUIRE( xTimerIsTimerActive( t ) == pdFALSE );
+    xTimerStart( t, 0 );
+    REQUIRE( xSemaphoreTake( done, pdMS_TO_TICKS( 1000 ) ) == pdTRUE );
+    REQUIRE( fired == 3 );
+    REQUIRE( xTimerIsTimerActive( t ) == pdFALSE );
+
+    // Pended functions run in the service task in order
+    static std::atomic< int > order;
+    order = 0;
+    xTimerDelete( t, 0 );
+    xTimerPendFunctionCall( []( void *, uint32_t v ) { order = order * 10 + v; }, nullptr, 1, 0 );
+    xTimerPendFunctionCall( []( void *, uint32_t v ) {
+        order = order * 10 + v;
+        xSemaphoreGive( done );
+    }, nullptr, 2, 0 );
+    REQUIRE( xSemaphoreTake( done, pdMS_TO_TICKS( 1000 ) ) == pdTRUE );
+    REQUIRE( order == 12 );
+    vSemaphoreDelete( done );
+}
+
+TEST_CASE( "esp_timer fires once" ) {
+    static SemaphoreHandle_t done;
+    done = xSemaphoreCreateBinary();
+    esp_timer_create_args_t args{};
+    args.callback = []( void * ) { xSemaphoreGive( done ); };
+    esp_timer_handle_t timer;
+    REQUIRE( esp_timer_create( &args, &timer ) == ESP_OK );
+
+    int64_t start = esp_timer_get_time();
+    REQUIRE( esp_timer_start_once( timer, 2000 ) == ESP_OK );
+    REQUIRE( esp_timer_start_once( timer, 2000 ) == ESP_ERR_INVALID_STATE );
+    REQUIRE( xSemaphoreTake( done, pdMS_TO_TICKS( 1000 ) ) == pdTRUE );
+    REQUIRE( esp_timer_get_time() - start >= 2000 );
+    REQUIRE( esp_timer_stop( timer ) == ESP_ERR_INVALID_STATE );
+    REQUIRE( esp_timer_delete( timer ) == ESP_OK );
+    vSemaphoreDelete( done );
+}
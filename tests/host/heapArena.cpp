@@ -0,0 +1,134 @@
+#include <catch2/catch.hpp>
+
+#include <heapArena.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using jac::HeapArena;
+
+TEST_CASE( "Heap arena coalesces freed blocks" ) {
+    alignas( 8 ) static uint8_t memory[ 4096 ];
+    HeapArena arena( memory, sizeof( memory ) );
+    const size_t capacity = arena.capacity();
+    REQUIRE( capacity > 4000 );
+
+    std::vector< void* > blocks;
+    for ( int i = 0; i != 16; i++ ) {
+        void* p = arena.allocate( 100 );
+        REQUIRE( p );
+        REQUIRE( reinterpret_cast< uintptr_t >( p ) % HeapArena::ALIGNMENT == 0 );
+        REQUIRE( arena.contains( p ) );
+        REQUIRE( arena.usableSize( p ) >= 100 );
+        REQUIRE( arena.usableSize( p ) < 100 + HeapArena::ALIGNMENT );
+        std::memset( p, i, 100 );
+        blocks.push_back( p );
+    }
+    REQUIRE( arena.freeSize() < capacity - 16 * 100 );
+
+    // Free every other block first, so the rest merges with both neighbours
+    for ( size_t i = 0; i < blocks.size(); i += 2 )
+        arena.release( blocks[ i ] );
+    for ( size_t i = 1; i < blocks.size(); i += 2 )
+        arena.release( blocks[ i ] );
+    REQUIRE( arena.freeSize() == capacity );
+    REQUIRE( arena.largestFreeBlock() == capacity - 4 );
+    REQUIRE( arena.minimumFreeSize() < capacity - 16 * 100 );
+}
+
+TEST_CASE( "Heap arena reallocation keeps the content" ) {
+    alignas( 8 ) static uint8_t memory[ 4096 ];
+    HeapArena arena( memory, sizeof( memory ) );
+
+    char* p = static_cast< char* >( arena.allocate( 10 ) );
+    std::strcpy( p, "arena" );
+    // Grows in place, the rest of the arena is free
+    char* q = static_cast< char* >( arena.reallocate( p, 1000 ) );
+    REQUIRE( q == p );
+    REQUIRE( std::strcmp( q, "arena" ) == 0 );
+
+    // Blocked by the following allocation, has to move
+    void* blocker = arena.allocate( 16 );
+    REQUIRE( blocker );
+    char* moved = static_cast< char* >( arena.reallocate( q, 2000 ) );
+    REQUIRE( moved );
+    REQUIRE( moved != q );
+    REQUIRE( std::strcmp( moved, "arena" ) == 0 );
+
+    // Shrinking never moves
+    REQUIRE( arena.reallocate( moved, 8 ) == moved );
+    REQUIRE( arena.reallocate( nullptr, 8 ) );
+    REQUIRE( arena.reallocate( moved, 0 ) == nullptr );
+}
+
+TEST_CASE( "Heap arena reports exhaustion" ) {
+    alignas( 8 ) static uint8_t memory[ 1024 ];
+    HeapArena arena( memory, sizeof( memory ) );
+
+    REQUIRE( arena.allocate( 0 ) == nullptr );
+    REQUIRE( arena.allocate( 2048 ) == nullptr );
+    void* p = arena.allocate( 600 );
+    REQUIRE( p );
+    REQUIRE( arena.allocate( 600 ) == nullptr );
+    // A failed reallocation leaves the block untouched
+    void* blocker = arena.allocate( 16 );
+    REQUIRE( blocker );
+    std::memset( p, 0xAB, 600 );
+    REQUIRE( arena.reallocate( p, 900 ) == nullptr );
+    REQUIRE( static_cast< uint8_t* >( p )[ 599 ] == 0xAB );
+    arena.release( p );
+    arena.release( blocker );
+    REQUIRE( arena.allocate( 900 ) );
+}
+
+TEST_CASE( "Heap arena survives random allocations" ) {
+    alignas( 8 ) static uint8_t memory[ 65536 ];
+    HeapArena arena( memory, sizeof( memory ) );
+    const size_t capacity = arena.capacity();
+
+    struct Allocation {
+        uint8_t* ptr;
+        size_t size;
+    };
+    std::vector< Allocation > live;
+    std::mt19937 random( 42 );
+    for ( int i = 0; i != 20000; i++ ) {
+        size_t size = random() % 4 == 0 ? random() % 2048 + 1 : random() % 64 + 1;
+        if ( !live.empty() && random() % 2 == 0 ) {
+            size_t index = random() % live.size();
+            Allocation a = live[ index ];
+            for ( size_t j = 0; j != a.size; j++ )
+                REQUIRE( a.ptr[ j ] == uint8_t( a.size ) );
+            live.erase( live.begin() + index );
+            arena.release( a.ptr );
+        }
+        else if ( auto p = static_cast< uint8_t* >( arena.allocate( size ) ) ) {
+            std::memset( p, uint8_t( size ), size );
+            live.push_back( { p, size } );
+        }
+    }
+    for ( const Allocation& a : live )
+        arena.release( a.ptr );
+    REQUIRE( arena.freeSize() == capacity );
+    REQUIRE( arena.largestFreeBlock() == capacity - 4 );
+}
+
+TEST_CASE( "Heap arena is the only base of compressed pointers" ) {
+    alignas( 8 ) static uint8_t memory[ 1024 ];
+    static std::vector< uint8_t > large( HeapArena::MAX_COMPRESSED_SIZE + 1024 );
+    {
+        HeapArena first( memory, 512 );
+        HeapArena second( memory + 512, 512 );
+        REQUIRE( first.attachPointerCompression() );
+        REQUIRE_FALSE( second.attachPointerCompression() );
+        first.detachPointerCompression();
+        REQUIRE( second.attachPointerCompression() );
+    }
+    // The destructor releases the base
+    HeapArena tooLarge( large.data(), large.size() );
+    REQUIRE_FALSE( tooLarge.attachPointerCompression() );
+    HeapArena third( memory, sizeof( memory ) );
+    REQUIRE( third.attachPointerCompression() );
+}
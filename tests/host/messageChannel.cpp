@@ -0,0 +1,97 @@
+#include <catch2/catch.hpp>
+
+#include <messageChannel.hpp>
+
+#include <cstring>
+#include <thread>
+
+using jac::utility::MessageChannel;
+using jac::utility::MessageRing;
+using jac::utility::MessageWaker;
+
+TEST_CASE( "Message ring wraps around" ) {
+    MessageRing ring( 64 );
+    REQUIRE( ring.capacity() == 64 );
+    REQUIRE( ring.reserve( 64 ) == nullptr );
+
+    const uint8_t *data;
+    uint32_t size;
+    for ( int i = 0; i != 10; i++ ) {
+        uint8_t *message = ring.reserve( 20 );
+        REQUIRE( message );
+        std::memset( message, i, 20 );
+        ring.commit();
+        REQUIRE( ring.front( data, size ) );
+        REQUIRE( size == 20 );
+        REQUIRE( data[ 0 ] == i );
+        REQUIRE( data[ 19 ] == i );
+        ring.pop();
+        REQUIRE( ring.empty() );
+    }
+    REQUIRE_FALSE( ring.front( data, size ) );
+}
+
+TEST_CASE( "Message ring passes messages between threads" ) {
+    MessageRing ring( 256 );
+    const int count = 20000;
+    std::thread producer( [&] {
+        for ( int i = 0; i != count; ) {
+            uint32_t size = sizeof( int ) + i % 97;
+            uint8_t *message = ring.reserve( size );
+            if ( !message ) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::memcpy( message, &i, sizeof( int ) );
+            std::memset( message + sizeof( int ), uint8_t( i ), size - sizeof( int ) );
+            ring.commit();
+            i++;
+        }
+    } );
+
+    bool ordered = true;
+    for ( int next = 0; next != count; ) {
+        const uint8_t *data;
+        uint32_t size;
+        if ( !ring.front( data, size ) ) {
+            std::this_thread::yield();
+            continue;
+        }
+        int value;
+        std::memcpy( &value, data, sizeof( int ) );
+        ordered = ordered && value == next && size == sizeof( int ) + next % 97
+            && ( size == sizeof( int ) || data[ size - 1 ] == uint8_t( next ) );
+        ring.pop();
+        next++;
+    }
+    producer.join();
+    REQUIRE( ordered );
+    REQUIRE( ring.empty() );
+}
+
+TEST_CASE( "Message channel wakes up the peer" ) {
+    struct CountingWaker: MessageWaker {
+        int count = 0;
+        void wake() override { count++; }
+    };
+
+    MessageChannel channel( 128 );
+    auto a = channel.port( 0 );
+    auto b = channel.port( 1 );
+    CountingWaker waker;
+    b.setWaker( &waker );
+
+    auto fill = []( uint8_t *message ) { message[ 0 ] = 42; };
+    REQUIRE( a.send( 1, fill ) );
+    REQUIRE( waker.count == 1 );
+    REQUIRE( a.incoming().empty() );
+
+    const uint8_t *data;
+    uint32_t size;
+    REQUIRE( b.incoming().front( data, size ) );
+    REQUIRE( data[ 0 ] == 42 );
+
+    b.setWaker( nullptr );
+    while ( a.send( 1, fill ) );
+    REQUIRE( waker.count == 1 );
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// The ROM contains tinfl of miniz, the host uses the library itself
+#include <miniz.h>
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstdint>
+
+// Same as the ROM implementation: the result is the standard (zlib) CRC-32 if
+// crc is the CRC of the preceding data
+uint32_t esp_rom_crc32_le( uint32_t crc, const uint8_t *buf, uint32_t len );
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <esp_err.h>
+#include <cstdint>
+
+uint32_t esp_get_free_heap_size();
+uint32_t esp_get_minimum_free_heap_size();
+// Exits the program; there is nothing to restart on the host
+[[noreturn]] void esp_restart();
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <esp_err.h>
+#include <cstdint>
+
+// Callbacks of esp_timer run in a dedicated thread, see freertos/FreeRTOS.h.
+// Time is measured from the start of the program.
+struct esp_timer;
+using esp_timer_handle_t = esp_timer*;
+using esp_timer_cb_t = void (*)( void* );
+
+enum esp_timer_dispatch_t {
+    ESP_TIMER_TASK
+};
+
+struct esp_timer_create_args_t {
+    esp_timer_cb_t callback;
+    void *arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char *name;
+    bool skip_unhandled_events;
+};
+
+esp_err_t esp_timer_create( const esp_timer_create_args_t *args, esp_timer_handle_t *handle );
+esp_err_t esp_timer_start_once( esp_timer_handle_t timer, uint64_t timeout );
+esp_err_t esp_timer_start_periodic( esp_timer_handle_t timer, uint64_t period );
+esp_err_t esp_timer_stop( esp_timer_handle_t timer );
+esp_err_t esp_timer_delete( esp_timer_handle_t timer );
+bool esp_timer_is_active( esp_timer_handle_t timer );
+int64_t esp_timer_get_time();
+int64_t esp_timer_get_next_alarm();
@@ -0,0 +1,55 @@
+#pragma once
+
+// POSIX shim of the subset of FreeRTOS (as shipped with ESP-IDF) the runtime
+// uses. It allows to build the runtime components on the host, e.g., for
+// benchmarking and profiling. Tasks are threads, queues and semaphores are
+// guarded by a mutex and the timer service runs in its own thread. Interrupt
+// context does not exist on the host, so the *FromISR variants behave as the
+// regular ones.
+//
+// Only C++ sources can use the shim.
+
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+using TickType_t = uint32_t;
+using BaseType_t = int;
+using UBaseType_t = unsigned;
+#define portBASE_TYPE int
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define errQUEUE_EMPTY pdFALSE
+#define errQUEUE_FULL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define portMAX_DELAY ( TickType_t ) 0xffffffffUL
+#define portTICK_PERIOD_MS ( ( TickType_t ) 1000 / configTICK_RATE_HZ )
+#define pdMS_TO_TICKS( ms ) ( ( TickType_t ) ( ( ( TickType_t ) ( ms ) * configTICK_RATE_HZ ) / 1000 ) )
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define portNUM_PROCESSORS 2
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define portYIELD_FROM_ISR()
+
+// Critical sections are recursive just like on ESP32
+struct portMUX_TYPE {
+    std::recursive_mutex mutex;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+
+inline void portENTER_CRITICAL( portMUX_TYPE *mux ) { mux->mutex.lock(); }
+inline void portEXIT_CRITICAL( portMUX_TYPE *mux ) { mux->mutex.unlock(); }
+inline void portENTER_CRITICAL_ISR( portMUX_TYPE *mux ) { mux->mutex.lock(); }
+inline void portEXIT_CRITICAL_ISR( portMUX_TYPE *mux ) { mux->mutex.unlock(); }
+
+inline BaseType_t xPortInIsrContext() { return pdFALSE; }
+BaseType_t xPortGetCoreID();
+
+void *pvPortMalloc( size_t size );
+void vPortFree( void *ptr );
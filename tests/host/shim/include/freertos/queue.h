@@ -0,0 +1,43 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+struct QueueDefinition;
+using QueueHandle_t = QueueDefinition*;
+
+QueueHandle_t xQueueCreate( UBaseType_t length, UBaseType_t itemSize );
+void vQueueDelete( QueueHandle_t queue );
+
+BaseType_t xQueueSendToBack( QueueHandle_t queue, const void *item, TickType_t ticksToWait );
+BaseType_t xQueueSendToFront( QueueHandle_t queue, const void *item, TickType_t ticksToWait );
+BaseType_t xQueueReceive( QueueHandle_t queue, void *item, TickType_t ticksToWait );
+BaseType_t xQueuePeek( QueueHandle_t queue, void *item, TickType_t ticksToWait );
+UBaseType_t uxQueueMessagesWaiting( QueueHandle_t queue );
+UBaseType_t uxQueueSpacesAvailable( QueueHandle_t queue );
+BaseType_t xQueueReset( QueueHandle_t queue );
+
+inline BaseType_t xQueueSend( QueueHandle_t queue, const void *item, TickType_t ticksToWait ) {
+    return xQueueSendToBack( queue, item, ticksToWait );
+}
+
+inline BaseType_t xQueueSendToBackFromISR( QueueHandle_t queue, const void *item, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    return xQueueSendToBack( queue, item, 0 );
+}
+
+inline BaseType_t xQueueSendToFrontFromISR( QueueHandle_t queue, const void *item, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    return xQueueSendToFront( queue, item, 0 );
+}
+
+inline BaseType_t xQueueSendFromISR( QueueHandle_t queue, const void *item, BaseType_t *woken ) {
+    return xQueueSendToBackFromISR( queue, item, woken );
+}
+
+inline BaseType_t xQueueReceiveFromISR( QueueHandle_t queue, void *item, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    return xQueueReceive( queue, item, 0 );
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+// Semaphores are queues of zero-sized items as in FreeRTOS; the number of items
+// in the queue is the count of the semaphore. Mutexes do not implement
+// priority inheritance.
+using SemaphoreHandle_t = QueueHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateCounting( UBaseType_t maxCount, UBaseType_t initialCount );
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTakeRecursive( SemaphoreHandle_t mutex, TickType_t ticksToWait );
+BaseType_t xSemaphoreGiveRecursive( SemaphoreHandle_t mutex );
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return xSemaphoreCreateCounting( 1, 0 );
+}
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+    return xSemaphoreCreateCounting( 1, 1 );
+}
+
+inline void vSemaphoreDelete( SemaphoreHandle_t semaphore ) {
+    vQueueDelete( semaphore );
+}
+
+inline BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t ticksToWait ) {
+    return xQueueReceive( semaphore, nullptr, ticksToWait );
+}
+
+inline BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore ) {
+    return xQueueSendToBack( semaphore, nullptr, 0 );
+}
+
+inline BaseType_t xSemaphoreTakeFromISR( SemaphoreHandle_t semaphore, BaseType_t *woken ) {
+    return xQueueReceiveFromISR( semaphore, nullptr, woken );
+}
+
+inline BaseType_t xSemaphoreGiveFromISR( SemaphoreHandle_t semaphore, BaseType_t *woken ) {
+    return xQueueSendToBackFromISR( semaphore, nullptr, woken );
+}
+
+inline UBaseType_t uxSemaphoreGetCount( SemaphoreHandle_t semaphore ) {
+    return uxQueueMessagesWaiting( semaphore );
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+#include <thread>
+
+// Tasks are detached threads; priorities and core affinity are ignored. A task
+// can delete only itself (vTaskDelete( nullptr )), there is no way to stop
+// another thread.
+struct tskTaskControlBlock;
+using TaskHandle_t = tskTaskControlBlock*;
+using TaskFunction_t = void (*)( void* );
+
+BaseType_t xTaskCreate( TaskFunction_t code, const char *name, uint32_t stackDepth,
+    void *parameters, UBaseType_t priority, TaskHandle_t *createdTask );
+BaseType_t xTaskCreatePinnedToCore( TaskFunction_t code, const char *name, uint32_t stackDepth,
+    void *parameters, UBaseType_t priority, TaskHandle_t *createdTask, BaseType_t coreId );
+void vTaskDelete( TaskHandle_t task );
+
+void vTaskDelay( TickType_t ticks );
+#define taskYIELD() std::this_thread::yield()
+TickType_t xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+const char *pcTaskGetName( TaskHandle_t task );
+
+uint32_t ulTaskNotifyTake( BaseType_t clearCountOnExit, TickType_t ticksToWait );
+BaseType_t xTaskNotifyGive( TaskHandle_t task );
+
+inline TickType_t xTaskGetTickCountFromISR() {
+    return xTaskGetTickCount();
+}
+
+inline void vTaskNotifyGiveFromISR( TaskHandle_t task, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    xTaskNotifyGive( task );
+}
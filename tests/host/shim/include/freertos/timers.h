@@ -0,0 +1,46 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+// Timer callbacks and pended functions run in the timer service thread in the
+// order they are due, just like in the FreeRTOS timer task. Deleting a timer
+// is deferred to the service thread, so it never races with its callback.
+struct tmrTimerControl;
+using TimerHandle_t = tmrTimerControl*;
+using TimerCallbackFunction_t = void (*)( TimerHandle_t );
+using PendedFunction_t = void (*)( void*, uint32_t );
+
+TimerHandle_t xTimerCreate( const char *name, TickType_t period, UBaseType_t autoReload,
+    void *timerId, TimerCallbackFunction_t callback );
+BaseType_t xTimerStart( TimerHandle_t timer, TickType_t ticksToWait );
+BaseType_t xTimerStop( TimerHandle_t timer, TickType_t ticksToWait );
+BaseType_t xTimerReset( TimerHandle_t timer, TickType_t ticksToWait );
+BaseType_t xTimerChangePeriod( TimerHandle_t timer, TickType_t period, TickType_t ticksToWait );
+BaseType_t xTimerDelete( TimerHandle_t timer, TickType_t ticksToWait );
+BaseType_t xTimerIsTimerActive( TimerHandle_t timer );
+TickType_t xTimerGetPeriod( TimerHandle_t timer );
+void *pvTimerGetTimerID( TimerHandle_t timer );
+void vTimerSetTimerID( TimerHandle_t timer, void *timerId );
+void vTimerSetReloadMode( TimerHandle_t timer, UBaseType_t autoReload );
+BaseType_t xTimerPendFunctionCall( PendedFunction_t function, void *parameter1,
+    uint32_t parameter2, TickType_t ticksToWait );
+
+inline BaseType_t xTimerStartFromISR( TimerHandle_t timer, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    return xTimerStart( timer, 0 );
+}
+
+inline BaseType_t xTimerStopFromISR( TimerHandle_t timer, BaseType_t *woken ) {
+    if ( woken )
+        *woken = pdFALSE;
+    return xTimerStop( timer, 0 );
+}
+
+inline BaseType_t xTimerPendFunctionCallFromISR( PendedFunction_t function, void *parameter1,
+    uint32_t parameter2, BaseType_t *woken )
+{
+    if ( woken )
+        *woken = pdFALSE;
+    return xTimerPendFunctionCall( function, parameter1, parameter2, 0 );
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+// ESP-IDF declares the directory entries here, glibc in <dirent.h>
+#include <dirent.h>
@@ -0,0 +1,141 @@
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <esp_rom_crc.h>
+#include "scheduler.hpp"
+
+#include <cstdlib>
+#include <limits>
+#include <unistd.h>
+
+using jac::host::Clock;
+using jac::host::Scheduler;
+
+struct esp_timer {
+    Scheduler::Alarm alarm;
+};
+
+namespace {
+
+Scheduler& timerService() {
+    static Scheduler *service = new Scheduler();
+    return *service;
+}
+
+size_t availableMemory() {
+    long pages = sysconf( _SC_AVPHYS_PAGES );
+    long pageSize = sysconf( _SC_PAGESIZE );
+    if ( pages < 0 || pageSize < 0 )
+        return 0;
+    return size_t( pages ) * size_t( pageSize );
+}
+
+} // namespace
+
+esp_err_t esp_timer_create( const esp_timer_create_args_t *args, esp_timer_handle_t *handle ) {
+    if ( !args || !args->callback || !handle )
+        return ESP_ERR_INVALID_ARG;
+    auto *timer = new esp_timer();
+    timer->alarm.fire = [callback = args->callback, arg = args->arg] { callback( arg ); };
+    *handle = timer;
+    return ESP_OK;
+}
+
+static esp_err_t startTimer( esp_timer_handle_t timer, uint64_t time, bool periodic ) {
+    if ( timerService().armed( timer->alarm ) )
+        return ESP_ERR_INVALID_STATE;
+    auto duration = std::chrono::microseconds( time );
+    timerService().setPeriod( timer->alarm, periodic, duration );
+    timerService().arm( timer->alarm, duration );
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once( esp_timer_handle_t timer, uint64_t timeout ) {
+    return startTimer( timer, timeout, false );
+}
+
+esp_err_t esp_timer_start_periodic( esp_timer_handle_t timer, uint64_t period ) {
+    if ( period == 0 )
+        return ESP_ERR_INVALID_ARG;
+    return startTimer( timer, period, true );
+}
+
+esp_err_t esp_timer_stop( esp_timer_handle_t timer ) {
+    if ( !timerService().armed( timer->alarm ) )
+        return ESP_ERR_INVALID_STATE;
+    timerService().disarm( timer->alarm );
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete( esp_timer_handle_t timer ) {
+    if ( timerService().armed( timer->alarm ) )
+        return ESP_ERR_INVALID_STATE;
+    // The callback might be running, free the timer after it
+    timerService().defer( [timer] { delete timer; } );
+    return ESP_OK;
+}
+
+bool esp_timer_is_active( esp_timer_handle_t timer ) {
+    return timerService().armed( timer->alarm );
+}
+
+int64_t esp_timer_get_time() {
+    auto elapsed = Clock::now() - jac::host::startTime();
+    return std::chrono::duration_cast< std::chrono::microseconds >( elapsed ).count();
+}
+
+int64_t esp_timer_get_next_alarm() {
+    auto due = timerService().nextDue();
+    if ( due == Clock::time_point::max() )
+        return std::numeric_limits< int64_t >::max();
+    return std::chrono::duration_cast< std::chrono::microseconds >(
+        due - jac::host::startTime() ).count();
+}
+
+void *heap_caps_malloc( size_t size, uint32_t ) {
+    return std::malloc( size );
+}
+
+void *heap_caps_calloc( size_t n, size_t size, uint32_t ) {
+    return std::calloc( n, size );
+}
+
+void *heap_caps_realloc( void *ptr, size_t size, uint32_t ) {
+    return std::realloc( ptr, size );
+}
+
+void heap_caps_free( void *ptr ) {
+    std::free( ptr );
+}
+
+size_t heap_caps_get_free_size( uint32_t ) {
+    return availableMemory();
+}
+
+size_t heap_caps_get_largest_free_block( uint32_t ) {
+    return availableMemory();
+}
+
+uint32_t esp_get_free_heap_size() {
+    size_t free = availableMemory();
+    return free > std::numeric_limits< uint32_t >::max()
+        ? std::numeric_limits< uint32_t >::max() : uint32_t( free );
+}
+
+uint32_t esp_get_minimum_free_heap_size() {
+    return esp_get_free_heap_size();
+}
+
+void esp_restart() {
+    std::exit( EXIT_SUCCESS );
+}
+
+uint32_t esp_rom_crc32_le( uint32_t crc, const uint8_t *buf, uint32_t len ) {
+    crc = ~crc;
+    for ( uint32_t i = 0; i != len; i++ ) {
+        crc ^= buf[ i ];
+        for ( int bit = 0; bit != 8; bit++ )
+            crc = ( crc >> 1 ) ^ ( 0xEDB88320u & -( crc & 1 ) );
+    }
+    return ~crc;
+}
@@ -0,0 +1,365 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include "scheduler.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+using jac::host::Clock;
+using jac::host::Scheduler;
+
+namespace {
+
+Clock::duration ticksToDuration( TickType_t ticks ) {
+    return std::chrono::milliseconds( ticks * 1000ll / configTICK_RATE_HZ );
+}
+
+// Wait on the condition variable until pred holds or the ticks elapse; return
+// the final value of pred
+template < typename Pred >
+bool waitFor( std::condition_variable& cv, std::unique_lock< std::mutex >& lock,
+    TickType_t ticks, Pred pred )
+{
+    if ( ticks == portMAX_DELAY ) {
+        cv.wait( lock, pred );
+        return true;
+    }
+    return cv.wait_for( lock, ticksToDuration( ticks ), pred );
+}
+
+Scheduler& timerService() {
+    static Scheduler *service = new Scheduler();
+    return *service;
+}
+
+// Thrown by vTaskDelete to unwind the deleted task
+struct TaskDeleted {};
+
+} // namespace
+
+struct QueueDefinition {
+    std::mutex mutex;
+    std::condition_variable changed;
+    UBaseType_t length;
+    UBaseType_t itemSize;
+    UBaseType_t count = 0;
+    UBaseType_t head = 0;
+    std::vector< uint8_t > storage;
+    // Owner and depth of a recursive mutex
+    TaskHandle_t holder = nullptr;
+    UBaseType_t depth = 0;
+
+    QueueDefinition( UBaseType_t length, UBaseType_t itemSize )
+        : length( length ), itemSize( itemSize ), storage( length * itemSize )
+    {}
+
+    uint8_t *slot( UBaseType_t index ) {
+        return storage.data() + ( ( head + index ) % length ) * itemSize;
+    }
+};
+
+struct tskTaskControlBlock {
+    std::string name;
+    std::mutex mutex;
+    std::condition_variable notified;
+    uint32_t notifyValue = 0;
+};
+
+struct tmrTimerControl {
+    std::string name;
+    TickType_t period;
+    void *id;
+    TimerCallbackFunction_t callback;
+    Scheduler::Alarm alarm;
+};
+
+namespace {
+
+// Threads not created by xTaskCreate (e.g., the main thread) get their control
+// block on the first use
+thread_local std::unique_ptr< tskTaskControlBlock > foreignTask;
+thread_local TaskHandle_t currentTask = nullptr;
+
+} // namespace
+
+BaseType_t xPortGetCoreID() {
+    return 0;
+}
+
+void *pvPortMalloc( size_t size ) {
+    return std::malloc( size );
+}
+
+void vPortFree( void *ptr ) {
+    std::free( ptr );
+}
+
+QueueHandle_t xQueueCreate( UBaseType_t length, UBaseType_t itemSize ) {
+    if ( length == 0 )
+        return nullptr;
+    return new QueueDefinition( length, itemSize );
+}
+
+void vQueueDelete( QueueHandle_t queue ) {
+    delete queue;
+}
+
+static BaseType_t queueSend( QueueHandle_t q, const void *item, TickType_t ticks, bool front ) {
+    std::unique_lock lock( q->mutex );
+    if ( !waitFor( q->changed, lock, ticks, [&] { return q->count < q->length; } ) )
+        return errQUEUE_FULL;
+    if ( front )
+        q->head = ( q->head + q->length - 1 ) % q->length;
+    uint8_t *slot = q->slot( front ? 0 : q->count );
+    if ( q->itemSize )
+        std::memcpy( slot, item, q->itemSize );
+    q->count++;
+    q->changed.notify_all();
+    return pdPASS;
+}
+
+BaseType_t xQueueSendToBack( QueueHandle_t queue, const void *item, TickType_t ticksToWait ) {
+    return queueSend( queue, item, ticksToWait, false );
+}
+
+BaseType_t xQueueSendToFront( QueueHandle_t queue, const void *item, TickType_t ticksToWait ) {
+    return queueSend( queue, item, ticksToWait, true );
+}
+
+static BaseType_t queueReceive( QueueHandle_t q, void *item, TickType_t ticks, bool remove ) {
+    std::unique_lock lock( q->mutex );
+    if ( !waitFor( q->changed, lock, ticks, [&] { return q->count > 0; } ) )
+        return errQUEUE_EMPTY;
+    if ( q->itemSize && item )
+        std::memcpy( item, q->slot( 0 ), q->itemSize );
+    if ( remove ) {
+        q->head = ( q->head + 1 ) % q->length;
+        q->count--;
+        q->changed.notify_all();
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive( QueueHandle_t queue, void *item, TickType_t ticksToWait ) {
+    return queueReceive( queue, item, ticksToWait, true );
+}
+
+BaseType_t xQueuePeek( QueueHandle_t queue, void *item, TickType_t ticksToWait ) {
+    return queueReceive( queue, item, ticksToWait, false );
+}
+
+UBaseType_t uxQueueMessagesWaiting( QueueHandle_t queue ) {
+    std::unique_lock lock( queue->mutex );
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable( QueueHandle_t queue ) {
+    std::unique_lock lock( queue->mutex );
+    return queue->length - queue->count;
+}
+
+BaseType_t xQueueReset( QueueHandle_t queue ) {
+    std::unique_lock lock( queue->mutex );
+    queue->count = 0;
+    queue->head = 0;
+    queue->changed.notify_all();
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting( UBaseType_t maxCount, UBaseType_t initialCount ) {
+    if ( initialCount > maxCount )
+        return nullptr;
+    auto *semaphore = xQueueCreate( maxCount, 0 );
+    if ( semaphore )
+        semaphore->count = initialCount;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() {
+    return xSemaphoreCreateCounting( 1, 1 );
+}
+
+BaseType_t xSemaphoreTakeRecursive( SemaphoreHandle_t mutex, TickType_t ticksToWait ) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    {
+        std::unique_lock lock( mutex->mutex );
+        if ( mutex->holder == self ) {
+            mutex->depth++;
+            return pdPASS;
+        }
+    }
+    if ( xSemaphoreTake( mutex, ticksToWait ) != pdPASS )
+        return pdFAIL;
+    std::unique_lock lock( mutex->mutex );
+    mutex->holder = self;
+    mutex->depth = 1;
+    return pdPASS;
+}
+
+BaseType_t xSemaphoreGiveRecursive( SemaphoreHandle_t mutex ) {
+    {
+        std::unique_lock lock( mutex->mutex );
+        if ( mutex->holder != xTaskGetCurrentTaskHandle() )
+            return pdFAIL;
+        if ( --mutex->depth != 0 )
+            return pdPASS;
+        mutex->holder = nullptr;
+    }
+    return xSemaphoreGive( mutex );
+}
+
+BaseType_t xTaskCreate( TaskFunction_t code, const char *name, uint32_t,
+    void *parameters, UBaseType_t, TaskHandle_t *createdTask )
+{
+    auto *task = new tskTaskControlBlock();
+    task->name = name ? name : "";
+    if ( createdTask )
+        *createdTask = task;
+    std::thread( [=] {
+        currentTask = task;
+        try {
+            code( parameters );
+        }
+        catch ( const TaskDeleted& ) {}
+        // FreeRTOS tasks must not return, treat it as deletion
+        delete task;
+    } ).detach();
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore( TaskFunction_t code, const char *name, uint32_t stackDepth,
+    void *parameters, UBaseType_t priority, TaskHandle_t *createdTask, BaseType_t )
+{
+    return xTaskCreate( code, name, stackDepth, parameters, priority, createdTask );
+}
+
+void vTaskDelete( TaskHandle_t task ) {
+    if ( task && task != currentTask ) {
+        std::fprintf( stderr, "vTaskDelete: cannot delete another task (%s)\n",
+            task->name.c_str() );
+        std::abort();
+    }
+    if ( !currentTask || currentTask == foreignTask.get() ) {
+        // Not a task created by xTaskCreate, there is nothing to unwind to
+        std::fprintf( stderr, "vTaskDelete: cannot delete a foreign thread\n" );
+        std::abort();
+    }
+    throw TaskDeleted();
+}
+
+void vTaskDelay( TickType_t ticks ) {
+    std::this_thread::sleep_for( ticksToDuration( ticks ) );
+}
+
+TickType_t xTaskGetTickCount() {
+    auto elapsed = Clock::now() - jac::host::startTime();
+    return TickType_t( std::chrono::duration_cast< std::chrono::milliseconds >( elapsed ).count()
+        * configTICK_RATE_HZ / 1000 );
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    if ( !currentTask ) {
+        foreignTask = std::make_unique< tskTaskControlBlock >();
+        foreignTask->name = "main";
+        currentTask = foreignTask.get();
+    }
+    return currentTask;
+}
+
+const char *pcTaskGetName( TaskHandle_t task ) {
+    if ( !task )
+        task = xTaskGetCurrentTaskHandle();
+    return task->name.c_str();
+}
+
+uint32_t ulTaskNotifyTake( BaseType_t clearCountOnExit, TickType_t ticksToWait ) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    std::unique_lock lock( task->mutex );
+    waitFor( task->notified, lock, ticksToWait, [&] { return task->notifyValue != 0; } );
+    uint32_t value = task->notifyValue;
+    if ( value )
+        task->notifyValue = clearCountOnExit ? 0 : value - 1;
+    return value;
+}
+
+BaseType_t xTaskNotifyGive( TaskHandle_t task ) {
+    std::unique_lock lock( task->mutex );
+    task->notifyValue++;
+    task->notified.notify_all();
+    return pdPASS;
+}
+
+TimerHandle_t xTimerCreate( const char *name, TickType_t period, UBaseType_t autoReload,
+    void *timerId, TimerCallbackFunction_t callback )
+{
+    if ( period == 0 )
+        return nullptr;
+    auto *timer = new tmrTimerControl{ name ? name : "", period, timerId, callback, {} };
+    timer->alarm.fire = [timer] { timer->callback( timer ); };
+    timer->alarm.periodic = autoReload;
+    timer->alarm.period = ticksToDuration( period );
+    return timer;
+}
+
+BaseType_t xTimerStart( TimerHandle_t timer, TickType_t ) {
+    timerService().arm( timer->alarm, ticksToDuration( timer->period ) );
+    return pdPASS;
+}
+
+BaseType_t xTimerStop( TimerHandle_t timer, TickType_t ) {
+    timerService().disarm( timer->alarm );
+    return pdPASS;
+}
+
+BaseType_t xTimerReset( TimerHandle_t timer, TickType_t ticksToWait ) {
+    return xTimerStart( timer, ticksToWait );
+}
+
+BaseType_t xTimerChangePeriod( TimerHandle_t timer, TickType_t period, TickType_t ticksToWait ) {
+    if ( period == 0 )
+        return pdFAIL;
+    // As in FreeRTOS, changing the period also starts a dormant timer
+    timer->period = period;
+    timerService().setPeriod( timer->alarm, timer->alarm.periodic, ticksToDuration( period ) );
+    return xTimerStart( timer, ticksToWait );
+}
+
+BaseType_t xTimerDelete( TimerHandle_t timer, TickType_t ) {
+    timerService().disarm( timer->alarm );
+    timerService().defer( [timer] { delete timer; } );
+    return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive( TimerHandle_t timer ) {
+    return timerService().armed( timer->alarm ) ? pdTRUE : pdFALSE;
+}
+
+TickType_t xTimerGetPeriod( TimerHandle_t timer ) {
+    return timer->period;
+}
+
+void *pvTimerGetTimerID( TimerHandle_t timer ) {
+    return timer->id;
+}
+
+void vTimerSetTimerID( TimerHandle_t timer, void *timerId ) {
+    timer->id = timerId;
+}
+
+void vTimerSetReloadMode( TimerHandle_t timer, UBaseType_t autoReload ) {
+    timerService().setPeriod( timer->alarm, autoReload, timer->alarm.period );
+}
+
+BaseType_t xTimerPendFunctionCall( PendedFunction_t function, void *parameter1,
+    uint32_t parameter2, TickType_t )
+{
+    timerService().defer( [=] { function( parameter1, parameter2 ); } );
+    return pdPASS;
+}
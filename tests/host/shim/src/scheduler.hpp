@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace jac::host {
+
+using Clock = std::chrono::steady_clock;
+
+// Time the program started; FreeRTOS ticks and esp_timer time count from it
+inline Clock::time_point startTime() {
+    static const Clock::time_point start = Clock::now();
+    return start;
+}
+
+// Service thread running alarms and deferred functions in the order they are
+// due. It serves as the FreeRTOS timer task and as the esp_timer task.
+class Scheduler {
+public:
+    struct Alarm {
+        std::function< void() > fire;
+        Clock::duration period = {};
+        bool periodic = false;
+        bool armed = false;
+        Clock::time_point due;
+        std::multimap< Clock::time_point, Alarm* >::iterator position;
+    };
+
+    Scheduler() {
+        std::thread( [this] { _run(); } ).detach();
+    }
+
+    // The service thread lives for the whole program, so the schedulers are
+    // never destroyed
+    Scheduler( const Scheduler& ) = delete;
+    Scheduler& operator=( const Scheduler& ) = delete;
+
+    // Arm the alarm to fire after delay; an armed alarm is rescheduled
+    void arm( Alarm& a, Clock::duration delay ) {
+        std::unique_lock lock( _mutex );
+        _disarm( a );
+        a.armed = true;
+        a.due = Clock::now() + delay;
+        a.position = _alarms.emplace( a.due, &a );
+        _changed.notify_one();
+    }
+
+    void disarm( Alarm& a ) {
+        std::unique_lock lock( _mutex );
+        _disarm( a );
+    }
+
+    // Change the period of the alarm; it applies from the next firing
+    void setPeriod( Alarm& a, bool periodic, Clock::duration period ) {
+        std::unique_lock lock( _mutex );
+        a.periodic = periodic;
+        a.period = period;
+    }
+
+    bool armed( const Alarm& a ) {
+        std::unique_lock lock( _mutex );
+        return a.armed;
+    }
+
+    // Run f in the service thread after the functions and the alarms
+    // that are already due
+    void defer( std::function< void() > f ) {
+        std::unique_lock lock( _mutex );
+        _deferred.push_back( std::move( f ) );
+        _changed.notify_one();
+    }
+
+    // Due time of the nearest alarm or Clock::time_point::max()
+    Clock::time_point nextDue() {
+        std::unique_lock lock( _mutex );
+        return _alarms.empty() ? Clock::time_point::max() : _alarms.begin()->first;
+    }
+
+private:
+    void _disarm( Alarm& a ) {
+        if ( !a.armed )
+            return;
+        _alarms.erase( a.position );
+        a.armed = false;
+    }
+
+    void _run() {
+        std::unique_lock lock( _mutex );
+        while ( true ) {
+            auto now = Clock::now();
+            if ( !_alarms.empty() && _alarms.begin()->first <= now ) {
+                Alarm& a = *_alarms.begin()->second;
+                _alarms.erase( _alarms.begin() );
+                a.armed = false;
+                if ( a.periodic ) {
+                    // Keep the phase, but do not try to catch up missed periods
+                    a.due = std::max( a.due + a.period, now );
+                    a.armed = true;
+                    a.position = _alarms.emplace( a.due, &a );
+                }
+                // The alarm cannot be deleted while it fires, deletion is
+                // deferred to this thread
+                lock.unlock();
+                a.fire();
+                lock.lock();
+                continue;
+            }
+            if ( !_deferred.empty() ) {
+                auto f = std::move( _deferred.front() );
+                _deferred.pop_front();
+                lock.unlock();
+                f();
+                lock.lock();
+                continue;
+            }
+            if ( _alarms.empty() )
+                _changed.wait( lock );
+            else
+                _changed.wait_until( lock, _alarms.begin()->first );
+        }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::multimap< Clock::time_point, Alarm* > _alarms;
+    std::deque< std::function< void() > > _deferred;
+};
+
+} // namespace jac::host
@@ -0,0 +1,103 @@
+#include <catch2/catch.hpp>
+
+#include <timerQueue.hpp>
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <random>
+#include <vector>
+
+using jac::utility::TimerQueue;
+
+TEST_CASE( "Timer queue orders timers by deadline" ) {
+    TimerQueue queue;
+    std::mt19937 random( 42 );
+    std::vector< std::pair< int64_t, int > > expected;
+    for ( int id = 1; id <= 200; id++ ) {
+        int64_t deadline = random() % 1000;
+        queue.push( id, deadline );
+        expected.emplace_back( deadline, id );
+    }
+    std::sort( expected.begin(), expected.end() );
+
+    int64_t last = -1;
+    for ( int i = 0; i != 200; i++ ) {
+        REQUIRE( queue.topDeadline() >= last );
+        last = queue.topDeadline();
+        REQUIRE( queue.topDeadline() == expected[ i ].first );
+        queue.remove( queue.top() );
+    }
+    REQUIRE( queue.empty() );
+}
+
+TEST_CASE( "Timer queue removes timers from the middle" ) {
+    TimerQueue queue;
+    for ( int id = 1; id <= 50; id++ )
+        queue.push( id, ( id * 37 ) % 50 );
+    for ( int id = 2; id <= 50; id += 2 ) {
+        queue.remove( id );
+        REQUIRE_FALSE( queue.contains( id ) );
+    }
+    REQUIRE( queue.size() == 25 );
+
+    int64_t last = -1;
+    while ( !queue.empty() ) {
+        REQUIRE( queue.top() % 2 == 1 );
+        REQUIRE( queue.topDeadline() >= last );
+        last = queue.topDeadline();
+        queue.remove( queue.top() );
+    }
+
+    // Removed ids can be queued again
+    queue.push( 2, 10 );
+    queue.push( 4, 5 );
+    REQUIRE( queue.top() == 4 );
+}
+
+TEST_CASE( "Timer queue reschedules expired timers" ) {
+    TimerQueue queue;
+    // Periodic timers 1 (period 10) and 2 (period 25), one-shot timer 3
+    std::map< int, int64_t > periods = { { 1, 10 }, { 2, 25 } };
+    queue.push( 1, 10 );
+    queue.push( 2, 25 );
+    queue.push( 3, 15 );
+
+    std::vector< int > fired;
+    auto expire = [&]( int64_t now ) {
+        queue.expire( now, [&]( int id ) -> std::optional< int64_t > {
+            fired.push_back( id );
+            auto period = periods.find( id );
+            if ( period == periods.end() )
+                return std::nullopt;
+            return now + period->second;
+        } );
+    };
+
+    expire( 5 );
+    REQUIRE( fired.empty() );
+
+    expire( 10 );
+    REQUIRE( fired == std::vector< int >{ 1 } );
+    REQUIRE( queue.topDeadline() == 15 );
+
+    // Each due timer fires once even if it is late, the earliest first
+    fired.clear();
+    expire( 100 );
+    REQUIRE( fired == std::vector< int >{ 3, 1, 2 } );
+    REQUIRE_FALSE( queue.contains( 3 ) );
+    REQUIRE( queue.size() == 2 );
+    REQUIRE( queue.top() == 1 );
+    REQUIRE( queue.topDeadline() == 110 );
+
+    fired.clear();
+    expire( 110 );
+    REQUIRE( fired == std::vector< int >{ 1 } );
+    REQUIRE( queue.topDeadline() == 120 );
+
+    fired.clear();
+    expire( 125 );
+    REQUIRE( fired == std::vector< int >{ 1, 2 } );
+    REQUIRE( queue.top() == 1 );
+    REQUIRE( queue.topDeadline() == 135 );
+}
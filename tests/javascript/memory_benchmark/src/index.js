@@ -0,0 +1,122 @@
+// Object footprint and throughput benchmark
+//
+// Compares Duktape builds, e.g., the default one and the low-memory profile
+// (JAC_LOW_MEMORY). Each benchmark repeatedly creates a batch of BATCH_SIZE
+// values kept alive in an array until MIN_DURATION elapses. The results are
+// printed in the same format as the promise benchmark:
+//
+//   BENCH {"name":...,"ops":...,"duration":...,"opsPerSec":...,"heapPeak":...,"bytesPerObject":...}
+//
+// followed by "BENCH DONE". bytesPerObject is the RAM taken from the allocator
+// per created value, including the allocator overhead (about zero for
+// propertyAccess, which creates none). It requires the InstrumentedAllocator
+// feature wrapping an allocator that reports its free memory (e.g.,
+// ArenaAllocator) and it is null otherwise. heapPeak is null when the
+// allocation statistics are compiled out (e.g., in the low-memory build).
+
+var MIN_DURATION = 2000; // in milliseconds
+var BATCH_SIZE = 1000;
+
+var memory = null;
+try {
+    memory = require("process");
+} catch (e) {}
+
+var gc = null;
+try {
+    gc = require("gc");
+} catch (e) {}
+
+function allocatorFree() {
+    if (!memory)
+        return null;
+    if (gc)
+        gc.collect();
+    var usage = memory.memoryUsage();
+    return usage.allocatorFree !== undefined ? usage.allocatorFree : null;
+}
+
+function heapPeak() {
+    if (!memory)
+        return null;
+    var usage = memory.memoryUsage();
+    return usage.enabled ? usage.peakBytes : null;
+}
+
+// Measure the footprint of a single batch, the slots of the array holding it
+// are allocated beforehand
+function bytesPerObject(create) {
+    var batch = [];
+    for (var i = 0; i !== BATCH_SIZE; i++)
+        batch.push(0);
+    var before = allocatorFree();
+    for (i = 0; i !== BATCH_SIZE; i++)
+        batch[i] = create(i);
+    var after = allocatorFree();
+    if (before === null || after === null)
+        return null;
+    return Math.round((before - after) / BATCH_SIZE);
+}
+
+function bench(name, create) {
+    var footprint = bytesPerObject(create);
+    if (memory)
+        memory.resetPeak();
+    var ops = 0;
+    var start = Date.now();
+    var duration = 0;
+    while (duration < MIN_DURATION) {
+        var batch = [];
+        for (var i = 0; i !== BATCH_SIZE; i++)
+            batch.push(create(i));
+        ops += BATCH_SIZE;
+        duration = Date.now() - start;
+    }
+    console.log("BENCH " + JSON.stringify({
+        name: name,
+        ops: ops,
+        duration: duration,
+        opsPerSec: Math.round(ops * 1000 / duration),
+        heapPeak: heapPeak(),
+        bytesPerObject: footprint
+    }));
+}
+
+function emptyObject(i) {
+    return {};
+}
+
+function smallObject(i) {
+    return { id: i, name: "item", next: null };
+}
+
+function smallArray(i) {
+    return [i, i + 1, i + 2];
+}
+
+function uniqueString(i) {
+    return "item" + i;
+}
+
+function closure(i) {
+    return function () { return i; };
+}
+
+// Property access on a shared object, creates no values
+var target = { a: 1, b: 2, c: 3, d: 4, e: 5, f: 6, g: 7, h: 8 };
+function propertyAccess(i) {
+    target.a = target.b + target.h;
+    target.h = target.c + target.g;
+    return target.d + target.e + target.f;
+}
+
+bench("emptyObject", emptyObject);
+bench("smallObject", smallObject);
+bench("smallArray", smallArray);
+bench("uniqueString", uniqueString);
+bench("closure", closure);
+bench("propertyAccess", propertyAccess);
+console.log("BENCH DONE");
+// The host runner (tests/host) provides exit()
+if (typeof exit === "function")
+    exit();
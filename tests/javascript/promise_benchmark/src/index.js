@@ -0,0 +1,110 @@
+// Promise and async/await throughput benchmark
+//
+// Each benchmark repeats its round until MIN_DURATION elapses. The results are
+// printed over the console as single lines:
+//
+//   BENCH {"name":...,"ops":...,"duration":...,"opsPerSec":...,"heapPeak":...,"gcCount":...}
+//
+// followed by "BENCH DONE". Use tools/bench.py to collect and compare them.
+// The heap peak is available only with the InstrumentedAllocator feature, it
+// is null otherwise.
+
+var MIN_DURATION = 2000; // in milliseconds
+var CHAIN_DEPTH = 100;
+var FAN_OUT = 100;
+var AWAIT_COUNT = 100;
+var TIMER_COUNT = 20;
+
+var memory = null;
+try {
+    memory = require("process");
+} catch (e) {}
+
+// Count mark-and-sweep rounds: a self-referencing object is reclaimed only by
+// mark-and-sweep, so its finalizer runs once per round. The finalizer creates
+// a new sentinel for the next round.
+var gcCount = 0;
+function armGcSentinel() {
+    var sentinel = {};
+    sentinel.self = sentinel;
+    Duktape.fin(sentinel, function () {
+        gcCount++;
+        armGcSentinel();
+    });
+}
+armGcSentinel();
+
+function heapPeak() {
+    if (!memory)
+        return null;
+    var usage = memory.memoryUsage();
+    return usage.enabled ? usage.peakBytes : null;
+}
+
+function delay(time) {
+    return new Promise(function (resolve) {
+        createTimer(time, true, function () { resolve(time); });
+    });
+}
+
+async function bench(name, opsPerRound, round) {
+    if (memory)
+        memory.resetPeak();
+    var gcStart = gcCount;
+    var ops = 0;
+    var start = Date.now();
+    var duration = 0;
+    while (duration < MIN_DURATION) {
+        await round();
+        ops += opsPerRound;
+        duration = Date.now() - start;
+    }
+    console.log("BENCH " + JSON.stringify({
+        name: name,
+        ops: ops,
+        duration: duration,
+        opsPerSec: Math.round(ops * 1000 / duration),
+        heapPeak: heapPeak(),
+        gcCount: gcCount - gcStart
+    }));
+}
+
+function thenChain() {
+    var p = Promise.resolve(0);
+    for (var i = 0; i !== CHAIN_DEPTH; i++)
+        p = p.then(function (v) { return v + 1; });
+    return p;
+}
+
+function allFanOut() {
+    var promises = [];
+    for (var i = 0; i !== FAN_OUT; i++) {
+        promises.push(new Promise(function (resolve) { resolve(promises.length); }));
+    }
+    return Promise.all(promises);
+}
+
+async function awaitLoop() {
+    var sum = 0;
+    for (var i = 0; i !== AWAIT_COUNT; i++)
+        sum += await i;
+    return sum;
+}
+
+async function timerLoop() {
+    for (var i = 0; i !== TIMER_COUNT; i++)
+        await delay(1);
+}
+
+async function main() {
+    await bench("thenChain", CHAIN_DEPTH, thenChain);
+    await bench("allFanOut", FAN_OUT, allFanOut);
+    await bench("awaitLoop", AWAIT_COUNT, awaitLoop);
+    await bench("timerLoop", TIMER_COUNT, timerLoop);
+    console.log("BENCH DONE");
+    // The host runner (tests/host) provides exit()
+    if (typeof exit === "function")
+        exit();
+}
+
+main();
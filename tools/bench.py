@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+
+"""
+Collect results of a benchmark program (e.g., tests/javascript/promise_benchmark
+or tests/javascript/memory_benchmark)
+from the device serial output or from a saved log, store them as JSON and
+optionally compare them with results of a previous run.
+"""
+
+import click
+import json
+import serial
+import sys
+
+RESULT_PREFIX = "BENCH "
+DONE_LINE = "BENCH DONE"
+
+def parseResults(lines):
+    """
+    Read result lines until the benchmark finishes, return results indexed by
+    name. Other output of the program is ignored.
+    """
+    results = {}
+    for line in lines:
+        line = line.strip()
+        if line == DONE_LINE:
+            break
+        if not line.startswith(RESULT_PREFIX):
+            continue
+        result = json.loads(line[len(RESULT_PREFIX):])
+        results[result["name"]] = result
+        print(f"{result['name']}: {result['opsPerSec']} ops/s", file=sys.stderr)
+    return results
+
+def serialLines(port, baudrate):
+    with serial.Serial(port, baudrate) as s:
+        while True:
+            yield s.readline().decode("utf-8", "replace")
+
+def compareResults(baseline, results, threshold):
+    """
+    Print the change of throughput of each benchmark, return names of the
+    benchmarks slower than the baseline by more than threshold percent.
+    """
+    regressions = []
+    for name, result in sorted(results.items()):
+        if name not in baseline:
+            print(f"{name}: no baseline")
+            continue
+        old = baseline[name]["opsPerSec"]
+        new = result["opsPerSec"]
+        change = (new - old) * 100 / old if old else 0
+        print(f"{name}: {old} -> {new} ops/s ({change:+.1f} %)")
+        oldBytes = baseline[name].get("bytesPerObject")
+        newBytes = result.get("bytesPerObject")
+        if oldBytes is not None and newBytes is not None:
+            print(f"{name}: {oldBytes} -> {newBytes} B per object")
+        if change < -threshold:
+            regressions.append(name)
+    return regressions
+
+@click.command()
+@click.option("-p", "--port", type=str, default=None,
+    help="Serial port to read the results from")
+@click.option("-b", "--baudrate", type=int, default=921600,
+    help="Baudrate")
+@click.option("-i", "--input", type=click.File("r"), default=None,
+    help="Read the results from a log instead (e.g., output of the host runtime)")
+@click.option("-o", "--output", type=click.File("w"), default=None,
+    help="Store the results as JSON")
+@click.option("--baseline", type=click.File("r"), default=None,
+    help="JSON results of a previous run to compare with")
+@click.option("--threshold", type=float, default=5,
+    help="Allowed slowdown against the baseline in percent")
+def bench(port, baudrate, input, output, baseline, threshold):
+    """
+    Collect benchmark results. Restart the device after starting the command
+    so the output of the whole run is captured. Exits with a non-zero code if
+    a benchmark regressed against the baseline.
+    """
+    if input is not None:
+        results = parseResults(input)
+    elif port is not None:
+        results = parseResults(serialLines(port, baudrate))
+    else:
+        raise click.UsageError("Specify either --port or --input")
+
+    if output is not None:
+        json.dump(results, output, indent=4, sort_keys=True)
+        output.write("\n")
+    if baseline is not None:
+        regressions = compareResults(json.load(baseline), results, threshold)
+        if regressions:
+            print(f"Regressions: {', '.join(regressions)}")
+            sys.exit(1)
+
+if __name__ == "__main__":
+    bench()
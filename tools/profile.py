@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+"""
+Collect samples of the sampling profiler (see samplingProfiler.hpp) over the
+Duktape debugger connection and write them as folded stacks, which can be
+rendered, e.g., by flamegraph.pl or speedscope.
+"""
+
+import click
+import socket
+import struct
+import sys
+
+# Duktape debugger protocol, see doc/debugger.rst in the Duktape repository
+EOM = 0x00
+REQ = 0x01
+REP = 0x02
+ERR = 0x03
+NFY = 0x04
+
+CMD_RESUME = 0x13
+CMD_APP_NOTIFY = 0x07
+
+PROFILE_TAG = "jac-profile"
+
+class DebugConnection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buffer = b""
+
+    def readExactly(self, size):
+        while len(self.buffer) < size:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise EOFError("Connection closed")
+            self.buffer += chunk
+        data, self.buffer = self.buffer[:size], self.buffer[size:]
+        return data
+
+    def readLine(self):
+        while b"\n" not in self.buffer:
+            chunk = self.sock.recv(4096)
+            if not chunk:
+                raise EOFError("Connection closed")
+            self.buffer += chunk
+        line, self.buffer = self.buffer.split(b"\n", 1)
+        return line.decode("utf-8")
+
+    def readValue(self):
+        """
+        Read a single dvalue. Markers (EOM, REQ, ...) are returned as a tuple
+        ("marker", value).
+        """
+        ib = self.readExactly(1)[0]
+        if ib <= NFY:
+            return ("marker", ib)
+        if ib == 0x10:
+            return struct.unpack(">i", self.readExactly(4))[0]
+        if ib == 0x11:
+            size = struct.unpack(">I", self.readExactly(4))[0]
+            return self.readExactly(size).decode("utf-8", "replace")
+        if ib == 0x12:
+            size = struct.unpack(">H", self.readExactly(2))[0]
+            return self.readExactly(size).decode("utf-8", "replace")
+        if ib == 0x13:
+            size = struct.unpack(">I", self.readExactly(4))[0]
+            return self.readExactly(size)
+        if ib == 0x14:
+            size = struct.unpack(">H", self.readExactly(2))[0]
+            return self.readExactly(size)
+        if ib in (0x15, 0x16):
+            return None
+        if ib == 0x17:
+            return None
+        if ib == 0x18:
+            return True
+        if ib == 0x19:
+            return False
+        if ib == 0x1a:
+            return struct.unpack(">d", self.readExactly(8))[0]
+        if ib == 0x1b:
+            self.readExactly(1) # class
+            self.readExactly(self.readExactly(1)[0])
+            return None
+        if ib in (0x1c, 0x1e):
+            self.readExactly(self.readExactly(1)[0])
+            return None
+        if ib == 0x1d:
+            self.readExactly(2) # flags
+            self.readExactly(self.readExactly(1)[0])
+            return None
+        if 0x60 <= ib <= 0x7f:
+            return self.readExactly(ib - 0x60).decode("utf-8", "replace")
+        if 0x80 <= ib <= 0xbf:
+            return ib - 0x80
+        if ib >= 0xc0:
+            return ((ib - 0xc0) << 8) + self.readExactly(1)[0]
+        raise RuntimeError(f"Unknown dvalue 0x{ib:02x}")
+
+    def readMessage(self):
+        """
+        Read a message, return tuple (type, values)
+        """
+        start = self.readValue()
+        if not isinstance(start, tuple):
+            raise RuntimeError("Expected start of a message")
+        values = []
+        while True:
+            v = self.readValue()
+            if v == ("marker", EOM):
+                return start[1], values
+            values.append(v)
+
+    def sendRequest(self, command):
+        # Small integers are encoded in a single byte
+        self.sock.sendall(bytes([REQ, 0x80 + command, EOM]))
+
+def writeFolded(stacks, output):
+    for stack, count in sorted(stacks.items()):
+        output.write(f"{stack} {count}\n")
+    output.flush()
+
+@click.command()
+@click.option("-h", "--host", type=str, required=True,
+    help="Address of the device")
+@click.option("-p", "--port", type=int, default=3333,
+    help="Debugger port")
+@click.option("-o", "--output", type=click.File("w"), default="-",
+    help="Output file for the folded stacks")
+def profile(host, port, output):
+    """
+    Collect profiler samples until interrupted (Ctrl+C), then write them as
+    folded stacks. The program has to start the profiler via
+    require("samplingProfiler").start().
+    """
+    stacks = {}
+    with socket.create_connection((host, port)) as sock:
+        conn = DebugConnection(sock)
+        print(f"Connected to: {conn.readLine()}", file=sys.stderr)
+        # Duktape pauses the execution when the debugger attaches
+        conn.sendRequest(CMD_RESUME)
+        try:
+            while True:
+                type, values = conn.readMessage()
+                if type != NFY or len(values) < 2:
+                    continue
+                if values[0] != CMD_APP_NOTIFY or values[1] != PROFILE_TAG:
+                    continue
+                samples = values[2:]
+                for stack, count in zip(samples[0::2], samples[1::2]):
+                    stacks[stack] = stacks.get(stack, 0) + count
+                print(f"Collected {sum(stacks.values())} samples", file=sys.stderr)
+        except (KeyboardInterrupt, EOFError):
+            pass
+    writeFolded(stacks, output)
+
+if __name__ == "__main__":
+    profile()
@@ -4,10 +4,15 @@ import click
 import serial
 import serial.tools.list_ports
 import base64
+import gzip
+import hashlib
+import hmac
 import time
 from dataclasses import dataclass
 from enum import Enum
 import os
+import struct
+import zlib
 
 class FileType(Enum):
     File = 1
@@ -28,9 +33,45 @@ def getPortPath(userSpec):
         raise RuntimeError("Multiple devices available, please choose one")
     return ports[0].device
 
+def isNetworkPort(path):
+    return path.startswith("socket://")
+
+def authenticate(port):
+    """
+    Answer the challenge of the network uploader with the shared secret from
+    the environment variable JAC_UPLOADER_SECRET
+    """
+    secret = os.environ.get("JAC_UPLOADER_SECRET")
+    if not secret:
+        raise RuntimeError("Set JAC_UPLOADER_SECRET to the uploader secret of the device")
+    challenge = port.readline().decode("utf-8").strip()
+    if not challenge.startswith("AUTH "):
+        raise RuntimeError(f"Unexpected greeting: {challenge}")
+    nonce = challenge[len("AUTH "):]
+    response = hmac.new(secret.encode("utf-8"), nonce.encode("utf-8"), hashlib.sha256)
+    port.write(f"{response.hexdigest()}\n".encode("utf-8"))
+    result = port.readline().decode("utf-8").strip()
+    if result != "OK":
+        raise RuntimeError(f"Authentication failed: {result}")
+
+def openPort(userSpec, baudrate):
+    """
+    Open the serial port or the connection to the network uploader, which is
+    specified as socket://<host>:<port>
+    """
+    path = getPortPath(userSpec)
+    port = serial.serial_for_url(path, baudrate)
+    if isNetworkPort(path):
+        try:
+            authenticate(port)
+        except:
+            port.close()
+            raise
+    return port
+
 def acceptsSerialPort(function):
     function = click.option("-p", "--port", type=str, default=None,
-        help="Serial port")(function)
+        help="Serial port or socket://<host>:<port> of the network uploader")(function)
     function = click.option("-b", "--baudrate", type=int, default=921600,
         help="Baudrate")(function)
     return function
@@ -65,6 +106,51 @@ def listTargetEntries(port):
         res.append(FsEntry(l[1], type))
     return res
 
+def readManifest(port):
+    """
+    Return dictionary name -> (size, sha256 digest) of the files on the device
+    """
+    port.write("MANIFEST\n".encode("utf-8"))
+    res = {}
+    while True:
+        l = port.readline().decode("utf-8").strip()
+        if len(l) == 0:
+            break
+        if l.startswith("ERROR"):
+            print(l)
+            continue
+        name, size, digest = l.split()
+        res[name.lstrip("/")] = (int(size), digest)
+    return res
+
+def readBlockDigests(port, name, blockSize):
+    port.write(f"HASH {name} {blockSize}\n".encode("utf-8"))
+    res = []
+    while True:
+        l = port.readline().decode("utf-8").strip()
+        if len(l) == 0:
+            return res
+        if l.startswith("ERROR"):
+            raise RuntimeError(l)
+        res.append(l)
+
+def changedRanges(content, digests, blockSize):
+    """
+    Compare the content with the digests of the blocks on the device and
+    return the changed ranges as a list of (offset, data). Adjacent blocks are
+    merged.
+    """
+    ranges = []
+    for i in range(0, (len(content) + blockSize - 1) // blockSize):
+        block = content[i * blockSize:(i + 1) * blockSize]
+        if i < len(digests) and hashlib.sha256(block).hexdigest() == digests[i]:
+            continue
+        if ranges and ranges[-1][0] + len(ranges[-1][1]) == i * blockSize:
+            ranges[-1] = (ranges[-1][0], ranges[-1][1] + block)
+        else:
+            ranges.append((i * blockSize, block))
+    return ranges
+
 def delete(port, entry):
     port.write(f"REMOVE {entry}\n".encode("utf-8"))
     print(port.readline())
@@ -76,34 +162,330 @@ def isHiddenFile(path):
     path = os.path.normpath(path)
     return any([x[0] == "." and x != "." and x != ".." for x in path.split(os.sep)])
 
-@click.command()
-@acceptsSerialPort
-@click.option("-d", "--dir", type=click.Path(file_okay=False, dir_okay=True, exists=True), default=None)
-def sync(port, baudrate, dir):
-    toUpload = []
+def collectFiles(dir):
+    """
+    Walk the directory and yield (name relative to dir, path) of all
+    non-hidden files
+    """
     for root, dirs, files in os.walk(dir):
         files = [f for f in files if not isHiddenFile(os.path.join(root, f))]
         for f in files:
-            with open(os.path.join(root, f), "rb") as file:
-                content = base64.b64encode(file.read()).decode("utf-8")
-            name = os.path.join(root, f)
-            name = os.path.relpath(name, dir)
-            toUpload.append((name, content))
-    with serial.Serial(getPortPath(port), baudrate) as s:
+            path = os.path.join(root, f)
+            yield os.path.relpath(path, dir), path
+
+class BinarySession:
+    """
+    Binary framed transfer mode of the uploader, see
+    runtime/components/jacStorage/include/uploaderFeatures/binaryTransfer.hpp
+    for the protocol.
+    """
+    MAGIC = 0xA5
+    OPEN = 0x01
+    DATA = 0x02
+    CLOSE = 0x03
+    END = 0x04
+    SEEK = 0x05
+    ACK = 0x10
+    NAK = 0x11
+    ERROR = 0x12
+
+    MODE_WRITE = 0
+    MODE_READ = 1
+    MODE_PATCH = 2
+
+    MAX_PAYLOAD = 1024
+    # Unacknowledged frames in flight; has to fit into the UART buffer of the
+    # device. TCP provides flow control, so the window is limited only by the
+    # latency of the network.
+    WINDOW = 3
+    NETWORK_WINDOW = 16
+    TIMEOUT = 1
+    RETRIES = 10
+
+    def __init__(self, port):
+        self.port = port
+        self.seq = 0
+        self.window = self.NETWORK_WINDOW if isNetworkPort(port.port) else self.WINDOW
+        port.write("BINARY\n".encode("utf-8"))
+        response = port.readline().decode("utf-8").strip()
+        if response != "OK":
+            raise RuntimeError(f"Cannot enter binary mode: {response}")
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        try:
+            self.send([(self.END, b"")])
+        except RuntimeError:
+            pass
+
+    @staticmethod
+    def encodeFrame(type, seq, payload):
+        body = struct.pack("<BHH", type, seq & 0xFFFF, len(payload)) + payload
+        return bytes([BinarySession.MAGIC]) + body + struct.pack("<I", zlib.crc32(body))
+
+    def readFrame(self):
+        """
+        Read a frame, return (type, seq, payload) or None on timeout or for a
+        corrupted frame.
+        """
+        t = self.port.timeout
+        self.port.timeout = self.TIMEOUT
+        try:
+            while True:
+                b = self.port.read(1)
+                if len(b) == 0:
+                    return None
+                if b[0] == self.MAGIC:
+                    break
+            header = self.port.read(5)
+            if len(header) != 5:
+                return None
+            type, seq, length = struct.unpack("<BHH", header)
+            if length > self.MAX_PAYLOAD:
+                return None
+            rest = self.port.read(length + 4)
+            if len(rest) != length + 4:
+                return None
+            payload = rest[:length]
+            if struct.unpack("<I", rest[length:])[0] != zlib.crc32(header + payload):
+                return None
+            return type, seq, payload
+        finally:
+            self.port.timeout = t
+
+    def send(self, frames):
+        """
+        Send frames (list of (type, payload)) and wait until all of them are
+        acknowledged. Uses go-back-N: on NAK or timeout all the unacknowledged
+        frames starting with the expected one are sent again.
+        """
+        base = self.seq
+        encoded = [self.encodeFrame(type, base + i, payload)
+            for i, (type, payload) in enumerate(frames)]
+        acked = 0
+        sent = 0
+        retries = 0
+        while acked != len(encoded):
+            while sent < len(encoded) and sent - acked < self.window:
+                self.port.write(encoded[sent])
+                sent += 1
+            frame = self.readFrame()
+            if frame is None:
+                retries += 1
+                if retries > self.RETRIES:
+                    raise RuntimeError("Device does not respond")
+                sent = acked
+                continue
+            type, seq, payload = frame
+            index = (seq - base) & 0xFFFF
+            if index > sent or (index == sent and type != self.NAK):
+                # Stale response from before
+                continue
+            if type == self.ACK:
+                acked = max(acked, index + 1)
+                retries = 0
+            elif type == self.NAK:
+                acked = max(acked, index)
+                sent = acked
+            elif type == self.ERROR:
+                self.seq = base + index + 1
+                raise RuntimeError(payload.decode("utf-8", "replace"))
+        self.seq = base + len(encoded)
+
+    def patch(self, target, size, ranges):
+        """
+        Rewrite the ranges (list of (offset, data)) of an existing file and
+        set its size
+        """
+        frames = [(self.OPEN, bytes([self.MODE_PATCH]) + struct.pack("<I", size)
+            + target.encode("utf-8"))]
+        for offset, data in ranges:
+            frames.append((self.SEEK, struct.pack("<I", offset)))
+            for i in range(0, len(data), self.MAX_PAYLOAD):
+                frames.append((self.DATA, data[i:i + self.MAX_PAYLOAD]))
+        frames.append((self.CLOSE, b""))
+        self.send(frames)
+
+    def push(self, target, content):
+        frames = [(self.OPEN, bytes([self.MODE_WRITE]) + target.encode("utf-8"))]
+        for i in range(0, len(content), self.MAX_PAYLOAD):
+            frames.append((self.DATA, content[i:i + self.MAX_PAYLOAD]))
+        frames.append((self.CLOSE, b""))
+        self.send(frames)
+
+    def pull(self, source):
+        self.send([(self.OPEN, bytes([self.MODE_READ]) + source.encode("utf-8"))])
+        content = b""
+        expected = 0
+        while True:
+            frame = self.readFrame()
+            if frame is None:
+                raise RuntimeError("Corrupted or missing data")
+            type, seq, payload = frame
+            if type != self.DATA or seq != expected:
+                raise RuntimeError("Unexpected frame")
+            if len(payload) == 0:
+                return content
+            content += payload
+            expected = (expected + 1) & 0xFFFF
+
+def compressModule(name, content):
+    """
+    Compress JavaScript modules, the runtime inflates "<module>.gz" when
+    "<module>" is missing. Other files are kept as they are.
+    """
+    if not name.endswith(".js"):
+        return name, content
+    # Fixed mtime makes the output reproducible, so unchanged files are
+    # recognized by sync
+    return name + ".gz", gzip.compress(content, compresslevel=9, mtime=0)
+
+# Files at least this large are updated by transferring only the changed
+# blocks. The block size matches the flash sector size of the device.
+DELTA_BLOCK_SIZE = 4096
+DELTA_THRESHOLD = 2 * DELTA_BLOCK_SIZE
+
+IMAGE_MAGIC = 0x474D494A # "JIMG"
+IMAGE_VERSION = 2
+# The device compiles the modules in the image in place, so they are stored
+# wrapped in the module function (see NodeModuleLoader::MODULE_PREFIX)
+MODULE_PREFIX = b"function (exports, require, module, __filename, __dirname) {"
+MODULE_SUFFIX = b"\n}"
+
+# Bytecode cache directory of the device (see
+# NodeModuleLoader::Configuration::bytecodeCacheDir)
+CACHE_DIR = "__jbc"
+
+def buildImage(dir):
+    """
+    Pack all files in the directory into a module image. See
+    runtime/components/jacFilesystem/include/packedImage.hpp for the format.
+    """
+    entries = []
+    for name, path in collectFiles(dir):
+        with open(path, "rb") as file:
+            content = MODULE_PREFIX + file.read() + MODULE_SUFFIX
+        id = "/" + name.replace(os.sep, "/")
+        entries.append((id.encode("utf-8"), content))
+    entries.sort(key=lambda e: e[0])
+
+    HEADER_SIZE = 16
+    ENTRY_SIZE = 16
+    offset = HEADER_SIZE + ENTRY_SIZE * len(entries)
+    table = b""
+    blob = b""
+    for id, content in entries:
+        pathOffset = offset + len(blob)
+        blob += id + b"\0"
+        dataOffset = offset + len(blob)
+        blob += content + b"\0"
+        table += struct.pack("<4I", pathOffset, len(id), dataOffset, len(content))
+    size = offset + len(blob)
+    header = struct.pack("<4I", IMAGE_MAGIC, IMAGE_VERSION, size, len(entries))
+    return header + table + blob
+
+def acceptsTransferMode(function):
+    return click.option("--binary/--text", default=True,
+        help="Use the binary framed protocol (default) or the base64 text protocol")(function)
+
+def pushText(port, target, content, chunkSize, delay):
+    content = base64.b64encode(content).decode("utf-8")
+    message = f"PUSH {target} {content}\n".encode("utf-8")
+    for chunk in [message[i:i + chunkSize] for i in range(0, len(message), chunkSize)]:
+        port.write(chunk)
+        time.sleep(delay)
+    return port.readline()
+
+@click.command()
+@acceptsSerialPort
+@acceptsTransferMode
+@click.option("-d", "--dir", type=click.Path(file_okay=False, dir_okay=True, exists=True), default=None)
+@click.option("--full", is_flag=True, default=False,
+    help="Remove all files from the device and upload everything")
+@click.option("--compress", is_flag=True, default=False,
+    help="Store JavaScript modules compressed")
+def sync(port, baudrate, binary, dir, full, compress):
+    """
+    Make the device storage match the directory. Only the files that differ
+    from the device are uploaded; for large files only the changed blocks are
+    transferred (binary mode only).
+    """
+    local = {}
+    for name, path in collectFiles(dir):
+        with open(path, "rb") as file:
+            name = name.replace(os.sep, "/")
+            content = file.read()
+        if compress:
+            name, content = compressModule(name, content)
+        local[name] = content
+    with openPort(port, baudrate) as s:
         # Windows restarts ESP32, so there will be bootloader message
         time.sleep(1)
         clearPort(s)
         jumpIntoUploader(s)
+        manifest = {} if full else readManifest(s)
         for entry in listTargetEntries(s):
-            delete(s, entry.name)
-        for f, content in toUpload:
-            message = f"PUSH {f} {content}\n".encode("utf-8")
-            print(message)
-            CHUNK_SIZE = 256
-            for chunk in [message[i:i + CHUNK_SIZE] for i in range(0, len(message), CHUNK_SIZE)]:
-                s.write(chunk)
-                time.sleep(0.2)
-            print(s.readline())
+            name = entry.name.lstrip("/")
+            if full:
+                delete(s, entry.name)
+            elif name == CACHE_DIR or name.startswith(CACHE_DIR + "/"):
+                # Bytecode cache validates itself against the sources
+                continue
+            elif entry.type == FileType.File and name not in local:
+                delete(s, entry.name)
+            elif entry.type == FileType.Directory:
+                if not any(f.startswith(name + "/") for f in local):
+                    delete(s, entry.name)
+
+        toPush = []
+        toPatch = []
+        for name, content in local.items():
+            remote = manifest.get(name)
+            if remote is not None and remote[1] == hashlib.sha256(content).hexdigest():
+                continue
+            if binary and remote is not None and len(content) >= DELTA_THRESHOLD:
+                digests = readBlockDigests(s, name, DELTA_BLOCK_SIZE)
+                toPatch.append((name, content, changedRanges(content, digests, DELTA_BLOCK_SIZE)))
+            else:
+                toPush.append((name, content))
+        print(f"{len(local) - len(toPush) - len(toPatch)} files unchanged")
+
+        if binary:
+            with BinarySession(s) as session:
+                for f, content in toPush:
+                    print(f"{f}: {len(content)} B")
+                    session.push(f, content)
+                for f, content, ranges in toPatch:
+                    print(f"{f}: {sum(len(r[1]) for r in ranges)} of {len(content)} B changed")
+                    session.patch(f, len(content), ranges)
+        else:
+            for f, content in toPush:
+                print(f)
+                print(pushText(s, f, content, 256, 0.2))
+        exitUploader(s)
+
+@click.command()
+@acceptsSerialPort
+@click.option("-d", "--dir", type=click.Path(file_okay=False, dir_okay=True, exists=True), default=None)
+def image(port, baudrate, dir):
+    """
+    Upload the directory as a read-only module image. Modules in the image take
+    precedence over the files in the storage. The device has to be restarted to
+    use the new image.
+    """
+    content = base64.b64encode(buildImage(dir)).decode("utf-8")
+    with openPort(port, baudrate) as s:
+        time.sleep(1)
+        clearPort(s)
+        jumpIntoUploader(s)
+        message = f"IMAGE {content}\n".encode("utf-8")
+        CHUNK_SIZE = 256
+        for chunk in [message[i:i + CHUNK_SIZE] for i in range(0, len(message), CHUNK_SIZE)]:
+            s.write(chunk)
+            time.sleep(0.2)
+        print(s.readline())
         exitUploader(s)
 
 @click.command()
@@ -116,33 +498,91 @@ def read(port, dir):
 @acceptsSerialPort
 @click.argument("source", type=click.Path(exists=True, file_okay=True, dir_okay=False))
 @click.argument("target", type=str)
-def push(port, baudrate, source, target):
-    with serial.Serial(getPortPath(port), baudrate) as s:
+@acceptsTransferMode
+@click.option("--compress", is_flag=True, default=False,
+    help="Store a JavaScript module compressed")
+def push(port, baudrate, source, target, binary, compress):
+    with open(source, "rb") as file:
+        content = file.read()
+    if compress:
+        target, content = compressModule(target, content)
+    with openPort(port, baudrate) as s:
         jumpIntoUploader(s)
-        content = base64.b64encode(open(source, "rb").read()).decode("utf-8")
-        message = f"PUSH {target} {content}\n".encode("utf-8")
-        CHUNK_SIZE = 1024
-        for chunk in [message[i:i + CHUNK_SIZE] for i in range(0, len(message), CHUNK_SIZE)]:
-            s.write(chunk)
-            time.sleep(0.1)
-        print(s.readline())
+        if binary:
+            with BinarySession(s) as session:
+                session.push(target, content)
+        else:
+            print(pushText(s, target, content, 1024, 0.1))
         print(exitUploader(s))
 
 @click.command()
 @acceptsSerialPort
 @click.argument("source", type=str)
 @click.argument("target", type=click.File("wb"))
-def pull(port, baudrate, source, target):
-    with serial.Serial(getPortPath(port), baudrate) as s:
+@acceptsTransferMode
+def pull(port, baudrate, source, target, binary):
+    with openPort(port, baudrate) as s:
         jumpIntoUploader(s)
-        s.write(f"PULL {source}\n".encode("utf-8"))
-        content = s.readline()[:-2]
-        target.write(base64.b64decode(content))
+        if binary:
+            with BinarySession(s) as session:
+                target.write(session.pull(source))
+        else:
+            s.write(f"PULL {source}\n".encode("utf-8"))
+            content = s.readline()[:-2]
+            target.write(base64.b64decode(content))
+
+@click.command()
+@acceptsSerialPort
+def profile(port, baudrate):
+    """
+    Print the event loop profile of the running program. All times are in
+    microseconds.
+    """
+    with openPort(port, baudrate) as s:
+        jumpIntoUploader(s)
+        s.write("PROFILE\n".encode("utf-8"))
+        while True:
+            l = s.readline().decode("utf-8").strip()
+            if len(l) == 0:
+                break
+            print(l)
+            if l.startswith("ERROR"):
+                break
+        exitUploader(s)
+
+@click.command()
+@acceptsSerialPort
+@click.argument("target", type=click.File("wb"))
+@click.option("--clear", is_flag=True, default=False,
+    help="Clear the log after it is downloaded")
+@click.option("--separator", type=str, default="\\n",
+    help="Bytes written after each record (default newline)")
+def telemetry(port, baudrate, target, clear, separator):
+    """
+    Download the records of the telemetry log into TARGET.
+    """
+    separator = separator.encode("utf-8").decode("unicode_escape").encode("latin-1")
+    count = 0
+    with openPort(port, baudrate) as s:
+        jumpIntoUploader(s)
+        s.write(("TELEMETRY CLEAR\n" if clear else "TELEMETRY\n").encode("utf-8"))
+        while True:
+            l = s.readline().strip()
+            if len(l) == 0:
+                break
+            if l.startswith(b"ERROR"):
+                print(l.decode("utf-8"))
+                break
+            target.write(base64.b64decode(l))
+            target.write(separator)
+            count += 1
+        exitUploader(s)
+    print(f"Downloaded {count} records")
 
 @click.command("list")
 @acceptsSerialPort
 def listContent(port, baudrate):
-    with serial.Serial(getPortPath(port), baudrate) as s:
+    with openPort(port, baudrate) as s:
         for l in listTargetEntries(s):
             if l.type == FileType.File:
                 print(l.name)
@@ -152,10 +592,13 @@ def cli():
     pass
 
 cli.add_command(sync)
+cli.add_command(image)
 cli.add_command(read)
 cli.add_command(push)
 cli.add_command(pull)
 cli.add_command(listContent)
+cli.add_command(profile)
+cli.add_command(telemetry)
 
 if __name__ == "__main__":
     cli()
\ No newline at end of file